@@ -13,6 +13,7 @@
 # limitations under the License.
 
 
+import array
 import ctypes
 import os
 import math
@@ -28,6 +29,43 @@ class LineJoinStyle(Enum):
     Round = 1
     Bevel = 2
 
+class DrawOp(Enum):
+    b = 0
+    B = 1
+    bstar = 2
+    Bstar = 3
+    c = 4
+    cm = 5
+    Do = 6
+    EMC = 7
+    f = 8
+    fstar = 9
+    G = 10
+    g = 11
+    h = 12
+    i = 13
+    j = 14
+    J = 15
+    K = 16
+    k = 17
+    l = 18
+    m = 19
+    M = 20
+    n = 21
+    q = 22
+    Q = 23
+    re = 24
+    RG = 25
+    rg = 26
+    s = 27
+    S = 28
+    v = 29
+    w = 30
+    W = 31
+    Wstar = 32
+    y = 33
+    draw_image = 34
+
 class Colorspace(Enum):
     DeviceRGB = 0
     DeviceGray = 1
@@ -70,6 +108,27 @@ class TextMode(Enum):
     FillStrokeClip = 6
     Clip = 7
 
+class StreamCategory(Enum):
+    PageContent = 0
+    Image = 1
+    Font = 2
+    EmbeddedFile = 3
+    Other = 4
+
+class WritePhase(Enum):
+    Objects = 0
+    Streams = 1
+    Fonts = 2
+    Pages = 3
+    Annotations = 4
+    Structure = 5
+    Catalog = 6
+    Outlines = 7
+    Xref = 8
+    Compression = 9
+    FontSubsetting = 10
+    Images = 11
+
 class IntentSubtype(Enum):
     PDFX = 0
     PDFA = 1
@@ -82,6 +141,8 @@ class CapyPDFException(Exception):
 ec_type = ctypes.c_int32
 enum_type = ctypes.c_int32
 
+WriteCallback = ctypes.CFUNCTYPE(ctypes.c_int32, ctypes.c_void_p, ctypes.c_int64, ctypes.c_void_p)
+
 class FontId(ctypes.Structure):
     _fields_ = [('id', ctypes.c_int32)]
 
@@ -94,6 +155,9 @@ class IccColorSpaceId(ctypes.Structure):
 class OptionalContentGroupId(ctypes.Structure):
     _fields_ = [('id', ctypes.c_int32)]
 
+class FormXObjectId(ctypes.Structure):
+    _fields_ = [('id', ctypes.c_int32)]
+
 
 cfunc_types = (
 
@@ -106,9 +170,27 @@ cfunc_types = (
 ('capy_options_set_pagebox',
     [ctypes.c_void_p, enum_type, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_options_set_output_intent', [ctypes.c_void_p, enum_type, ctypes.c_char_p]),
+('capy_options_set_num_threads', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_streaming', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_cid_fonts', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_png_predictors', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_image_max_dimension', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_number_precision', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_compact_content', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_object_streams', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_first_page_first', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_page_tree_fanout', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_collect_stats', [ctypes.c_void_p, ctypes.c_int32]),
+('capy_options_set_resource_context', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_options_set_compression', [ctypes.c_void_p, enum_type, ctypes.c_int32]),
+('capy_options_set_color_cache_size', [ctypes.c_void_p, ctypes.c_int32]),
 
 ('capy_generator_new', [ctypes.c_char_p, ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_new_callback', [WriteCallback, ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_new_memory', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_memory_output', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_int64)]),
 ('capy_generator_add_page', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_generator_add_form_xobject', [ctypes.c_void_p, ctypes.c_void_p, ctypes.POINTER(FormXObjectId)]),
 ('capy_generator_embed_jpg', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_load_icc_profile', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
 ('capy_generator_load_font', [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_void_p]),
@@ -116,8 +198,16 @@ cfunc_types = (
 ('capy_generator_add_optional_content_group', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_generator_destroy', [ctypes.c_void_p]),
 ('capy_generator_text_width', [ctypes.c_void_p, ctypes.c_char_p, FontId, ctypes.c_double, ctypes.POINTER(ctypes.c_double)]),
+('capy_generator_text_advances', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint32), ctypes.c_int32, FontId, ctypes.c_double, ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double)]),
+('capy_generator_text_run_new', [ctypes.c_void_p, ctypes.c_char_p, FontId, ctypes.c_double, ctypes.c_void_p]),
+('capy_generator_glyph_run_new', [ctypes.c_void_p, FontId, ctypes.c_double, ctypes.POINTER(ctypes.c_uint32),
+    ctypes.POINTER(ctypes.c_double), ctypes.POINTER(ctypes.c_double), ctypes.c_int32, ctypes.c_void_p]),
+('capy_generator_color_cache_stats', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64)]),
+('capy_generator_phase_stats', [ctypes.c_void_p, enum_type, ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_double)]),
+('capy_generator_write_stats', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64)]),
 
 ('capy_page_draw_context_new', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_form_xobject_draw_context_new', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_void_p]),
 ('capy_dc_add_simple_navigation', [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_int32, ctypes.c_void_p]),
 ('capy_dc_cmd_b', [ctypes.c_void_p]),
 ('capy_dc_cmd_B', [ctypes.c_void_p]),
@@ -128,6 +218,7 @@ cfunc_types = (
     ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_cm', [ctypes.c_void_p,
     ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
+('capy_dc_cmd_Do', [ctypes.c_void_p, FormXObjectId]),
 ('capy_dc_cmd_EMC', [ctypes.c_void_p]),
 ('capy_dc_cmd_f', [ctypes.c_void_p]),
 ('capy_dc_cmd_fstar', [ctypes.c_void_p]),
@@ -140,6 +231,9 @@ cfunc_types = (
 ('capy_dc_cmd_k', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_K', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_l', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double]),
+('capy_dc_cmd_l_array', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_double), ctypes.c_int32]),
+('capy_dc_cmd_c_array', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_double), ctypes.c_int32]),
+('capy_dc_cmd_re_array', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_double), ctypes.c_int32]),
 ('capy_dc_cmd_m', [ctypes.c_void_p, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_cmd_M', [ctypes.c_void_p, ctypes.c_double]),
 ('capy_dc_cmd_n', [ctypes.c_void_p]),
@@ -163,8 +257,12 @@ cfunc_types = (
     [ctypes.c_void_p, ctypes.c_char_p, FontId, ctypes.c_double, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_render_text_obj',
     [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_dc_render_glyph_run',
+    [ctypes.c_void_p, ctypes.c_void_p, ctypes.c_double, ctypes.c_double]),
 ('capy_dc_set_nonstroke', [ctypes.c_void_p, ctypes.c_void_p]),
 ('capy_dc_text_new', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_dc_execute_buffer', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint8), ctypes.c_int32,
+    ctypes.POINTER(ctypes.c_double), ctypes.c_int32]),
 ('capy_dc_destroy', [ctypes.c_void_p]),
 
 ('capy_text_destroy', [ctypes.c_void_p]),
@@ -192,6 +290,26 @@ cfunc_types = (
 ('capy_optional_content_group_new', [ctypes.c_void_p, ctypes.c_char_p]),
 ('capy_optional_content_group_destroy', [ctypes.c_void_p]),
 
+('capy_incremental_update_new', [ctypes.c_char_p, ctypes.c_void_p]),
+('capy_incremental_update_root_object', [ctypes.c_void_p, ctypes.POINTER(ctypes.c_int32)]),
+('capy_incremental_update_object_dictionary',
+    [ctypes.c_void_p, ctypes.c_int32, ctypes.POINTER(ctypes.c_void_p), ctypes.POINTER(ctypes.c_int64)]),
+('capy_incremental_update_add_object',
+    [ctypes.c_void_p, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int64, ctypes.POINTER(ctypes.c_int32)]),
+('capy_incremental_update_replace_object',
+    [ctypes.c_void_p, ctypes.c_int32, ctypes.c_char_p, ctypes.c_char_p, ctypes.c_int64]),
+('capy_incremental_update_write', [ctypes.c_void_p]),
+('capy_incremental_update_destroy', [ctypes.c_void_p]),
+
+('capy_resource_context_new', [ctypes.c_void_p, ctypes.c_void_p]),
+('capy_resource_context_destroy', [ctypes.c_void_p]),
+
+('capy_glyph_run_destroy', [ctypes.c_void_p]),
+
+('capy_font_cache_set_subset_capacity', [ctypes.c_int32]),
+('capy_font_cache_set_font_capacity', [ctypes.c_int32]),
+('capy_font_cache_stats', [ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64), ctypes.POINTER(ctypes.c_int64)]),
+
 )
 
 if os.name == 'nt':
@@ -241,6 +359,18 @@ def check_error(errorcode):
     if errorcode != 0:
         raise_with_error(errorcode)
 
+def set_font_subset_cache_capacity(max_entries):
+    check_error(libfile.capy_font_cache_set_subset_capacity(max_entries))
+
+def set_font_cache_capacity(max_entries):
+    check_error(libfile.capy_font_cache_set_font_capacity(max_entries))
+
+def font_cache_stats():
+    '''Returns (font_hits, font_misses, subset_hits, subset_misses).'''
+    counts = [ctypes.c_int64() for _ in range(4)]
+    check_error(libfile.capy_font_cache_stats(*[ctypes.pointer(c) for c in counts]))
+    return tuple(c.value for c in counts)
+
 def to_bytepath(filename):
     if isinstance(filename, bytes):
         return filename
@@ -249,6 +379,25 @@ def to_bytepath(filename):
     else:
         return str(filename).encode('UTF-8')
 
+def to_double_array(values):
+    # Contiguous float64 buffers such as numpy arrays are copied in one go.
+    try:
+        view = memoryview(values)
+    except TypeError:
+        view = None
+    if view is not None and not (view.format == 'd' and view.c_contiguous):
+        # Strided or differently typed buffers are first copied into a
+        # flat float64 array.
+        try:
+            view = memoryview(array.array('d', memoryview(view.tobytes()).cast(view.format)))
+        except (TypeError, ValueError):
+            view = None
+            values = list(values)
+    if view is not None:
+        num_values = view.nbytes // ctypes.sizeof(ctypes.c_double)
+        return (ctypes.c_double * num_values).from_buffer_copy(view), num_values
+    return (ctypes.c_double * len(values))(*values), len(values)
+
 class Options:
     def __init__(self):
         opt = ctypes.c_void_p()
@@ -286,11 +435,64 @@ class Options:
             raise CapyPDFException('Argument must be an intent subtype.')
         check_error(libfile.capy_options_set_output_intent(self, stype.value, identifier.encode('utf-8')))
 
+    def set_num_threads(self, num_threads):
+        if not isinstance(num_threads, int):
+            raise CapyPDFException('Thread count must be an integer.')
+        check_error(libfile.capy_options_set_num_threads(self, num_threads))
+
+    def set_streaming(self, streaming):
+        check_error(libfile.capy_options_set_streaming(self, 1 if streaming else 0))
+
+    def set_cid_fonts(self, cid_fonts):
+        check_error(libfile.capy_options_set_cid_fonts(self, 1 if cid_fonts else 0))
+
+    def set_png_predictors(self, png_predictors):
+        check_error(libfile.capy_options_set_png_predictors(self, 1 if png_predictors else 0))
+
+    def set_image_max_dimension(self, max_pixels):
+        check_error(libfile.capy_options_set_image_max_dimension(self, max_pixels))
+
+    def set_number_precision(self, precision):
+        check_error(libfile.capy_options_set_number_precision(self, precision))
+
+    def set_compact_content(self, compact):
+        check_error(libfile.capy_options_set_compact_content(self, 1 if compact else 0))
+
+    def set_object_streams(self, object_streams):
+        check_error(libfile.capy_options_set_object_streams(self, 1 if object_streams else 0))
+
+    def set_first_page_first(self, first_page_first):
+        check_error(libfile.capy_options_set_first_page_first(self, 1 if first_page_first else 0))
+
+    def set_page_tree_fanout(self, fanout):
+        check_error(libfile.capy_options_set_page_tree_fanout(self, fanout))
+
+    def set_collect_stats(self, collect_stats):
+        check_error(libfile.capy_options_set_collect_stats(self, 1 if collect_stats else 0))
+
+    def set_resource_context(self, ctx):
+        if not isinstance(ctx, ResourceContext):
+            raise CapyPDFException('Argument must be a resource context.')
+        check_error(libfile.capy_options_set_resource_context(self, ctx))
+
+    def set_color_cache_size(self, max_entries):
+        check_error(libfile.capy_options_set_color_cache_size(self, max_entries))
+
+    def set_compression(self, category, level):
+        if not isinstance(category, StreamCategory):
+            raise CapyPDFException('Argument must be a stream category.')
+        if not isinstance(level, int) or isinstance(level, bool):
+            raise CapyPDFException('Compression level must be an integer.')
+        if level < 0 or level > 9:
+            raise CapyPDFException('Compression level must be between 0 and 9.')
+        check_error(libfile.capy_options_set_compression(self, category.value, level))
+
 
 class DrawContext:
-    def __init__(self, generator):
-        dcptr = ctypes.c_void_p()
-        check_error(libfile.capy_page_draw_context_new(generator, ctypes.pointer(dcptr)))
+    def __init__(self, generator, dcptr=None):
+        if dcptr is None:
+            dcptr = ctypes.c_void_p()
+            check_error(libfile.capy_page_draw_context_new(generator, ctypes.pointer(dcptr)))
         self._as_parameter_ = dcptr
         self.generator = generator
 
@@ -332,6 +534,11 @@ class DrawContext:
     def cmd_cm(self, m1, m2, m3, m4, m5, m6):
         check_error(libfile.capy_dc_cmd_cm(self, m1, m2, m3, m4, m5, m6))
 
+    def cmd_Do(self, fxoid):
+        if not isinstance(fxoid, FormXObjectId):
+            raise CapyPDFException('Argument is not a form XObject id.')
+        check_error(libfile.capy_dc_cmd_Do(self, fxoid))
+
     def cmd_EMC(self):
         check_error(libfile.capy_dc_cmd_EMC(self))
 
@@ -368,6 +575,18 @@ class DrawContext:
     def cmd_l(self, x, y):
         check_error(libfile.capy_dc_cmd_l(self, x, y))
 
+    def cmd_l_array(self, coords):
+        arr, num_values = to_double_array(coords)
+        check_error(libfile.capy_dc_cmd_l_array(self, arr, num_values))
+
+    def cmd_c_array(self, coords):
+        arr, num_values = to_double_array(coords)
+        check_error(libfile.capy_dc_cmd_c_array(self, arr, num_values))
+
+    def cmd_re_array(self, rects):
+        arr, num_values = to_double_array(rects)
+        check_error(libfile.capy_dc_cmd_re_array(self, arr, num_values))
+
     def cmd_m(self, x, y):
         check_error(libfile.capy_dc_cmd_m(self, x, y))
 
@@ -439,11 +658,23 @@ class DrawContext:
     def render_text_obj(self, tobj):
         check_error(libfile.capy_dc_render_text_obj(self, tobj))
 
+    def render_glyph_run(self, run, x, y):
+        if not isinstance(run, GlyphRun):
+            raise CapyPDFException('Argument is not a glyph run.')
+        check_error(libfile.capy_dc_render_glyph_run(self, run, x, y))
+
     def draw_image(self, iid):
         if not isinstance(iid, ImageId):
             raise CapyPDFException('Image id argument is not an image id object.')
         check_error(libfile.capy_dc_draw_image(self, iid))
 
+    def execute_buffer(self, buf):
+        if not isinstance(buf, CommandBuffer):
+            raise CapyPDFException('Argument is not a command buffer.')
+        ops = (ctypes.c_uint8 * len(buf.ops)).from_buffer(buf.ops)
+        args = (ctypes.c_double * len(buf.args)).from_buffer(buf.args)
+        check_error(libfile.capy_dc_execute_buffer(self, ops, len(buf.ops), args, len(buf.args)))
+
     def set_page_transition(self, tr):
         if not isinstance(tr, Transition):
             raise CapyPDFException('Argument is not a transition object.')
@@ -471,6 +702,147 @@ class DrawContext:
                                                           len(ocgs),
                                                           transition))
 
+class CommandBuffer:
+    """Drawing operations recorded in packed arrays so that they can be
+    executed with a single call to DrawContext.execute_buffer."""
+
+    def __init__(self):
+        self.ops = array.array('B')
+        self.args = array.array('d')
+
+    def __len__(self):
+        return len(self.ops)
+
+    def clear(self):
+        del self.ops[:]
+        del self.args[:]
+
+    def add(self, op, *args):
+        self.ops.append(op.value)
+        self.args.extend(args)
+
+    def cmd_Do(self, fxoid):
+        if not isinstance(fxoid, FormXObjectId):
+            raise CapyPDFException('Argument is not a form XObject id.')
+        self.add(DrawOp.Do, fxoid.id)
+
+    def cmd_j(self, join_style):
+        self.add(DrawOp.j, join_style.value)
+
+    def cmd_J(self, cap_style):
+        self.add(DrawOp.J, cap_style.value)
+
+    def draw_image(self, iid):
+        if not isinstance(iid, ImageId):
+            raise CapyPDFException('Image id argument is not an image id object.')
+        self.add(DrawOp.draw_image, iid.id)
+
+    def cmd_b(self):
+        self.add(DrawOp.b)
+
+    def cmd_B(self):
+        self.add(DrawOp.B)
+
+    def cmd_bstar(self):
+        self.add(DrawOp.bstar)
+
+    def cmd_Bstar(self):
+        self.add(DrawOp.Bstar)
+
+    def cmd_c(self, x1, y1, x2, y2, x3, y3):
+        self.add(DrawOp.c, x1, y1, x2, y2, x3, y3)
+
+    def cmd_cm(self, m1, m2, m3, m4, m5, m6):
+        self.add(DrawOp.cm, m1, m2, m3, m4, m5, m6)
+
+    def cmd_EMC(self):
+        self.add(DrawOp.EMC)
+
+    def cmd_f(self):
+        self.add(DrawOp.f)
+
+    def cmd_fstar(self):
+        self.add(DrawOp.fstar)
+
+    def cmd_G(self, gray):
+        self.add(DrawOp.G, gray)
+
+    def cmd_g(self, gray):
+        self.add(DrawOp.g, gray)
+
+    def cmd_h(self):
+        self.add(DrawOp.h)
+
+    def cmd_i(self, flatness):
+        self.add(DrawOp.i, flatness)
+
+    def cmd_K(self, c, m, y, k):
+        self.add(DrawOp.K, c, m, y, k)
+
+    def cmd_k(self, c, m, y, k):
+        self.add(DrawOp.k, c, m, y, k)
+
+    def cmd_l(self, x, y):
+        self.add(DrawOp.l, x, y)
+
+    def cmd_m(self, x, y):
+        self.add(DrawOp.m, x, y)
+
+    def cmd_M(self, miterlimit):
+        self.add(DrawOp.M, miterlimit)
+
+    def cmd_n(self):
+        self.add(DrawOp.n)
+
+    def cmd_q(self):
+        self.add(DrawOp.q)
+
+    def cmd_Q(self):
+        self.add(DrawOp.Q)
+
+    def cmd_re(self, x, y, w, h):
+        self.add(DrawOp.re, x, y, w, h)
+
+    def cmd_RG(self, r, g, b):
+        self.add(DrawOp.RG, r, g, b)
+
+    def cmd_rg(self, r, g, b):
+        self.add(DrawOp.rg, r, g, b)
+
+    def cmd_s(self):
+        self.add(DrawOp.s)
+
+    def cmd_S(self):
+        self.add(DrawOp.S)
+
+    def cmd_v(self, x2, y2, x3, y3):
+        self.add(DrawOp.v, x2, y2, x3, y3)
+
+    def cmd_w(self, line_width):
+        self.add(DrawOp.w, line_width)
+
+    def cmd_W(self):
+        self.add(DrawOp.W)
+
+    def cmd_Wstar(self):
+        self.add(DrawOp.Wstar)
+
+    def cmd_y(self, x1, y1, x3, y3):
+        self.add(DrawOp.y, x1, y1, x3, y3)
+
+class FormXObjectDrawContext(DrawContext):
+    '''Adds itself as a form XObject on exit. The result is stored in xobject_id.'''
+    def __init__(self, generator, dcptr):
+        super().__init__(generator, dcptr)
+        self.xobject_id = None
+
+    def __exit__(self, exc_type, exc_value, exc_tb):
+        try:
+            if exc_type is None:
+                self.xobject_id = self.generator.add_form_xobject(self)
+        finally:
+            self.generator = None
+
 class StateContextManager:
     def __init__(self, ctx):
         self.ctx = ctx
@@ -492,6 +864,44 @@ class Generator:
         check_error(libfile.capy_generator_new(file_name_bytes, options, ctypes.pointer(gptr)))
         self._as_parameter_ = gptr
 
+    @classmethod
+    def to_memory(cls, options=None):
+        '''The output can be read with memory_output() after writing.'''
+        if options is None:
+            options = Options()
+        g = cls.__new__(cls)
+        g._as_parameter_ = None
+        gptr = ctypes.c_void_p()
+        check_error(libfile.capy_generator_new_memory(options, ctypes.pointer(gptr)))
+        g._as_parameter_ = gptr
+        return g
+
+    @classmethod
+    def to_callback(cls, write_func, options=None):
+        '''write_func is called with bytes objects containing the output in order.'''
+        if options is None:
+            options = Options()
+        def callback(data, data_size, user_data):
+            try:
+                write_func(ctypes.string_at(data, data_size))
+            except Exception:
+                return 1
+            return 0
+        g = cls.__new__(cls)
+        g._as_parameter_ = None
+        # Must be kept alive for as long as the generator.
+        g._write_callback = WriteCallback(callback)
+        gptr = ctypes.c_void_p()
+        check_error(libfile.capy_generator_new_callback(g._write_callback, None, options, ctypes.pointer(gptr)))
+        g._as_parameter_ = gptr
+        return g
+
+    def memory_output(self):
+        data = ctypes.c_void_p()
+        data_size = ctypes.c_int64()
+        check_error(libfile.capy_generator_memory_output(self, ctypes.pointer(data), ctypes.pointer(data_size)))
+        return ctypes.string_at(data, data_size.value)
+
     def __del__(self):
         if self._as_parameter_ is not None:
             check_error(libfile.capy_generator_destroy(self))
@@ -511,6 +921,21 @@ class Generator:
     def add_page(self, page_ctx):
         check_error(libfile.capy_generator_add_page(self, page_ctx))
 
+    def form_xobject_draw_context(self, w, h):
+        '''Returns a context for recording a stamp.
+
+        Used as a context manager it adds the stamp on exit. Otherwise pass it
+        to add_form_xobject when done.'''
+        dcptr = ctypes.c_void_p()
+        check_error(libfile.capy_form_xobject_draw_context_new(self, w, h, ctypes.pointer(dcptr)))
+        return FormXObjectDrawContext(self, dcptr)
+
+    def add_form_xobject(self, ctx):
+        '''Identical form XObjects are stored once and get the same id.'''
+        fxoid = FormXObjectId()
+        check_error(libfile.capy_generator_add_form_xobject(self, ctx, ctypes.pointer(fxoid)))
+        return fxoid
+
     def embed_jpg(self, fname):
         iid = ImageId()
         check_error(libfile.capy_generator_embed_jpg(self, to_bytepath(fname), ctypes.pointer(iid)))
@@ -531,6 +956,22 @@ class Generator:
         check_error(libfile.capy_generator_load_image(self, to_bytepath(fname), ctypes.pointer(iid)))
         return iid
 
+    def load_image_for_placement(self, fname, width_pt, height_pt, max_dpi):
+        iid = ImageId()
+        check_error(libfile.capy_generator_load_image_for_placement(self,
+                                                                    to_bytepath(fname),
+                                                                    ctypes.c_double(width_pt),
+                                                                    ctypes.c_double(height_pt),
+                                                                    ctypes.c_double(max_dpi),
+                                                                    ctypes.pointer(iid)))
+        return iid
+
+    def load_images(self, fnames):
+        paths = (ctypes.c_char_p * len(fnames))(*[to_bytepath(f) for f in fnames])
+        iids = (ImageId * len(fnames))()
+        check_error(libfile.capy_generator_load_images(self, paths, len(fnames), iids))
+        return list(iids)
+
     def write(self):
         check_error(libfile.capy_generator_write(self))
 
@@ -544,6 +985,62 @@ class Generator:
         check_error(libfile.capy_generator_text_width(self, bytes, font, pointsize, ctypes.pointer(w)))
         return w.value
 
+    def text_advances(self, text, font, pointsize):
+        '''Returns the advance of every character, including kerning against the previous one.'''
+        if not isinstance(text, str):
+            raise CapyPDFException('Text must be a Unicode string.')
+        if not isinstance(font, FontId):
+            raise CapyPDFException('Argument not a font object.')
+        codepoints = (ctypes.c_uint32 * len(text))(*[ord(c) for c in text])
+        advances = (ctypes.c_double * len(text))()
+        w = ctypes.c_double()
+        check_error(libfile.capy_generator_text_advances(self, codepoints, len(text), font, pointsize, advances, ctypes.pointer(w)))
+        return list(advances)
+
+    def text_run(self, text, font, pointsize):
+        '''Lays out text like DrawContext.render_text, for drawing it many times.'''
+        if not isinstance(text, str):
+            raise CapyPDFException('Text must be a Unicode string.')
+        if not isinstance(font, FontId):
+            raise CapyPDFException('Argument not a font object.')
+        rptr = ctypes.c_void_p()
+        check_error(libfile.capy_generator_text_run_new(self, text.encode('UTF-8'), font, pointsize, ctypes.pointer(rptr)))
+        return GlyphRun(rptr)
+
+    def glyph_run(self, font, pointsize, glyphs):
+        '''Glyphs is a list of (character, x, y) tuples.'''
+        if not isinstance(font, FontId):
+            raise CapyPDFException('Argument not a font object.')
+        num = len(glyphs)
+        codepoints = (ctypes.c_uint32 * num)(*[ord(g[0]) for g in glyphs])
+        xs = (ctypes.c_double * num)(*[g[1] for g in glyphs])
+        ys = (ctypes.c_double * num)(*[g[2] for g in glyphs])
+        rptr = ctypes.c_void_p()
+        check_error(libfile.capy_generator_glyph_run_new(self, font, pointsize, codepoints, xs, ys, num, ctypes.pointer(rptr)))
+        return GlyphRun(rptr)
+
+    def color_cache_stats(self):
+        hits = ctypes.c_int64()
+        misses = ctypes.c_int64()
+        check_error(libfile.capy_generator_color_cache_stats(self, ctypes.pointer(hits), ctypes.pointer(misses)))
+        return (hits.value, misses.value)
+
+    def phase_stats(self, phase):
+        if not isinstance(phase, WritePhase):
+            raise CapyPDFException('Argument must be a write phase.')
+        count = ctypes.c_int64()
+        nbytes = ctypes.c_int64()
+        seconds = ctypes.c_double()
+        check_error(libfile.capy_generator_phase_stats(self, phase.value, ctypes.pointer(count), ctypes.pointer(nbytes), ctypes.pointer(seconds)))
+        return (count.value, nbytes.value, seconds.value)
+
+    def write_stats(self):
+        num_objects = ctypes.c_int64()
+        compression_in = ctypes.c_int64()
+        peak_stream_bytes = ctypes.c_int64()
+        check_error(libfile.capy_generator_write_stats(self, ctypes.pointer(num_objects), ctypes.pointer(compression_in), ctypes.pointer(peak_stream_bytes)))
+        return (num_objects.value, compression_in.value, peak_stream_bytes.value)
+
     def add_optional_content_group(self, ocg):
         ocgid = OptionalContentGroupId()
         check_error(libfile.capy_generator_add_optional_content_group(self, ocg, ctypes.pointer(ocgid)))
@@ -650,3 +1147,62 @@ class OptionalContentGroup:
 
     def __del__(self):
         check_error(libfile.capy_optional_content_group_destroy(self))
+
+
+class GlyphRun:
+    '''Glyphs whose font subsets have been resolved, created with Generator.text_run or glyph_run.'''
+    def __init__(self, rptr):
+        self._as_parameter_ = rptr
+
+    def __del__(self):
+        if self._as_parameter_ is not None:
+            check_error(libfile.capy_glyph_run_destroy(self))
+
+class ResourceContext:
+    '''Color profiles and other resources shared by generators, also in different threads.'''
+    def __init__(self, options):
+        self._as_parameter_ = None
+        cptr = ctypes.c_void_p()
+        check_error(libfile.capy_resource_context_new(options, ctypes.pointer(cptr)))
+        self._as_parameter_ = cptr
+
+    def __del__(self):
+        if self._as_parameter_ is not None:
+            check_error(libfile.capy_resource_context_destroy(self))
+
+class IncrementalUpdate:
+    '''Appends added and replaced objects to an existing PDF file as a new revision.'''
+    def __init__(self, filename):
+        self._as_parameter_ = None
+        uptr = ctypes.c_void_p()
+        check_error(libfile.capy_incremental_update_new(to_bytepath(filename), ctypes.pointer(uptr)))
+        self._as_parameter_ = uptr
+
+    def __del__(self):
+        if self._as_parameter_ is not None:
+            check_error(libfile.capy_incremental_update_destroy(self))
+
+    def root_object(self):
+        num = ctypes.c_int32()
+        check_error(libfile.capy_incremental_update_root_object(self, ctypes.pointer(num)))
+        return num.value
+
+    def object_dictionary(self, object_num):
+        data = ctypes.c_void_p()
+        data_size = ctypes.c_int64()
+        check_error(libfile.capy_incremental_update_object_dictionary(self,
+            object_num, ctypes.pointer(data), ctypes.pointer(data_size)))
+        return ctypes.string_at(data, data_size.value).decode('latin-1')
+
+    def add_object(self, dictionary, stream=b''):
+        num = ctypes.c_int32()
+        check_error(libfile.capy_incremental_update_add_object(self,
+            dictionary.encode('latin-1'), stream, len(stream), ctypes.pointer(num)))
+        return num.value
+
+    def replace_object(self, object_num, dictionary, stream=b''):
+        check_error(libfile.capy_incremental_update_replace_object(self,
+            object_num, dictionary.encode('latin-1'), stream, len(stream)))
+
+    def write(self):
+        check_error(libfile.capy_incremental_update_write(self))
@@ -0,0 +1,428 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Fixed workloads for measuring throughput. Results are printed to stdout
+// as a JSON array with one entry per workload.
+//
+// Usage: benchmarks <source root> <font dir> [workload names]
+//
+// The font directory must contain NotoSans-Regular.ttf and NotoSerif-Regular.ttf.
+// Every workload runs in its own child process so that its peak memory use
+// is measured on its own.
+//
+// The CMYK workload needs a CMYK ICC profile, whose path is read from the
+// CAPYPDF_BENCH_CMYK_PROFILE environment variable. It is skipped otherwise.
+
+#include <pdfgen.hpp>
+
+#include <fmt/core.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace capypdf;
+
+namespace {
+
+const std::vector<std::string> text_lines{
+    "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod",
+    "tempor incididunt ut labore et dolore magna aliqua. Amet mauris commodo",
+    "quis imperdiet. Risus viverra adipiscing at in tellus integer feugiat",
+    "scelerisque varius. Urna nec tincidunt praesent semper. Velit euismod in",
+    "pellentesque massa placerat duis ultricies lacus sed. AV, Tv, To, kerning.",
+};
+
+typedef std::chrono::steady_clock Clock;
+
+void check(ErrorCode ec) {
+    if(ec != ErrorCode::NoError) {
+        fprintf(stderr, "%s\n", error_text(ec));
+        std::exit(1);
+    }
+}
+
+template<typename T> T check(rvoe<T> rc) {
+    if(!rc) {
+        check(rc.error());
+    }
+    return std::move(rc.value());
+}
+
+u8string to_u8(const std::string &s) { return check(u8string::from_cstr(s)); }
+
+void append_utf8(std::string &out, uint32_t codepoint) {
+    if(codepoint < 0x80) {
+        out += (char)codepoint;
+    } else if(codepoint < 0x800) {
+        out += (char)(0xC0 | (codepoint >> 6));
+        out += (char)(0x80 | (codepoint & 0x3F));
+    } else {
+        out += (char)(0xE0 | (codepoint >> 12));
+        out += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        out += (char)(0x80 | (codepoint & 0x3F));
+    }
+}
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+struct Phases {
+    double setup = 0;
+    double draw = 0;
+    double write = 0;
+};
+
+struct Result {
+    int32_t pages = 0;
+    size_t output_bytes = 0;
+    Phases phases;
+};
+
+struct BenchmarkPaths {
+    std::filesystem::path source_root;
+    std::filesystem::path fontdir;
+};
+
+// Runs one document through construction, drawing and writing into memory.
+// The draw function returns the number of pages it created.
+void run_document(const PdfGenerationData &opts,
+                  const std::function<void(PdfGen &)> &setup,
+                  const std::function<int32_t(PdfGen &)> &draw,
+                  Result &result) {
+    auto start = Clock::now();
+    auto gen = check(PdfGen::construct_in_memory(opts));
+    setup(*gen);
+    result.phases.setup += seconds_since(start);
+    start = Clock::now();
+    result.pages += draw(*gen);
+    result.phases.draw += seconds_since(start);
+    start = Clock::now();
+    check(gen->write());
+    result.phases.write += seconds_since(start);
+    result.output_bytes += gen->memory_output().size();
+}
+
+Result text_pages(const BenchmarkPaths &paths) {
+    const int32_t num_pages = 200;
+    Result result;
+    CapyPDF_FontId fid;
+    std::vector<u8string> lines;
+    for(const auto &l : text_lines) {
+        lines.push_back(to_u8(l));
+    }
+    run_document(
+        PdfGenerationData{},
+        [&](PdfGen &gen) { fid = check(gen.load_font(paths.fontdir / "NotoSerif-Regular.ttf")); },
+        [&](PdfGen &gen) {
+            std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+            for(int32_t page = 0; page < num_pages; ++page) {
+                for(int32_t row = 0; row < 60; ++row) {
+                    check(ctx->render_text(
+                        lines[(page + row) % lines.size()], fid, 10, 40, 800 - 12.5 * row));
+                }
+                check(gen.add_page(*ctx));
+            }
+            return num_pages;
+        },
+        result);
+    return result;
+}
+
+Result path_pages(const BenchmarkPaths &) {
+    const int32_t num_pages = 200;
+    Result result;
+    run_document(
+        PdfGenerationData{},
+        [](PdfGen &) {},
+        [&](PdfGen &gen) {
+            std::mt19937 rng(1234);
+            std::uniform_real_distribution<double> coord(0, 590);
+            std::uniform_real_distribution<double> color(0, 1);
+            std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+            for(int32_t page = 0; page < num_pages; ++page) {
+                for(int32_t shape = 0; shape < 200; ++shape) {
+                    check(ctx->cmd_rg(color(rng), color(rng), color(rng)));
+                    check(ctx->cmd_m(coord(rng), coord(rng)));
+                    for(int32_t seg = 0; seg < 10; ++seg) {
+                        check(ctx->cmd_c(coord(rng),
+                                         coord(rng),
+                                         coord(rng),
+                                         coord(rng),
+                                         coord(rng),
+                                         coord(rng)));
+                        check(ctx->cmd_l(coord(rng), coord(rng)));
+                    }
+                    check(ctx->cmd_h());
+                    check(ctx->cmd_f());
+                }
+                check(gen.add_page(*ctx));
+            }
+            return num_pages;
+        },
+        result);
+    return result;
+}
+
+Result image_pages(const BenchmarkPaths &paths) {
+    const int32_t num_rounds = 10;
+    const std::vector<std::string> image_names{"flame_gradient.png",
+                                               "object_gradient.png",
+                                               "comic-colors.png",
+                                               "gray_alpha.png",
+                                               "simple.jpg",
+                                               "rgb_tiff.tif"};
+    Result result;
+    // A new document every round as identical images would be deduplicated.
+    for(int32_t round = 0; round < num_rounds; ++round) {
+        std::vector<CapyPDF_ImageId> images;
+        run_document(
+            PdfGenerationData{},
+            [&](PdfGen &gen) {
+                for(const auto &name : image_names) {
+                    const auto path = paths.source_root / "images" / name;
+                    images.push_back(name.ends_with(".jpg") ? check(gen.embed_jpg(path))
+                                                            : check(gen.load_image(path)));
+                }
+            },
+            [&](PdfGen &gen) {
+                std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+                for(const auto &iid : images) {
+                    auto pop = ctx->push_gstate();
+                    check(ctx->cmd_cm(200, 0, 0, 200, 100, 100));
+                    check(ctx->draw_image(iid));
+                }
+                check(gen.add_page(*ctx));
+                return 1;
+            },
+            result);
+    }
+    return result;
+}
+
+Result cmyk_pages(const BenchmarkPaths &) {
+    const int32_t num_pages = 100;
+    Result result;
+    const char *profile = getenv("CAPYPDF_BENCH_CMYK_PROFILE");
+    if(!profile) {
+        return result;
+    }
+    PdfGenerationData opts;
+    opts.output_colorspace = CAPYPDF_CS_DEVICE_CMYK;
+    opts.prof.cmyk_profile_file = profile;
+    run_document(
+        opts,
+        [](PdfGen &) {},
+        [&](PdfGen &gen) {
+            std::mt19937 rng(5678);
+            std::uniform_real_distribution<double> color(0, 1);
+            std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+            for(int32_t page = 0; page < num_pages; ++page) {
+                for(int32_t i = 0; i < 400; ++i) {
+                    check(ctx->set_nonstroke_color(
+                        DeviceRGBColor{color(rng), color(rng), color(rng)}));
+                    check(ctx->cmd_re((i % 20) * 28, (i / 20) * 40, 28, 40));
+                    check(ctx->cmd_f());
+                }
+                check(gen.add_page(*ctx));
+            }
+            return num_pages;
+        },
+        result);
+    return result;
+}
+
+Result font_subsetting(const BenchmarkPaths &paths) {
+    const int32_t num_pages = 20;
+    std::string all_glyphs;
+    const std::vector<std::pair<uint32_t, uint32_t>> ranges{
+        {0x21, 0x7E}, {0xA1, 0x17F}, {0x391, 0x3A1}, {0x3A3, 0x3C9}, {0x410, 0x44F}};
+    for(const auto &[first, last] : ranges) {
+        for(uint32_t cp = first; cp <= last; ++cp) {
+            append_utf8(all_glyphs, cp);
+        }
+    }
+    // Split into lines that fit on the page.
+    std::vector<u8string> lines;
+    const auto text = to_u8(all_glyphs);
+    std::string line;
+    int32_t count = 0;
+    for(const auto cp : check(utf8_to_glyphs(text))) {
+        append_utf8(line, cp);
+        if(++count % 60 == 0) {
+            lines.push_back(to_u8(line));
+            line.clear();
+        }
+    }
+    if(!line.empty()) {
+        lines.push_back(to_u8(line));
+    }
+    Result result;
+    CapyPDF_FontId fid;
+    run_document(
+        PdfGenerationData{},
+        [&](PdfGen &gen) { fid = check(gen.load_font(paths.fontdir / "NotoSans-Regular.ttf")); },
+        [&](PdfGen &gen) {
+            std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+            for(int32_t page = 0; page < num_pages; ++page) {
+                for(size_t i = 0; i < lines.size(); ++i) {
+                    check(ctx->render_text(lines[i], fid, 9, 20, 800 - 12.0 * i));
+                }
+                check(gen.add_page(*ctx));
+            }
+            return num_pages;
+        },
+        result);
+    return result;
+}
+
+Result many_pages(const BenchmarkPaths &) {
+    const int32_t num_pages = 5000;
+    Result result;
+    run_document(
+        PdfGenerationData{},
+        [](PdfGen &) {},
+        [&](PdfGen &gen) {
+            std::unique_ptr<PdfDrawContext> ctx{gen.new_page_draw_context()};
+            for(int32_t page = 0; page < num_pages; ++page) {
+                check(ctx->cmd_rg(0.2, 0.4, 0.8));
+                check(ctx->cmd_re(50, 50, 100 + page % 300, 100));
+                check(ctx->cmd_f());
+                check(gen.add_page(*ctx));
+            }
+            return num_pages;
+        },
+        result);
+    return result;
+}
+
+struct Workload {
+    const char *name;
+    Result (*run)(const BenchmarkPaths &paths);
+};
+
+const std::vector<Workload> workloads{
+    {"text_pages", text_pages},
+    {"path_pages", path_pages},
+    {"image_pages", image_pages},
+    {"cmyk_pages", cmyk_pages},
+    {"font_subsetting", font_subsetting},
+    {"many_pages", many_pages},
+};
+
+struct Measurement {
+    Result result;
+    double seconds = 0;
+    long peak_rss_kb = 0;
+};
+
+// Runs the workload in a child process. The child sends its result back
+// through a pipe and the parent gets the memory use from wait4, which
+// covers only that child.
+bool measure(const Workload &w, const BenchmarkPaths &paths, Measurement &m) {
+    int fds[2];
+    if(pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(stdout);
+    const pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if(pid == 0) {
+        close(fds[0]);
+        Measurement child;
+        const auto start = Clock::now();
+        child.result = w.run(paths);
+        child.seconds = seconds_since(start);
+        const bool sent = write(fds[1], &child, sizeof(child)) == (ssize_t)sizeof(child);
+        _exit(sent ? 0 : 1);
+    }
+    close(fds[1]);
+    const bool received = read(fds[0], &m, sizeof(m)) == (ssize_t)sizeof(m);
+    close(fds[0]);
+    int status;
+    rusage usage;
+    if(wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+       WEXITSTATUS(status) != 0 || !received) {
+        fprintf(stderr, "Workload %s failed.\n", w.name);
+        return false;
+    }
+    m.peak_rss_kb = usage.ru_maxrss;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        fprintf(stderr, "%s <source root> <font dir> [workload names]\n", argv[0]);
+        return 1;
+    }
+    const BenchmarkPaths paths{argv[1], argv[2]};
+    std::vector<std::string> selected(argv + 3, argv + argc);
+    bool first = true;
+    printf("[\n");
+    for(const auto &w : workloads) {
+        if(!selected.empty() &&
+           std::find(selected.begin(), selected.end(), w.name) == selected.end()) {
+            continue;
+        }
+        Measurement m;
+        if(!measure(w, paths, m)) {
+            return 1;
+        }
+        const auto &result = m.result;
+        const double total = m.seconds;
+        if(!first) {
+            printf(",\n");
+        }
+        first = false;
+        if(result.pages == 0) {
+            printf("  {\"name\": \"%s\", \"skipped\": true}", w.name);
+            continue;
+        }
+        const auto entry = fmt::format(
+            R"(  {{"name": "{}", "pages": {}, "output_bytes": {}, "seconds": {:.6f}, )"
+            R"("pages_per_second": {:.3f}, "mb_per_second": {:.3f}, "peak_rss_kb": {}, )"
+            R"("phases": {{"setup": {:.6f}, "draw": {:.6f}, "write": {:.6f}}}}})",
+            w.name,
+            result.pages,
+            result.output_bytes,
+            total,
+            result.pages / total,
+            result.output_bytes / total / 1e6,
+            m.peak_rss_kb,
+            result.phases.setup,
+            result.phases.draw,
+            result.phases.write);
+        fputs(entry.c_str(), stdout);
+    }
+    printf("\n]\n");
+    return 0;
+}
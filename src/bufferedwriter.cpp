@@ -0,0 +1,67 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <bufferedwriter.hpp>
+
+namespace capypdf {
+
+OutputSink file_sink(FILE *f) {
+    return [f](std::string_view data) -> rvoe<NoReturnValue> {
+        if(fwrite(data.data(), 1, data.size(), f) != data.size()) {
+            perror(nullptr);
+            RETERR(FileWriteError);
+        }
+        return NoReturnValue{};
+    };
+}
+
+OutputSink string_sink(std::string &out) {
+    return [&out](std::string_view data) -> rvoe<NoReturnValue> {
+        out += data;
+        return NoReturnValue{};
+    };
+}
+
+BufferedWriter::BufferedWriter(OutputSink sink_) : sink{std::move(sink_)} {
+    buf.reserve(buffer_size);
+}
+
+rvoe<NoReturnValue> BufferedWriter::write(std::string_view data) {
+    if(data.empty()) {
+        return NoReturnValue{};
+    }
+    if(buf.size() + data.size() > buffer_size) {
+        ERCV(flush());
+    }
+    if(data.size() >= buffer_size) {
+        ERCV(sink(data));
+    } else {
+        buf += data;
+    }
+    total_bytes += data.size();
+    last = data.back();
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> BufferedWriter::flush() {
+    if(!buf.empty()) {
+        ERCV(sink(buf));
+        buf.clear();
+    }
+    return NoReturnValue{};
+}
+
+} // namespace capypdf
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errorhandling.hpp>
+
+#include <cstdio>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace capypdf {
+
+// Receives the bytes of the output document in order.
+typedef std::function<rvoe<NoReturnValue>(std::string_view)> OutputSink;
+
+OutputSink file_sink(FILE *f);
+OutputSink string_sink(std::string &out);
+
+// Collects small writes into one reusable buffer. Writes larger than the
+// buffer go to the sink directly after flushing so big streams are never copied.
+// Keeps track of the output offset so the file position never needs to be queried.
+class BufferedWriter {
+public:
+    explicit BufferedWriter(OutputSink sink);
+
+    BufferedWriter(const BufferedWriter &) = delete;
+    BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+    rvoe<NoReturnValue> write(std::string_view data);
+    rvoe<NoReturnValue> flush();
+
+    uint64_t offset() const { return total_bytes; }
+    // The last byte written, or zero if nothing has been written yet.
+    char last_char() const { return last; }
+
+private:
+    static constexpr size_t buffer_size = 64 * 1024;
+
+    OutputSink sink;
+    std::string buf;
+    uint64_t total_bytes = 0;
+    char last = '\0';
+};
+
+} // namespace capypdf
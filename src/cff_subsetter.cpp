@@ -0,0 +1,719 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cff_subsetter.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+namespace capypdf {
+
+namespace {
+
+const uint16_t OP_CHARSET = 15;
+const uint16_t OP_ENCODING = 16;
+const uint16_t OP_CHARSTRINGS = 17;
+const uint16_t OP_PRIVATE = 18;
+const uint16_t OP_SUBRS = 19;
+const uint16_t OP_CHARSTRING_TYPE = (12 << 8) | 6;
+const uint16_t OP_ROS = (12 << 8) | 30;
+const uint16_t OP_FDARRAY = (12 << 8) | 36;
+const uint16_t OP_FDSELECT = (12 << 8) | 37;
+
+// Bodies of subroutines that no glyph in the subset calls.
+const std::string_view unused_subr{"\x0b", 1};
+
+// Type 2 charstring operators that matter for finding subroutine calls.
+const uint8_t CS_HSTEM = 1;
+const uint8_t CS_VSTEM = 3;
+const uint8_t CS_CALLSUBR = 10;
+const uint8_t CS_RETURN = 11;
+const uint8_t CS_ESCAPE = 12;
+const uint8_t CS_ENDCHAR = 14;
+const uint8_t CS_HSTEMHM = 18;
+const uint8_t CS_HINTMASK = 19;
+const uint8_t CS_CNTRMASK = 20;
+const uint8_t CS_VSTEMHM = 23;
+const uint8_t CS_SHORTINT = 28;
+const uint8_t CS_CALLGSUBR = 29;
+
+const int max_subr_depth = 10;
+const size_t max_stack_depth = 48;
+
+rvoe<uint32_t> read_be(std::string_view buf, size_t offset, size_t num_bytes) {
+    if(offset > buf.size() || buf.size() - offset < num_bytes) {
+        RETERR(IndexOutOfBounds);
+    }
+    uint32_t value = 0;
+    for(size_t i = 0; i < num_bytes; ++i) {
+        value = (value << 8) | (uint8_t)buf[offset + i];
+    }
+    return value;
+}
+
+rvoe<CFFIndex> parse_index(std::string_view table, size_t offset) {
+    CFFIndex index;
+    ERC(count, read_be(table, offset, 2));
+    if(count == 0) {
+        index.raw = table.substr(offset, 2);
+        return index;
+    }
+    ERC(off_size, read_be(table, offset + 2, 1));
+    if(off_size < 1 || off_size > 4) {
+        RETERR(MalformedFontFile);
+    }
+    const size_t offsets_start = offset + 3;
+    const size_t data_start = offsets_start + (count + 1) * off_size;
+    index.offsets.clear();
+    index.offsets.reserve(count + 1);
+    for(uint32_t i = 0; i <= count; ++i) {
+        ERC(value, read_be(table, offsets_start + i * off_size, off_size));
+        // Offsets are one based.
+        if(value == 0 || (!index.offsets.empty() && value - 1 < index.offsets.back())) {
+            RETERR(MalformedFontFile);
+        }
+        index.offsets.push_back(value - 1);
+    }
+    if(data_start > table.size() || table.size() - data_start < index.offsets.back()) {
+        RETERR(IndexOutOfBounds);
+    }
+    index.data = table.substr(data_start, index.offsets.back());
+    index.raw = table.substr(offset, data_start - offset + index.offsets.back());
+    return index;
+}
+
+rvoe<double> parse_real(std::string_view data, size_t &i) {
+    std::string text;
+    while(true) {
+        if(i >= data.size()) {
+            RETERR(MalformedFontFile);
+        }
+        const uint8_t b = data[i++];
+        for(const uint8_t nibble : {uint8_t(b >> 4), uint8_t(b & 0xf)}) {
+            if(nibble <= 9) {
+                text += char('0' + nibble);
+            } else if(nibble == 0xa) {
+                text += '.';
+            } else if(nibble == 0xb) {
+                text += 'E';
+            } else if(nibble == 0xc) {
+                text += "E-";
+            } else if(nibble == 0xe) {
+                text += '-';
+            } else if(nibble == 0xf) {
+                return strtod(text.c_str(), nullptr);
+            } else {
+                RETERR(MalformedFontFile);
+            }
+        }
+    }
+}
+
+rvoe<std::vector<CFFDictEntry>> parse_dict(std::string_view data) {
+    std::vector<CFFDictEntry> entries;
+    std::vector<double> operands;
+    size_t entry_start = 0;
+    size_t i = 0;
+    while(i < data.size()) {
+        const uint8_t b0 = data[i];
+        if(b0 <= 21) {
+            uint16_t op = b0;
+            ++i;
+            if(b0 == 12) {
+                ERC(b1, read_be(data, i, 1));
+                op = (12 << 8) | b1;
+                ++i;
+            }
+            entries.push_back(
+                CFFDictEntry{op, data.substr(entry_start, i - entry_start), std::move(operands)});
+            operands.clear();
+            entry_start = i;
+        } else if(b0 == 28) {
+            ERC(v, read_be(data, i + 1, 2));
+            operands.push_back((int16_t)v);
+            i += 3;
+        } else if(b0 == 29) {
+            ERC(v, read_be(data, i + 1, 4));
+            operands.push_back((int32_t)v);
+            i += 5;
+        } else if(b0 == 30) {
+            ++i;
+            ERC(v, parse_real(data, i));
+            operands.push_back(v);
+        } else if(b0 >= 32 && b0 <= 246) {
+            operands.push_back(int(b0) - 139);
+            i += 1;
+        } else if(b0 >= 247 && b0 <= 254) {
+            ERC(b1, read_be(data, i + 1, 1));
+            if(b0 <= 250) {
+                operands.push_back((int(b0) - 247) * 256 + int(b1) + 108);
+            } else {
+                operands.push_back(-(int(b0) - 251) * 256 - int(b1) - 108);
+            }
+            i += 2;
+        } else {
+            RETERR(MalformedFontFile);
+        }
+    }
+    if(!operands.empty()) {
+        RETERR(MalformedFontFile);
+    }
+    return entries;
+}
+
+const CFFDictEntry *find_op(const std::vector<CFFDictEntry> &dict, uint16_t op) {
+    for(const auto &e : dict) {
+        if(e.op == op) {
+            return &e;
+        }
+    }
+    return nullptr;
+}
+
+rvoe<int64_t> dict_offset(const std::vector<CFFDictEntry> &dict, uint16_t op, size_t operand) {
+    auto e = find_op(dict, op);
+    if(!e || e->operands.size() <= operand || e->operands[operand] < 0) {
+        RETERR(MalformedFontFile);
+    }
+    return (int64_t)e->operands[operand];
+}
+
+rvoe<CFFPrivateDict> parse_private(std::string_view table, const std::vector<CFFDictEntry> &dict) {
+    CFFPrivateDict priv;
+    ERC(size, dict_offset(dict, OP_PRIVATE, 0));
+    ERC(offset, dict_offset(dict, OP_PRIVATE, 1));
+    if((size_t)offset > table.size() || table.size() - offset < (size_t)size) {
+        RETERR(IndexOutOfBounds);
+    }
+    ERC(entries, parse_dict(table.substr(offset, size)));
+    priv.entries = std::move(entries);
+    if(find_op(priv.entries, OP_SUBRS)) {
+        // Relative to the start of the Private DICT.
+        ERC(subrs_offset, dict_offset(priv.entries, OP_SUBRS, 0));
+        ERC(subrs, parse_index(table, offset + subrs_offset));
+        priv.subrs = std::move(subrs);
+    }
+    return priv;
+}
+
+rvoe<std::vector<uint16_t>>
+parse_charset(std::string_view table, int64_t offset, size_t num_glyphs) {
+    std::vector<uint16_t> charset;
+    charset.reserve(num_glyphs);
+    charset.push_back(0);
+    if(offset == 0) {
+        // The predefined ISOAdobe charset maps glyphs to SIDs one to one.
+        for(size_t gid = 1; gid < num_glyphs; ++gid) {
+            charset.push_back((uint16_t)gid);
+        }
+        return charset;
+    }
+    if(offset < 3) {
+        // The Expert charsets are not used by OpenType fonts.
+        RETERR(UnsupportedFormat);
+    }
+    ERC(format, read_be(table, offset, 1));
+    size_t pos = offset + 1;
+    if(format == 0) {
+        for(size_t gid = 1; gid < num_glyphs; ++gid) {
+            ERC(sid, read_be(table, pos, 2));
+            charset.push_back((uint16_t)sid);
+            pos += 2;
+        }
+    } else if(format == 1 || format == 2) {
+        const size_t left_size = format == 1 ? 1 : 2;
+        while(charset.size() < num_glyphs) {
+            ERC(first, read_be(table, pos, 2));
+            ERC(num_left, read_be(table, pos + 2, left_size));
+            pos += 2 + left_size;
+            for(uint32_t i = 0; i <= num_left && charset.size() < num_glyphs; ++i) {
+                charset.push_back((uint16_t)(first + i));
+            }
+        }
+    } else {
+        RETERR(MalformedFontFile);
+    }
+    return charset;
+}
+
+rvoe<std::vector<uint8_t>>
+parse_fd_select(std::string_view table, int64_t offset, size_t num_glyphs, size_t num_fds) {
+    std::vector<uint8_t> fd_select;
+    fd_select.reserve(num_glyphs);
+    ERC(format, read_be(table, offset, 1));
+    if(format == 0) {
+        for(size_t gid = 0; gid < num_glyphs; ++gid) {
+            ERC(fd, read_be(table, offset + 1 + gid, 1));
+            fd_select.push_back((uint8_t)fd);
+        }
+    } else if(format == 3) {
+        ERC(num_ranges, read_be(table, offset + 1, 2));
+        size_t pos = offset + 3;
+        for(uint32_t r = 0; r < num_ranges; ++r) {
+            ERC(first, read_be(table, pos, 2));
+            ERC(fd, read_be(table, pos + 2, 1));
+            ERC(next, read_be(table, pos + 3, 2));
+            if(first != fd_select.size() || next < first) {
+                RETERR(MalformedFontFile);
+            }
+            fd_select.insert(fd_select.end(), next - first, (uint8_t)fd);
+            pos += 3;
+        }
+        if(fd_select.size() != num_glyphs) {
+            RETERR(MalformedFontFile);
+        }
+    } else {
+        RETERR(MalformedFontFile);
+    }
+    for(const auto fd : fd_select) {
+        if(fd >= num_fds) {
+            RETERR(MalformedFontFile);
+        }
+    }
+    return fd_select;
+}
+
+int32_t subr_bias(size_t num_subrs) {
+    if(num_subrs < 1240) {
+        return 107;
+    } else if(num_subrs < 33900) {
+        return 1131;
+    }
+    return 32768;
+}
+
+// Finds the subroutines that a glyph calls. This needs to follow the
+// stem hints, because the length of hintmask operands depends on them.
+class CharstringScanner {
+public:
+    CharstringScanner(const CFFFont &font,
+                      std::vector<bool> &global_used,
+                      std::vector<std::vector<bool>> &local_used)
+        : font(font), global_used(global_used), local_used(local_used) {}
+
+    rvoe<NoReturnValue> scan_glyph(uint32_t gid) {
+        const size_t private_index = font.is_cid ? font.fd_select.at(gid) : 0;
+        stack.clear();
+        num_stems = 0;
+        ERCV(run(font.charstrings.entry(gid), private_index, 0));
+        return NoReturnValue{};
+    }
+
+private:
+    // Returns true if the charstring ended the glyph.
+    rvoe<bool> run(std::string_view code, size_t private_index, int depth) {
+        if(depth > max_subr_depth) {
+            RETERR(MalformedFontFile);
+        }
+        size_t i = 0;
+        while(i < code.size()) {
+            const uint8_t b0 = code[i];
+            if(b0 >= 32 || b0 == CS_SHORTINT) {
+                if(stack.size() >= max_stack_depth) {
+                    RETERR(MalformedFontFile);
+                }
+                if(b0 == CS_SHORTINT) {
+                    ERC(v, read_be(code, i + 1, 2));
+                    stack.push_back((int16_t)v);
+                    i += 3;
+                } else if(b0 <= 246) {
+                    stack.push_back(int(b0) - 139);
+                    i += 1;
+                } else if(b0 <= 254) {
+                    ERC(b1, read_be(code, i + 1, 1));
+                    stack.push_back(b0 <= 250 ? (int(b0) - 247) * 256 + int(b1) + 108
+                                              : -(int(b0) - 251) * 256 - int(b1) - 108);
+                    i += 2;
+                } else {
+                    ERC(v, read_be(code, i + 1, 4));
+                    stack.push_back((int32_t)v / 65536.0);
+                    i += 5;
+                }
+                continue;
+            }
+            ++i;
+            switch(b0) {
+            case CS_HSTEM:
+            case CS_VSTEM:
+            case CS_HSTEMHM:
+            case CS_VSTEMHM:
+                num_stems += stack.size() / 2;
+                stack.clear();
+                break;
+            case CS_HINTMASK:
+            case CS_CNTRMASK:
+                // Any operands are an implicit vstem.
+                num_stems += stack.size() / 2;
+                stack.clear();
+                i += (num_stems + 7) / 8;
+                break;
+            case CS_CALLSUBR:
+            case CS_CALLGSUBR: {
+                if(stack.empty()) {
+                    RETERR(MalformedFontFile);
+                }
+                const bool global = b0 == CS_CALLGSUBR;
+                const auto &subrs =
+                    global ? font.global_subrs : font.privates.at(private_index).subrs;
+                auto &used = global ? global_used : local_used.at(private_index);
+                const int64_t subr = (int64_t)stack.back() + subr_bias(subrs.size());
+                stack.pop_back();
+                if(subr < 0 || (size_t)subr >= subrs.size()) {
+                    RETERR(MalformedFontFile);
+                }
+                used[subr] = true;
+                ERC(ended, run(subrs.entry(subr), private_index, depth + 1));
+                if(ended) {
+                    return true;
+                }
+                break;
+            }
+            case CS_RETURN:
+                return false;
+            case CS_ENDCHAR:
+                return true;
+            case CS_ESCAPE:
+                // The escaped operators do not affect hints or calls.
+                ++i;
+                stack.clear();
+                break;
+            default:
+                stack.clear();
+            }
+        }
+        return false;
+    }
+
+    const CFFFont &font;
+    std::vector<bool> &global_used;
+    std::vector<std::vector<bool>> &local_used;
+    std::vector<double> stack;
+    size_t num_stems = 0;
+};
+
+size_t index_size(size_t count, size_t data_size) {
+    if(count == 0) {
+        return 2;
+    }
+    size_t off_size = 1;
+    while(off_size < 4 && (data_size + 1) >> (8 * off_size)) {
+        ++off_size;
+    }
+    return 3 + (count + 1) * off_size + data_size;
+}
+
+size_t total_size(const std::vector<std::string> &entries) {
+    size_t size = 0;
+    for(const auto &e : entries) {
+        size += e.size();
+    }
+    return size;
+}
+
+size_t total_size(const std::vector<std::string_view> &entries) {
+    size_t size = 0;
+    for(const auto &e : entries) {
+        size += e.size();
+    }
+    return size;
+}
+
+void append_be(std::string &out, uint32_t value, size_t num_bytes) {
+    for(size_t i = num_bytes; i > 0; --i) {
+        out += char((value >> (8 * (i - 1))) & 0xff);
+    }
+}
+
+template<typename T> void append_index(std::string &out, const std::vector<T> &entries) {
+    append_be(out, (uint32_t)entries.size(), 2);
+    if(entries.empty()) {
+        return;
+    }
+    const auto data_size = total_size(entries);
+    const size_t off_size = (index_size(entries.size(), data_size) - 3 - data_size) /
+                            (entries.size() + 1);
+    out += char(off_size);
+    uint32_t offset = 1;
+    append_be(out, offset, off_size);
+    for(const auto &e : entries) {
+        offset += e.size();
+        append_be(out, offset, off_size);
+    }
+    for(const auto &e : entries) {
+        out += e;
+    }
+}
+
+// Offsets are written as five byte integers so that the size of a DICT
+// does not depend on them.
+void append_fixed_operand(std::string &out, int64_t value) {
+    out += char(29);
+    append_be(out, (uint32_t)value, 4);
+}
+
+void append_operator(std::string &out, uint16_t op) {
+    if(op >> 8) {
+        out += char(op >> 8);
+    }
+    out += char(op & 0xff);
+}
+
+size_t operator_size(uint16_t op) { return (op >> 8) ? 2 : 1; }
+
+std::string copy_dict_except(const std::vector<CFFDictEntry> &dict,
+                             std::initializer_list<uint16_t> skipped) {
+    std::string result;
+    for(const auto &e : dict) {
+        if(std::find(skipped.begin(), skipped.end(), e.op) == skipped.end()) {
+            result += e.raw;
+        }
+    }
+    return result;
+}
+
+std::vector<std::string_view> used_entries(const CFFIndex &index, const std::vector<bool> &used) {
+    std::vector<std::string_view> entries;
+    entries.reserve(index.size());
+    for(size_t i = 0; i < index.size(); ++i) {
+        entries.push_back(used[i] ? index.entry(i) : unused_subr);
+    }
+    return entries;
+}
+
+} // namespace
+
+rvoe<CFFFont> parse_cff(std::string_view table) {
+    CFFFont font;
+    ERC(major, read_be(table, 0, 1));
+    if(major != 1) {
+        // CFF2 is not supported in PDF.
+        RETERR(UnsupportedFormat);
+    }
+    ERC(header_size, read_be(table, 2, 1));
+    if(header_size < 4 || header_size > table.size()) {
+        RETERR(MalformedFontFile);
+    }
+    font.header = table.substr(0, header_size);
+    ERC(names, parse_index(table, header_size));
+    font.name_index = names.raw;
+    ERC(top_dicts, parse_index(table, header_size + names.raw.size()));
+    if(top_dicts.size() != 1) {
+        // An OpenType font has exactly one font in its CFF table.
+        RETERR(UnsupportedFormat);
+    }
+    ERC(top_dict, parse_dict(top_dicts.entry(0)));
+    font.top_dict = std::move(top_dict);
+    ERC(strings, parse_index(table, header_size + names.raw.size() + top_dicts.raw.size()));
+    font.string_index = strings.raw;
+    ERC(gsubrs,
+        parse_index(table,
+                    header_size + names.raw.size() + top_dicts.raw.size() + strings.raw.size()));
+    font.global_subrs = std::move(gsubrs);
+
+    auto cstype = find_op(font.top_dict, OP_CHARSTRING_TYPE);
+    if(cstype && (cstype->operands.empty() || cstype->operands[0] != 2)) {
+        RETERR(UnsupportedFormat);
+    }
+    ERC(charstrings_offset, dict_offset(font.top_dict, OP_CHARSTRINGS, 0));
+    ERC(charstrings, parse_index(table, charstrings_offset));
+    if(charstrings.size() == 0) {
+        RETERR(MalformedFontFile);
+    }
+    font.charstrings = std::move(charstrings);
+    const int64_t charset_offset =
+        find_op(font.top_dict, OP_CHARSET) ? dict_offset(font.top_dict, OP_CHARSET, 0).value_or(-1)
+                                           : 0;
+    if(charset_offset < 0) {
+        RETERR(MalformedFontFile);
+    }
+    ERC(charset, parse_charset(table, charset_offset, font.num_glyphs()));
+    font.charset = std::move(charset);
+
+    font.is_cid = find_op(font.top_dict, OP_ROS) != nullptr;
+    if(font.is_cid) {
+        ERC(fdarray_offset, dict_offset(font.top_dict, OP_FDARRAY, 0));
+        ERC(fdarray, parse_index(table, fdarray_offset));
+        if(fdarray.size() == 0 || fdarray.size() > 256) {
+            RETERR(MalformedFontFile);
+        }
+        for(size_t i = 0; i < fdarray.size(); ++i) {
+            ERC(font_dict, parse_dict(fdarray.entry(i)));
+            ERC(priv, parse_private(table, font_dict));
+            font.font_dicts.emplace_back(std::move(font_dict));
+            font.privates.emplace_back(std::move(priv));
+        }
+        ERC(fdselect_offset, dict_offset(font.top_dict, OP_FDSELECT, 0));
+        ERC(fd_select,
+            parse_fd_select(table, fdselect_offset, font.num_glyphs(), font.font_dicts.size()));
+        font.fd_select = std::move(fd_select);
+    } else {
+        ERC(priv, parse_private(table, font.top_dict));
+        font.privates.emplace_back(std::move(priv));
+    }
+    return font;
+}
+
+rvoe<std::string> generate_cff_subset(const CFFFont &font, const std::vector<uint32_t> &font_ids) {
+    if(font_ids.empty() || font_ids.size() > 65535) {
+        RETERR(IndexOutOfBounds);
+    }
+    const size_t num_glyphs = font_ids.size();
+    std::vector<bool> global_used(font.global_subrs.size());
+    std::vector<std::vector<bool>> local_used;
+    for(const auto &p : font.privates) {
+        local_used.emplace_back(p.subrs.size());
+    }
+    CharstringScanner scanner(font, global_used, local_used);
+    std::vector<std::string_view> charstrings;
+    charstrings.reserve(num_glyphs);
+    for(const auto gid : font_ids) {
+        if(gid >= font.num_glyphs()) {
+            RETERR(IndexOutOfBounds);
+        }
+        ERCV(scanner.scan_glyph(gid));
+        charstrings.push_back(font.charstrings.entry(gid));
+    }
+    const auto global_subrs = used_entries(font.global_subrs, global_used);
+
+    std::string charset;
+    if(font.is_cid) {
+        // CID i is glyph i.
+        charset += char(2);
+        if(num_glyphs > 1) {
+            append_be(charset, 1, 2);
+            append_be(charset, (uint32_t)num_glyphs - 2, 2);
+        }
+    } else {
+        charset += char(0);
+        for(size_t i = 1; i < num_glyphs; ++i) {
+            append_be(charset, font.charset.at(font_ids[i]), 2);
+        }
+    }
+    std::string fd_select;
+    if(font.is_cid) {
+        fd_select += char(0);
+        for(const auto gid : font_ids) {
+            fd_select += char(font.fd_select.at(gid));
+        }
+    }
+
+    // Private DICTs are rewritten so that their local subroutines follow them directly.
+    std::vector<std::string> private_dicts;
+    std::vector<std::vector<std::string_view>> local_subrs;
+    for(size_t i = 0; i < font.privates.size(); ++i) {
+        const auto &p = font.privates[i];
+        auto dict = copy_dict_except(p.entries, {OP_SUBRS});
+        local_subrs.emplace_back(used_entries(p.subrs, local_used[i]));
+        if(p.subrs.size() > 0) {
+            append_fixed_operand(dict, dict.size() + 5 + operator_size(OP_SUBRS));
+            append_operator(dict, OP_SUBRS);
+        }
+        private_dicts.emplace_back(std::move(dict));
+    }
+    const size_t private_operand_size = 2 * 5 + operator_size(OP_PRIVATE);
+
+    std::vector<std::string> font_dicts;
+    for(const auto &fd : font.font_dicts) {
+        font_dicts.emplace_back(copy_dict_except(fd, {OP_PRIVATE}));
+    }
+    size_t font_dicts_size = 0;
+    for(const auto &fd : font_dicts) {
+        font_dicts_size += fd.size() + private_operand_size;
+    }
+
+    auto top_dict = copy_dict_except(
+        font.top_dict,
+        {OP_CHARSET, OP_ENCODING, OP_CHARSTRINGS, OP_PRIVATE, OP_FDARRAY, OP_FDSELECT});
+    size_t top_dict_size = top_dict.size() + 2 * (5 + 1);
+    if(font.is_cid) {
+        top_dict_size += 2 * (5 + 2);
+    } else {
+        top_dict_size += private_operand_size;
+    }
+
+    // Lay out the table to find the offsets.
+    size_t pos = font.header.size() + font.name_index.size() + index_size(1, top_dict_size) +
+                 font.string_index.size() +
+                 index_size(global_subrs.size(), total_size(global_subrs));
+    const size_t charset_offset = pos;
+    pos += charset.size();
+    const size_t fd_select_offset = pos;
+    pos += fd_select.size();
+    const size_t charstrings_offset = pos;
+    pos += index_size(charstrings.size(), total_size(charstrings));
+    const size_t fdarray_offset = pos;
+    if(font.is_cid) {
+        pos += index_size(font_dicts.size(), font_dicts_size);
+    }
+    std::vector<size_t> private_offsets;
+    for(size_t i = 0; i < private_dicts.size(); ++i) {
+        private_offsets.push_back(pos);
+        pos += private_dicts[i].size();
+        if(!local_subrs[i].empty()) {
+            pos += index_size(local_subrs[i].size(), total_size(local_subrs[i]));
+        }
+    }
+    const size_t table_size = pos;
+
+    append_fixed_operand(top_dict, charset_offset);
+    append_operator(top_dict, OP_CHARSET);
+    append_fixed_operand(top_dict, charstrings_offset);
+    append_operator(top_dict, OP_CHARSTRINGS);
+    if(font.is_cid) {
+        append_fixed_operand(top_dict, fdarray_offset);
+        append_operator(top_dict, OP_FDARRAY);
+        append_fixed_operand(top_dict, fd_select_offset);
+        append_operator(top_dict, OP_FDSELECT);
+        for(size_t i = 0; i < font_dicts.size(); ++i) {
+            append_fixed_operand(font_dicts[i], private_dicts[i].size());
+            append_fixed_operand(font_dicts[i], private_offsets[i]);
+            append_operator(font_dicts[i], OP_PRIVATE);
+        }
+    } else {
+        append_fixed_operand(top_dict, private_dicts[0].size());
+        append_fixed_operand(top_dict, private_offsets[0]);
+        append_operator(top_dict, OP_PRIVATE);
+    }
+    assert(top_dict.size() == top_dict_size);
+
+    std::string out;
+    out.reserve(table_size);
+    out += font.header;
+    out += font.name_index;
+    append_index(out, std::vector<std::string>{std::move(top_dict)});
+    out += font.string_index;
+    append_index(out, global_subrs);
+    assert(out.size() == charset_offset);
+    out += charset;
+    out += fd_select;
+    append_index(out, charstrings);
+    if(font.is_cid) {
+        append_index(out, font_dicts);
+    }
+    for(size_t i = 0; i < private_dicts.size(); ++i) {
+        assert(out.size() == private_offsets[i]);
+        out += private_dicts[i];
+        if(!local_subrs[i].empty()) {
+            append_index(out, local_subrs[i]);
+        }
+    }
+    assert(out.size() == table_size);
+    return out;
+}
+
+} // namespace capypdf
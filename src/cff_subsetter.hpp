@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errorhandling.hpp>
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace capypdf {
+
+// An INDEX structure. Entry i is data[offsets[i], offsets[i + 1]).
+struct CFFIndex {
+    std::string_view raw;
+    std::string_view data;
+    std::vector<uint32_t> offsets{0};
+
+    size_t size() const { return offsets.size() - 1; }
+    std::string_view entry(size_t i) const {
+        return data.substr(offsets[i], offsets[i + 1] - offsets[i]);
+    }
+};
+
+// One operator of a DICT together with the bytes of its operands.
+struct CFFDictEntry {
+    uint16_t op;
+    std::string_view raw;
+    std::vector<double> operands;
+};
+
+struct CFFPrivateDict {
+    std::vector<CFFDictEntry> entries;
+    CFFIndex subrs;
+};
+
+// A parsed 'CFF ' table of an OpenType font. Everything points into the
+// font file. CFF2 tables of variable fonts are not supported.
+struct CFFFont {
+    std::string_view header;
+    std::string_view name_index;
+    std::vector<CFFDictEntry> top_dict;
+    std::string_view string_index;
+    CFFIndex global_subrs;
+    CFFIndex charstrings;
+    // The SID of every glyph in name keyed fonts, the CID in CID keyed fonts.
+    std::vector<uint16_t> charset;
+    bool is_cid = false;
+    // Only used by CID keyed fonts, which have one Private DICT per font DICT.
+    std::vector<std::vector<CFFDictEntry>> font_dicts;
+    std::vector<uint8_t> fd_select;
+    std::vector<CFFPrivateDict> privates;
+
+    size_t num_glyphs() const { return charstrings.size(); }
+};
+
+rvoe<CFFFont> parse_cff(std::string_view table);
+
+// The glyphs of the result are numbered in the order of font_ids. Subroutines
+// that none of the glyphs call are emptied but keep their numbers, so the
+// charstrings are copied unchanged. Name keyed fonts stay name keyed and
+// should be used with CID = GID. CID keyed fonts get an identity charset.
+rvoe<std::string> generate_cff_subset(const CFFFont &font, const std::vector<uint32_t> &font_ids);
+
+} // namespace capypdf
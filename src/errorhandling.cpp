@@ -67,6 +67,18 @@ const std::array<const char *, (std::size_t)ErrorCode::NumErrors> error_texts{
 "OCG not used on this page.",
 "Unsupported TIFF image.",
 "Used object with a drawing context that was not used to create it.",
+"Thread count can not be negative.",
+"Compression level must be between 0 and 9.",
+"Cache size can not be negative.",
+"Font has more glyphs than fit in a single CID subset.",
+"Image size limits must be positive.",
+"Number precision must be between 0 and 9.",
+"Coordinate array does not consist of whole path elements.",
+"Could not parse the cross reference section of the input file.",
+"Page tree fanout must be zero or at least two.",
+"Command buffer has an unknown operation or the wrong number of arguments.",
+"First page first output can not be combined with streaming.",
+"Structure item marked content is only supported on pages.",
 };
 
 // clang-format on
@@ -65,6 +65,18 @@ enum class ErrorCode : int32_t {
     UnusedOcg,
     UnsupportedTIFF,
     WrongDrawContext,
+    NegativeThreadCount,
+    InvalidCompressionLevel,
+    NegativeCacheSize,
+    TooManyGlyphs,
+    InvalidImageLimit,
+    InvalidNumberPrecision,
+    BadCoordinateCount,
+    BadXref,
+    InvalidPageTreeFanout,
+    BadCommandBuffer,
+    StreamingFirstPageFirst,
+    StructureOutsidePage,
     // When you add an error code here, also add the string representation in the .cpp file.
     NumErrors,
 };
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fontcache.hpp>
+
+namespace capypdf {
+
+FontCache &FontCache::instance() {
+    static FontCache cache;
+    return cache;
+}
+
+rvoe<std::shared_ptr<const CachedFontFile>>
+FontCache::get_font(const std::filesystem::path &fname) {
+    std::error_code ec;
+    const auto abspath = std::filesystem::absolute(fname, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    const auto mtime = std::filesystem::last_write_time(abspath, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    const auto key = abspath.lexically_normal().string();
+    {
+        std::lock_guard<std::mutex> lk(mut);
+        auto it = fonts.find(key);
+        if(it != fonts.end() && it->second.mtime == mtime) {
+            ++counts.font_hits;
+            it->second.last_used = ++use_counter;
+            return it->second.font;
+        }
+        ++counts.font_misses;
+    }
+    // Parse without holding the lock so that documents using
+    // other fonts do not have to wait.
+    ERC(parsed, load_and_parse_truetype_font(abspath));
+    std::lock_guard<std::mutex> lk(mut);
+    auto &entry = fonts[key];
+    entry.last_used = ++use_counter;
+    if(entry.font && entry.mtime == mtime) {
+        // Some other thread parsed the same file at the same time.
+        return entry.font;
+    }
+    entry.mtime = mtime;
+    entry.font = std::make_shared<const CachedFontFile>(CachedFontFile{next_id++, std::move(parsed)});
+    auto font = entry.font;
+    evict_fonts();
+    return font;
+}
+
+void FontCache::set_font_capacity(size_t max_entries) {
+    std::lock_guard<std::mutex> lk(mut);
+    font_capacity = max_entries;
+    evict_fonts();
+}
+
+void FontCache::evict_fonts() {
+    while(fonts.size() > font_capacity) {
+        auto oldest = fonts.begin();
+        for(auto it = fonts.begin(); it != fonts.end(); ++it) {
+            if(it->second.last_used < oldest->second.last_used) {
+                oldest = it;
+            }
+        }
+        fonts.erase(oldest);
+    }
+}
+
+bool FontCache::subset_cache_enabled() {
+    std::lock_guard<std::mutex> lk(mut);
+    return subset_capacity > 0;
+}
+
+void FontCache::set_subset_capacity(size_t max_entries) {
+    std::lock_guard<std::mutex> lk(mut);
+    subset_capacity = max_entries;
+    while(subsets.size() > subset_capacity) {
+        subset_index.erase(subsets.back().first);
+        subsets.pop_back();
+    }
+}
+
+std::optional<std::string> FontCache::find_subset(const std::string &key) {
+    std::lock_guard<std::mutex> lk(mut);
+    auto it = subset_index.find(key);
+    if(it == subset_index.end()) {
+        ++counts.subset_misses;
+        return {};
+    }
+    ++counts.subset_hits;
+    subsets.splice(subsets.begin(), subsets, it->second);
+    return it->second->second;
+}
+
+void FontCache::store_subset(const std::string &key, const std::string &font_data) {
+    std::lock_guard<std::mutex> lk(mut);
+    if(subset_capacity == 0 || subset_index.contains(key)) {
+        return;
+    }
+    subsets.emplace_front(key, font_data);
+    subset_index[subsets.front().first] = subsets.begin();
+    while(subsets.size() > subset_capacity) {
+        subset_index.erase(subsets.back().first);
+        subsets.pop_back();
+    }
+}
+
+FontCacheStats FontCache::stats() {
+    std::lock_guard<std::mutex> lk(mut);
+    return counts;
+}
+
+} // namespace capypdf
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <ft_subsetter.hpp>
+
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+
+namespace capypdf {
+
+struct CachedFontFile {
+    // Unique for every parse so that subsets of different versions
+    // of the same file never get mixed up.
+    uint64_t id;
+    TrueTypeFontFile font;
+};
+
+struct FontCacheStats {
+    uint64_t font_hits;
+    uint64_t font_misses;
+    uint64_t subset_hits;
+    uint64_t subset_misses;
+};
+
+// Process wide cache shared by all documents. Parsed font files are kept
+// for as long as the file on disk does not change, up to a limit after
+// which the least recently used one is dropped. Documents keep the fonts
+// they use alive on their own. Generated subset fonts are kept in an LRU
+// cache, which is disabled by default.
+class FontCache {
+public:
+    static FontCache &instance();
+
+    rvoe<std::shared_ptr<const CachedFontFile>> get_font(const std::filesystem::path &fname);
+    void set_font_capacity(size_t max_entries);
+
+    bool subset_cache_enabled();
+    void set_subset_capacity(size_t max_entries);
+    std::optional<std::string> find_subset(const std::string &key);
+    void store_subset(const std::string &key, const std::string &font_data);
+
+    FontCacheStats stats();
+
+private:
+    FontCache() = default;
+
+    void evict_fonts();
+
+    struct FontEntry {
+        std::filesystem::file_time_type mtime;
+        std::shared_ptr<const CachedFontFile> font;
+        uint64_t last_used = 0;
+    };
+
+    std::mutex mut;
+    uint64_t next_id = 0;
+    uint64_t use_counter = 0;
+    size_t font_capacity = 64;
+    std::unordered_map<std::string, FontEntry> fonts;
+    FontCacheStats counts{0, 0, 0, 0};
+
+    size_t subset_capacity = 0;
+    // Most recently used first. The index keys point to the strings in the list.
+    std::list<std::pair<std::string, std::string>> subsets;
+    std::unordered_map<std::string_view, decltype(subsets)::iterator> subset_index;
+};
+
+} // namespace capypdf
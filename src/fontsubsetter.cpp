@@ -32,14 +32,15 @@ const uint32_t SPACE = ' ';
 
 FontSubsetData create_startstate() {
     std::vector<TTGlyphs> start_state{RegularGlyph{0}};
+    std::vector<uint32_t> start_ids{0};
     std::unordered_map<uint32_t, uint32_t> start_mapping{};
-    return FontSubsetData{std::move(start_state), std::move(start_mapping)};
+    return FontSubsetData{std::move(start_state), std::move(start_ids), std::move(start_mapping)};
 }
 
 rvoe<NoReturnValue> add_subglyphs(std::unordered_set<uint32_t> &new_subglyphs,
                                   uint32_t glyph_id,
                                   const TrueTypeFontFile &ttfile) {
-    const auto &cur_glyph = ttfile.glyphs.at(glyph_id);
+    ERC(cur_glyph, ttfile.glyph_data(glyph_id));
     ERC(iscomp, is_composite_glyph(cur_glyph));
     if(!iscomp) {
         return NoReturnValue{};
@@ -63,11 +64,28 @@ rvoe<std::vector<uint32_t>> get_all_subglyphs(uint32_t glyph_id, const TrueTypeF
 
 } // namespace
 
-rvoe<FontSubsetter> FontSubsetter::construct(const std::filesystem::path &fontfile, FT_Face face) {
-    ERC(ttfile, load_and_parse_truetype_font(fontfile));
+rvoe<FontSubsetter> FontSubsetter::construct(std::shared_ptr<const CachedFontFile> fontfile,
+                                             FT_Face face,
+                                             FontSubsetType type) {
     std::vector<FontSubsetData> subsets;
     subsets.emplace_back(create_startstate());
-    return FontSubsetter(std::move(ttfile), face, std::move(subsets));
+    return FontSubsetter(std::move(fontfile), face, type, std::move(subsets));
+}
+
+FontSubsetter::FontSubsetter(std::shared_ptr<const CachedFontFile> fontfile_,
+                             FT_Face face_,
+                             FontSubsetType type_,
+                             std::vector<FontSubsetData> subsets_)
+    : fontfile{std::move(fontfile_)}, face{face_}, type{type_}, subsets{std::move(subsets_)} {
+    for(size_t subset = 0; subset < subsets.size(); ++subset) {
+        const auto &glyphs = subsets[subset].glyphs;
+        for(size_t offset = 0; offset < glyphs.size(); ++offset) {
+            if(std::holds_alternative<RegularGlyph>(glyphs[offset])) {
+                glyph_index.try_emplace(std::get<RegularGlyph>(glyphs[offset]).unicode_codepoint,
+                                        FontSubsetInfo{int32_t(subset), int32_t(offset)});
+            }
+        }
+    }
 }
 
 rvoe<FontSubsetInfo> FontSubsetter::get_glyph_subset(uint32_t glyph) {
@@ -79,32 +97,50 @@ rvoe<FontSubsetInfo> FontSubsetter::get_glyph_subset(uint32_t glyph) {
 }
 
 rvoe<FontSubsetInfo> FontSubsetter::unchecked_insert_glyph_to_last_subset(uint32_t glyph) {
-    if(subsets.back().glyphs.size() == max_glyphs) {
+    const auto subset_limit = type == FontSubsetType::CID ? max_cid_glyphs : max_glyphs;
+    if(subsets.back().glyphs.size() == subset_limit) {
+        if(type == FontSubsetType::CID) {
+            RETERR(TooManyGlyphs);
+        }
         subsets.emplace_back(create_startstate());
     }
-    if(glyph == SPACE) {
+    // CID fonts have two byte codes so the space character has no fixed location.
+    const bool fixed_space = type == FontSubsetType::Simple;
+    if(fixed_space && glyph == SPACE) {
         // In the PDF document model the space character is special.
         // Every subset font _must_ have the space character in
         // location 32.
         if(subsets.back().glyphs.size() == SPACE) {
             const auto space_index = FT_Get_Char_Index(face, glyph);
-            subsets.back().glyphs.push_back(RegularGlyph{glyph});
+            push_regular_glyph(glyph);
             subsets.back().font_index_mapping[space_index] =
                 (uint32_t)subsets.back().glyphs.size() - 1;
         }
         return FontSubsetInfo{int32_t(subsets.size() - 1), SPACE};
     }
     const auto font_index = FT_Get_Char_Index(face, glyph);
-    if(subsets.back().glyphs.size() == SPACE) {
+    if(fixed_space && subsets.back().glyphs.size() == SPACE) {
         // NOTE: the case where the subset font has fewer than 32 characters
         // is handled when serializing the font.
-        subsets.back().glyphs.emplace_back(RegularGlyph{32});
+        push_regular_glyph(32);
         subsets.back().font_index_mapping[font_index] = SPACE;
     }
-    ERC(iscomp, is_composite_glyph(ttfile.glyphs.at(font_index)));
+    bool iscomp = false;
+    if(!fontfile->font.is_cff()) {
+        // CFF glyphs can not be composite. Empty glyphs, such as the
+        // space in CID subsets, have no header to check.
+        ERC(glyph_data, fontfile->font.glyph_data(font_index));
+        if(!glyph_data.empty()) {
+            ERC(rv, is_composite_glyph(glyph_data));
+            iscomp = rv;
+        }
+    }
     if(iscomp) {
-        ERC(subglyphs, get_all_subglyphs(font_index, ttfile));
-        if(subglyphs.size() + subsets.back().glyphs.size() >= max_glyphs) {
+        ERC(subglyphs, get_all_subglyphs(font_index, fontfile->font));
+        if(subglyphs.size() + subsets.back().glyphs.size() >= subset_limit) {
+            if(type == FontSubsetType::CID) {
+                RETERR(TooManyGlyphs);
+            }
             fprintf(stderr, "Composite glyph overflow not yet implemented.");
             std::abort();
         }
@@ -115,42 +151,84 @@ rvoe<FontSubsetInfo> FontSubsetter::unchecked_insert_glyph_to_last_subset(uint32
             }
             // Composite glyph parts do not necessarily correspond to any Unicode codepoint.
             subsets.back().glyphs.push_back(CompositeGlyph{new_glyph});
+            subsets.back().font_ids.push_back(new_glyph);
             subsets.back().font_index_mapping[new_glyph] =
                 (uint32_t)subsets.back().glyphs.size() - 1;
         }
-        subsets.back().glyphs.push_back(RegularGlyph{glyph});
+        push_regular_glyph(glyph);
         subsets.back().font_index_mapping[font_index] = (uint32_t)subsets.back().glyphs.size() - 1;
     } else {
-        subsets.back().glyphs.push_back(RegularGlyph{glyph});
+        push_regular_glyph(glyph);
         subsets.back().font_index_mapping[font_index] = (uint32_t)subsets.back().glyphs.size() - 1;
     }
     return FontSubsetInfo{int32_t(subsets.size() - 1), int32_t(subsets.back().glyphs.size() - 1)};
 }
 
+void FontSubsetter::push_regular_glyph(uint32_t codepoint) {
+    subsets.back().glyphs.push_back(RegularGlyph{codepoint});
+    subsets.back().font_ids.push_back(font_id_for_glyph(face, subsets.back().glyphs.back()));
+    push_regular_glyph_index(codepoint);
+}
+
+void FontSubsetter::push_regular_glyph_index(uint32_t codepoint) {
+    // A codepoint can appear in more than one subset (e.g. 0 and space).
+    // Lookups always return the first one.
+    glyph_index.try_emplace(codepoint,
+                            FontSubsetInfo{int32_t(subsets.size() - 1),
+                                           int32_t(subsets.back().glyphs.size() - 1)});
+}
+
 std::optional<FontSubsetInfo> FontSubsetter::find_glyph(uint32_t glyph) const {
-    for(size_t subset = 0; subset < subsets.size(); ++subset) {
-        auto loc =
-            std::find_if(subsets.at(subset).glyphs.cbegin(),
-                         subsets.at(subset).glyphs.cend(),
-                         [&glyph](const TTGlyphs &ttg) {
-                             if(std::holds_alternative<RegularGlyph>(ttg)) {
-                                 return std::get<RegularGlyph>(ttg).unicode_codepoint == glyph;
-                             }
-                             return false;
-                         });
-        if(loc != subsets[subset].glyphs.cend()) {
-            return FontSubsetInfo{int32_t(subset),
-                                  int32_t(loc - subsets.at(subset).glyphs.cbegin())};
+    auto it = glyph_index.find(glyph);
+    if(it == glyph_index.end()) {
+        return {};
+    }
+    return it->second;
+}
+
+std::string FontSubsetter::subset_cache_key(int32_t subset_number) const {
+    // The glyph mapping is fully determined by the font file and the glyph list.
+    const auto &glyphs = subsets.at(subset_number).glyphs;
+    std::string key;
+    key.reserve(sizeof(uint64_t) + glyphs.size() * (1 + sizeof(uint32_t)));
+    key.append((const char *)&fontfile->id, sizeof(fontfile->id));
+    // The same glyphs are laid out differently in simple and CID subsets.
+    key += type == FontSubsetType::CID ? 'C' : 'S';
+    for(const auto &g : glyphs) {
+        uint32_t value;
+        if(std::holds_alternative<RegularGlyph>(g)) {
+            key += 'r';
+            value = std::get<RegularGlyph>(g).unicode_codepoint;
+        } else {
+            key += 'c';
+            value = std::get<CompositeGlyph>(g).font_index;
         }
+        key.append((const char *)&value, sizeof(value));
     }
-    return {};
+    return key;
 }
 
-rvoe<std::string> FontSubsetter::generate_subset(FT_Face face,
-                                                 const TrueTypeFontFile &source,
+rvoe<std::string> FontSubsetter::generate_subset(const TrueTypeFontFile &source,
                                                  int32_t subset_number) const {
     const auto &glyphs = subsets.at(subset_number);
-    return generate_font(face, source, glyphs.glyphs, glyphs.font_index_mapping);
+    auto &cache = FontCache::instance();
+    std::string key;
+    if(cache.subset_cache_enabled()) {
+        key = subset_cache_key(subset_number);
+        auto cached = cache.find_subset(key);
+        if(cached) {
+            return std::move(*cached);
+        }
+    }
+    ERC(font_data,
+        generate_font(source,
+                      glyphs.font_ids,
+                      glyphs.font_index_mapping,
+                      type == FontSubsetType::CID));
+    if(!key.empty()) {
+        cache.store_subset(key, font_data);
+    }
+    return font_data;
 }
 
 } // namespace capypdf
@@ -18,6 +18,7 @@
 
 #include <filesystem>
 #include <ft_subsetter.hpp>
+#include <fontcache.hpp>
 
 #include <vector>
 #include <string>
@@ -26,12 +27,21 @@
 #include <cstdint>
 #include <unordered_map>
 #include <variant>
+#include <memory>
 
 typedef struct FT_FaceRec_ *FT_Face;
 
 namespace capypdf {
 
 static const std::size_t max_glyphs = 255;
+static const std::size_t max_cid_glyphs = 65535;
+
+enum class FontSubsetType {
+    // Simple TrueType fonts with one byte codes, split into subsets of at most 255 glyphs.
+    Simple,
+    // A single Identity-H encoded CIDFontType2 subset with two byte codes.
+    CID,
+};
 
 struct FontSubsetInfo {
     int32_t subset;
@@ -40,15 +50,22 @@ struct FontSubsetInfo {
 
 struct FontSubsetData {
     std::vector<TTGlyphs> glyphs;
+    // Font file index of every entry in glyphs. Resolved when the glyph is added
+    // so that generating the subset does not need the FreeType face.
+    std::vector<uint32_t> font_ids;
     std::unordered_map<uint32_t, uint32_t> font_index_mapping;
 };
 
 class FontSubsetter {
 public:
-    static rvoe<FontSubsetter> construct(const std::filesystem::path &fontfile, FT_Face face);
+    static rvoe<FontSubsetter> construct(std::shared_ptr<const CachedFontFile> fontfile,
+                                         FT_Face face,
+                                         FontSubsetType type = FontSubsetType::Simple);
 
-    FontSubsetter(TrueTypeFontFile ttfile, FT_Face face, std::vector<FontSubsetData> subsets)
-        : ttfile{ttfile}, face{face}, subsets{subsets} {}
+    FontSubsetter(std::shared_ptr<const CachedFontFile> fontfile,
+                  FT_Face face,
+                  FontSubsetType type,
+                  std::vector<FontSubsetData> subsets);
 
     rvoe<FontSubsetInfo> get_glyph_subset(uint32_t glyph);
     rvoe<FontSubsetInfo> unchecked_insert_glyph_to_last_subset(uint32_t glyph);
@@ -57,22 +74,26 @@ public:
         return subsets.at(subset_number).glyphs;
     }
 
-    std::vector<TTGlyphs> &get_subset(int32_t subset_number) {
-        return subsets.at(subset_number).glyphs;
-    }
-
+    FontSubsetType subset_type() const { return type; }
     size_t num_subsets() const { return subsets.size(); }
     size_t subset_size(size_t subset) const { return subsets.at(subset).glyphs.size(); }
 
-    rvoe<std::string>
-    generate_subset(FT_Face face, const TrueTypeFontFile &source, int32_t subset_number) const;
+    // Safe to call from several threads at once.
+    rvoe<std::string> generate_subset(const TrueTypeFontFile &source, int32_t subset_number) const;
 
 private:
-    TrueTypeFontFile ttfile;
+    std::string subset_cache_key(int32_t subset_number) const;
+
+    std::shared_ptr<const CachedFontFile> fontfile;
     FT_Face face;
+    FontSubsetType type;
     std::optional<FontSubsetInfo> find_glyph(uint32_t glyph) const;
+    void push_regular_glyph(uint32_t codepoint);
+    void push_regular_glyph_index(uint32_t codepoint);
 
     std::vector<FontSubsetData> subsets;
+    // Location of the first occurrence of each codepoint in the subsets.
+    std::unordered_map<uint32_t, FontSubsetInfo> glyph_index;
 };
 
 } // namespace capypdf
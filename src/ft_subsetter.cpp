@@ -24,6 +24,7 @@
 #include <bit>
 #include <cmath>
 
+#include <deque>
 #include <stdexcept>
 #include <variant>
 #include <expected>
@@ -401,6 +402,17 @@ rvoe<TTMaxp10> load_maxp(const std::vector<TTDirEntry> &dir, std::string_view bu
     uint32_t version;
     safe_memcpy(&version, buf, e->offset);
     byte_swap_inplace(version);
+    if(version == 0x5000) {
+        // Fonts with CFF outlines only have the glyph count.
+        if(e->length < sizeof(uint32_t) + sizeof(uint16_t)) {
+            RETERR(MalformedFontFile);
+        }
+        TTMaxp10 maxp{};
+        maxp.version = version;
+        safe_memcpy(&maxp.num_glyphs, buf, e->offset + sizeof(uint32_t));
+        byte_swap_inplace(maxp.num_glyphs);
+        return maxp;
+    }
     if(version != 1 << 16) {
         RETERR(UnsupportedFormat);
     }
@@ -433,24 +445,25 @@ rvoe<std::vector<int32_t>> load_loca(const std::vector<TTDirEntry> &dir,
     if(!loca) {
         RETERR(MalformedFontFile);
     }
-    std::vector<int32_t> offsets;
-    offsets.reserve(num_glyphs);
+    std::vector<int32_t> offsets(size_t(num_glyphs) + 1);
     if(index_to_loc_format == 0) {
-        for(uint16_t i = 0; i <= num_glyphs; ++i) {
+        ERC(table, get_substring(buf, loca->offset, offsets.size() * sizeof(uint16_t)));
+        for(size_t i = 0; i < offsets.size(); ++i) {
             uint16_t offset;
-            ERCV(safe_memcpy(&offset, buf, loca->offset + i * sizeof(uint16_t)));
+            memcpy(&offset, table.data() + i * sizeof(uint16_t), sizeof(uint16_t));
             byte_swap_inplace(offset);
-            offsets.push_back(offset * 2);
+            offsets[i] = offset * 2;
         }
     } else if(index_to_loc_format == 1) {
-        for(uint16_t i = 0; i <= num_glyphs; ++i) {
+        ERC(table, get_substring(buf, loca->offset, offsets.size() * sizeof(int32_t)));
+        for(size_t i = 0; i < offsets.size(); ++i) {
             int32_t offset;
-            ERCV(safe_memcpy(&offset, buf, loca->offset + i * sizeof(int32_t)));
+            memcpy(&offset, table.data() + i * sizeof(int32_t), sizeof(int32_t));
             byte_swap_inplace(offset);
             if(offset < 0) {
                 RETERR(IndexIsNegative);
             }
-            offsets.push_back(offset);
+            offsets[i] = offset;
         }
     } else {
         RETERR(MalformedFontFile);
@@ -512,26 +525,12 @@ rvoe<TTHmtx> load_hmtx(const std::vector<TTDirEntry> &dir,
     return hmtx;
 }
 
-rvoe<std::vector<std::string>> load_glyphs(const std::vector<TTDirEntry> &dir,
-                                           std::string_view buf,
-                                           uint16_t num_glyphs,
-                                           const std::vector<int32_t> &loca) {
-    std::vector<std::string> glyph_data;
+rvoe<std::string_view> load_glyf(const std::vector<TTDirEntry> &dir, std::string_view buf) {
     auto e = find_entry(dir, "glyf");
     if(!e) {
         RETERR(MalformedFontFile);
     }
-    if(e->offset > buf.size()) {
-        RETERR(MalformedFontFile);
-    }
-    auto glyf_start = std::string_view(buf).substr(e->offset);
-    for(uint16_t i = 0; i < num_glyphs; ++i) {
-        const auto data_off = loca.at(i);
-        const auto data_size = loca.at(i + 1) - loca.at(i);
-        ERC(sstr, get_substring(glyf_start, data_off, data_size));
-        glyph_data.emplace_back(std::move(sstr));
-    }
-    return glyph_data;
+    return get_substring(buf, e->offset, e->length);
 }
 
 rvoe<std::string>
@@ -556,44 +555,51 @@ load_raw_table(const std::vector<TTDirEntry> &dir, std::string_view buf, const c
     return std::string(buf.data() + e->offset, buf.data() + end_offset);
 }
 
-rvoe<std::vector<std::string>>
-subset_glyphs(FT_Face face,
-              const TrueTypeFontFile &source,
-              const std::vector<TTGlyphs> glyphs,
-              const std::unordered_map<uint32_t, uint32_t> &comp_mapping) {
-    std::vector<std::string> subset;
-    assert(std::get<RegularGlyph>(glyphs[0]).unicode_codepoint == 0);
-    assert(glyphs.size() < 255);
-    for(const auto &g : glyphs) {
-        uint32_t gid = font_id_for_glyph(face, g);
-        assert(gid < source.glyphs.size());
-        subset.push_back(source.glyphs[gid]);
+// Composite glyphs are rewritten to use the new glyph numbers, and their
+// data is stored in rewritten. All other glyphs point to the source font.
+rvoe<std::vector<std::string_view>>
+subset_glyphs(const TrueTypeFontFile &source,
+              const std::vector<uint32_t> &font_ids,
+              const std::unordered_map<uint32_t, uint32_t> &comp_mapping,
+              bool is_cid,
+              std::deque<std::string> &rewritten) {
+    std::vector<std::string_view> subset;
+    subset.reserve(std::max<size_t>(font_ids.size(), SPACE + 1));
+    assert(font_ids[0] == 0);
+    assert(is_cid || font_ids.size() <= 255);
+    for(const auto gid : font_ids) {
+        ERC(glyph, source.glyph_data(gid));
+        subset.push_back(glyph);
         if(!subset.back().empty()) {
             ERC(num_contours, extract<int16_t>(subset.back(), 0));
             byte_swap_inplace(num_contours);
             if(num_contours < 0) {
-                ERCV(reassign_composite_glyph_numbers(subset.back(), comp_mapping));
+                rewritten.emplace_back(subset.back());
+                ERCV(reassign_composite_glyph_numbers(rewritten.back(), comp_mapping));
+                subset.back() = rewritten.back();
             }
         }
     }
     // Glyph ID 32 _must_ be the space character. Pad empty things until done.
-    if(subset.size() < SPACE + 1) {
+    // CID subsets have two byte codes and no fixed space.
+    if(!is_cid && subset.size() < SPACE + 1) {
+        ERC(notdef, source.glyph_data(0));
         while(subset.size() < SPACE) {
-            subset.emplace_back(source.glyphs[0]);
+            subset.push_back(notdef);
         }
-        subset.emplace_back(source.glyphs.at(SPACE));
+        ERC(space, source.glyph_data(SPACE));
+        subset.push_back(space);
     }
     return subset;
 }
 
-TTHmtx
-subset_hmtx(FT_Face face, const TrueTypeFontFile &source, const std::vector<TTGlyphs> &glyphs) {
+TTHmtx subset_hmtx(const TrueTypeFontFile &source, const std::vector<uint32_t> &font_ids) {
     TTHmtx subset;
     assert(source.hmtx.longhor.size() + source.hmtx.left_side_bearings.size() ==
            source.maxp.num_glyphs);
     assert(!source.hmtx.longhor.empty());
-    for(const auto &g : glyphs) {
-        const auto gid = font_id_for_glyph(face, g);
+    subset.longhor.reserve(font_ids.size());
+    for(const auto gid : font_ids) {
         if(gid < source.hmtx.longhor.size()) {
             subset.longhor.push_back(source.hmtx.longhor[gid]);
         } else {
@@ -632,7 +638,10 @@ TTDirEntry write_raw_table(std::string &odata, const char *tag, std::string_view
     return e;
 }
 
-std::string serialize_font(TrueTypeFontFile &tf) {
+// Fonts with CFF outlines pass the subset CFF table instead of glyphs.
+std::string serialize_font(TrueTypeFontFile &tf,
+                           const std::vector<std::string_view> &glyphs,
+                           std::string_view cff_table = {}) {
     std::string odata;
     odata.reserve(1024 * 1024);
     TTDirEntry e;
@@ -640,6 +649,10 @@ std::string serialize_font(TrueTypeFontFile &tf) {
     std::vector<TTDirEntry> directory;
 
     off.set_table_size(tf.num_directory_entries());
+    if(tf.is_cff()) {
+        // OpenType files with CFF outlines are tagged 'OTTO'.
+        off.scaler = 0x4F54544F;
+    }
     const auto num_tables = off.num_tables;
     off.swap_endian();
     append_bytes(odata, off);
@@ -672,30 +685,36 @@ std::string serialize_font(TrueTypeFontFile &tf) {
         write_raw_table(odata, "hhea", std::string_view((char *)&tf.hhea, sizeof(tf.hhea))));
 
     tf.maxp.swap_endian();
+    // Version 0.5 of the table only has the version and the number of glyphs.
+    const size_t maxp_size = tf.is_cff() ? sizeof(uint32_t) + sizeof(uint16_t) : sizeof(tf.maxp);
     directory.push_back(
-        write_raw_table(odata, "maxp", std::string_view((char *)&tf.maxp, sizeof(tf.maxp))));
-    // glyph time
-    std::vector<int32_t> loca;
-    size_t glyphs_start = odata.size();
-    for(const auto &g : tf.glyphs) {
-        const auto offset = (int32_t)(odata.size() - glyphs_start);
-        loca.push_back(offset);
-        append_bytes(odata, g);
-    }
-    loca.push_back((int32_t)(odata.size() - glyphs_start));
-    e.set_tag("glyf");
-    e.offset = glyphs_start;
-    e.length = odata.size() - glyphs_start;
-    directory.push_back(e);
-
-    e.set_tag("loca");
-    e.offset = odata.size();
-    for(auto offset : loca) {
-        byte_swap_inplace(offset);
-        append_bytes(odata, offset);
+        write_raw_table(odata, "maxp", std::string_view((char *)&tf.maxp, maxp_size)));
+    if(tf.is_cff()) {
+        directory.push_back(write_raw_table(odata, "CFF ", cff_table));
+    } else {
+        // glyph time
+        std::vector<int32_t> loca;
+        size_t glyphs_start = odata.size();
+        for(const auto &g : glyphs) {
+            const auto offset = (int32_t)(odata.size() - glyphs_start);
+            loca.push_back(offset);
+            append_bytes(odata, g);
+        }
+        loca.push_back((int32_t)(odata.size() - glyphs_start));
+        e.set_tag("glyf");
+        e.offset = glyphs_start;
+        e.length = odata.size() - glyphs_start;
+        directory.push_back(e);
+
+        e.set_tag("loca");
+        e.offset = odata.size();
+        for(auto offset : loca) {
+            byte_swap_inplace(offset);
+            append_bytes(odata, offset);
+        }
+        e.length = odata.size() - e.offset;
+        directory.push_back(e);
     }
-    e.length = odata.size() - e.offset;
-    directory.push_back(e);
 
     e.set_tag("hmtx");
     e.offset = odata.size();
@@ -728,13 +747,13 @@ std::string serialize_font(TrueTypeFontFile &tf) {
     return odata;
 }
 
-std::string gen_cmap(const std::vector<TTGlyphs> &glyphs) {
+std::string gen_cmap(size_t num_glyphs) {
     TTEncodingSubtable0 glyphencoding;
     glyphencoding.format = 0;
     glyphencoding.language = 0;
     glyphencoding.length = sizeof(glyphencoding);
     for(size_t i = 0; i < 256; ++i) {
-        if(i < glyphs.size()) {
+        if(i < num_glyphs) {
             glyphencoding.glyphids[i] = i;
         } else {
             glyphencoding.glyphids[i] = 0;
@@ -797,13 +816,26 @@ rvoe<TrueTypeFontFile> parse_truetype_font(std::string_view buf) {
         RETERR(MalformedFontFile);
     }
 #endif
-    ERC(loca, load_loca(directory, buf, tf.head.index_to_loc_format, tf.maxp.num_glyphs));
     ERC(hhea, load_hhea(directory, buf))
     tf.hhea = hhea;
     ERC(hmtx, load_hmtx(directory, buf, tf.maxp.num_glyphs, tf.hhea.num_hmetrics))
     tf.hmtx = hmtx;
-    ERC(glyphs, load_glyphs(directory, buf, tf.maxp.num_glyphs, loca))
-    tf.glyphs = glyphs;
+    if(auto cff_entry = find_entry(directory, "CFF ")) {
+        ERC(table, get_substring(buf, cff_entry->offset, cff_entry->length));
+        ERC(cff, parse_cff(table));
+        if(cff.num_glyphs() != tf.maxp.num_glyphs) {
+            RETERR(MalformedFontFile);
+        }
+        tf.cff = std::make_shared<const CFFFont>(std::move(cff));
+    } else {
+        if(tf.maxp.version != 1 << 16) {
+            RETERR(UnsupportedFormat);
+        }
+        ERC(loca, load_loca(directory, buf, tf.head.index_to_loc_format, tf.maxp.num_glyphs));
+        tf.loca = std::move(loca);
+        ERC(glyf, load_glyf(directory, buf));
+        tf.glyf = glyf;
+    }
 
     ERC(cvt, load_raw_table(directory, buf, "cvt "));
     tf.cvt = cvt;
@@ -893,44 +925,70 @@ rvoe<TrueTypeFontFile> parse_truetype_font(std::string_view buf) {
     return tf;
 }
 
-rvoe<std::string> generate_font(FT_Face face,
-                                std::string_view buf,
-                                const std::vector<TTGlyphs> &glyphs,
-                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping) {
+rvoe<std::string> generate_font(std::string_view buf,
+                                const std::vector<uint32_t> &font_ids,
+                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping,
+                                bool is_cid) {
     ERC(source, parse_truetype_font(buf));
-    return generate_font(face, source, glyphs, comp_mapping);
+    return generate_font(source, font_ids, comp_mapping, is_cid);
 }
 
-rvoe<std::string> generate_font(FT_Face face,
-                                const TrueTypeFontFile &source,
-                                const std::vector<TTGlyphs> &glyphs,
-                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping) {
+rvoe<std::string> generate_font(const TrueTypeFontFile &source,
+                                const std::vector<uint32_t> &font_ids,
+                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping,
+                                bool is_cid) {
     TrueTypeFontFile dest;
-    assert(std::get<RegularGlyph>(glyphs[0]).unicode_codepoint == 0);
-    ERC(subglyphs, subset_glyphs(face, source, glyphs, comp_mapping));
-    dest.glyphs = subglyphs;
+    assert(font_ids[0] == 0);
+    std::deque<std::string> rewritten;
+    std::vector<std::string_view> subglyphs;
+    std::string cff_table;
+    if(source.is_cff()) {
+        ERC(cff_subset, generate_cff_subset(*source.cff, font_ids));
+        cff_table = std::move(cff_subset);
+        dest.cff = source.cff;
+    } else {
+        ERC(glyphs, subset_glyphs(source, font_ids, comp_mapping, is_cid, rewritten));
+        subglyphs = std::move(glyphs);
+    }
 
     dest.head = source.head;
     // https://learn.microsoft.com/en-us/typography/opentype/spec/otff#calculating-checksums
     dest.head.checksum_adjustment = 0;
     dest.hhea = source.hhea;
     dest.maxp = source.maxp;
-    dest.maxp.num_glyphs = dest.glyphs.size();
-    dest.hmtx = subset_hmtx(face, source, glyphs);
+    dest.maxp.num_glyphs = source.is_cff() ? font_ids.size() : subglyphs.size();
+    dest.hmtx = subset_hmtx(source, font_ids);
     dest.hhea.num_hmetrics = dest.hmtx.longhor.size();
     dest.head.index_to_loc_format = 1;
     dest.cvt = source.cvt;
     dest.fpgm = source.fpgm;
     dest.prep = source.prep;
-    dest.cmap = gen_cmap(glyphs);
+    if(!is_cid) {
+        // CIDFontType2 fonts map codes to glyphs with /CIDToGIDMap and
+        // do not use the cmap, which could not address them all anyway.
+        dest.cmap = gen_cmap(font_ids.size());
+    }
 
-    auto bytes = serialize_font(dest);
+    auto bytes = serialize_font(dest, subglyphs, cff_table);
     return bytes;
 }
 
+rvoe<std::string_view> TrueTypeFontFile::glyph_data(uint32_t glyph_id) const {
+    if(glyph_id >= num_glyphs()) {
+        RETERR(IndexOutOfBounds);
+    }
+    if(cff) {
+        // The charstring, which can not be composite.
+        return cff->charstrings.entry(glyph_id);
+    }
+    return get_substring(glyf, loca[glyph_id], int64_t(loca[glyph_id + 1]) - loca[glyph_id]);
+}
+
 rvoe<TrueTypeFontFile> load_and_parse_truetype_font(const std::filesystem::path &fname) {
-    ERC(buf, load_file(fname));
-    return parse_truetype_font(std::string_view{buf.data(), buf.size()});
+    ERC(file, MappedFile::open(fname));
+    ERC(font, parse_truetype_font(file->data()));
+    font.storage = std::move(file);
+    return std::move(font);
 }
 
 rvoe<bool> is_composite_glyph(std::string_view buf) {
@@ -18,6 +18,7 @@
 
 #include <filesystem>
 #include <pdfcommon.hpp>
+#include <cff_subsetter.hpp>
 #include <errorhandling.hpp>
 
 #include <string>
@@ -25,12 +26,15 @@
 #include <vector>
 #include <variant>
 #include <unordered_map>
+#include <memory>
 #include <expected>
 
 typedef struct FT_FaceRec_ *FT_Face;
 
 namespace capypdf {
 
+class MappedFile;
+
 #pragma pack(push, r1, 1)
 
 struct TTHead {
@@ -153,20 +157,39 @@ typedef std::variant<RegularGlyph, CompositeGlyph> TTGlyphs;
  * prep
  */
 
+/* OpenType fonts with PostScript outlines have a 'CFF ' table instead
+ * of 'glyf' and 'loca' and a version 0.5 'maxp' table.
+ */
+
 struct TrueTypeFontFile {
-    std::vector<std::string> glyphs;
+    // The file contents when the font was loaded from disk. The glyph
+    // data points inside it, so copies of the font share a single mapping.
+    std::shared_ptr<const MappedFile> storage;
+    // Glyphs are sliced out of the glyf table only when they are used.
+    std::string_view glyf;
+    std::vector<int32_t> loca;
+    // Set for fonts with CFF outlines instead of glyf.
+    std::shared_ptr<const CFFFont> cff;
     TTHead head;
     TTHhea hhea;
     TTHmtx hmtx;
-    // std::vector<int32_t> loca;
     TTMaxp10 maxp;
     std::string cvt;
     std::string fpgm;
     std::string prep;
     std::string cmap;
 
+    bool is_cff() const { return cff != nullptr; }
+    size_t num_glyphs() const {
+        if(cff) {
+            return cff->num_glyphs();
+        }
+        return loca.empty() ? 0 : loca.size() - 1;
+    }
+    rvoe<std::string_view> glyph_data(uint32_t glyph_id) const;
+
     int num_directory_entries() const {
-        int entries = 6;
+        int entries = is_cff() ? 5 : 6;
         if(!cmap.empty()) {
             ++entries;
         }
@@ -189,16 +212,21 @@ rvoe<capypdf::NoReturnValue>
 reassign_composite_glyph_numbers(std::string &buf,
                                  const std::unordered_map<uint32_t, uint32_t> &mapping);
 
-rvoe<std::string> generate_font(FT_Face face,
-                                const TrueTypeFontFile &source,
-                                const std::vector<TTGlyphs> &glyphs,
-                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping);
-
-rvoe<std::string> generate_font(FT_Face face,
-                                std::string_view buf,
-                                const std::vector<TTGlyphs> &glyphs,
-                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping);
-
+// The glyphs are given as indices into the source font. This does not use
+// FreeType, so any number of subsets of one font can be generated at once.
+// Simple subsets have at most 255 glyphs with the space in slot 32 and a one
+// byte cmap. CID subsets are addressed by glyph id and get no cmap.
+rvoe<std::string> generate_font(const TrueTypeFontFile &source,
+                                const std::vector<uint32_t> &font_ids,
+                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping,
+                                bool is_cid);
+
+rvoe<std::string> generate_font(std::string_view buf,
+                                const std::vector<uint32_t> &font_ids,
+                                const std::unordered_map<uint32_t, uint32_t> &comp_mapping,
+                                bool is_cid);
+
+// The glyph data of the result points into buf.
 rvoe<TrueTypeFontFile> parse_truetype_font(std::string_view buf);
 rvoe<TrueTypeFontFile> load_and_parse_truetype_font(const std::filesystem::path &fname);
 
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <glyphmetrics.hpp>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_ADVANCES_H
+
+namespace capypdf {
+
+GlyphMetrics::GlyphMetrics(FT_Face face)
+    : face{face}, units_per_em_{face ? face->units_per_EM : 1000},
+      has_kerning{face && FT_HAS_KERNING(face)} {
+    latin1_advances.fill(not_cached);
+    if(has_kerning) {
+        latin1_kerning.assign(latin1_size * latin1_size, not_cached);
+    }
+}
+
+std::optional<int32_t> GlyphMetrics::advance(uint32_t codepoint) {
+    int32_t adv;
+    if(codepoint < latin1_size) {
+        adv = latin1_advances[codepoint];
+        if(adv == not_cached) {
+            adv = latin1_advances[codepoint] = lookup_advance(codepoint);
+        }
+    } else {
+        auto it = advances.find(codepoint);
+        if(it == advances.end()) {
+            it = advances.emplace(codepoint, lookup_advance(codepoint)).first;
+        }
+        adv = it->second;
+    }
+    if(adv == no_advance) {
+        return {};
+    }
+    return adv;
+}
+
+int32_t GlyphMetrics::kerning(uint32_t left, uint32_t right) {
+    if(!has_kerning) {
+        return 0;
+    }
+    if(left < latin1_size && right < latin1_size) {
+        auto &k = latin1_kerning[left * latin1_size + right];
+        if(k == not_cached) {
+            k = lookup_kerning(left, right);
+        }
+        return k;
+    }
+    const uint64_t key = (uint64_t(left) << 32) | right;
+    auto it = kerning_pairs.find(key);
+    if(it == kerning_pairs.end()) {
+        it = kerning_pairs.emplace(key, lookup_kerning(left, right)).first;
+    }
+    return it->second;
+}
+
+int32_t GlyphMetrics::lookup_advance(uint32_t codepoint) {
+    if(!face) {
+        return no_advance;
+    }
+    // Missing characters get the advance of .notdef, the same as when drawing them.
+    const auto glyph_index = FT_Get_Char_Index(face, codepoint);
+    FT_Fixed adv;
+    if(FT_Get_Advance(face, glyph_index, FT_LOAD_NO_SCALE, &adv) != 0) {
+        return no_advance;
+    }
+    return (int32_t)adv;
+}
+
+int32_t GlyphMetrics::lookup_kerning(uint32_t left, uint32_t right) {
+    FT_Vector k;
+    if(FT_Get_Kerning(face,
+                      FT_Get_Char_Index(face, left),
+                      FT_Get_Char_Index(face, right),
+                      FT_KERNING_UNSCALED,
+                      &k) != 0) {
+        return 0;
+    }
+    return (int32_t)k.x;
+}
+
+} // namespace capypdf
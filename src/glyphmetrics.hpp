@@ -0,0 +1,58 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+typedef struct FT_FaceRec_ *FT_Face;
+
+namespace capypdf {
+
+// Advances and kerning of one font in font units. Values are looked up from
+// FreeType the first time they are needed and remembered after that, with
+// flat tables for Latin-1 so that the common case needs no hashing.
+class GlyphMetrics {
+public:
+    explicit GlyphMetrics(FT_Face face);
+
+    std::optional<int32_t> advance(uint32_t codepoint);
+    int32_t kerning(uint32_t left, uint32_t right);
+    int32_t units_per_em() const { return units_per_em_; }
+
+private:
+    static constexpr uint32_t latin1_size = 256;
+    static constexpr int32_t not_cached = INT32_MIN;
+    static constexpr int32_t no_advance = INT32_MIN + 1;
+
+    int32_t lookup_advance(uint32_t codepoint);
+    int32_t lookup_kerning(uint32_t left, uint32_t right);
+
+    FT_Face face;
+    int32_t units_per_em_;
+    bool has_kerning;
+    std::array<int32_t, latin1_size> latin1_advances;
+    std::unordered_map<uint32_t, int32_t> advances;
+    // Only allocated for fonts that have kerning.
+    std::vector<int32_t> latin1_kerning;
+    std::unordered_map<uint64_t, int32_t> kerning_pairs;
+};
+
+} // namespace capypdf
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace capypdf {
+
+// Set of object numbers or id structs, which are small non-negative
+// integers. Membership is tracked in a bitmap and clearing only touches
+// the entries that were added, so a set can be reused cheaply.
+// Iteration is in increasing order.
+template<typename T> class IdSet {
+public:
+    typedef typename std::vector<T>::const_iterator const_iterator;
+
+    bool insert(const T &value) {
+        const auto index = index_of(value);
+        const size_t word = index / 64;
+        const uint64_t bit = uint64_t(1) << (index % 64);
+        if(word >= bits.size()) {
+            bits.resize(word + 1);
+        }
+        if(bits[word] & bit) {
+            return false;
+        }
+        bits[word] |= bit;
+        if(!members.empty() && index < index_of(members.back())) {
+            is_sorted = false;
+        }
+        members.push_back(value);
+        return true;
+    }
+
+    bool contains(const T &value) const {
+        const auto index = index_of(value);
+        const size_t word = index / 64;
+        return word < bits.size() && (bits[word] & (uint64_t(1) << (index % 64)));
+    }
+
+    bool empty() const { return members.empty(); }
+    size_t size() const { return members.size(); }
+
+    void clear() {
+        for(const auto &m : members) {
+            bits[index_of(m) / 64] = 0;
+        }
+        members.clear();
+        is_sorted = true;
+    }
+
+    const_iterator begin() const {
+        sort_members();
+        return members.cbegin();
+    }
+    const_iterator end() const { return members.cend(); }
+
+private:
+    static size_t index_of(const T &value) {
+        if constexpr(std::is_integral_v<T>) {
+            assert(value >= 0);
+            return (size_t)value;
+        } else {
+            assert(value.id >= 0);
+            return (size_t)value.id;
+        }
+    }
+
+    void sort_members() const {
+        if(!is_sorted) {
+            std::sort(members.begin(), members.end(), [](const T &a, const T &b) {
+                return index_of(a) < index_of(b);
+            });
+            is_sorted = true;
+        }
+    }
+
+    std::vector<uint64_t> bits;
+    mutable std::vector<T> members;
+    mutable bool is_sorted = true;
+};
+
+} // namespace capypdf
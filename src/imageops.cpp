@@ -17,6 +17,7 @@
 #include <filesystem>
 #include <imageops.hpp>
 #include <utils.hpp>
+#include <pixelkernels.hpp>
 #include <png.h>
 #include <jpeglib.h>
 #include <tiffio.h>
@@ -25,6 +26,9 @@
 #include <stdexcept>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
 
 namespace capypdf {
 
@@ -59,14 +63,14 @@ std::expected<rgb_image, ErrorCode> load_rgba_png(png_image &image) {
         RETERR(UnsupportedFormat);
     }
     assert(buf.size() % 4 == 0);
-    result.pixels.reserve(PNG_IMAGE_SIZE(image) * 3 / 4);
-    result.alpha->reserve(PNG_IMAGE_SIZE(image) / 4);
-    for(size_t i = 0; i < buf.size(); i += 4) {
-        result.pixels += buf[i];
-        result.pixels += buf[i + 1];
-        result.pixels += buf[i + 2];
-        *result.alpha += buf[i + 3];
-    }
+    const size_t num_pixels = buf.size() / 4;
+    result.pixels.resize(num_pixels * 3);
+    result.alpha->resize(num_pixels);
+    split_alpha((const uint8_t *)buf.data(),
+                num_pixels,
+                3,
+                (uint8_t *)result.pixels.data(),
+                (uint8_t *)result.alpha->data());
 
     return std::move(result);
 }
@@ -84,12 +88,14 @@ std::expected<gray_image, ErrorCode> load_ga_png(png_image &image) {
         fprintf(stderr, "%s\n", image.message);
         RETERR(UnsupportedFormat);
     }
-    result.pixels.reserve(PNG_IMAGE_SIZE(image) / 2);
-    result.alpha->reserve(PNG_IMAGE_SIZE(image) / 2);
-    for(size_t i = 0; i < buf.size(); i += 2) {
-        result.pixels += buf[i];
-        *result.alpha += buf[i + 1];
-    }
+    const size_t num_pixels = buf.size() / 2;
+    result.pixels.resize(num_pixels);
+    result.alpha->resize(num_pixels);
+    split_alpha((const uint8_t *)buf.data(),
+                num_pixels,
+                1,
+                (uint8_t *)result.pixels.data(),
+                (uint8_t *)result.alpha->data());
 
     return std::move(result);
 }
@@ -116,35 +122,19 @@ std::expected<png_data, ErrorCode> load_png_data(png_image &image) {
 
 std::expected<mono_image, ErrorCode> load_mono_png(png_image &image) {
     mono_image result;
-    const size_t final_size = (image.width + 7) / 8 * image.height;
-    result.pixels.reserve(final_size);
+    // PDF spec 8.9.3 "Sample representation", rows are padded to whole bytes.
+    const size_t row_size = (image.width + 7) / 8;
+    result.pixels.resize(row_size * image.height);
     result.w = image.width;
     result.h = image.height;
     ERC(pd, load_png_data(image));
-    size_t offset = 0;
-    const int white_pixel = pd.colormap[0] == 1 ? 1 : 0;
-    const int num_padding_bits = (result.w % 8) == 0 ? 0 : 8 - result.w % 8;
+    const uint8_t white_pixel = pd.colormap[0] == 1 ? 1 : 0;
     for(int j = 0; j < result.h; ++j) {
-        unsigned char current_byte = 0;
-        for(int i = 0; i < result.w; ++i) {
-            current_byte <<= 1;
-            if(pd.pixels[offset] == white_pixel) {
-                current_byte |= 1;
-            }
-            if((i % 8 == 0) && i > 0) {
-                result.pixels.push_back(~current_byte);
-                current_byte = 0;
-            }
-            ++offset;
-        }
-        // PDF spec 8.9.3 "Sample representation"
-
-        if(num_padding_bits > 0) {
-            current_byte <<= num_padding_bits;
-        }
-        result.pixels.push_back(~current_byte);
+        pack_bits((const uint8_t *)pd.pixels.data() + size_t(j) * result.w,
+                  result.w,
+                  1 - white_pixel,
+                  (uint8_t *)result.pixels.data() + j * row_size);
     }
-    assert(result.pixels.size() == final_size);
     return std::move(result);
 }
 
@@ -182,51 +172,27 @@ std::expected<std::optional<mono_image>, ErrorCode> try_load_mono_alpha_png(png_
     mono_image result;
     result.w = image.width;
     result.h = image.height;
-    result.alpha = std::string{};
-    const size_t final_size = (image.width + 7) / 8 * image.height;
-    result.pixels.reserve(final_size);
-    result.alpha->reserve(final_size);
+    const size_t row_size = (image.width + 7) / 8;
+    result.pixels.resize(row_size * image.height);
+    result.alpha = std::string(row_size * image.height, '\0');
     const uint8_t black_pixel = 0;
-    const uint8_t transparent = 255;
-    const int num_padding_bits = (result.w % 8) == 0 ? 0 : 8 - result.w % 8;
+    const uint8_t fully_opaque = 255;
+    // One byte per pixel for the color and the alpha of a row, one when the
+    // pixel is white or opaque.
+    std::vector<uint8_t> white(result.w);
+    std::vector<uint8_t> opaque(result.w);
     for(int j = 0; j < result.h; ++j) {
-        unsigned char current_byte = 0;
-        unsigned char current_mask_byte = 255;
         for(int i = 0; i < result.w; ++i) {
-            current_byte <<= 1;
-            current_mask_byte <<= 1;
-            const auto colormap_entry = pd.pixels.at(j * result.w + i);
+            const auto colormap_entry = (uint8_t)pd.pixels.at(j * result.w + i);
             assert(colormap_entry * sizeof(pngbytes) < pd.colormap.size());
-            if(colormap_entry != 0) {
-                ++i;
-                --i;
-            }
             const auto *colormap_data = pd.colormap.data() + colormap_entry * sizeof(pngbytes);
             const auto *pixel = reinterpret_cast<const pngbytes *>(colormap_data);
-            if(pixel->r == black_pixel) {
-                current_byte |= 1;
-            }
-            if(pixel->a != transparent) {
-                current_mask_byte |= 1;
-            }
-            if((i % 8 == 0) && i > 0) {
-                result.pixels.push_back(~current_byte);
-                result.alpha->push_back(~current_mask_byte);
-                current_byte = 0;
-                current_mask_byte = 255;
-            }
+            white[i] = pixel->r != black_pixel;
+            opaque[i] = pixel->a == fully_opaque;
         }
-        // PDF spec 8.9.3 "Sample representation"
-
-        if(num_padding_bits > 0) {
-            current_byte <<= num_padding_bits;
-            current_mask_byte <<= num_padding_bits;
-        }
-        result.pixels.push_back(current_byte);
-        result.alpha->push_back(~current_mask_byte);
+        pack_bits(white.data(), result.w, 1, (uint8_t *)result.pixels.data() + j * row_size);
+        pack_bits(opaque.data(), result.w, 1, (uint8_t *)result.alpha->data() + j * row_size);
     }
-    assert(result.pixels.size() == final_size);
-    assert(result.alpha->size() == final_size);
     return std::move(result);
 }
 
@@ -269,12 +235,307 @@ std::expected<RasterImage, ErrorCode> load_png_file(const std::filesystem::path
 }
 
 rvoe<RasterImage> load_tif_file(const std::filesystem::path &fname) {
+    ERC(reader, TiffRowReader::open(fname));
+    const auto w = reader->width();
+    const auto h = reader->height();
+    std::string pixels;
+    ERC(rows_read, reader->read_rows(h, pixels));
+    if(rows_read != h) {
+        RETERR(FileReadError);
+    }
+    switch(reader->format()) {
+    case TiffPixelFormat::Mono:
+        return mono_image{w, h, std::move(pixels), {}};
+    case TiffPixelFormat::Gray:
+        return gray_image{w, h, std::move(pixels), {}};
+    case TiffPixelFormat::RGB:
+        return rgb_image{w, h, std::move(pixels), {}};
+    case TiffPixelFormat::CMYK:
+        return cmyk_image{w, h, std::move(pixels), reader->icc()};
+    }
+    RETERR(Unreachable);
+}
+
+uint32_t read_be32(const char *data) {
+    const auto *u = reinterpret_cast<const unsigned char *>(data);
+    return (uint32_t(u[0]) << 24) | (uint32_t(u[1]) << 16) | (uint32_t(u[2]) << 8) | u[3];
+}
+
+uint8_t paeth(uint8_t a, uint8_t b, uint8_t c) {
+    const int p = int(a) + int(b) - int(c);
+    const int pa = std::abs(p - int(a));
+    const int pb = std::abs(p - int(b));
+    const int pc = std::abs(p - int(c));
+    if(pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+// Sum of the filtered bytes as signed values, the usual heuristic for choosing the filter.
+uint64_t filter_cost(const uint8_t *row, size_t row_bytes) {
+    uint64_t cost = 0;
+    for(size_t i = 0; i < row_bytes; ++i) {
+        const int8_t v = (int8_t)row[i];
+        cost += v < 0 ? -v : v;
+    }
+    return cost;
+}
+
+} // namespace
+
+rvoe<jpg_image> load_jpg(const std::filesystem::path &fname) {
+    jpg_image im;
+    std::error_code ec;
+    im.path = std::filesystem::canonical(fname, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    im.file_size = std::filesystem::file_size(im.path, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    im.mtime = std::filesystem::last_write_time(im.path, ec);
+    if(ec) {
+        RETERR(CouldNotOpenFile);
+    }
+    FILE *f = fopen(im.path.string().c_str(), "rb");
+    if(!f) {
+        RETERR(CouldNotOpenFile);
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> fcloser(f, fclose);
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    std::unique_ptr<jpeg_decompress_struct, decltype(&jpeg_destroy_decompress)> jpgcloser(
+        &cinfo, &jpeg_destroy_decompress);
+
+    jpeg_stdio_src(&cinfo, f);
+    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+        RETERR(UnsupportedFormat);
+    }
+    im.h = cinfo.image_height;
+    im.w = cinfo.image_width;
+    im.num_components = cinfo.num_components;
+    if(im.num_components != 1 && im.num_components != 3 && im.num_components != 4) {
+        RETERR(UnsupportedFormat);
+    }
+    im.inverted_cmyk = im.num_components == 4 && cinfo.saw_Adobe_marker;
+    return im;
+}
+
+rvoe<std::optional<png_encoded_image>> load_png_passthrough(const std::filesystem::path &fname) {
+    const char png_signature[] = "\x89PNG\r\n\x1a\n";
+    const size_t signature_size = sizeof(png_signature) - 1;
+    ERC(contents, load_file(fname));
+    if(contents.size() < signature_size ||
+       std::string_view(contents).substr(0, signature_size) != png_signature) {
+        RETERR(UnsupportedFormat);
+    }
+    png_encoded_image im{};
+    bool has_header = false;
+    size_t offset = signature_size;
+    while(offset + 12 <= contents.size()) {
+        const uint32_t chunk_size = read_be32(contents.data() + offset);
+        const std::string_view chunk_type(contents.data() + offset + 4, 4);
+        const size_t data_offset = offset + 8;
+        if(chunk_size > contents.size() - data_offset - 4) {
+            RETERR(UnsupportedFormat);
+        }
+        const char *chunk_data = contents.data() + data_offset;
+        if(chunk_type == "IHDR") {
+            if(chunk_size != 13) {
+                RETERR(UnsupportedFormat);
+            }
+            im.w = read_be32(chunk_data);
+            im.h = read_be32(chunk_data + 4);
+            const uint8_t bit_depth = chunk_data[8];
+            const uint8_t color_type = chunk_data[9];
+            const uint8_t interlace = chunk_data[12];
+            // Only 8 bit gray and RGB images without interlacing map directly to PDF.
+            if(bit_depth != 8 || interlace != 0) {
+                return std::optional<png_encoded_image>{};
+            }
+            if(color_type == 0) {
+                im.channels = 1;
+            } else if(color_type == 2) {
+                im.channels = 3;
+            } else {
+                return std::optional<png_encoded_image>{};
+            }
+            has_header = true;
+        } else if(chunk_type == "IDAT") {
+            im.idat.append(chunk_data, chunk_size);
+        } else if(chunk_type == "tRNS" || chunk_type == "gAMA" || chunk_type == "cHRM" ||
+                  chunk_type == "iCCP") {
+            // These change how the pixels are to be interpreted.
+            return std::optional<png_encoded_image>{};
+        } else if(chunk_type == "IEND") {
+            break;
+        }
+        offset = data_offset + chunk_size + 4;
+    }
+    if(!has_header || im.idat.empty()) {
+        RETERR(UnsupportedFormat);
+    }
+    return std::optional<png_encoded_image>{std::move(im)};
+}
+
+std::string png_predict(std::string_view pixels,
+                        size_t row_bytes,
+                        size_t bytes_per_pixel,
+                        std::string_view previous_row) {
+    assert(row_bytes > 0);
+    assert(previous_row.empty() || previous_row.size() == row_bytes);
+    const size_t num_rows = pixels.size() / row_bytes;
+    const size_t bpp = std::min(bytes_per_pixel, row_bytes);
+    std::string result(num_rows * (row_bytes + 1), '\0');
+    const std::vector<uint8_t> zero_row(row_bytes, 0);
+    // One scratch row per filter type. The loops are kept simple so that
+    // the compiler can vectorize them.
+    std::vector<uint8_t> filtered(5 * row_bytes);
+    for(size_t r = 0; r < num_rows; ++r) {
+        const auto *cur = reinterpret_cast<const uint8_t *>(pixels.data()) + r * row_bytes;
+        const uint8_t *first_prev = previous_row.empty()
+                                        ? zero_row.data()
+                                        : reinterpret_cast<const uint8_t *>(previous_row.data());
+        const uint8_t *prev = r == 0 ? first_prev : cur - row_bytes;
+        uint8_t *none = filtered.data();
+        uint8_t *sub = none + row_bytes;
+        uint8_t *up = sub + row_bytes;
+        uint8_t *avg = up + row_bytes;
+        uint8_t *pae = avg + row_bytes;
+        for(size_t i = 0; i < bpp; ++i) {
+            none[i] = cur[i];
+            sub[i] = cur[i];
+            up[i] = cur[i] - prev[i];
+            avg[i] = cur[i] - (prev[i] >> 1);
+            pae[i] = cur[i] - prev[i];
+        }
+        for(size_t i = bpp; i < row_bytes; ++i) {
+            none[i] = cur[i];
+            sub[i] = cur[i] - cur[i - bpp];
+            up[i] = cur[i] - prev[i];
+            avg[i] = cur[i] - uint8_t((int(cur[i - bpp]) + int(prev[i])) >> 1);
+            pae[i] = cur[i] - paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+        }
+        size_t best_filter = 0;
+        uint64_t best_cost = filter_cost(none, row_bytes);
+        for(size_t f = 1; f < 5; ++f) {
+            const auto cost = filter_cost(filtered.data() + f * row_bytes, row_bytes);
+            if(cost < best_cost) {
+                best_cost = cost;
+                best_filter = f;
+            }
+        }
+        char *out = result.data() + r * (row_bytes + 1);
+        out[0] = (char)best_filter;
+        memcpy(out + 1, filtered.data() + best_filter * row_bytes, row_bytes);
+    }
+    return result;
+}
+
+std::string box_downsample(
+    std::string_view pixels, int32_t w, int32_t h, int32_t channels, int32_t new_w, int32_t new_h) {
+    assert(new_w > 0 && new_h > 0 && new_w <= w && new_h <= h);
+    assert(pixels.size() == (size_t)w * h * channels);
+    // Source column ranges are the same for every row, so compute them only once.
+    std::vector<int32_t> col_start(new_w + 1);
+    for(int32_t x = 0; x <= new_w; ++x) {
+        col_start[x] = (int32_t)((int64_t)x * w / new_w);
+    }
+    std::string result((size_t)new_w * new_h * channels, '\0');
+    std::vector<uint32_t> row_sums((size_t)w * channels);
+    const auto *src = reinterpret_cast<const uint8_t *>(pixels.data());
+    for(int32_t y = 0; y < new_h; ++y) {
+        const int32_t y0 = (int32_t)((int64_t)y * h / new_h);
+        const int32_t y1 = (int32_t)((int64_t)(y + 1) * h / new_h);
+        std::fill(row_sums.begin(), row_sums.end(), 0);
+        for(int32_t sy = y0; sy < y1; ++sy) {
+            const uint8_t *row = src + (size_t)sy * w * channels;
+            for(size_t i = 0; i < row_sums.size(); ++i) {
+                row_sums[i] += row[i];
+            }
+        }
+        auto *out = reinterpret_cast<uint8_t *>(result.data()) + (size_t)y * new_w * channels;
+        for(int32_t x = 0; x < new_w; ++x) {
+            const int32_t x0 = col_start[x];
+            const int32_t x1 = col_start[x + 1];
+            // A box of a whole large image does not fit 32 bits.
+            const uint64_t count = uint64_t(x1 - x0) * uint64_t(y1 - y0);
+            for(int32_t c = 0; c < channels; ++c) {
+                uint64_t sum = 0;
+                for(int32_t sx = x0; sx < x1; ++sx) {
+                    sum += row_sums[(size_t)sx * channels + c];
+                }
+                out[(size_t)x * channels + c] = uint8_t((sum + count / 2) / count);
+            }
+        }
+    }
+    return result;
+}
+
+namespace {
+
+template<typename T> void shrink_image(T &image, int32_t channels, int32_t new_w, int32_t new_h) {
+    image.pixels = box_downsample(image.pixels, image.w, image.h, channels, new_w, new_h);
+    if(image.alpha) {
+        image.alpha = box_downsample(*image.alpha, image.w, image.h, 1, new_w, new_h);
+    }
+    image.w = new_w;
+    image.h = new_h;
+}
+
+} // namespace
+
+void shrink_to_fit(RasterImage &image, int32_t max_w, int32_t max_h) {
+    if(std::holds_alternative<mono_image>(image)) {
+        return;
+    }
+    const auto [w, h] = std::visit([](const auto &im) { return std::pair{im.w, im.h}; }, image);
+    if(w <= max_w && h <= max_h) {
+        return;
+    }
+    const double scale = std::min((double)max_w / w, (double)max_h / h);
+    const int32_t new_w = std::clamp((int32_t)std::lround(w * scale), 1, w);
+    const int32_t new_h = std::clamp((int32_t)std::lround(h * scale), 1, h);
+    if(std::holds_alternative<rgb_image>(image)) {
+        shrink_image(std::get<rgb_image>(image), 3, new_w, new_h);
+    } else if(std::holds_alternative<gray_image>(image)) {
+        shrink_image(std::get<gray_image>(image), 1, new_w, new_h);
+    } else if(std::holds_alternative<cmyk_image>(image)) {
+        shrink_image(std::get<cmyk_image>(image), 4, new_w, new_h);
+    }
+}
+
+TiffRowReader::TiffRowReader(TIFF *tif,
+                             int32_t w,
+                             int32_t h,
+                             TiffPixelFormat format,
+                             int32_t bits_per_sample,
+                             int32_t num_planes,
+                             bool inverted,
+                             std::optional<std::string> icc)
+    : tif(tif), w(w), h(h), pixel_format(format), bits_per_sample(bits_per_sample),
+      num_planes(num_planes), inverted(inverted), icc_profile(std::move(icc)) {
+    // With separate planes this is the size of one plane's row.
+    scanline_size = TIFFScanlineSize64(tif);
+    // Libtiff gives 16 bit samples in native byte order.
+    out_row_size = (bits_per_sample == 16 ? scanline_size / 2 : scanline_size) * num_planes;
+    line.resize((scanline_size + 1) / 2);
+}
+
+TiffRowReader::~TiffRowReader() { TIFFClose(tif); }
+
+rvoe<std::unique_ptr<TiffRowReader>> TiffRowReader::open(const std::filesystem::path &fname) {
     TIFF *tif = TIFFOpen(fname.string().c_str(), "rb");
     if(!tif) {
         RETERR(FileReadError);
     }
-    std::optional<std::string> icc;
     std::unique_ptr<TIFF, decltype(&TIFFClose)> tiffcloser(tif, TIFFClose);
+    std::optional<std::string> icc;
 
     uint32_t w{}, h{};
     uint16_t bitspersample{}, samplesperpixel{}, photometric{}, planarconf{};
@@ -287,11 +548,15 @@ rvoe<RasterImage> load_tif_file(const std::filesystem::path &fname) {
     if(TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h) != 1) {
         RETERR(UnsupportedTIFF);
     }
+    // Readers work in whole rows and bands of at least one row.
+    if(w == 0 || h == 0 || w > INT32_MAX || h > INT32_MAX) {
+        RETERR(UnsupportedTIFF);
+    }
 
     if(TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bitspersample) != 1) {
         RETERR(UnsupportedTIFF);
     }
-    if(bitspersample != 8) {
+    if(bitspersample != 1 && bitspersample != 8 && bitspersample != 16) {
         RETERR(UnsupportedTIFF);
     }
 
@@ -317,76 +582,134 @@ rvoe<RasterImage> load_tif_file(const std::filesystem::path &fname) {
     if(TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarconf) != 1) {
         RETERR(UnsupportedTIFF);
     }
-    // Maybe fail for this?
+    // Separate color planes are interleaved while reading.
+    const int32_t num_planes = planarconf == PLANARCONFIG_SEPARATE ? samplesperpixel : 1;
+    if(num_planes != 1 && num_planes != 3 && num_planes != 4) {
+        RETERR(UnsupportedTIFF);
+    }
 
     if(TIFFGetField(tif, TIFFTAG_ICCPROFILE, &icc_count, &icc_data) == 1) {
         icc = std::string{(const char *)icc_data, icc_count};
     }
 
-    const auto scanlinesize = TIFFScanlineSize64(tif);
-    std::string line(scanlinesize, 0);
-    std::string pixels;
-    pixels.reserve(scanlinesize * h);
-    for(uint32_t row = 0; row < h; ++row) {
-        if(TIFFReadScanline(tif, line.data(), row) != 1) {
-            fprintf(stderr, "TIFF decoding failed.\n");
-            RETERR(FileReadError);
-        }
-        pixels += line;
+    if(bitspersample == 1 &&
+       (samplesperpixel != 1 ||
+        (photometric != PHOTOMETRIC_MINISBLACK && photometric != PHOTOMETRIC_MINISWHITE))) {
+        RETERR(UnsupportedTIFF);
     }
+
+    TiffPixelFormat format;
     switch(photometric) {
     case PHOTOMETRIC_SEPARATED:
         if(samplesperpixel != 4) {
             RETERR(UnsupportedTIFF);
         }
-        return cmyk_image{(int32_t)w, (int32_t)h, std::move(pixels), std::move(icc)};
+        format = TiffPixelFormat::CMYK;
+        break;
     case PHOTOMETRIC_RGB:
         if(samplesperpixel != 3) {
             RETERR(UnsupportedTIFF);
         }
-        return rgb_image{(int32_t)w, (int32_t)h, std::move(pixels), std::move(icc)};
+        format = TiffPixelFormat::RGB;
+        break;
     case PHOTOMETRIC_MINISBLACK:
+    case PHOTOMETRIC_MINISWHITE:
         if(samplesperpixel != 1) {
             RETERR(UnsupportedTIFF);
         }
-        return gray_image{(int32_t)w, (int32_t)h, std::move(pixels), std::move(icc)};
-
+        format = bitspersample == 1 ? TiffPixelFormat::Mono : TiffPixelFormat::Gray;
+        break;
     default:
         RETERR(UnsupportedTIFF);
     }
+    tiffcloser.release();
+    return std::unique_ptr<TiffRowReader>(new TiffRowReader(tif,
+                                                            (int32_t)w,
+                                                            (int32_t)h,
+                                                            format,
+                                                            bitspersample,
+                                                            num_planes,
+                                                            photometric == PHOTOMETRIC_MINISWHITE,
+                                                            std::move(icc)));
 }
 
-} // namespace
-
-rvoe<jpg_image> load_jpg(const std::filesystem::path &fname) {
-    jpg_image im;
-    ERC(contents, load_file(fname));
-    im.file_contents = std::move(contents);
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
+int32_t TiffRowReader::channels() const {
+    switch(pixel_format) {
+    case TiffPixelFormat::Mono:
+    case TiffPixelFormat::Gray:
+        return 1;
+    case TiffPixelFormat::RGB:
+        return 3;
+    case TiffPixelFormat::CMYK:
+        return 4;
+    }
+    return 1;
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_decompress(&cinfo);
-    std::unique_ptr<jpeg_decompress_struct, decltype(&jpeg_destroy_decompress)> jpgcloser(
-        &cinfo, &jpeg_destroy_decompress);
+rvoe<NoReturnValue> TiffRowReader::read_scanline(int32_t row, uint16_t plane, uint8_t *out) {
+    void *target = bits_per_sample == 16 ? (void *)line.data() : (void *)out;
+    if(TIFFReadScanline(tif, target, row, plane) != 1) {
+        fprintf(stderr, "TIFF decoding failed.\n");
+        RETERR(FileReadError);
+    }
+    if(bits_per_sample == 16) {
+        narrow_16_to_8(line.data(), out_row_size / num_planes, out);
+    }
+    return NoReturnValue{};
+}
 
-    jpeg_mem_src(&cinfo, (const unsigned char *)im.file_contents.data(), im.file_contents.length());
-    if(jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
-        RETERR(UnsupportedFormat);
+rvoe<int32_t> TiffRowReader::read_rows(int32_t max_rows, std::string &rows) {
+    const auto num_rows = std::min(max_rows, h - next_row);
+    rows.resize(out_row_size * num_rows);
+    if(num_planes == 1) {
+        for(int32_t i = 0; i < num_rows; ++i) {
+            ERCV(read_scanline(next_row + i, 0, (uint8_t *)rows.data() + out_row_size * i));
+        }
+    } else {
+        // Each plane is stored in strips of its own. Reading one plane at a time
+        // keeps libtiff from going back to the start of a strip on every row.
+        const size_t plane_row_size = out_row_size / num_planes;
+        const size_t plane_size = plane_row_size * num_rows;
+        planes.resize(plane_size * num_planes);
+        for(int32_t p = 0; p < num_planes; ++p) {
+            for(int32_t i = 0; i < num_rows; ++i) {
+                ERCV(read_scanline(
+                    next_row + i, p, planes.data() + p * plane_size + i * plane_row_size));
+            }
+        }
+        for(int32_t i = 0; i < num_rows; ++i) {
+            const uint8_t *row_planes[4];
+            for(int32_t p = 0; p < num_planes; ++p) {
+                row_planes[p] = planes.data() + p * plane_size + i * plane_row_size;
+            }
+            interleave_planes(
+                row_planes, num_planes, w, (uint8_t *)rows.data() + out_row_size * i);
+        }
     }
-    jpeg_start_decompress(&cinfo);
-    im.h = cinfo.image_height;
-    im.w = cinfo.image_width;
-    // Fixme, validate that this is an 8bpp RGB image.
-    return std::move(im);
+    next_row += num_rows;
+    if(inverted) {
+        // Both 1 and 8 bit PDF gray have zero as black.
+        invert_bytes((uint8_t *)rows.data(), rows.size());
+    }
+    return num_rows;
+}
+
+bool is_png_file(const std::filesystem::path &fname) {
+    const auto extension = fname.extension();
+    return extension == ".png" || extension == ".PNG";
+}
+
+bool is_tif_file(const std::filesystem::path &fname) {
+    const auto extension = fname.extension();
+    return extension == ".tif" || extension == ".tiff" || extension == ".TIF" ||
+           extension == ".TIFF";
 }
 
 rvoe<RasterImage> load_image_file(const std::filesystem::path &fname) {
-    auto extension = fname.extension();
-    if(extension == ".png" || extension == ".PNG") {
+    if(is_png_file(fname)) {
         return load_png_file(fname);
     }
-    if(extension == ".tif" || extension == ".tiff" || extension == ".TIF" || extension == ".TIFF") {
+    if(is_tif_file(fname)) {
         return load_tif_file(fname);
     }
     fprintf(stderr, "Unsupported image file format: %s\n", fname.string().c_str());
@@ -19,10 +19,15 @@
 #include <errorhandling.hpp>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <optional>
 #include <variant>
 #include <expected>
 #include <filesystem>
+#include <memory>
+#include <vector>
+
+typedef struct tiff TIFF;
 
 namespace capypdf {
 
@@ -47,10 +52,17 @@ struct gray_image {
     std::optional<std::string> alpha;
 };
 
+// Only the header is parsed, the file contents are read when the PDF is written.
 struct jpg_image {
     int32_t w;
     int32_t h;
-    std::string file_contents;
+    int32_t num_components;
+    // Adobe CMYK files store inverted values.
+    bool inverted_cmyk;
+    // Used to detect if the file changes before it is written.
+    std::filesystem::path path;
+    uint64_t file_size;
+    std::filesystem::file_time_type mtime;
 };
 
 struct cmyk_image {
@@ -61,10 +73,101 @@ struct cmyk_image {
     std::optional<std::string> alpha;
 };
 
+// The still compressed pixel data of a PNG file. It is stored with PNG
+// predictors, so it can be used in a PDF as is.
+struct png_encoded_image {
+    int32_t w;
+    int32_t h;
+    int32_t channels;
+    std::string idat;
+};
+
 typedef std::variant<mono_image, gray_image, rgb_image, cmyk_image> RasterImage;
 
 rvoe<RasterImage> load_image_file(const std::filesystem::path &fname);
 
+enum class TiffPixelFormat {
+    Mono,
+    Gray,
+    RGB,
+    CMYK,
+};
+
+// Decodes a TIFF file a few rows at a time so that large scans need not
+// be held in memory whole. Rows are converted to the same 1 or 8 bit
+// layout that load_image_file produces.
+class TiffRowReader {
+public:
+    static rvoe<std::unique_ptr<TiffRowReader>> open(const std::filesystem::path &fname);
+    ~TiffRowReader();
+
+    TiffRowReader(const TiffRowReader &) = delete;
+    TiffRowReader &operator=(const TiffRowReader &) = delete;
+
+    int32_t width() const { return w; }
+    int32_t height() const { return h; }
+    TiffPixelFormat format() const { return pixel_format; }
+    int32_t channels() const;
+    int32_t bits_per_component() const { return bits_per_sample == 1 ? 1 : 8; }
+    size_t row_bytes() const { return out_row_size; }
+    const std::optional<std::string> &icc() const { return icc_profile; }
+
+    // Replaces the contents of rows with the next rows of the image, at most max_rows
+    // of them. Returns the number of rows read, which is zero at the end of the image.
+    rvoe<int32_t> read_rows(int32_t max_rows, std::string &rows);
+
+private:
+    TiffRowReader(TIFF *tif,
+                  int32_t w,
+                  int32_t h,
+                  TiffPixelFormat format,
+                  int32_t bits_per_sample,
+                  int32_t num_planes,
+                  bool inverted,
+                  std::optional<std::string> icc);
+
+    rvoe<NoReturnValue> read_scanline(int32_t row, uint16_t plane, uint8_t *out);
+
+    TIFF *tif;
+    int32_t w;
+    int32_t h;
+    TiffPixelFormat pixel_format;
+    int32_t bits_per_sample;
+    int32_t num_planes;
+    bool inverted;
+    std::optional<std::string> icc_profile;
+    size_t scanline_size;
+    size_t out_row_size;
+    std::vector<uint16_t> line;
+    std::vector<uint8_t> planes;
+    int32_t next_row = 0;
+};
+
 rvoe<jpg_image> load_jpg(const std::filesystem::path &fname);
 
+// Whether load_image_file treats the file as a PNG or a TIFF, based on its extension.
+bool is_png_file(const std::filesystem::path &fname);
+bool is_tif_file(const std::filesystem::path &fname);
+
+// Returns nothing if the file needs to be decoded, e.g. because it has an alpha channel
+// or gamma information.
+rvoe<std::optional<png_encoded_image>> load_png_passthrough(const std::filesystem::path &fname);
+
+// Adds a PNG filter type byte in front of every row, choosing the filter that is
+// likely to compress best. When an image is predicted in pieces, previous_row
+// must be the last row of the preceding piece.
+std::string png_predict(std::string_view pixels,
+                        size_t row_bytes,
+                        size_t bytes_per_pixel,
+                        std::string_view previous_row = {});
+
+// Scales 8 bit interleaved pixels down by averaging the source pixels
+// that fall inside each destination pixel.
+std::string box_downsample(
+    std::string_view pixels, int32_t w, int32_t h, int32_t channels, int32_t new_w, int32_t new_h);
+
+// Downsamples the image and its alpha channel so that it fits inside the
+// given size, keeping the aspect ratio. 1 bit images are not modified.
+void shrink_to_fit(RasterImage &image, int32_t max_w, int32_t max_h);
+
 } // namespace capypdf
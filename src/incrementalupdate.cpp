@@ -0,0 +1,369 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <incrementalupdate.hpp>
+#include <bufferedwriter.hpp>
+#include <utils.hpp>
+
+#include <fmt/core.h>
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <unordered_set>
+
+namespace capypdf {
+
+namespace {
+
+const uint64_t tail_size = 1024;
+
+// Marks xref entries that no section has described yet.
+const int64_t unseen_entry = -2;
+
+typedef std::unique_ptr<FILE, int (*)(FILE *)> FileCloser;
+
+rvoe<std::string> read_file_range(FILE *f, uint64_t offset, uint64_t size) {
+    std::string buf(size, '\0');
+    if(fseek(f, (long)offset, SEEK_SET) != 0 || fread(buf.data(), 1, size, f) != size) {
+        perror(nullptr);
+        RETERR(FileReadError);
+    }
+    return buf;
+}
+
+bool is_pdf_whitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\0';
+}
+
+void skip_whitespace(std::string_view text, size_t &pos) {
+    while(pos < text.size() && is_pdf_whitespace(text[pos])) {
+        ++pos;
+    }
+}
+
+template<typename T> std::optional<T> parse_number(std::string_view text, size_t &pos) {
+    skip_whitespace(text, pos);
+    T value;
+    auto [ptr, ec] = std::from_chars(text.data() + pos, text.data() + text.size(), value);
+    if(ec != std::errc{}) {
+        return {};
+    }
+    pos = ptr - text.data();
+    return value;
+}
+
+// The number after a key in a trailer dictionary. For references
+// this is the object number.
+std::optional<int64_t> dict_number(std::string_view dict, std::string_view key) {
+    auto pos = dict.find(key);
+    while(pos != std::string_view::npos) {
+        size_t after = pos + key.size();
+        if(after < dict.size() && std::isalnum((unsigned char)dict[after])) {
+            // A longer key that starts with the same letters.
+            pos = dict.find(key, after);
+            continue;
+        }
+        return parse_number<int64_t>(dict, after);
+    }
+    return {};
+}
+
+// Finds the "stream" keyword, which must be followed by an end of line.
+size_t find_stream_keyword(std::string_view text) {
+    auto pos = text.find("stream");
+    while(pos != std::string_view::npos) {
+        const auto after = pos + 6;
+        if(after < text.size() && (text[after] == '\n' || text[after] == '\r')) {
+            return pos;
+        }
+        pos = text.find("stream", after);
+    }
+    return pos;
+}
+
+} // namespace
+
+rvoe<std::unique_ptr<PdfIncrementalUpdate>>
+PdfIncrementalUpdate::open(const std::filesystem::path &fname) {
+    FILE *f = fopen(fname.string().c_str(), "rb");
+    if(!f) {
+        perror(nullptr);
+        RETERR(CouldNotOpenFile);
+    }
+    FileCloser fcloser(f, fclose);
+    fseek(f, 0, SEEK_END);
+    const auto file_size = (uint64_t)ftell(f);
+    const auto tail_bytes = std::min(file_size, tail_size);
+    ERC(tail, read_file_range(f, file_size - tail_bytes, tail_bytes));
+    const auto startxref = tail.rfind("startxref");
+    if(startxref == std::string::npos) {
+        RETERR(BadXref);
+    }
+    size_t pos = startxref + 9;
+    const auto last_xref = parse_number<uint64_t>(tail, pos);
+    if(!last_xref) {
+        RETERR(BadXref);
+    }
+
+    XrefState state;
+    state.xref_offset = *last_xref;
+    std::optional<uint64_t> section = *last_xref;
+    std::unordered_set<uint64_t> visited;
+    bool is_newest = true;
+    while(section) {
+        if(*section >= file_size || !visited.insert(*section).second) {
+            RETERR(BadXref);
+        }
+        ERC(text, read_file_range(f, *section, file_size - *section));
+        size_t p = 0;
+        skip_whitespace(text, p);
+        if(text.compare(p, 4, "xref") != 0) {
+            // Cross reference streams are not handled.
+            RETERR(UnsupportedFormat);
+        }
+        p += 4;
+        while(true) {
+            skip_whitespace(text, p);
+            if(text.compare(p, 7, "trailer") == 0) {
+                break;
+            }
+            const auto first = parse_number<int64_t>(text, p);
+            const auto count = parse_number<int64_t>(text, p);
+            if(!first || !count || *first < 0 || *count < 0) {
+                RETERR(BadXref);
+            }
+            for(int64_t i = 0; i < *count; ++i) {
+                const auto offset = parse_number<int64_t>(text, p);
+                const auto generation = parse_number<int64_t>(text, p);
+                skip_whitespace(text, p);
+                if(!offset || !generation || p >= text.size()) {
+                    RETERR(BadXref);
+                }
+                const char type = text[p++];
+                if(type != 'n' && type != 'f') {
+                    RETERR(BadXref);
+                }
+                const auto object_num = (size_t)(*first + i);
+                if(object_num >= state.offsets.size()) {
+                    state.offsets.resize(object_num + 1, unseen_entry);
+                }
+                // Newer sections are read first and take precedence.
+                if(state.offsets[object_num] == unseen_entry) {
+                    state.offsets[object_num] = type == 'n' ? *offset : -1;
+                }
+            }
+        }
+        p += 7;
+        const auto trailer_end = text.find("startxref", p);
+        const auto trailer = std::string_view(text).substr(p, trailer_end - p);
+        if(is_newest) {
+            const auto size = dict_number(trailer, "/Size");
+            const auto root = dict_number(trailer, "/Root");
+            if(!size || !root || *size <= 0 || *root <= 0 || *root >= *size) {
+                RETERR(BadXref);
+            }
+            state.size = (int32_t)*size;
+            state.root = (int32_t)*root;
+            if(const auto info = dict_number(trailer, "/Info")) {
+                state.info = (int32_t)*info;
+            }
+            const auto id_start = trailer.find('<', trailer.find("/ID"));
+            const auto id_end = trailer.find('>', id_start);
+            if(trailer.find("/ID") != std::string_view::npos && id_end != std::string_view::npos) {
+                state.first_id = trailer.substr(id_start, id_end - id_start + 1);
+            }
+            is_newest = false;
+        }
+        section.reset();
+        if(const auto prev = dict_number(trailer, "/Prev")) {
+            section = (uint64_t)*prev;
+        }
+    }
+    state.offsets.resize(std::max((size_t)state.size, state.offsets.size()), -1);
+    for(auto &offset : state.offsets) {
+        if(offset == unseen_entry) {
+            offset = -1;
+        }
+    }
+    return std::unique_ptr<PdfIncrementalUpdate>(
+        new PdfIncrementalUpdate(fname, file_size, std::move(state)));
+}
+
+PdfIncrementalUpdate::PdfIncrementalUpdate(std::filesystem::path fname_,
+                                           uint64_t file_size_,
+                                           XrefState state_)
+    : fname{std::move(fname_)}, file_size{file_size_}, state{std::move(state_)} {}
+
+rvoe<std::string> PdfIncrementalUpdate::read_range(uint64_t offset, uint64_t size) const {
+    FILE *f = fopen(fname.string().c_str(), "rb");
+    if(!f) {
+        perror(nullptr);
+        RETERR(CouldNotOpenFile);
+    }
+    FileCloser fcloser(f, fclose);
+    return read_file_range(f, offset, size);
+}
+
+rvoe<std::string_view> PdfIncrementalUpdate::object_dictionary(int32_t object_num) {
+    auto pending_it = pending.find(object_num);
+    if(pending_it != pending.end()) {
+        return std::string_view(pending_it->second.dictionary);
+    }
+    auto cache_it = dictionary_cache.find(object_num);
+    if(cache_it != dictionary_cache.end()) {
+        return std::string_view(cache_it->second);
+    }
+    if(object_num <= 0 || (size_t)object_num >= state.offsets.size() ||
+       state.offsets[object_num] < 0) {
+        RETERR(IndexOutOfBounds);
+    }
+    const uint64_t offset = state.offsets[object_num];
+    if(offset >= file_size) {
+        RETERR(BadXref);
+    }
+    // Objects are mostly small so start with a small read.
+    uint64_t chunk = 4096;
+    while(true) {
+        const auto size = std::min(chunk, file_size - offset);
+        ERC(text, read_range(offset, size));
+        auto end = std::min(text.find("endobj"), find_stream_keyword(text));
+        if(end != std::string::npos) {
+            auto start = text.find("obj");
+            if(start == std::string::npos || start >= end) {
+                RETERR(BadXref);
+            }
+            start += 3;
+            skip_whitespace(text, start);
+            while(end > start && is_pdf_whitespace(text[end - 1])) {
+                --end;
+            }
+            auto &cached = dictionary_cache[object_num];
+            cached = text.substr(start, end - start);
+            return std::string_view(cached);
+        }
+        if(size == file_size - offset) {
+            RETERR(BadXref);
+        }
+        chunk *= 4;
+    }
+}
+
+int32_t PdfIncrementalUpdate::add_object(UpdatedObject obj) {
+    const auto object_num = state.size++;
+    if(state.offsets.size() < (size_t)state.size) {
+        state.offsets.resize(state.size, -1);
+    }
+    pending[object_num] = std::move(obj);
+    return object_num;
+}
+
+rvoe<NoReturnValue> PdfIncrementalUpdate::replace_object(int32_t object_num, UpdatedObject obj) {
+    if(object_num <= 0 || object_num >= state.size) {
+        RETERR(IndexOutOfBounds);
+    }
+    dictionary_cache.erase(object_num);
+    pending[object_num] = std::move(obj);
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfIncrementalUpdate::write() {
+    ERC(last_byte, read_range(file_size - 1, 1));
+    FILE *f = fopen(fname.string().c_str(), "ab");
+    if(!f) {
+        perror(nullptr);
+        RETERR(CouldNotOpenFile);
+    }
+    FileCloser fcloser(f, fclose);
+    BufferedWriter out(file_sink(f));
+    if(last_byte[0] != '\n' && last_byte[0] != '\r') {
+        ERCV(out.write("\n"));
+    }
+    std::vector<std::pair<int32_t, uint64_t>> written;
+    for(const auto &[object_num, obj] : pending) {
+        written.emplace_back(object_num, file_size + out.offset());
+        ERCV(out.write(fmt::format("{} 0 obj\n", object_num)));
+        ERCV(out.write(obj.dictionary));
+        if(out.last_char() != '\n') {
+            ERCV(out.write("\n"));
+        }
+        if(!obj.stream.empty()) {
+            ERCV(out.write("stream\n"));
+            ERCV(out.write(obj.stream));
+            if(out.last_char() != '\n') {
+                ERCV(out.write("\n"));
+            }
+            ERCV(out.write("endstream\n"));
+        }
+        ERCV(out.write("endobj\n"));
+    }
+
+    const uint64_t xref_offset = file_size + out.offset();
+    std::string buf = "xref\n";
+    auto app = std::back_inserter(buf);
+    size_t i = 0;
+    while(i < written.size()) {
+        size_t j = i;
+        while(j + 1 < written.size() && written[j + 1].first == written[j].first + 1) {
+            ++j;
+        }
+        fmt::format_to(app, "{} {}\n", written[i].first, j - i + 1);
+        for(size_t k = i; k <= j; ++k) {
+            fmt::format_to(app, "{:010} 00000 n \n", written[k].second);
+        }
+        i = j + 1;
+    }
+    const auto new_id = create_trailer_id();
+    // The first identifier stays the same over all revisions.
+    const auto &first_id = state.first_id.empty() ? new_id : state.first_id;
+    fmt::format_to(app,
+                   R"(trailer
+<<
+  /Size {}
+  /Root {} 0 R
+)",
+                   state.size,
+                   state.root);
+    if(state.info) {
+        fmt::format_to(app, "  /Info {} 0 R\n", *state.info);
+    }
+    fmt::format_to(app,
+                   R"(  /ID [{}{}]
+  /Prev {}
+>>
+startxref
+{}
+%%EOF
+)",
+                   first_id,
+                   new_id,
+                   state.xref_offset,
+                   xref_offset);
+    ERCV(out.write(buf));
+    ERCV(out.flush());
+
+    for(const auto &[object_num, offset] : written) {
+        state.offsets.at(object_num) = (int64_t)offset;
+    }
+    state.first_id = first_id;
+    state.xref_offset = xref_offset;
+    file_size += out.offset();
+    pending.clear();
+    return NoReturnValue{};
+}
+
+} // namespace capypdf
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errorhandling.hpp>
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace capypdf {
+
+// The parts of the latest trailer that a new revision needs.
+struct XrefState {
+    uint64_t xref_offset = 0;
+    int32_t size = 0;
+    int32_t root = 0;
+    std::optional<int32_t> info;
+    std::string first_id;
+    // Offset of every object in use, newest revision first. Unused entries are -1.
+    std::vector<int64_t> offsets;
+};
+
+struct UpdatedObject {
+    std::string dictionary;
+    std::string stream;
+};
+
+// Appends a new revision to an existing PDF file. Only added and replaced
+// objects are written, followed by a cross reference section whose trailer
+// points to the previous one with /Prev. Files using cross reference
+// streams are not supported.
+class PdfIncrementalUpdate {
+public:
+    static rvoe<std::unique_ptr<PdfIncrementalUpdate>> open(const std::filesystem::path &fname);
+
+    const XrefState &xref_state() const { return state; }
+
+    // The dictionary part of an object, cached for the lifetime of the updater.
+    rvoe<std::string_view> object_dictionary(int32_t object_num);
+
+    int32_t add_object(UpdatedObject obj);
+    rvoe<NoReturnValue> replace_object(int32_t object_num, UpdatedObject obj);
+
+    rvoe<NoReturnValue> write();
+
+private:
+    PdfIncrementalUpdate(std::filesystem::path fname, uint64_t file_size, XrefState state);
+
+    rvoe<std::string> read_range(uint64_t offset, uint64_t size) const;
+
+    std::filesystem::path fname;
+    uint64_t file_size;
+    XrefState state;
+    std::map<int32_t, UpdatedObject> pending;
+    std::unordered_map<int32_t, std::string> dictionary_cache;
+};
+
+} // namespace capypdf
@@ -16,9 +16,12 @@
 
 #include <capypdf.h>
 #include <cstring>
+#include <algorithm>
 #include <pdfgen.hpp>
 #include <pdfdrawcontext.hpp>
 #include <errorhandling.hpp>
+#include <fontcache.hpp>
+#include <incrementalupdate.hpp>
 
 #define RETNOERR return (CAPYPDF_EC)ErrorCode::NoError
 
@@ -128,6 +131,120 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_output_intent(CapyPDF_Options *opt,
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_num_threads(CapyPDF_Options *opt,
+                                                       int32_t num_threads) CAPYPDF_NOEXCEPT {
+    if(num_threads < 0) {
+        return (CAPYPDF_EC)ErrorCode::NegativeThreadCount;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->num_threads = num_threads;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_streaming(CapyPDF_Options *opt,
+                                                     int32_t streaming) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->streaming = streaming != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_cid_fonts(CapyPDF_Options *opt,
+                                                     int32_t cid_fonts) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->cid_fonts = cid_fonts != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_png_predictors(CapyPDF_Options *opt,
+                                                          int32_t png_predictors) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->png_predictors = png_predictors != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_image_max_dimension(CapyPDF_Options *opt,
+                                                               int32_t max_pixels) CAPYPDF_NOEXCEPT {
+    if(max_pixels < 0) {
+        return (CAPYPDF_EC)ErrorCode::InvalidImageLimit;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->max_image_dimension = max_pixels;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_number_precision(CapyPDF_Options *opt,
+                                                            int32_t precision) CAPYPDF_NOEXCEPT {
+    if(precision < 0 || precision > 9) {
+        return (CAPYPDF_EC)ErrorCode::InvalidNumberPrecision;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->number_precision = precision;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_compact_content(CapyPDF_Options *opt,
+                                                           int32_t compact) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->compact_content = compact != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_object_streams(CapyPDF_Options *opt,
+                                                         int32_t object_streams) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->object_streams = object_streams != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_first_page_first(CapyPDF_Options *opt,
+                                                           int32_t first_page_first) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->first_page_first = first_page_first != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_page_tree_fanout(CapyPDF_Options *opt,
+                                                            int32_t fanout) CAPYPDF_NOEXCEPT {
+    if(fanout < 0 || fanout == 1) {
+        return (CAPYPDF_EC)ErrorCode::InvalidPageTreeFanout;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->page_tree_fanout = fanout;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_collect_stats(CapyPDF_Options *opt,
+                                                        int32_t collect_stats) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->collect_stats = collect_stats != 0;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_resource_context(
+    CapyPDF_Options *opt, CapyPDF_ResourceContext *ctx) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    CHECK_NULL(ctx);
+    opts->resources = *reinterpret_cast<std::shared_ptr<PdfResourceContext> *>(ctx);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_color_cache_size(CapyPDF_Options *opt,
+                                                            int32_t max_entries) CAPYPDF_NOEXCEPT {
+    if(max_entries < 0) {
+        return (CAPYPDF_EC)ErrorCode::NegativeCacheSize;
+    }
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    opts->color_cache_size = max_entries;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_options_set_compression(CapyPDF_Options *opt,
+                                                       CAPYPDF_Stream_Category category,
+                                                       int32_t level) CAPYPDF_NOEXCEPT {
+    auto opts = reinterpret_cast<PdfGenerationData *>(opt);
+    return conv_err(opts->compression.set_level(category, level));
+}
+
 CAPYPDF_EC capy_generator_new(const char *filename,
                               const CapyPDF_Options *options,
                               CapyPDF_Generator **out_ptr) CAPYPDF_NOEXCEPT {
@@ -142,6 +259,51 @@ CAPYPDF_EC capy_generator_new(const char *filename,
     return conv_err(rc);
 }
 
+CAPYPDF_EC capy_generator_new_callback(CapyPDF_Write_Callback callback,
+                                       void *user_data,
+                                       const CapyPDF_Options *options,
+                                       CapyPDF_Generator **out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(callback);
+    CHECK_NULL(options);
+    CHECK_NULL(out_ptr);
+    auto opts = reinterpret_cast<const PdfGenerationData *>(options);
+    auto sink = [callback, user_data](std::string_view data) -> rvoe<NoReturnValue> {
+        if(callback(data.data(), (int64_t)data.size(), user_data) != 0) {
+            RETERR(FileWriteError);
+        }
+        return NoReturnValue{};
+    };
+    auto rc = PdfGen::construct(std::move(sink), *opts);
+    if(rc) {
+        *out_ptr = reinterpret_cast<CapyPDF_Generator *>(rc.value().release());
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_EC capy_generator_new_memory(const CapyPDF_Options *options,
+                                     CapyPDF_Generator **out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(options);
+    CHECK_NULL(out_ptr);
+    auto opts = reinterpret_cast<const PdfGenerationData *>(options);
+    auto rc = PdfGen::construct_in_memory(*opts);
+    if(rc) {
+        *out_ptr = reinterpret_cast<CapyPDF_Generator *>(rc.value().release());
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_EC capy_generator_memory_output(CapyPDF_Generator *generator,
+                                        const char **data,
+                                        int64_t *data_size) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(data);
+    CHECK_NULL(data_size);
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    const auto &output = g->memory_output();
+    *data = output.data();
+    *data_size = (int64_t)output.size();
+    RETNOERR;
+}
+
 CAPYPDF_EC capy_generator_add_page(CapyPDF_Generator *g,
                                    CapyPDF_DrawContext *dctx) CAPYPDF_NOEXCEPT {
     auto *gen = reinterpret_cast<PdfGen *>(g);
@@ -151,6 +313,19 @@ CAPYPDF_EC capy_generator_add_page(CapyPDF_Generator *g,
     return conv_err(rc);
 }
 
+CAPYPDF_EC capy_generator_add_form_xobject(CapyPDF_Generator *g,
+                                           CapyPDF_DrawContext *dctx,
+                                           CapyPDF_FormXObjectId *out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(out_ptr);
+    auto *gen = reinterpret_cast<PdfGen *>(g);
+    auto *ctx = reinterpret_cast<PdfDrawContext *>(dctx);
+    auto rc = gen->add_form_xobject(*ctx);
+    if(rc) {
+        *out_ptr = rc.value();
+    }
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_embed_jpg(CapyPDF_Generator *g,
                                                    const char *fname,
                                                    CapyPDF_ImageId *iid) CAPYPDF_NOEXCEPT {
@@ -164,6 +339,9 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_load_font(CapyPDF_Generator *g,
                                                    CapyPDF_FontId *fid) CAPYPDF_NOEXCEPT {
     auto *gen = reinterpret_cast<PdfGen *>(g);
     auto rc = gen->load_font(fname);
+    if(rc) {
+        *fid = rc.value();
+    }
     return conv_err(rc);
 }
 
@@ -178,6 +356,37 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_load_image(CapyPDF_Generator *g,
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_load_image_for_placement(CapyPDF_Generator *g,
+                                                                  const char *fname,
+                                                                  double width_pt,
+                                                                  double height_pt,
+                                                                  double max_dpi,
+                                                                  CapyPDF_ImageId *iid)
+    CAPYPDF_NOEXCEPT {
+    auto *gen = reinterpret_cast<PdfGen *>(g);
+    auto rc = gen->load_image(fname, ImageResolutionLimit{width_pt, height_pt, max_dpi});
+    if(rc) {
+        *iid = rc.value();
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_load_images(CapyPDF_Generator *g,
+                                                     const char **fnames,
+                                                     int32_t num_files,
+                                                     CapyPDF_ImageId *iids) CAPYPDF_NOEXCEPT {
+    auto *gen = reinterpret_cast<PdfGen *>(g);
+    if(num_files < 0) {
+        return (CAPYPDF_EC)ErrorCode::IndexOutOfBounds;
+    }
+    std::vector<std::filesystem::path> paths(fnames, fnames + num_files);
+    auto rc = gen->load_images(paths);
+    if(rc) {
+        std::copy(rc->begin(), rc->end(), iids);
+    }
+    return conv_err(rc);
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_load_icc_profile(
     CapyPDF_Generator *g, const char *fname, CapyPDF_IccColorSpaceId *iid) CAPYPDF_NOEXCEPT {
     auto *gen = reinterpret_cast<PdfGen *>(g);
@@ -230,6 +439,128 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_text_width(CapyPDF_Generator *generator
     return conv_err(rc);
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_text_advances(CapyPDF_Generator *generator,
+                                                       const uint32_t *codepoints,
+                                                       int32_t num_codepoints,
+                                                       CapyPDF_FontId font,
+                                                       double pointsize,
+                                                       double *advances,
+                                                       double *width) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(width);
+    if(num_codepoints < 0) {
+        return (CAPYPDF_EC)ErrorCode::IndexOutOfBounds;
+    }
+    if(num_codepoints > 0) {
+        CHECK_NULL(codepoints);
+    }
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    std::span<const uint32_t> cps(codepoints, num_codepoints);
+    std::span<double> out;
+    if(advances) {
+        out = std::span<double>(advances, num_codepoints);
+    }
+    auto rc = g->text_advances(font, pointsize, cps, out);
+    if(rc) {
+        *width = rc.value();
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_text_run_new(CapyPDF_Generator *generator,
+                                                      const char *utf8_text,
+                                                      CapyPDF_FontId font,
+                                                      double pointsize,
+                                                      CapyPDF_GlyphRun **out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(out_ptr);
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    auto u8t = u8string::from_cstr(utf8_text);
+    if(!u8t) {
+        return conv_err(u8t);
+    }
+    auto rc = g->create_text_run(u8t.value(), font, pointsize);
+    if(rc) {
+        *out_ptr = reinterpret_cast<CapyPDF_GlyphRun *>(new PdfGlyphRun(std::move(rc.value())));
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_glyph_run_new(CapyPDF_Generator *generator,
+                                                       CapyPDF_FontId font,
+                                                       double pointsize,
+                                                       const uint32_t *codepoints,
+                                                       const double *x,
+                                                       const double *y,
+                                                       int32_t num_glyphs,
+                                                       CapyPDF_GlyphRun **out_ptr)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(out_ptr);
+    if(num_glyphs < 0) {
+        return (CAPYPDF_EC)ErrorCode::IndexOutOfBounds;
+    }
+    if(num_glyphs > 0) {
+        CHECK_NULL(codepoints);
+        CHECK_NULL(x);
+        CHECK_NULL(y);
+    }
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    std::vector<PdfGlyph> glyphs;
+    glyphs.reserve(num_glyphs);
+    for(int32_t i = 0; i < num_glyphs; ++i) {
+        glyphs.push_back(PdfGlyph{codepoints[i], x[i], y[i]});
+    }
+    auto rc = g->create_glyph_run(font, pointsize, glyphs);
+    if(rc) {
+        *out_ptr = reinterpret_cast<CapyPDF_GlyphRun *>(new PdfGlyphRun(std::move(rc.value())));
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_color_cache_stats(CapyPDF_Generator *generator,
+                                                           int64_t *hits,
+                                                           int64_t *misses) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(hits);
+    CHECK_NULL(misses);
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    const auto stats = g->color_cache_stats();
+    *hits = (int64_t)stats.hits;
+    *misses = (int64_t)stats.misses;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_phase_stats(CapyPDF_Generator *generator,
+                                                     enum CAPYPDF_Write_Phase phase,
+                                                     int64_t *count,
+                                                     int64_t *bytes,
+                                                     double *seconds) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(count);
+    CHECK_NULL(bytes);
+    CHECK_NULL(seconds);
+    if((int)phase < 0 || (size_t)phase >= num_write_phases) {
+        return (CAPYPDF_EC)ErrorCode::BadEnum;
+    }
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    const auto &stats = g->write_stats().phases[phase];
+    *count = stats.count;
+    *bytes = (int64_t)stats.bytes;
+    *seconds = stats.seconds;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_generator_write_stats(CapyPDF_Generator *generator,
+                                                     int64_t *num_objects,
+                                                     int64_t *compression_in_bytes,
+                                                     int64_t *peak_stream_bytes) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(num_objects);
+    CHECK_NULL(compression_in_bytes);
+    CHECK_NULL(peak_stream_bytes);
+    auto *g = reinterpret_cast<PdfGen *>(generator);
+    const auto &stats = g->write_stats();
+    *num_objects = g->num_objects();
+    *compression_in_bytes = (int64_t)stats.compression_in;
+    *peak_stream_bytes = (int64_t)stats.peak_held_stream_bytes;
+    RETNOERR;
+}
+
 // Draw Context
 
 CAPYPDF_EC capy_page_draw_context_new(CapyPDF_Generator *g,
@@ -239,6 +570,16 @@ CAPYPDF_EC capy_page_draw_context_new(CapyPDF_Generator *g,
     RETNOERR;
 }
 
+CAPYPDF_EC capy_form_xobject_draw_context_new(CapyPDF_Generator *g,
+                                              double w,
+                                              double h,
+                                              CapyPDF_DrawContext **out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(out_ptr);
+    auto *gen = reinterpret_cast<PdfGen *>(g);
+    *out_ptr = reinterpret_cast<CapyPDF_DrawContext *>(gen->new_form_xobject_draw_context(w, h));
+    RETNOERR;
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_b(CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCEPT {
     auto c = reinterpret_cast<PdfDrawContext *>(ctx);
     return conv_err(c->cmd_b());
@@ -287,6 +628,12 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_cm(CapyPDF_DrawContext *ctx,
     return conv_err(c->cmd_cm(m1, m2, m3, m4, m5, m6));
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_Do(CapyPDF_DrawContext *ctx,
+                                         CapyPDF_FormXObjectId fxoid) CAPYPDF_NOEXCEPT {
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(c->cmd_Do(fxoid));
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_EMC(CapyPDF_DrawContext *ctx) CAPYPDF_NOEXCEPT {
     auto c = reinterpret_cast<PdfDrawContext *>(ctx);
     return conv_err(c->cmd_EMC());
@@ -354,6 +701,36 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_l(CapyPDF_DrawContext *ctx,
     return conv_err(c->cmd_l(x, y));
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_l_array(CapyPDF_DrawContext *ctx,
+                                              const double *coords,
+                                              int32_t num_values) CAPYPDF_NOEXCEPT {
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    if(num_values < 0) {
+        return (CAPYPDF_EC)ErrorCode::BadCoordinateCount;
+    }
+    return conv_err(c->cmd_l_array(std::span<const double>(coords, num_values)));
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_c_array(CapyPDF_DrawContext *ctx,
+                                              const double *coords,
+                                              int32_t num_values) CAPYPDF_NOEXCEPT {
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    if(num_values < 0) {
+        return (CAPYPDF_EC)ErrorCode::BadCoordinateCount;
+    }
+    return conv_err(c->cmd_c_array(std::span<const double>(coords, num_values)));
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_re_array(CapyPDF_DrawContext *ctx,
+                                               const double *rects,
+                                               int32_t num_values) CAPYPDF_NOEXCEPT {
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    if(num_values < 0) {
+        return (CAPYPDF_EC)ErrorCode::BadCoordinateCount;
+    }
+    return conv_err(c->cmd_re_array(std::span<const double>(rects, num_values)));
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_m(CapyPDF_DrawContext *ctx,
                                         double x,
                                         double y) CAPYPDF_NOEXCEPT {
@@ -444,6 +821,19 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_cmd_y(
     return conv_err(c->cmd_y(x1, y1, x3, y3));
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_execute_buffer(CapyPDF_DrawContext *ctx,
+                                                 const uint8_t *ops,
+                                                 int32_t num_ops,
+                                                 const double *args,
+                                                 int32_t num_args) CAPYPDF_NOEXCEPT {
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    if(num_ops < 0 || num_args < 0) {
+        return (CAPYPDF_EC)ErrorCode::BadCommandBuffer;
+    }
+    return conv_err(c->execute_buffer(std::span<const uint8_t>(ops, num_ops),
+                                      std::span<const double>(args, num_args)));
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_set_stroke(CapyPDF_DrawContext *ctx,
                                              CapyPDF_Color *c) CAPYPDF_NOEXCEPT {
     auto *dc = reinterpret_cast<PdfDrawContext *>(ctx);
@@ -478,6 +868,15 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_render_text(CapyPDF_DrawContext *ctx,
     return conv_err(c->render_text(utxt.value(), fid, point_size, x, y));
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_render_glyph_run(CapyPDF_DrawContext *ctx,
+                                                   const CapyPDF_GlyphRun *run,
+                                                   double x,
+                                                   double y) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(run);
+    auto c = reinterpret_cast<PdfDrawContext *>(ctx);
+    return conv_err(c->render_glyph_run(*reinterpret_cast<const PdfGlyphRun *>(run), x, y));
+}
+
 CAPYPDF_PUBLIC CAPYPDF_EC capy_dc_render_text_obj(CapyPDF_DrawContext *ctx,
                                                   CapyPDF_Text *text) CAPYPDF_NOEXCEPT {
     auto c = reinterpret_cast<PdfDrawContext *>(ctx);
@@ -658,6 +1057,156 @@ CAPYPDF_PUBLIC CAPYPDF_EC capy_optional_content_group_destroy(CapyPDF_OptionalCo
     RETNOERR;
 }
 
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_new(const char *filename,
+                                                      CapyPDF_IncrementalUpdate **out_ptr)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(filename);
+    CHECK_NULL(out_ptr);
+    auto rc = PdfIncrementalUpdate::open(filename);
+    if(rc) {
+        *out_ptr = reinterpret_cast<CapyPDF_IncrementalUpdate *>(rc.value().release());
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_root_object(CapyPDF_IncrementalUpdate *u,
+                                                              int32_t *object_num)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(object_num);
+    auto *update = reinterpret_cast<PdfIncrementalUpdate *>(u);
+    *object_num = update->xref_state().root;
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_object_dictionary(CapyPDF_IncrementalUpdate *u,
+                                                                    int32_t object_num,
+                                                                    const char **data,
+                                                                    int64_t *data_size)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(data);
+    CHECK_NULL(data_size);
+    auto *update = reinterpret_cast<PdfIncrementalUpdate *>(u);
+    auto rc = update->object_dictionary(object_num);
+    if(rc) {
+        *data = rc.value().data();
+        *data_size = (int64_t)rc.value().size();
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_add_object(CapyPDF_IncrementalUpdate *u,
+                                                             const char *dictionary,
+                                                             const char *stream,
+                                                             int64_t stream_size,
+                                                             int32_t *object_num)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(dictionary);
+    CHECK_NULL(object_num);
+    if(stream_size < 0) {
+        return (CAPYPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    if(stream_size > 0) {
+        CHECK_NULL(stream);
+    }
+    auto *update = reinterpret_cast<PdfIncrementalUpdate *>(u);
+    *object_num = update->add_object(
+        UpdatedObject{dictionary, std::string(stream ? stream : "", (size_t)stream_size)});
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_replace_object(CapyPDF_IncrementalUpdate *u,
+                                                                 int32_t object_num,
+                                                                 const char *dictionary,
+                                                                 const char *stream,
+                                                                 int64_t stream_size)
+    CAPYPDF_NOEXCEPT {
+    CHECK_NULL(dictionary);
+    if(stream_size < 0) {
+        return (CAPYPDF_EC)ErrorCode::IndexIsNegative;
+    }
+    if(stream_size > 0) {
+        CHECK_NULL(stream);
+    }
+    auto *update = reinterpret_cast<PdfIncrementalUpdate *>(u);
+    auto rc = update->replace_object(
+        object_num,
+        UpdatedObject{dictionary, std::string(stream ? stream : "", (size_t)stream_size)});
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_write(CapyPDF_IncrementalUpdate *u)
+    CAPYPDF_NOEXCEPT {
+    auto *update = reinterpret_cast<PdfIncrementalUpdate *>(u);
+    auto rc = update->write();
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_incremental_update_destroy(CapyPDF_IncrementalUpdate *u)
+    CAPYPDF_NOEXCEPT {
+    delete reinterpret_cast<PdfIncrementalUpdate *>(u);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_resource_context_new(
+    const CapyPDF_Options *opt, CapyPDF_ResourceContext **out_ptr) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(opt);
+    CHECK_NULL(out_ptr);
+    auto opts = reinterpret_cast<const PdfGenerationData *>(opt);
+    auto rc = PdfResourceContext::construct(
+        opts->prof.rgb_profile_file, opts->prof.gray_profile_file, opts->prof.cmyk_profile_file);
+    if(rc) {
+        // The handle owns a reference so that the C side can share the context.
+        *out_ptr = reinterpret_cast<CapyPDF_ResourceContext *>(
+            new std::shared_ptr<PdfResourceContext>(std::move(rc.value())));
+    }
+    return conv_err(rc);
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_resource_context_destroy(CapyPDF_ResourceContext *ctx)
+    CAPYPDF_NOEXCEPT {
+    delete reinterpret_cast<std::shared_ptr<PdfResourceContext> *>(ctx);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_glyph_run_destroy(CapyPDF_GlyphRun *run) CAPYPDF_NOEXCEPT {
+    delete reinterpret_cast<PdfGlyphRun *>(run);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_font_cache_set_subset_capacity(int32_t max_entries)
+    CAPYPDF_NOEXCEPT {
+    if(max_entries < 0) {
+        return (CAPYPDF_EC)ErrorCode::NegativeCacheSize;
+    }
+    FontCache::instance().set_subset_capacity(max_entries);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_font_cache_set_font_capacity(int32_t max_entries)
+    CAPYPDF_NOEXCEPT {
+    if(max_entries < 0) {
+        return (CAPYPDF_EC)ErrorCode::NegativeCacheSize;
+    }
+    FontCache::instance().set_font_capacity(max_entries);
+    RETNOERR;
+}
+
+CAPYPDF_PUBLIC CAPYPDF_EC capy_font_cache_stats(int64_t *font_hits,
+                                                int64_t *font_misses,
+                                                int64_t *subset_hits,
+                                                int64_t *subset_misses) CAPYPDF_NOEXCEPT {
+    CHECK_NULL(font_hits);
+    CHECK_NULL(font_misses);
+    CHECK_NULL(subset_hits);
+    CHECK_NULL(subset_misses);
+    const auto stats = FontCache::instance().stats();
+    *font_hits = (int64_t)stats.font_hits;
+    *font_misses = (int64_t)stats.font_misses;
+    *subset_hits = (int64_t)stats.subset_hits;
+    *subset_misses = (int64_t)stats.subset_misses;
+    RETNOERR;
+}
+
 const char *capy_error_message(CAPYPDF_EC error_code) CAPYPDF_NOEXCEPT {
     return error_text((ErrorCode)error_code);
 }
@@ -22,6 +22,10 @@
 #include <cassert>
 #include <stdexcept>
 #include <array>
+#include <mutex>
+#include <unordered_map>
+#include <functional>
+#include <bit>
 
 namespace {
 
@@ -30,15 +34,127 @@ const std::array<int, 4> ri2lcms = {INTENT_RELATIVE_COLORIMETRIC,
                                     INTENT_SATURATION,
                                     INTENT_PERCEPTUAL};
 
-}
+struct TransformKey {
+    cmsHPROFILE src;
+    cmsUInt32Number src_format;
+    cmsHPROFILE dst;
+    cmsUInt32Number dst_format;
+    cmsUInt32Number intent;
+
+    bool operator==(const TransformKey &o) const = default;
+};
+
+struct TransformKeyHash {
+    size_t operator()(const TransformKey &k) const {
+        size_t h = std::hash<cmsHPROFILE>{}(k.src);
+        h = h * 31 + std::hash<cmsHPROFILE>{}(k.dst);
+        h = h * 31 + k.src_format;
+        h = h * 31 + k.dst_format;
+        return h * 31 + k.intent;
+    }
+};
+
+struct RgbKey {
+    uint64_t r;
+    uint64_t g;
+    uint64_t b;
+
+    bool operator==(const RgbKey &o) const = default;
+};
+
+struct RgbKeyHash {
+    size_t operator()(const RgbKey &k) const {
+        size_t h = std::hash<uint64_t>{}(k.r);
+        h = h * 31 + std::hash<uint64_t>{}(k.g);
+        return h * 31 + std::hash<uint64_t>{}(k.b);
+    }
+};
+
+} // namespace
 
 namespace capypdf {
 
-rvoe<PdfColorConverter>
-PdfColorConverter::construct(const std::filesystem::path &rgb_profile_fname,
-                             const std::filesystem::path &gray_profile_fname,
-                             const std::filesystem::path &cmyk_profile_fname) {
-    PdfColorConverter conv;
+// Documents tend to use a small palette of colors over and over,
+// so converting each of them only once skips lcms almost entirely.
+// When the cache gets full it is emptied, which keeps its size bounded.
+class SolidColorCache {
+public:
+    explicit SolidColorCache(size_t max_entries) : max_entries{max_entries} {}
+
+    std::optional<DeviceCMYKColor> find(const RgbKey &key) {
+        std::lock_guard<std::mutex> lk(m);
+        auto it = colors.find(key);
+        if(it == colors.end()) {
+            ++misses;
+            return {};
+        }
+        ++hits;
+        return it->second;
+    }
+
+    void insert(const RgbKey &key, const DeviceCMYKColor &cmyk) {
+        std::lock_guard<std::mutex> lk(m);
+        if(colors.size() >= max_entries) {
+            colors.clear();
+        }
+        colors[key] = cmyk;
+    }
+
+    ColorCacheStats stats() const {
+        std::lock_guard<std::mutex> lk(m);
+        return ColorCacheStats{hits, misses};
+    }
+
+private:
+    size_t max_entries;
+    mutable std::mutex m;
+    std::unordered_map<RgbKey, DeviceCMYKColor, RgbKeyHash> colors;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// Transforms are created without the lcms pixel cache, which makes
+// them safe to use from several threads at the same time.
+class TransformCache {
+public:
+    TransformCache() = default;
+    TransformCache(const TransformCache &) = delete;
+    ~TransformCache() {
+        for(auto &[key, transform] : transforms) {
+            cmsDeleteTransform(transform);
+        }
+    }
+
+    cmsHTRANSFORM get(cmsHPROFILE src,
+                      cmsUInt32Number src_format,
+                      cmsHPROFILE dst,
+                      cmsUInt32Number dst_format,
+                      CapyPDF_Rendering_Intent intent) {
+        const TransformKey key{src, src_format, dst, dst_format, (cmsUInt32Number)intent};
+        std::lock_guard<std::mutex> lk(m);
+        auto it = transforms.find(key);
+        if(it != transforms.end()) {
+            return it->second;
+        }
+        auto transform = cmsCreateTransform(
+            src, src_format, dst, dst_format, ri2lcms.at(intent), cmsFLAGS_NOCACHE);
+        if(transform) {
+            transforms[key] = transform;
+        }
+        return transform;
+    }
+
+private:
+    std::mutex m;
+    std::unordered_map<TransformKey, cmsHTRANSFORM, TransformKeyHash> transforms;
+};
+
+rvoe<std::shared_ptr<ColorProfileSet>>
+ColorProfileSet::construct(const std::filesystem::path &rgb_profile_fname,
+                           const std::filesystem::path &gray_profile_fname,
+                           const std::filesystem::path &cmyk_profile_fname) {
+    std::shared_ptr<ColorProfileSet> set{new ColorProfileSet()};
+    auto &conv = *set;
     if(!rgb_profile_fname.empty()) {
         ERC(rgb, load_file(rgb_profile_fname));
         conv.rgb_profile_data = std::move(rgb);
@@ -90,70 +206,92 @@ PdfColorConverter::construct(const std::filesystem::path &rgb_profile_fname,
         // Not having a CMYK profile is fine, but any call to CMYK color conversions
         // is an error.
     }
-    return rvoe<PdfColorConverter>(std::move(conv));
+    return set;
+}
+
+ColorProfileSet::ColorProfileSet() : transforms{std::make_unique<TransformCache>()} {}
+
+ColorProfileSet::~ColorProfileSet() {}
+
+rvoe<PdfColorConverter>
+PdfColorConverter::construct(const std::filesystem::path &rgb_profile_fname,
+                             const std::filesystem::path &gray_profile_fname,
+                             const std::filesystem::path &cmyk_profile_fname) {
+    ERC(profiles,
+        ColorProfileSet::construct(rgb_profile_fname, gray_profile_fname, cmyk_profile_fname));
+    return PdfColorConverter(std::move(profiles));
 }
 
-PdfColorConverter::PdfColorConverter() {}
+PdfColorConverter::PdfColorConverter(std::shared_ptr<ColorProfileSet> profiles)
+    : profiles{std::move(profiles)} {}
+
+PdfColorConverter::PdfColorConverter(PdfColorConverter &&o) = default;
 
 PdfColorConverter::~PdfColorConverter() {}
 
+PdfColorConverter &PdfColorConverter::operator=(PdfColorConverter &&o) = default;
+
 DeviceRGBColor PdfColorConverter::to_rgb(const DeviceCMYKColor &cmyk) {
     DeviceRGBColor rgb;
-    auto transform = cmsCreateTransform(cmyk_profile.h,
-                                        TYPE_CMYK_DBL,
-                                        gray_profile.h,
-                                        TYPE_RGB_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = profiles->transforms->get(profiles->cmyk_profile.h,
+                                               TYPE_CMYK_DBL,
+                                               profiles->rgb_profile.h,
+                                               TYPE_RGB_DBL,
+                                               CAPY_RI_RELATIVE_COLORIMETRIC);
     cmsDoTransform(transform, &cmyk, &rgb, 1);
-    cmsDeleteTransform(transform);
     return rgb;
 }
 
 DeviceGrayColor PdfColorConverter::to_gray(const DeviceRGBColor &rgb) {
     DeviceGrayColor gray;
-    auto transform = cmsCreateTransform(rgb_profile.h,
-                                        TYPE_RGB_DBL,
-                                        gray_profile.h,
-                                        TYPE_GRAY_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = profiles->transforms->get(profiles->rgb_profile.h,
+                                               TYPE_RGB_DBL,
+                                               profiles->gray_profile.h,
+                                               TYPE_GRAY_DBL,
+                                               CAPY_RI_RELATIVE_COLORIMETRIC);
     cmsDoTransform(transform, &rgb, &gray, 1);
-    cmsDeleteTransform(transform);
     return gray;
 }
 
 DeviceGrayColor PdfColorConverter::to_gray(const DeviceCMYKColor &cmyk) {
     DeviceGrayColor gray;
-    auto transform = cmsCreateTransform(cmyk_profile.h,
-                                        TYPE_CMYK_DBL,
-                                        gray_profile.h,
-                                        TYPE_GRAY_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = profiles->transforms->get(profiles->cmyk_profile.h,
+                                               TYPE_CMYK_DBL,
+                                               profiles->gray_profile.h,
+                                               TYPE_GRAY_DBL,
+                                               CAPY_RI_RELATIVE_COLORIMETRIC);
     cmsDoTransform(transform, &cmyk, &gray, 1);
-    cmsDeleteTransform(transform);
     return gray;
 }
 
 rvoe<DeviceCMYKColor> PdfColorConverter::to_cmyk(const DeviceRGBColor &rgb) {
-    if(!cmyk_profile.h) {
+    if(!profiles->cmyk_profile.h) {
         RETERR(NoCmykProfile);
     }
+    const RgbKey key{std::bit_cast<uint64_t>(rgb.r.v()),
+                     std::bit_cast<uint64_t>(rgb.g.v()),
+                     std::bit_cast<uint64_t>(rgb.b.v())};
+    if(color_cache) {
+        auto cached = color_cache->find(key);
+        if(cached) {
+            return *cached;
+        }
+    }
     DeviceCMYKColor cmyk;
     double buf[4]; // PDF uses values [0, 1] but littlecms seems to use [0, 100].
-    auto transform = cmsCreateTransform(rgb_profile.h,
-                                        TYPE_RGB_DBL,
-                                        cmyk_profile.h,
-                                        TYPE_CMYK_DBL,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = profiles->transforms->get(profiles->rgb_profile.h,
+                                               TYPE_RGB_DBL,
+                                               profiles->cmyk_profile.h,
+                                               TYPE_CMYK_DBL,
+                                               CAPY_RI_RELATIVE_COLORIMETRIC);
     cmsDoTransform(transform, &rgb, &buf, 1);
     cmyk.c = buf[0] / 100.0;
     cmyk.m = buf[1] / 100.0;
     cmyk.y = buf[2] / 100.0;
     cmyk.k = buf[3] / 100.0;
-    cmsDeleteTransform(transform);
+    if(color_cache) {
+        color_cache->insert(key, cmyk);
+    }
     return cmyk;
 }
 
@@ -161,35 +299,46 @@ std::string PdfColorConverter::rgb_pixels_to_gray(std::string_view rgb_data) {
     assert(rgb_data.size() % 3 == 0);
     const int32_t num_pixels = (int32_t)rgb_data.size() / 3;
     std::string converted_pixels(num_pixels, '\0');
-    auto transform = cmsCreateTransform(rgb_profile.h,
-                                        TYPE_RGB_8,
-                                        gray_profile.h,
-                                        TYPE_GRAY_8,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = profiles->transforms->get(profiles->rgb_profile.h,
+                                               TYPE_RGB_8,
+                                               profiles->gray_profile.h,
+                                               TYPE_GRAY_8,
+                                               CAPY_RI_RELATIVE_COLORIMETRIC);
     cmsDoTransform(transform, rgb_data.data(), converted_pixels.data(), num_pixels);
-    cmsDeleteTransform(transform);
     return converted_pixels;
 }
 
 rvoe<std::string> PdfColorConverter::rgb_pixels_to_cmyk(std::string_view rgb_data) {
-    if(!cmyk_profile.h) {
+    if(!profiles->cmyk_profile.h) {
         RETERR(NoCmykProfile);
     }
     assert(rgb_data.size() % 3 == 0);
     const int32_t num_pixels = (int32_t)rgb_data.size() / 3;
     std::string converted_pixels(num_pixels * 4, '\0');
-    auto transform = cmsCreateTransform(rgb_profile.h,
-                                        TYPE_RGB_8,
-                                        cmyk_profile.h,
-                                        TYPE_CMYK_8,
-                                        ri2lcms.at(CAPY_RI_RELATIVE_COLORIMETRIC),
-                                        0);
+    auto transform = profiles->transforms->get(profiles->rgb_profile.h,
+                                               TYPE_RGB_8,
+                                               profiles->cmyk_profile.h,
+                                               TYPE_CMYK_8,
+                                               CAPY_RI_RELATIVE_COLORIMETRIC);
     cmsDoTransform(transform, rgb_data.data(), converted_pixels.data(), num_pixels);
-    cmsDeleteTransform(transform);
     return converted_pixels;
 }
 
+void PdfColorConverter::set_color_cache_size(size_t max_entries) {
+    if(max_entries == 0) {
+        color_cache.reset();
+    } else {
+        color_cache = std::make_unique<SolidColorCache>(max_entries);
+    }
+}
+
+ColorCacheStats PdfColorConverter::color_cache_stats() const {
+    if(!color_cache) {
+        return ColorCacheStats{0, 0};
+    }
+    return color_cache->stats();
+}
+
 rvoe<int> PdfColorConverter::get_num_channels(std::string_view icc_data) const {
     cmsHPROFILE h = cmsOpenProfileFromMem(icc_data.data(), icc_data.size());
     if(!h) {
@@ -21,6 +21,7 @@
 #include <string>
 #include <expected>
 #include <filesystem>
+#include <memory>
 
 // To avoid pulling all of LittleCMS in this file.
 typedef void *cmsHPROFILE;
@@ -48,13 +49,48 @@ struct LcmsHolder {
     }
 };
 
+class TransformCache;
+class SolidColorCache;
+
+struct ColorCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// The ICC profiles used for conversions and the transforms between them.
+// It does not change after construction apart from the transform cache,
+// which is locked, so converters in different threads can share one.
+class ColorProfileSet {
+public:
+    static rvoe<std::shared_ptr<ColorProfileSet>>
+    construct(const std::filesystem::path &rgb_profile_fname,
+              const std::filesystem::path &gray_profile_fname,
+              const std::filesystem::path &cmyk_profile_fname);
+
+    ColorProfileSet(const ColorProfileSet &) = delete;
+    ~ColorProfileSet();
+
+private:
+    friend class PdfColorConverter;
+    ColorProfileSet();
+
+    LcmsHolder rgb_profile;
+    LcmsHolder gray_profile;
+    LcmsHolder cmyk_profile;
+
+    std::string rgb_profile_data, gray_profile_data, cmyk_profile_data;
+    // Declared last so transforms are freed before the profiles.
+    std::unique_ptr<TransformCache> transforms;
+};
+
 class PdfColorConverter {
 public:
     static rvoe<PdfColorConverter> construct(const std::filesystem::path &rgb_profile_fname,
                                              const std::filesystem::path &gray_profile_fname,
                                              const std::filesystem::path &cmyk_profile_fname);
+    explicit PdfColorConverter(std::shared_ptr<ColorProfileSet> profiles);
 
-    PdfColorConverter(PdfColorConverter &&o) = default;
+    PdfColorConverter(PdfColorConverter &&o);
     ~PdfColorConverter();
 
     DeviceRGBColor to_rgb(const DeviceCMYKColor &cmyk);
@@ -66,22 +102,22 @@ public:
     std::string rgb_pixels_to_gray(std::string_view rgb_data);
     rvoe<std::string> rgb_pixels_to_cmyk(std::string_view rgb_data);
 
-    const std::string &get_rgb() const { return rgb_profile_data; }
-    const std::string &get_gray() const { return gray_profile_data; }
-    const std::string &get_cmyk() const { return cmyk_profile_data; }
+    const std::string &get_rgb() const { return profiles->rgb_profile_data; }
+    const std::string &get_gray() const { return profiles->gray_profile_data; }
+    const std::string &get_cmyk() const { return profiles->cmyk_profile_data; }
 
     rvoe<int> get_num_channels(std::string_view icc_data) const;
 
-    PdfColorConverter &operator=(PdfColorConverter &&o) = default;
+    // Remember up to max_entries converted RGB to CMYK solid colors.
+    // Zero disables the cache.
+    void set_color_cache_size(size_t max_entries);
+    ColorCacheStats color_cache_stats() const;
 
-private:
-    PdfColorConverter();
-    LcmsHolder rgb_profile;
-    LcmsHolder gray_profile;
-    LcmsHolder cmyk_profile;
+    PdfColorConverter &operator=(PdfColorConverter &&o);
 
-    std::string rgb_profile_data, gray_profile_data, cmyk_profile_data;
-    // FIXME, store transforms so that they don't get recreated all the time.
+private:
+    std::shared_ptr<ColorProfileSet> profiles;
+    std::unique_ptr<SolidColorCache> color_cache;
 };
 
 } // namespace capypdf
@@ -27,6 +27,14 @@
 #include <fmt/core.h>
 #include <ft2build.h>
 #include <variant>
+#include <functional>
+#include <future>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <cmath>
+#include <charconv>
+#include <chrono>
 #include FT_FREETYPE_H
 #include FT_FONT_FORMATS_H
 #include FT_OPENTYPE_VALIDATE_H
@@ -52,14 +60,99 @@ std::array<const char *, 12> transition_names{
     "/Fade",
 };
 
-FT_Error guarded_face_close(FT_Face face) {
-    // Freetype segfaults if you give it a null pointer.
-    if(face) {
-        return FT_Done_Face(face);
+const size_t max_spare_stream_buffers = 4;
+
+const int32_t max_objects_per_stream = 200;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Adds the time spent in a scope, and optionally the bytes written, to a phase.
+class PhaseTimer {
+public:
+    explicit PhaseTimer(PhaseStats *phase, const BufferedWriter *out = nullptr)
+        : phase(phase), out(out) {
+        if(phase) {
+            start = std::chrono::steady_clock::now();
+            start_offset = out ? out->offset() : 0;
+        }
+    }
+
+    ~PhaseTimer() {
+        if(phase) {
+            phase->seconds += seconds_since(start);
+            if(out) {
+                phase->bytes += out->offset() - start_offset;
+            }
+        }
+    }
+
+private:
+    PhaseStats *phase;
+    const BufferedWriter *out;
+    std::chrono::steady_clock::time_point start;
+    uint64_t start_offset = 0;
+};
+
+CAPYPDF_Write_Phase object_phase(const ObjectType &obj) {
+    return std::visit(
+        [](const auto &o) {
+            using T = std::decay_t<decltype(o)>;
+            if constexpr(std::is_same_v<T, FullPDFObject>) {
+                return o.stream.empty() ? CAPY_PHASE_OBJECTS : CAPY_PHASE_STREAMS;
+            } else if constexpr(std::is_same_v<T, DeflatePDFObject> ||
+                                std::is_same_v<T, FileStreamPDFObject>) {
+                return CAPY_PHASE_STREAMS;
+            } else if constexpr(std::is_same_v<T, DelayedSubsetFontData> ||
+                                std::is_same_v<T, DelayedSubsetFontDescriptor> ||
+                                std::is_same_v<T, DelayedSubsetCMap> ||
+                                std::is_same_v<T, DelayedSubsetFont> ||
+                                std::is_same_v<T, DelayedCIDFont> ||
+                                std::is_same_v<T, DelayedType0Font>) {
+                return CAPY_PHASE_FONTS;
+            } else if constexpr(std::is_same_v<T, DelayedPages> ||
+                                std::is_same_v<T, DelayedPage>) {
+                return CAPY_PHASE_PAGES;
+            } else if constexpr(std::is_same_v<T, DelayedCheckboxWidgetAnnotation> ||
+                                std::is_same_v<T, DelayedAnnotation>) {
+                return CAPY_PHASE_ANNOTATIONS;
+            } else if constexpr(std::is_same_v<T, DelayedStructItem>) {
+                return CAPY_PHASE_STRUCTURE;
+            } else {
+                return CAPY_PHASE_OBJECTS;
+            }
+        },
+        obj);
+}
+
+uint64_t held_stream_size(const ObjectType &obj) {
+    if(std::holds_alternative<FullPDFObject>(obj)) {
+        return std::get<FullPDFObject>(obj).stream.size();
+    } else if(std::holds_alternative<DeflatePDFObject>(obj)) {
+        return std::get<DeflatePDFObject>(obj).stream.size();
     }
     return 0;
 }
 
+// Collects the object numbers of all "N 0 R" references in a dictionary.
+// A false match inside a string only changes the order objects are written in.
+void scan_references(std::string_view dict, std::vector<int32_t> &refs) {
+    size_t pos = 0;
+    while((pos = dict.find(" 0 R", pos)) != std::string_view::npos) {
+        size_t start = pos;
+        while(start > 0 && dict[start - 1] >= '0' && dict[start - 1] <= '9') {
+            --start;
+        }
+        int32_t num;
+        if(start < pos &&
+           std::from_chars(dict.data() + start, dict.data() + pos, num).ec == std::errc{}) {
+            refs.push_back(num);
+        }
+        pos += 4;
+    }
+}
+
 const char PDF_header[] = "%PDF-1.7\n%\xe5\xf6\xc4\xd6\n";
 
 const std::array<const char *, 14> font_names{
@@ -161,7 +254,10 @@ rvoe<std::string> build_subset_width_array(FT_Face face,
     return arr;
 }
 
-std::string create_subset_cmap(const std::vector<capypdf::TTGlyphs> &glyphs) {
+std::string create_subset_cmap(const std::vector<capypdf::TTGlyphs> &glyphs,
+                               capypdf::FontSubsetType type) {
+    // Simple fonts use one byte codes, CID fonts use two bytes.
+    const bool is_cid = type == capypdf::FontSubsetType::CID;
     std::string buf = fmt::format(R"(/CIDInit/ProcSet findresource begin
 12 dict begin
 begincmap
@@ -173,23 +269,32 @@ begincmap
 /CMapName/Adobe-Identity-UCS def
 /CMapType 2 def
 1 begincodespacerange
-<00> <FF>
+{}
 endcodespacerange
-{} beginbfchar
 )",
-                                  glyphs.size() - 1);
+                                  is_cid ? "<0000> <FFFF>" : "<00> <FF>");
     // Glyph zero is not mapped.
     auto appender = std::back_inserter(buf);
-    for(size_t i = 1; i < glyphs.size(); ++i) {
-        const auto &g = glyphs[i];
-        uint32_t unicode_codepoint = 0;
-        if(std::holds_alternative<capypdf::RegularGlyph>(g)) {
-            unicode_codepoint = std::get<capypdf::RegularGlyph>(g).unicode_codepoint;
+    // A bfchar block can have at most 100 entries.
+    const size_t max_block_size = 100;
+    for(size_t block_start = 1; block_start < glyphs.size(); block_start += max_block_size) {
+        const size_t block_end = std::min(block_start + max_block_size, glyphs.size());
+        fmt::format_to(appender, "{} beginbfchar\n", block_end - block_start);
+        for(size_t i = block_start; i < block_end; ++i) {
+            const auto &g = glyphs[i];
+            uint32_t unicode_codepoint = 0;
+            if(std::holds_alternative<capypdf::RegularGlyph>(g)) {
+                unicode_codepoint = std::get<capypdf::RegularGlyph>(g).unicode_codepoint;
+            }
+            if(is_cid) {
+                fmt::format_to(appender, "<{:04X}> <{:04X}>\n", i, unicode_codepoint);
+            } else {
+                fmt::format_to(appender, "<{:02X}> <{:04X}>\n", i, unicode_codepoint);
+            }
         }
-        fmt::format_to(appender, "<{:02X}> <{:04X}>\n", i, unicode_codepoint);
+        buf += "endbfchar\n";
     }
-    buf += R"(endbfchar
-endcmap
+    buf += R"(endcmap
 CMapName currentdict /CMap defineresource pop
 end
 end
@@ -197,85 +302,132 @@ end
     return buf;
 }
 
+// Packs mesh shading data as 8 bit flags, 32 bit coordinates and 16 bit color
+// components, which is what mesh_shading_dict declares. Values are written
+// straight into a buffer sized up front instead of being appended one by one.
+class MeshPacker {
+public:
+    template<typename T>
+    MeshPacker(const T &shade, size_t num_bytes)
+        : xoffset(shade.minx), yoffset(shade.miny),
+          xscale(coordmax / (shade.maxx - shade.minx)),
+          yscale(coordmax / (shade.maxy - shade.miny)) {
+        buf.resize(num_bytes);
+        out = buf.data();
+    }
+
+    void flag(int f) {
+        assert(f >= 0 && f < 3);
+        *out++ = (char)f;
+    }
+
+    void point(const Point &p) {
+        put32(quantize(p.x, xoffset, xscale));
+        put32(quantize(p.y, yoffset, yscale));
+    }
+
+    // Color components are already limited to [0, 1].
+    void color(const DeviceRGBColor &c) {
+        put16(uint16_t(colormax * c.r.v()));
+        put16(uint16_t(colormax * c.g.v()));
+        put16(uint16_t(colormax * c.b.v()));
+    }
+
+    std::string finish() {
+        assert(out == buf.data() + buf.size());
+        return std::move(buf);
+    }
+
+private:
+    static constexpr double coordmax = std::numeric_limits<uint32_t>::max();
+    static constexpr double colormax = std::numeric_limits<uint16_t>::max();
+
+    // Points outside of the declared bounds are clamped to them rather than
+    // wrapping around.
+    static uint32_t quantize(double v, double offset, double scale) {
+        const double q = (v - offset) * scale;
+        if(!(q > 0)) {
+            return 0;
+        }
+        return q >= coordmax ? std::numeric_limits<uint32_t>::max() : uint32_t(q);
+    }
+
+    void put32(uint32_t v) {
+        out[0] = char(v >> 24);
+        out[1] = char(v >> 16);
+        out[2] = char(v >> 8);
+        out[3] = char(v);
+        out += 4;
+    }
+
+    void put16(uint16_t v) {
+        out[0] = char(v >> 8);
+        out[1] = char(v);
+        out += 2;
+    }
+
+    double xoffset, yoffset, xscale, yscale;
+    std::string buf;
+    char *out = nullptr;
+};
+
+constexpr size_t packed_flag_size = 1;
+constexpr size_t packed_point_size = 2 * 4;
+constexpr size_t packed_color_size = 3 * 2;
+
 std::string serialize_shade4(const ShadingType4 &shade) {
-    std::string s;
+    MeshPacker packer(shade,
+                      shade.elements.size() *
+                          (packed_flag_size + packed_point_size + packed_color_size));
     for(const auto &e : shade.elements) {
-        double xratio = (e.sp.p.x - shade.minx) / (shade.maxx - shade.minx);
-        double yratio = (e.sp.p.y - shade.miny) / (shade.maxy - shade.miny);
-        uint32_t xval = std::numeric_limits<uint32_t>::max() * xratio;
-        uint32_t yval = std::numeric_limits<uint32_t>::max() * yratio;
-        char flag = (char)e.flag;
-        assert(flag >= 0 && flag < 3);
-
-        xval = std::byteswap(xval);
-        yval = std::byteswap(yval);
-        //  FIXME: Assumes rgb is between 0 and 1;
-        const char *ptr;
-        ptr = (const char *)(&flag);
-        s.append(ptr, ptr + sizeof(char));
-        ptr = (const char *)(&xval);
-        s.append(ptr, ptr + sizeof(xval));
-        ptr = (const char *)(&yval);
-        s.append(ptr, ptr + sizeof(yval));
-
-        uint16_t rval = std::numeric_limits<uint16_t>::max() * e.sp.c.r.v();
-        uint16_t gval = std::numeric_limits<uint16_t>::max() * e.sp.c.g.v();
-        uint16_t bval = std::numeric_limits<uint16_t>::max() * e.sp.c.b.v();
-        rval = std::byteswap(rval);
-        gval = std::byteswap(gval);
-        bval = std::byteswap(bval);
-
-        ptr = (const char *)(&rval);
-        s.append(ptr, ptr + sizeof(uint16_t));
-        ptr = (const char *)(&gval);
-        s.append(ptr, ptr + sizeof(uint16_t));
-        ptr = (const char *)(&bval);
-        s.append(ptr, ptr + sizeof(uint16_t));
-    }
-    return s;
+        packer.flag(e.flag);
+        packer.point(e.sp.p);
+        packer.color(e.sp.c);
+    }
+    return packer.finish();
 }
 
 std::string serialize_shade6(const ShadingType6 &shade) {
-    std::string s;
+    // Twelve control points and four corner colors.
+    constexpr size_t patch_size =
+        packed_flag_size + 12 * packed_point_size + 4 * packed_color_size;
+    MeshPacker packer(shade, shade.elements.size() * patch_size);
     for(const auto &eh : shade.elements) {
         assert(std::holds_alternative<FullCoonsPatch>(eh));
         const auto &e = std::get<FullCoonsPatch>(eh);
-        char flag = 0; //(char)e.flag;
-        assert(flag >= 0 && flag < 3);
-        const char *ptr;
-        ptr = (const char *)(&flag);
-        s.append(ptr, ptr + sizeof(char));
-
+        packer.flag(0);
         for(const auto &p : e.p) {
-            double xratio = (p.x - shade.minx) / (shade.maxx - shade.minx);
-            double yratio = (p.y - shade.miny) / (shade.maxy - shade.miny);
-            uint32_t xval = std::numeric_limits<uint32_t>::max() * xratio;
-            uint32_t yval = std::numeric_limits<uint32_t>::max() * yratio;
-
-            xval = std::byteswap(xval);
-            yval = std::byteswap(yval);
-            ptr = (const char *)(&xval);
-            s.append(ptr, ptr + sizeof(xval));
-            ptr = (const char *)(&yval);
-            s.append(ptr, ptr + sizeof(yval));
+            packer.point(p);
         }
         for(const auto &c : e.c) {
-            uint16_t rval = std::numeric_limits<uint16_t>::max() * c.r.v();
-            uint16_t gval = std::numeric_limits<uint16_t>::max() * c.g.v();
-            uint16_t bval = std::numeric_limits<uint16_t>::max() * c.b.v();
-            rval = std::byteswap(rval);
-            gval = std::byteswap(gval);
-            bval = std::byteswap(bval);
-
-            ptr = (const char *)(&rval);
-            s.append(ptr, ptr + sizeof(uint16_t));
-            ptr = (const char *)(&gval);
-            s.append(ptr, ptr + sizeof(uint16_t));
-            ptr = (const char *)(&bval);
-            s.append(ptr, ptr + sizeof(uint16_t));
+            packer.color(c);
         }
     }
-    return s;
+    return packer.finish();
+}
+
+template<typename T> std::string mesh_shading_dict(int shadingtype, const T &shade) {
+    return fmt::format(
+        R"(<<
+  /ShadingType {}
+  /ColorSpace {}
+  /BitsPerCoordinate 32
+  /BitsPerComponent 16
+  /BitsPerFlag 8
+  /Decode [
+    {} {}
+    {} {}
+    0 1
+    0 1
+    0 1
+  ]
+)",
+        shadingtype,
+        colorspace_names.at((int)shade.colorspace),
+        shade.minx,
+        shade.maxx,
+        shade.miny,
+        shade.maxy);
 }
 
 void serialize_trans(std::back_insert_iterator<std::string> buf_append,
@@ -306,6 +458,124 @@ void serialize_trans(std::back_insert_iterator<std::string> buf_append,
     fmt::format_to(buf_append, "{}>>\n", indent);
 }
 
+// Compresses streams in worker threads. Results are handed out
+// in job order so the caller can write objects sequentially.
+// At most `window` finished results are kept in memory at a time.
+class CompressionPool {
+public:
+    typedef std::function<rvoe<CompressedStream>(int32_t)> WorkFunction;
+
+    CompressionPool(size_t num_threads, const std::vector<int32_t> &jobs, WorkFunction work_)
+        : work{std::move(work_)}, window{2 * num_threads} {
+        tasks.reserve(jobs.size());
+        results.reserve(jobs.size());
+        for(const auto object_num : jobs) {
+            tasks.emplace_back([this, object_num]() { return work(object_num); });
+            results.emplace_back(tasks.back().get_future());
+        }
+        for(size_t i = 0; i < num_threads; ++i) {
+            threads.emplace_back([this]() { worker(); });
+        }
+    }
+
+    ~CompressionPool() {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stopping = true;
+        }
+        cv.notify_all();
+        for(auto &t : threads) {
+            t.join();
+        }
+    }
+
+    // Must be called with increasing job indexes.
+    rvoe<CompressedStream> take(size_t job_index) {
+        auto result = results.at(job_index).get();
+        {
+            std::lock_guard<std::mutex> lk(m);
+            consumed = job_index + 1;
+        }
+        cv.notify_all();
+        return result;
+    }
+
+private:
+    void worker() {
+        while(true) {
+            std::unique_lock<std::mutex> lk(m);
+            cv.wait(lk, [this]() {
+                return stopping || next_task >= tasks.size() || next_task < consumed + window;
+            });
+            if(stopping || next_task >= tasks.size()) {
+                return;
+            }
+            auto &task = tasks[next_task++];
+            lk.unlock();
+            task();
+        }
+    }
+
+    WorkFunction work;
+    size_t window;
+    std::vector<std::packaged_task<rvoe<CompressedStream>()>> tasks;
+    std::vector<std::future<rvoe<CompressedStream>>> results;
+    std::vector<std::thread> threads;
+    std::mutex m;
+    std::condition_variable cv;
+    size_t next_task = 0;
+    size_t consumed = 0;
+    bool stopping = false;
+};
+
+bool stored_image_matches(const StoredImageContents &stored,
+                          const ImageComponent &component,
+                          std::optional<int32_t> smask_id) {
+    if(stored.w != component.w || stored.h != component.h ||
+       stored.bits_per_component != component.bits_per_component ||
+       stored.colorspace != *component.colorspace || stored.is_mask != component.is_mask ||
+       stored.smask_id != smask_id) {
+        return false;
+    }
+    if(component.pixels.empty() && component.encoded) {
+        const auto &encoded = *component.encoded;
+        if(encoded.file) {
+            if(!stored.file) {
+                return false;
+            }
+            // A file that can not be read back counts as a miss.
+            const auto same = files_equal(*stored.file, *encoded.file);
+            return same && *same;
+        }
+        return stored.encoded && !stored.file && stored.data == encoded.stream;
+    }
+    return !stored.encoded && stored.data == component.pixels;
+}
+
+ImageComponent make_image_component(int32_t w,
+                                    int32_t h,
+                                    int32_t bits_per_component,
+                                    std::optional<ColorspaceType> colorspace,
+                                    bool is_mask,
+                                    int32_t colors,
+                                    std::string pixels) {
+    ContentHasher hasher;
+    hasher.update_value(w);
+    hasher.update_value(h);
+    hasher.update_value(bits_per_component);
+    hasher.update_value(is_mask);
+    hasher.update(pixels);
+    return ImageComponent{hasher.digest(),
+                          w,
+                          h,
+                          bits_per_component,
+                          std::move(colorspace),
+                          is_mask,
+                          colors,
+                          std::move(pixels),
+                          {}};
+}
+
 } // namespace
 
 const std::array<const char *, 4> rendering_intent_names{
@@ -315,6 +585,69 @@ const std::array<const char *, 4> rendering_intent_names{
     "Perceptual",
 };
 
+ChildIndex ChildIndex::build(size_t num_nodes, const std::vector<int32_t> &owners) {
+    ChildIndex index;
+    index.start.assign(num_nodes + 1, 0);
+    for(const auto owner : owners) {
+        assert(owner >= 0 && (size_t)owner < num_nodes);
+        ++index.start[owner + 1];
+    }
+    for(size_t node = 0; node < num_nodes; ++node) {
+        index.start[node + 1] += index.start[node];
+    }
+    index.items.resize(owners.size());
+    std::vector<int32_t> fill(index.start.begin(), index.start.end() - 1);
+    for(size_t i = 0; i < owners.size(); ++i) {
+        index.items[fill[owners[i]]++] = (int32_t)i;
+    }
+    return index;
+}
+
+rvoe<int32_t> CompressionLevels::level(CAPYPDF_Stream_Category category) const {
+    switch(category) {
+    case CAPY_STREAM_PAGE_CONTENT:
+        return page_content;
+    case CAPY_STREAM_IMAGE:
+        return image;
+    case CAPY_STREAM_FONT:
+        return font;
+    case CAPY_STREAM_EMBEDDED_FILE:
+        return embedded_file;
+    case CAPY_STREAM_OTHER:
+        return other;
+    }
+    RETERR(BadEnum);
+}
+
+rvoe<NoReturnValue> CompressionLevels::set_level(CAPYPDF_Stream_Category category,
+                                                 int32_t new_level) {
+    int32_t *target = nullptr;
+    switch(category) {
+    case CAPY_STREAM_PAGE_CONTENT:
+        target = &page_content;
+        break;
+    case CAPY_STREAM_IMAGE:
+        target = &image;
+        break;
+    case CAPY_STREAM_FONT:
+        target = &font;
+        break;
+    case CAPY_STREAM_EMBEDDED_FILE:
+        target = &embedded_file;
+        break;
+    case CAPY_STREAM_OTHER:
+        target = &other;
+        break;
+    default:
+        RETERR(BadEnum);
+    }
+    if(new_level < 0 || new_level > 9) {
+        RETERR(InvalidCompressionLevel);
+    }
+    *target = new_level;
+    return NoReturnValue{};
+}
+
 rvoe<PdfDocument> PdfDocument::construct(const PdfGenerationData &d, PdfColorConverter cm) {
     PdfDocument newdoc(d, std::move(cm));
     ERCV(newdoc.init());
@@ -325,6 +658,10 @@ PdfDocument::PdfDocument(const PdfGenerationData &d, PdfColorConverter cm)
     : opts{d}, cm{std::move(cm)} {}
 
 rvoe<NoReturnValue> PdfDocument::init() {
+    // Streamed objects are written as they are created, so they can not be reordered.
+    if(opts.streaming && opts.first_page_first) {
+        RETERR(StreamingFirstPageFirst);
+    }
     // PDF uses 1-based indexing so add a dummy thing in this vector
     // to make PDF and vector indices are the same.
     document_objects.emplace_back(DummyIndexZero{});
@@ -377,10 +714,11 @@ int32_t PdfDocument::create_page_group() {
 
 rvoe<NoReturnValue>
 PdfDocument::add_page(std::string resource_data,
-                      std::string page_data,
-                      const std::unordered_set<CapyPDF_FormWidgetId> &fws,
-                      const std::unordered_set<CapyPDF_AnnotationId> &annots,
-                      const std::unordered_set<CapyPDF_StructureItemId> &structs,
+                      std::string &&page_data,
+                      const IdSet<CapyPDF_FormWidgetId> &fws,
+                      const IdSet<CapyPDF_AnnotationId> &annots,
+                      const IdSet<CapyPDF_StructureItemId> &structs,
+                      const std::vector<CapyPDF_StructureItemId> &marked_content_items,
                       const std::optional<Transition> &transition,
                       const std::vector<SubPageNavigation> &subnav) {
     for(const auto &a : fws) {
@@ -394,12 +732,32 @@ PdfDocument::add_page(std::string resource_data,
         }
     }
     for(const auto &s : structs) {
-        if(structure_use.find(s) != structure_use.cend()) {
+        if((size_t)s.id >= structure_use.size()) {
+            RETERR(IndexOutOfBounds);
+        }
+        if(structure_use[s.id] >= 0) {
             RETERR(StructureReuse);
         }
     }
-    const auto resource_num = add_object(FullPDFObject{std::move(resource_data), ""});
-    const auto commands_num = add_object(FullPDFObject{std::move(page_data), ""});
+    last_page_stream_size = page_data.size();
+    // Pages that use the same fonts, images and so on share a single resource dictionary.
+    ContentHasher hasher;
+    hasher.update(resource_data);
+    const ContentKey resource_key{ContentKind::ResourceDict, hasher.digest()};
+    auto existing_resources = content_index.find(resource_key);
+    const bool new_resources =
+        existing_resources == content_index.end() ||
+        resource_dicts.at(existing_resources->second) != resource_data;
+    int32_t resource_num;
+    if(new_resources) {
+        resource_num = add_object(FullPDFObject{resource_data, ""});
+        content_index[resource_key] = resource_num;
+        resource_dicts[resource_num] = std::move(resource_data);
+    } else {
+        resource_num = existing_resources->second;
+    }
+    const auto commands_num =
+        add_object(DeflatePDFObject{"<<\n", std::move(page_data), CAPY_STREAM_PAGE_CONTENT});
     DelayedPage p;
     p.page_num = (int32_t)pages.size();
     for(const auto &a : fws) {
@@ -412,6 +770,15 @@ PdfDocument::add_page(std::string resource_data,
     if(!subnav.empty()) {
         p.subnav_root = create_subnavigation(subnav);
     }
+    if(!marked_content_items.empty()) {
+        p.struct_parents = p.page_num;
+        for(size_t mcid = 0; mcid < marked_content_items.size(); ++mcid) {
+            structure_kid_log.emplace_back(
+                StructureKid{marked_content_items[mcid], true, (int32_t)marked_content.size()});
+            marked_content.emplace_back(
+                MarkedContentRef{p.page_num, (int32_t)mcid, marked_content_items[mcid]});
+        }
+    }
     const auto page_num = add_object(std::move(p));
     for(const auto &fw : fws) {
         form_use[fw] = page_num;
@@ -420,16 +787,37 @@ PdfDocument::add_page(std::string resource_data,
         annotation_use[a] = page_num;
     }
     for(const auto &s : structs) {
-        structure_use[s] = page_num;
+        structure_use[s.id] = page_num;
     }
     pages.emplace_back(PageOffsets{resource_num, commands_num, page_num});
+    if(new_resources) {
+        ERCV(flush_object(resource_num));
+    }
+    ERCV(flush_object(commands_num));
     return NoReturnValue{};
 }
 
-void PdfDocument::add_form_xobject(std::string xobj_dict, std::string xobj_stream) {
-    const auto xobj_num = add_object(FullPDFObject{std::move(xobj_dict), std::move(xobj_stream)});
+rvoe<CapyPDF_FormXObjectId> PdfDocument::add_form_xobject(std::string xobj_dict,
+                                                          std::string xobj_stream) {
+    // Headers, footers and the like are often recorded again for every
+    // page. Identical ones are stored only once.
+    ContentHasher hasher;
+    hasher.update_value(xobj_dict.size());
+    hasher.update(xobj_dict);
+    hasher.update(xobj_stream);
+    const ContentKey key{ContentKind::FormXObject, hasher.digest()};
+    auto existing = content_index.find(key);
+    if(existing != content_index.end() &&
+       held_object_equals(form_xobjects.at(existing->second).xobj_num, xobj_dict, xobj_stream)) {
+        return CapyPDF_FormXObjectId{existing->second};
+    }
+    const auto xobj_num = add_object(
+        DeflatePDFObject{std::move(xobj_dict), std::move(xobj_stream), CAPY_STREAM_PAGE_CONTENT});
 
     form_xobjects.emplace_back(FormXObjectInfo{xobj_num});
+    content_index[key] = (int32_t)form_xobjects.size() - 1;
+    ERCV(flush_object(xobj_num));
+    return CapyPDF_FormXObjectId{(int32_t)form_xobjects.size() - 1};
 }
 
 int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &subnav) {
@@ -515,10 +903,123 @@ int32_t PdfDocument::create_subnavigation(const std::vector<SubPageNavigation> &
 
 int32_t PdfDocument::add_object(ObjectType object) {
     auto object_num = (int32_t)document_objects.size();
+    record_held_stream((int64_t)held_stream_size(object));
     document_objects.push_back(std::move(object));
     return object_num;
 }
 
+rvoe<NoReturnValue> PdfDocument::flush_object(int32_t object_num) {
+    if(!is_streaming) {
+        return NoReturnValue{};
+    }
+    auto &obj = document_objects.at(object_num);
+    const uint64_t offset = ofile->offset();
+    record_held_stream(-(int64_t)held_stream_size(obj));
+    auto *phase = phase_stats(object_phase(obj));
+    PhaseTimer timer(phase, ofile.get());
+    if(phase) {
+        ++phase->count;
+    }
+    if(std::holds_alternative<FullPDFObject>(obj)) {
+        const auto &pobj = std::get<FullPDFObject>(obj);
+        ERCV(write_finished_object(object_num, pobj.dictionary, pobj.stream));
+    } else if(std::holds_alternative<DeflatePDFObject>(obj)) {
+        auto &pobj = std::get<DeflatePDFObject>(obj);
+        ERC(level, opts.compression.level(pobj.category));
+        if(level > 0) {
+            ERC(compressed, compress_object(object_num));
+            record_compression(compressed, false);
+            ERCV(write_deflate_object(object_num, pobj, compressed));
+        } else {
+            ERCV(write_uncompressed_object(object_num, pobj));
+        }
+        if(pobj.category == CAPY_STREAM_PAGE_CONTENT) {
+            recycle_stream_buffer(std::move(pobj.stream));
+        }
+    } else if(std::holds_alternative<FileStreamPDFObject>(obj)) {
+        ERCV(write_file_stream_object(object_num, std::get<FileStreamPDFObject>(obj)));
+    } else {
+        RETERR(Unreachable);
+    }
+    obj = WrittenObject{offset};
+    return NoReturnValue{};
+}
+
+bool PdfDocument::held_object_equals(int32_t object_num,
+                                     std::string_view dictionary,
+                                     std::string_view stream) const {
+    const auto &obj = document_objects.at(object_num);
+    if(const auto *full = std::get_if<FullPDFObject>(&obj)) {
+        return full->dictionary == dictionary && full->stream == stream;
+    }
+    if(const auto *deflate = std::get_if<DeflatePDFObject>(&obj)) {
+        return deflate->unclosed_dictionary == dictionary && deflate->stream == stream;
+    }
+    return false;
+}
+
+bool PdfDocument::held_stream_equals(int32_t object_num, std::string_view stream) const {
+    const auto &obj = document_objects.at(object_num);
+    if(const auto *full = std::get_if<FullPDFObject>(&obj)) {
+        return full->stream == stream;
+    }
+    if(const auto *deflate = std::get_if<DeflatePDFObject>(&obj)) {
+        return deflate->stream == stream;
+    }
+    return false;
+}
+
+std::string PdfDocument::take_stream_buffer() {
+    std::string buf;
+    if(spare_stream_buffers.empty()) {
+        // Pages of one document tend to be of similar size.
+        buf.reserve(last_page_stream_size);
+    } else {
+        buf = std::move(spare_stream_buffers.back());
+        spare_stream_buffers.pop_back();
+    }
+    return buf;
+}
+
+PhaseStats *PdfDocument::phase_stats(CAPYPDF_Write_Phase phase) {
+    return opts.collect_stats ? &stats.phases.at(phase) : nullptr;
+}
+
+void PdfDocument::record_compression(const CompressedStream &compressed, bool is_font) {
+    if(!opts.collect_stats) {
+        return;
+    }
+    if(is_font) {
+        auto &subsetting = stats.phases[CAPY_PHASE_FONT_SUBSETTING];
+        ++subsetting.count;
+        subsetting.bytes += compressed.uncompressed_size;
+        subsetting.seconds += compressed.subset_seconds;
+        if(opts.compression.font == 0) {
+            return;
+        }
+    }
+    auto &compression = stats.phases[CAPY_PHASE_COMPRESSION];
+    ++compression.count;
+    compression.bytes += compressed.data.size();
+    compression.seconds += compressed.compress_seconds;
+    stats.compression_in += compressed.uncompressed_size;
+}
+
+void PdfDocument::record_held_stream(int64_t delta) {
+    if(!opts.collect_stats) {
+        return;
+    }
+    stats.held_stream_bytes += delta;
+    stats.peak_held_stream_bytes = std::max(stats.peak_held_stream_bytes, stats.held_stream_bytes);
+}
+
+void PdfDocument::recycle_stream_buffer(std::string &&buf) {
+    if(spare_stream_buffers.size() < max_spare_stream_buffers) {
+        buf.clear();
+        spare_stream_buffers.push_back(std::move(buf));
+    }
+}
+
 SeparationId PdfDocument::create_separation(std::string_view name,
                                             const DeviceCMYKColor &fallback) {
     std::string stream = fmt::format(R"({{ dup {} mul
@@ -592,6 +1093,10 @@ void PdfDocument::pad_subset_fonts() {
 
     for(auto &sf : fonts) {
         auto &subsetter = sf.subsets;
+        if(subsetter.subset_type() == FontSubsetType::CID) {
+            // CID fonts do not need a space character in a fixed location.
+            continue;
+        }
         assert(subsetter.num_subsets() > 0);
         const auto subset_id = subsetter.num_subsets() - 1;
         if(subsetter.get_subset(subset_id).size() > SPACE) {
@@ -616,28 +1121,58 @@ void PdfDocument::pad_subset_fonts() {
     }
 }
 
-rvoe<NoReturnValue> PdfDocument::write_to_file(FILE *output_file) {
-    assert(ofile == nullptr);
-    ofile = output_file;
+rvoe<NoReturnValue> PdfDocument::start_streaming(OutputSink sink) {
+    assert(!ofile);
+    ofile = std::make_unique<BufferedWriter>(std::move(sink));
+    is_streaming = true;
+    return write_header();
+}
+
+rvoe<NoReturnValue> PdfDocument::write_to_sink(OutputSink sink) {
+    assert(!ofile || is_streaming);
+    if(!ofile) {
+        ofile = std::make_unique<BufferedWriter>(std::move(sink));
+    }
     try {
-        auto rc = write_to_file_impl();
-        ofile = nullptr;
+        auto rc = write_to_sink_impl();
+        ofile.reset();
         return rc;
     } catch(...) {
-        ofile = nullptr;
+        ofile.reset();
         throw;
     }
 }
 
-rvoe<NoReturnValue> PdfDocument::write_to_file_impl() {
-    ERCV(write_header());
-    ERCV(create_catalog());
+rvoe<NoReturnValue> PdfDocument::write_to_sink_impl() {
+    if(!is_streaming) {
+        ERCV(write_header());
+    }
+    {
+        PhaseTimer timer(phase_stats(CAPY_PHASE_CATALOG));
+        ERCV(create_catalog());
+    }
     pad_subset_fonts();
+    if(opts.object_streams) {
+        packing_objects = true;
+        first_object_stream_num = (int32_t)document_objects.size();
+        packed_objects.assign(document_objects.size(), PackedObjectLocation{});
+    }
     ERC(object_offsets, write_objects());
-    const int64_t xref_offset = ftell(ofile);
-    ERCV(write_cross_reference_table(object_offsets));
-    ERCV(write_trailer(xref_offset));
-    return NoReturnValue{};
+    if(packing_objects) {
+        {
+            PhaseTimer timer(phase_stats(CAPY_PHASE_OBJECTS), ofile.get());
+            ERCV(flush_object_stream());
+        }
+        packing_objects = false;
+        PhaseTimer timer(phase_stats(CAPY_PHASE_XREF), ofile.get());
+        ERCV(write_cross_reference_stream(object_offsets));
+    } else {
+        PhaseTimer timer(phase_stats(CAPY_PHASE_XREF), ofile.get());
+        const int64_t xref_offset = ofile->offset();
+        ERCV(write_cross_reference_table(object_offsets));
+        ERCV(write_trailer(xref_offset));
+    }
+    return ofile->flush();
 }
 
 rvoe<NoReturnValue> PdfDocument::write_delayed_page(const DelayedPage &dp) {
@@ -652,14 +1187,10 @@ rvoe<NoReturnValue> PdfDocument::write_delayed_page(const DelayedPage &dp) {
   /Group {} 0 R
   /LastModified {}
 )",
-                   pages_object,
+                   p.parent_obj_num,
                    page_group_object,
                    current_date_string());
-    write_rectangle(buf_append, "MediaBox", opts.mediabox);
-
-    if(opts.cropbox) {
-        write_rectangle(buf_append, "CropBox", *opts.cropbox);
-    }
+    // The media and crop boxes are inherited from the page tree root.
     if(opts.bleedbox) {
         write_rectangle(buf_append, "BleedBox", *opts.bleedbox);
     }
@@ -669,12 +1200,10 @@ rvoe<NoReturnValue> PdfDocument::write_delayed_page(const DelayedPage &dp) {
     if(opts.artbox) {
         write_rectangle(buf_append, "ArtBox", *opts.artbox);
     }
-    fmt::format_to(buf_append,
-                   R"(  /Contents {} 0 R
-  /Resources {} 0 R
-)",
-                   p.commands_obj_num,
-                   p.resource_obj_num);
+    fmt::format_to(buf_append, "  /Contents {} 0 R\n", p.commands_obj_num);
+    if(!p.inherits_resources) {
+        fmt::format_to(buf_append, "  /Resources {} 0 R\n", p.resource_obj_num);
+    }
 
     if(!dp.used_form_widgets.empty() || !dp.used_annotations.empty()) {
         buf += "  /Annots [\n";
@@ -694,11 +1223,108 @@ rvoe<NoReturnValue> PdfDocument::write_delayed_page(const DelayedPage &dp) {
     if(dp.subnav_root) {
         fmt::format_to(buf_append, "  /PresSteps {} 0 R\n", dp.subnav_root.value());
     }
+    if(dp.struct_parents) {
+        fmt::format_to(buf_append, "  /StructParents {}\n", *dp.struct_parents);
+    }
     buf += ">>\n";
 
     return write_finished_object(p.page_obj_num, buf, "");
 }
 
+void PdfDocument::create_page_tree() {
+    // The /Resources shared by every page below a node are set on the node instead.
+    struct TreeEntry {
+        int32_t count;
+        std::optional<int32_t> resources;
+    };
+    const size_t fanout = opts.page_tree_fanout;
+    std::vector<std::vector<TreeEntry>> levels(1);
+    levels[0].reserve(pages.size());
+    for(const auto &p : pages) {
+        levels[0].emplace_back(TreeEntry{1, p.resource_obj_num});
+    }
+    // A lone page keeps its own resources, but a node with one kid node passes
+    // up whatever that node shares so that it can reach the root.
+    auto shared_resources = [](std::span<const TreeEntry> entries,
+                               bool are_pages) -> std::optional<int32_t> {
+        if((are_pages && entries.size() < 2) || !entries.front().resources) {
+            return {};
+        }
+        for(const auto &e : entries) {
+            if(e.resources != entries.front().resources) {
+                return {};
+            }
+        }
+        return entries.front().resources;
+    };
+    while(fanout > 1 && levels.back().size() > fanout) {
+        const auto &below = levels.back();
+        std::vector<TreeEntry> level;
+        level.reserve((below.size() + fanout - 1) / fanout);
+        for(size_t start = 0; start < below.size(); start += fanout) {
+            const auto kids = std::span<const TreeEntry>(below).subspan(
+                start, std::min(fanout, below.size() - start));
+            int32_t count = 0;
+            for(const auto &k : kids) {
+                count += k.count;
+            }
+            level.emplace_back(TreeEntry{count, shared_resources(kids, levels.size() == 1)});
+        }
+        levels.emplace_back(std::move(level));
+    }
+    page_tree_root.resources = shared_resources(levels.back(), levels.size() == 1);
+
+    // Intermediate nodes are created level by level from the bottom up so
+    // their object numbers are known in advance.
+    std::vector<int32_t> level_start(levels.size(), 0);
+    int32_t next_obj_num = (int32_t)document_objects.size();
+    for(size_t l = 1; l < levels.size(); ++l) {
+        level_start[l] = next_obj_num;
+        next_obj_num += (int32_t)levels[l].size();
+    }
+    auto obj_num_of = [&](size_t l, size_t i) {
+        return l == 0 ? pages[i].page_obj_num : level_start[l] + (int32_t)i;
+    };
+    auto parent_of = [&](size_t l, size_t i) -> std::pair<int32_t, const std::optional<int32_t> &> {
+        if(l + 1 == levels.size()) {
+            return {pages_object, page_tree_root.resources};
+        }
+        return {level_start[l + 1] + int32_t(i / fanout), levels[l + 1][i / fanout].resources};
+    };
+    for(size_t i = 0; i < pages.size(); ++i) {
+        const auto [parent, parent_resources] = parent_of(0, i);
+        pages[i].parent_obj_num = parent;
+        pages[i].inherits_resources = parent_resources.has_value();
+    }
+    for(size_t l = 1; l < levels.size(); ++l) {
+        for(size_t i = 0; i < levels[l].size(); ++i) {
+            const auto [parent, parent_resources] = parent_of(l, i);
+            std::string buf = fmt::format(R"(<<
+  /Type /Pages
+  /Parent {} 0 R
+  /Kids [
+)",
+                                          parent);
+            auto app = std::back_inserter(buf);
+            const size_t kids_end = std::min((i + 1) * fanout, levels[l - 1].size());
+            for(size_t k = i * fanout; k < kids_end; ++k) {
+                fmt::format_to(app, "    {} 0 R\n", obj_num_of(l - 1, k));
+            }
+            fmt::format_to(app, "  ]\n  /Count {}\n", levels[l][i].count);
+            if(levels[l][i].resources && !parent_resources) {
+                fmt::format_to(app, "  /Resources {} 0 R\n", *levels[l][i].resources);
+            }
+            buf += ">>\n";
+            [[maybe_unused]] const auto obj_num = add_object(FullPDFObject{std::move(buf), ""});
+            assert(obj_num == obj_num_of(l, i));
+        }
+    }
+    page_tree_root.kids.clear();
+    for(size_t i = 0; i < levels.back().size(); ++i) {
+        page_tree_root.kids.push_back(obj_num_of(levels.size() - 1, i));
+    }
+}
+
 rvoe<NoReturnValue> PdfDocument::write_pages_root() {
     std::string buf;
     auto buf_append = std::back_inserter(buf);
@@ -706,10 +1332,19 @@ rvoe<NoReturnValue> PdfDocument::write_pages_root() {
   /Type /Pages
   /Kids [
 )");
-    for(const auto &i : pages) {
-        fmt::format_to(buf_append, "    {} 0 R\n", i.page_obj_num);
+    for(const auto &kid : page_tree_root.kids) {
+        fmt::format_to(buf_append, "    {} 0 R\n", kid);
     }
-    fmt::format_to(buf_append, "  ]\n  /Count {}\n>>\n", pages.size());
+    fmt::format_to(buf_append, "  ]\n  /Count {}\n", pages.size());
+    // Inherited by all pages.
+    write_rectangle(buf_append, "MediaBox", opts.mediabox);
+    if(opts.cropbox) {
+        write_rectangle(buf_append, "CropBox", *opts.cropbox);
+    }
+    if(page_tree_root.resources) {
+        fmt::format_to(buf_append, "  /Resources {} 0 R\n", *page_tree_root.resources);
+    }
+    buf += ">>\n";
     return write_finished_object(pages_object, buf, "");
 }
 
@@ -737,17 +1372,21 @@ rvoe<NoReturnValue> PdfDocument::create_catalog() {
     std::string name;
     std::string structure;
 
+    create_page_tree();
+
     if(!embedded_files.empty()) {
         ERC(names, create_name_dict());
         name = fmt::format("  /Names {} 0 R\n", names);
     }
     if(!outlines.items.empty()) {
+        PhaseTimer timer(phase_stats(CAPY_PHASE_OUTLINES));
         ERC(outlines, create_outlines());
         outline = fmt::format("  /Outlines {} 0 R\n", outlines);
     }
     if(!structure_items.empty()) {
         create_structure_root_dict();
-        structure = fmt::format("  /StructureTreeRoot {} 0 R\n", *structure_root_object);
+        structure = fmt::format("  /StructTreeRoot {} 0 R\n  /MarkInfo << /Marked true >>\n",
+                                *structure_root_object);
     }
     fmt::format_to(app,
                    R"(<<
@@ -811,13 +1450,31 @@ void PdfDocument::create_output_intent() {
 }
 
 rvoe<int32_t> PdfDocument::create_outlines() {
+    const auto num_items = (int32_t)outlines.items.size();
     int32_t first_obj_num = (int32_t)document_objects.size();
-    int32_t catalog_obj_num = first_obj_num + (int32_t)outlines.items.size();
-    for(int32_t cur_id = 0; cur_id < (int32_t)outlines.items.size(); ++cur_id) {
+    int32_t catalog_obj_num = first_obj_num + num_items;
+    // Node num_items is the outline dictionary.
+    std::vector<int32_t> parents;
+    parents.reserve(num_items);
+    for(const auto &item : outlines.items) {
+        if(item.parent && (item.parent->id < 0 || item.parent->id >= num_items)) {
+            RETERR(IndexOutOfBounds);
+        }
+        parents.push_back(item.parent ? item.parent->id : num_items);
+    }
+    const auto children = ChildIndex::build(num_items + 1, parents);
+    std::vector<int32_t> prev(num_items, -1);
+    std::vector<int32_t> next(num_items, -1);
+    for(int32_t node = 0; node <= num_items; ++node) {
+        const auto siblings = children.of(node);
+        for(size_t i = 1; i < siblings.size(); ++i) {
+            prev[siblings[i]] = siblings[i - 1];
+            next[siblings[i - 1]] = siblings[i];
+        }
+    }
+    for(int32_t cur_id = 0; cur_id < num_items; ++cur_id) {
         const auto &cur_obj = outlines.items[cur_id];
         ERC(titlestr, utf8_to_pdfmetastr(cur_obj.title));
-        auto parent_id = outlines.parent.at(cur_id);
-        const auto &siblings = outlines.children.at(parent_id);
         std::string oitem = fmt::format(R"(<<
   /Title {}
   /Dest [ {} 0 R /XYZ null null null]
@@ -825,37 +1482,25 @@ rvoe<int32_t> PdfDocument::create_outlines() {
                                         titlestr,
                                         pages.at(cur_obj.dest.id).page_obj_num);
         auto app = std::back_inserter(oitem);
-        if(siblings.size() > 1) {
-            auto loc = std::find(siblings.begin(), siblings.end(), cur_id);
-            assert(loc != siblings.end());
-            if(loc != siblings.begin()) {
-                auto prevloc = loc;
-                --prevloc;
-                fmt::format_to(app, "  /Prev {} 0 R\n", first_obj_num + *prevloc);
-            }
-            auto nextloc = loc;
-            nextloc++;
-            if(nextloc != siblings.end()) {
-                fmt::format_to(app, "  /Next {} 0 R\n", first_obj_num + *nextloc);
-            }
+        if(prev[cur_id] >= 0) {
+            fmt::format_to(app, "  /Prev {} 0 R\n", first_obj_num + prev[cur_id]);
+        }
+        if(next[cur_id] >= 0) {
+            fmt::format_to(app, "  /Next {} 0 R\n", first_obj_num + next[cur_id]);
+        }
+        const auto item_children = children.of(cur_id);
+        if(!item_children.empty()) {
+            fmt::format_to(app, "  /First {} 0 R\n", first_obj_num + item_children.front());
+            fmt::format_to(app, "  /Last {} 0 R\n", first_obj_num + item_children.back());
+            fmt::format_to(app, "  /Count {}\n", -(int32_t)item_children.size());
         }
-        auto childs = outlines.children.find(cur_id);
-        if(childs != outlines.children.end()) {
-            const auto &children = childs->second;
-            fmt::format_to(app, "  /First {} 0 R\n", first_obj_num + children.front());
-            fmt::format_to(app, "  /Last {} 0 R\n", first_obj_num + children.back());
-            fmt::format_to(app, "  /Count {}\n", -(int32_t)children.size());
-        }
-        /*
-        if(node_counts[cur_id] > 0) {
-            fmt::format_to(app, "  /Count {}\n", -node_counts[cur_id]);
-        }*/
         fmt::format_to(app,
                        "  /Parent {} 0 R\n>>",
-                       parent_id >= 0 ? first_obj_num + parent_id : catalog_obj_num);
+                       parents[cur_id] < num_items ? first_obj_num + parents[cur_id]
+                                                   : catalog_obj_num);
         add_object(FullPDFObject{std::move(oitem), ""});
     }
-    const auto &top_level = outlines.children.at(-1);
+    const auto top_level = children.of(num_items);
     std::string buf = fmt::format(R"(<<
   /Type /Outlines
   /First {} 0 R
@@ -865,7 +1510,7 @@ rvoe<int32_t> PdfDocument::create_outlines() {
 )",
                                   first_obj_num + top_level.front(),
                                   first_obj_num + top_level.back(),
-                                  outlines.children.at(-1).size());
+                                  top_level.size());
 
     assert(catalog_obj_num == (int32_t)document_objects.size());
     // FIXME: add output intents here. PDF spec 14.11.5
@@ -873,27 +1518,113 @@ rvoe<int32_t> PdfDocument::create_outlines() {
 }
 
 void PdfDocument::create_structure_root_dict() {
-    std::string buf;
-    std::optional<CapyPDF_StructureItemId> rootobj;
-
-    for(int32_t i = 0; i < (int32_t)structure_items.size(); ++i) {
-        if(!structure_items[i].parent) {
-            rootobj = CapyPDF_StructureItemId{i};
-            break;
-        }
-        // FIXME, check that there is only one.
+    const auto num_items = (int32_t)structure_items.size();
+    std::vector<int32_t> owners;
+    owners.reserve(structure_kid_log.size());
+    for(const auto &kid : structure_kid_log) {
+        owners.push_back(kid.parent ? kid.parent->id : num_items);
     }
-    assert(rootobj);
-    // /ParentTree
-    buf = fmt::format(R"(<<
+    structure_kids = ChildIndex::build(num_items + 1, owners);
+
+    std::string buf = R"(<<
   /Type /StructTreeRoot
-  /K [ {} 0 R ]
->>
+  /K [
+)";
+    auto app = std::back_inserter(buf);
+    for(const auto &k : structure_kids.of(num_items)) {
+        const auto &root = structure_kid_log[k];
+        assert(!root.is_marked_content);
+        fmt::format_to(app, "    {} 0 R\n", structure_items[root.index].obj_id);
+    }
+    buf += "  ]\n";
+    if(!marked_content.empty()) {
+        const auto parent_tree = create_structure_parent_tree();
+        fmt::format_to(app,
+                       R"(  /ParentTree {} 0 R
+  /ParentTreeNextKey {}
 )",
-                      structure_items[rootobj->id].obj_id);
+                       parent_tree,
+                       pages.size());
+    }
+    buf += ">>\n";
     structure_root_object = add_object(FullPDFObject{buf, ""});
 }
 
+int32_t PdfDocument::create_structure_parent_tree() {
+    // Every page with marked content has an array of its structure items
+    // indexed by MCID. The keys are page numbers, so they are already sorted
+    // and the tree can be built bottom up with full nodes.
+    struct NumberTreeNode {
+        int32_t first_key;
+        int32_t last_key;
+        int32_t obj_num;
+    };
+    const size_t max_node_entries = 64;
+    auto add_node = [this](bool is_root,
+                           const char *entry_name,
+                           int32_t first_key,
+                           int32_t last_key,
+                           std::string_view entries) {
+        std::string node = "<<\n";
+        auto app = std::back_inserter(node);
+        if(!is_root) {
+            fmt::format_to(app, "  /Limits [ {} {} ]\n", first_key, last_key);
+        }
+        fmt::format_to(app, "  /{} [\n{}  ]\n>>\n", entry_name, entries);
+        return add_object(FullPDFObject{std::move(node), ""});
+    };
+
+    std::vector<std::string> leaf_entries(1);
+    std::vector<std::pair<int32_t, int32_t>> leaf_keys;
+    size_t num_entries = 0;
+    for(size_t i = 0; i < marked_content.size();) {
+        const auto page_num = marked_content[i].page_num;
+        if(num_entries == max_node_entries) {
+            leaf_entries.emplace_back();
+            num_entries = 0;
+        }
+        if(num_entries == 0) {
+            leaf_keys.emplace_back(page_num, page_num);
+        }
+        auto app = std::back_inserter(leaf_entries.back());
+        fmt::format_to(app, "    {} [", page_num);
+        for(; i < marked_content.size() && marked_content[i].page_num == page_num; ++i) {
+            fmt::format_to(app, " {} 0 R", structure_items.at(marked_content[i].sid.id).obj_id);
+        }
+        leaf_entries.back() += " ]\n";
+        leaf_keys.back().second = page_num;
+        ++num_entries;
+    }
+    if(leaf_entries.size() == 1) {
+        return add_node(true, "Nums", 0, 0, leaf_entries.front());
+    }
+    std::vector<NumberTreeNode> level;
+    for(size_t i = 0; i < leaf_entries.size(); ++i) {
+        const auto [first_key, last_key] = leaf_keys[i];
+        level.emplace_back(NumberTreeNode{
+            first_key, last_key, add_node(false, "Nums", first_key, last_key, leaf_entries[i])});
+    }
+    while(true) {
+        const bool is_root = level.size() <= max_node_entries;
+        std::vector<NumberTreeNode> parents;
+        for(size_t start = 0; start < level.size(); start += max_node_entries) {
+            const size_t end = std::min(start + max_node_entries, level.size());
+            std::string kids;
+            for(size_t k = start; k < end; ++k) {
+                fmt::format_to(std::back_inserter(kids), "    {} 0 R\n", level[k].obj_num);
+            }
+            const auto first_key = level[start].first_key;
+            const auto last_key = level[end - 1].last_key;
+            const auto obj_num = add_node(is_root, "Kids", first_key, last_key, kids);
+            if(is_root) {
+                return obj_num;
+            }
+            parents.emplace_back(NumberTreeNode{first_key, last_key, obj_num});
+        }
+        level = std::move(parents);
+    }
+}
+
 rvoe<NoReturnValue>
 PdfDocument::write_cross_reference_table(const std::vector<uint64_t> &object_offsets) {
     std::string buf;
@@ -941,11 +1672,172 @@ startxref
     return write_bytes(buf);
 }
 
+rvoe<NoReturnValue>
+PdfDocument::write_cross_reference_stream(const std::vector<uint64_t> &object_offsets) {
+    const int32_t info = 1;
+    const int32_t root = first_object_stream_num - 1;
+    const int32_t xref_num = first_object_stream_num + (int32_t)object_stream_offsets.size();
+    const uint64_t xref_offset = ofile->offset();
+    int offset_bytes = 1;
+    while(offset_bytes < 8 && (xref_offset >> (8 * offset_bytes)) != 0) {
+        ++offset_bytes;
+    }
+    std::string entries;
+    entries.reserve((xref_num + 1) * (3 + offset_bytes));
+    auto add_entry = [&](uint8_t type, uint64_t field2, uint16_t field3) {
+        entries += (char)type;
+        for(int i = offset_bytes - 1; i >= 0; --i) {
+            entries += (char)((field2 >> (8 * i)) & 0xff);
+        }
+        entries += (char)(field3 >> 8);
+        entries += (char)(field3 & 0xff);
+    };
+    for(size_t i = 0; i < object_offsets.size(); ++i) {
+        const auto &loc = packed_objects.at(i);
+        if(i == 0) {
+            add_entry(0, 0, 0xffff);
+        } else if(loc.stream_obj != 0) {
+            add_entry(2, loc.stream_obj, loc.index);
+        } else {
+            add_entry(1, object_offsets[i], 0);
+        }
+    }
+    for(const auto &offset : object_stream_offsets) {
+        add_entry(1, offset, 0);
+    }
+    add_entry(1, xref_offset, 0);
+
+    auto documentid = create_trailer_id();
+    std::string dict;
+    auto app = std::back_inserter(dict);
+    fmt::format_to(app,
+                   R"(<<
+  /Type /XRef
+  /Size {}
+  /W [ 1 {} 2 ]
+  /Root {} 0 R
+  /Info {} 0 R
+  /ID [{}{}]
+)",
+                   xref_num + 1,
+                   offset_bytes,
+                   root,
+                   info,
+                   documentid,
+                   documentid);
+    ERC(level, opts.compression.level(CAPY_STREAM_OTHER));
+    if(level > 0) {
+        ERC(compressed, flate_compress(entries, level));
+        entries = std::move(compressed);
+        dict += "  /Filter /FlateDecode\n";
+    }
+    fmt::format_to(app, "  /Length {}\n>>\n", entries.size());
+    ERCV(write_finished_object(xref_num, dict, entries));
+    return write_bytes(fmt::format("startxref\n{}\n%%EOF\n", xref_offset));
+}
+
+rvoe<NoReturnValue> PdfDocument::pack_object(int32_t object_number, std::string_view dict_data) {
+    auto &loc = packed_objects.at(object_number);
+    loc.stream_obj = first_object_stream_num + (int32_t)object_stream_offsets.size();
+    loc.index = objstm_count;
+    fmt::format_to(std::back_inserter(objstm_index), "{} {} ", object_number, objstm_body.size());
+    objstm_body += dict_data;
+    if(objstm_body.empty() || objstm_body.back() != '\n') {
+        objstm_body += '\n';
+    }
+    if(++objstm_count >= max_objects_per_stream) {
+        return flush_object_stream();
+    }
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfDocument::flush_object_stream() {
+    if(objstm_count == 0) {
+        return NoReturnValue{};
+    }
+    const int32_t stream_num = first_object_stream_num + (int32_t)object_stream_offsets.size();
+    objstm_index.back() = '\n';
+    std::string dict;
+    auto app = std::back_inserter(dict);
+    fmt::format_to(app,
+                   R"(<<
+  /Type /ObjStm
+  /N {}
+  /First {}
+)",
+                   objstm_count,
+                   objstm_index.size());
+    std::string stream = std::move(objstm_index);
+    stream += objstm_body;
+    ERC(level, opts.compression.level(CAPY_STREAM_OTHER));
+    if(level > 0) {
+        ERC(compressed, flate_compress(stream, level));
+        stream = std::move(compressed);
+        dict += "  /Filter /FlateDecode\n";
+    }
+    fmt::format_to(app, "  /Length {}\n>>\n", stream.size());
+    object_stream_offsets.push_back(ofile->offset());
+    objstm_index.clear();
+    objstm_body.clear();
+    objstm_count = 0;
+    return write_finished_object(stream_num, dict, stream);
+}
+
+size_t PdfDocument::worker_thread_count() const {
+    return opts.num_threads > 0 ? (size_t)opts.num_threads
+                                : std::max(std::thread::hardware_concurrency(), 1u);
+}
+
 rvoe<std::vector<uint64_t>> PdfDocument::write_objects() {
-    std::vector<uint64_t> object_offsets;
-    for(size_t i = 0; i < document_objects.size(); ++i) {
+    std::vector<int32_t> jobs;
+    std::unique_ptr<CompressionPool> pool;
+    const auto order = object_write_order();
+    size_t num_threads = worker_thread_count();
+    if(num_threads > 1) {
+        for(const auto i : order) {
+            const auto &obj = document_objects[i];
+            if(std::holds_alternative<DeflatePDFObject>(obj)) {
+                ERC(level, opts.compression.level(std::get<DeflatePDFObject>(obj).category));
+                if(level > 0) {
+                    jobs.push_back((int32_t)i);
+                }
+            } else if(std::holds_alternative<DelayedSubsetFontData>(obj)) {
+                jobs.push_back((int32_t)i);
+            }
+        }
+        if(!jobs.empty()) {
+            num_threads = std::min(num_threads, jobs.size());
+            // Subsets are generated without FreeType, so jobs for the same
+            // font can run in parallel. Results are taken in order, which
+            // keeps the output identical to a single threaded run.
+            pool = std::make_unique<CompressionPool>(
+                num_threads, jobs, [this](int32_t object_num) {
+                    return compress_object(object_num);
+                });
+        }
+    }
+    size_t next_job = 0;
+    auto get_compressed = [&](int32_t object_num) -> rvoe<CompressedStream> {
+        if(pool) {
+            assert(jobs.at(next_job) == object_num);
+            return pool->take(next_job++);
+        }
+        return compress_object(object_num);
+    };
+
+    std::vector<uint64_t> object_offsets(document_objects.size());
+    for(const auto i : order) {
         const auto &obj = document_objects[i];
-        object_offsets.push_back(ftell(ofile));
+        if(std::holds_alternative<WrittenObject>(obj)) {
+            object_offsets[i] = std::get<WrittenObject>(obj).offset;
+            continue;
+        }
+        object_offsets[i] = ofile->offset();
+        auto *phase = phase_stats(object_phase(obj));
+        PhaseTimer timer(phase, ofile.get());
+        if(phase) {
+            ++phase->count;
+        }
         if(std::holds_alternative<DummyIndexZero>(obj)) {
             // Skip.
         } else if(std::holds_alternative<FullPDFObject>(obj)) {
@@ -953,14 +1845,22 @@ rvoe<std::vector<uint64_t>> PdfDocument::write_objects() {
             write_finished_object(i, pobj.dictionary, pobj.stream);
         } else if(std::holds_alternative<DeflatePDFObject>(obj)) {
             const auto &pobj = std::get<DeflatePDFObject>(obj);
-            ERC(compressed, flate_compress(pobj.stream));
-            std::string dict = fmt::format("{}  /Filter /FlateDecode\n  /Length {}\n>>\n",
-                                           pobj.unclosed_dictionary,
-                                           compressed.size());
-            write_finished_object(i, dict, compressed);
+            ERC(level, opts.compression.level(pobj.category));
+            if(level > 0) {
+                ERC(compressed, get_compressed(i));
+                record_compression(compressed, false);
+                ERCV(write_deflate_object(i, pobj, compressed));
+            } else {
+                ERCV(write_uncompressed_object(i, pobj));
+            }
+        } else if(std::holds_alternative<FileStreamPDFObject>(obj)) {
+            ERCV(write_file_stream_object(i, std::get<FileStreamPDFObject>(obj)));
         } else if(std::holds_alternative<DelayedSubsetFontData>(obj)) {
             const auto &ssfont = std::get<DelayedSubsetFontData>(obj);
-            ERCV(write_subset_font_data(i, ssfont));
+            ERC(font_data, get_compressed(i));
+            record_compression(font_data, true);
+            ERCV(write_subset_font_data(
+                i, font_data, fonts.at(ssfont.fid.id).fontdata.fontdata->font.is_cff()));
         } else if(std::holds_alternative<DelayedSubsetFontDescriptor>(obj)) {
             const auto &ssfontd = std::get<DelayedSubsetFontDescriptor>(obj);
             write_subset_font_descriptor(
@@ -975,6 +1875,13 @@ rvoe<std::vector<uint64_t>> PdfDocument::write_objects() {
                                    0,
                                    ssfont.subfont_descriptor_obj,
                                    ssfont.subfont_cmap_obj));
+        } else if(std::holds_alternative<DelayedCIDFont>(obj)) {
+            const auto &cidfont = std::get<DelayedCIDFont>(obj);
+            ERCV(write_cid_font(i, fonts.at(cidfont.fid.id), cidfont.subfont_descriptor_obj));
+        } else if(std::holds_alternative<DelayedType0Font>(obj)) {
+            const auto &t0font = std::get<DelayedType0Font>(obj);
+            ERCV(write_type0_font(
+                i, fonts.at(t0font.fid.id), t0font.cidfont_obj, t0font.subfont_cmap_obj));
         } else if(std::holds_alternative<DelayedPages>(obj)) {
             // const auto &pages = std::get<DelayedPages>(obj);
             write_pages_root();
@@ -994,26 +1901,225 @@ rvoe<std::vector<uint64_t>> PdfDocument::write_objects() {
             RETERR(Unreachable);
         }
     }
-    return object_offsets;
+    return object_offsets;
+}
+
+std::vector<int32_t> PdfDocument::object_references(int32_t object_num) const {
+    std::vector<int32_t> refs;
+    const auto &obj = document_objects.at(object_num);
+    if(std::holds_alternative<FullPDFObject>(obj)) {
+        scan_references(std::get<FullPDFObject>(obj).dictionary, refs);
+    } else if(std::holds_alternative<DeflatePDFObject>(obj)) {
+        scan_references(std::get<DeflatePDFObject>(obj).unclosed_dictionary, refs);
+    } else if(std::holds_alternative<FileStreamPDFObject>(obj)) {
+        scan_references(std::get<FileStreamPDFObject>(obj).dictionary, refs);
+    } else if(std::holds_alternative<DelayedSubsetFontDescriptor>(obj)) {
+        refs.push_back(std::get<DelayedSubsetFontDescriptor>(obj).subfont_data_obj);
+    } else if(std::holds_alternative<DelayedSubsetFont>(obj)) {
+        const auto &ssfont = std::get<DelayedSubsetFont>(obj);
+        refs.push_back(ssfont.subfont_descriptor_obj);
+        refs.push_back(ssfont.subfont_cmap_obj);
+    } else if(std::holds_alternative<DelayedCIDFont>(obj)) {
+        refs.push_back(std::get<DelayedCIDFont>(obj).subfont_descriptor_obj);
+    } else if(std::holds_alternative<DelayedType0Font>(obj)) {
+        const auto &t0font = std::get<DelayedType0Font>(obj);
+        refs.push_back(t0font.cidfont_obj);
+        refs.push_back(t0font.subfont_cmap_obj);
+    } else if(std::holds_alternative<DelayedCheckboxWidgetAnnotation>(obj)) {
+        const auto &checkbox = std::get<DelayedCheckboxWidgetAnnotation>(obj);
+        refs.push_back(form_xobjects.at(checkbox.on.id).xobj_num);
+        refs.push_back(form_xobjects.at(checkbox.off.id).xobj_num);
+    } else if(std::holds_alternative<DelayedPage>(obj)) {
+        const auto &dp = std::get<DelayedPage>(obj);
+        const auto &p = pages.at(dp.page_num);
+        if(p.parent_obj_num != pages_object) {
+            refs.push_back(p.parent_obj_num);
+        }
+        refs.push_back(p.commands_obj_num);
+        refs.push_back(p.resource_obj_num);
+        for(const auto &a : dp.used_form_widgets) {
+            refs.push_back(form_widgets.at(a.id));
+        }
+        for(const auto &a : dp.used_annotations) {
+            refs.push_back(annotations.at(a.id));
+        }
+    }
+    return refs;
+}
+
+std::vector<int32_t> PdfDocument::object_write_order() const {
+    std::vector<int32_t> order;
+    order.reserve(document_objects.size());
+    if(!opts.first_page_first || pages.empty()) {
+        for(size_t i = 0; i < document_objects.size(); ++i) {
+            order.push_back((int32_t)i);
+        }
+        return order;
+    }
+    std::vector<bool> placed(document_objects.size(), false);
+    auto place = [&](int32_t object_num) {
+        if(!placed.at(object_num)) {
+            placed[object_num] = true;
+            order.push_back(object_num);
+        }
+    };
+    // The catalog is the last object.
+    place(0);
+    place((int32_t)document_objects.size() - 1);
+    place(pages_object);
+    place(page_group_object);
+    // Then everything the first page needs, but not other pages or
+    // whatever they might lead to.
+    std::vector<int32_t> pending{pages.front().page_obj_num};
+    while(!pending.empty()) {
+        const auto object_num = pending.back();
+        pending.pop_back();
+        if(placed.at(object_num)) {
+            continue;
+        }
+        const auto &obj = document_objects[object_num];
+        if(std::holds_alternative<DelayedPages>(obj) ||
+           (std::holds_alternative<DelayedPage>(obj) &&
+            object_num != pages.front().page_obj_num)) {
+            continue;
+        }
+        place(object_num);
+        const auto refs = object_references(object_num);
+        // Reversed so that the references come out in the order they appear.
+        pending.insert(pending.end(), refs.rbegin(), refs.rend());
+    }
+    for(size_t i = 0; i < document_objects.size(); ++i) {
+        place((int32_t)i);
+    }
+    return order;
+}
+
+// This may be called from a worker thread so it must not modify any state.
+rvoe<CompressedStream> PdfDocument::compress_object(int32_t object_num) const {
+    const auto &obj = document_objects.at(object_num);
+    if(std::holds_alternative<DeflatePDFObject>(obj)) {
+        const auto &pobj = std::get<DeflatePDFObject>(obj);
+        const auto start = std::chrono::steady_clock::now();
+        ERC(level, opts.compression.level(pobj.category));
+        ERC(compressed, flate_compress(pobj.stream, level));
+        CompressedStream result{std::move(compressed), pobj.stream.size()};
+        if(opts.collect_stats) {
+            result.compress_seconds = seconds_since(start);
+        }
+        return result;
+    } else if(std::holds_alternative<DelayedSubsetFontData>(obj)) {
+        const auto &ssfont = std::get<DelayedSubsetFontData>(obj);
+        const auto &font = fonts.at(ssfont.fid.id);
+        auto start = std::chrono::steady_clock::now();
+        ERC(subset_font,
+            font.subsets.generate_subset(font.fontdata.fontdata->font, ssfont.subset_id));
+        const double subset_seconds = opts.collect_stats ? seconds_since(start) : 0;
+        if(opts.compression.font == 0) {
+            const auto font_size = subset_font.size();
+            return CompressedStream{std::move(subset_font), font_size, subset_seconds};
+        }
+        start = std::chrono::steady_clock::now();
+        ERC(compressed_bytes, flate_compress(subset_font, opts.compression.font));
+        CompressedStream result{std::move(compressed_bytes), subset_font.size(), subset_seconds};
+        if(opts.collect_stats) {
+            result.compress_seconds = seconds_since(start);
+        }
+        return result;
+    }
+    RETERR(Unreachable);
+}
+
+rvoe<NoReturnValue> PdfDocument::write_file_stream_object(int32_t object_num,
+                                                          const FileStreamPDFObject &pobj) {
+    std::unique_ptr<FILE, int (*)(FILE *)> fcloser(nullptr, fclose);
+    FILE *f;
+    if(pobj.temporary) {
+        f = pobj.temporary->f.get();
+        rewind(f);
+    } else {
+        std::error_code ec;
+        const auto size = std::filesystem::file_size(pobj.fname, ec);
+        const auto mtime = ec ? std::filesystem::file_time_type{}
+                              : std::filesystem::last_write_time(pobj.fname, ec);
+        if(ec || size != pobj.file_size || mtime != pobj.mtime) {
+            // The file has changed after the dictionary was created.
+            RETERR(FileReadError);
+        }
+        f = fopen(pobj.fname.string().c_str(), "rb");
+        if(!f) {
+            RETERR(CouldNotOpenFile);
+        }
+        fcloser.reset(f);
+    }
+    ERCV(write_object_start(object_num, pobj.dictionary));
+    if(pobj.file_size > 0) {
+        ERCV(write_bytes("stream\n"));
+        // Chunks are larger than the output buffer so they are passed through without copying.
+        std::string chunk(1024 * 1024, '\0');
+        uint64_t remaining = pobj.file_size;
+        while(remaining > 0) {
+            const auto to_read = (size_t)std::min<uint64_t>(remaining, chunk.size());
+            if(fread(chunk.data(), 1, to_read, f) != to_read) {
+                RETERR(FileReadError);
+            }
+            ERCV(write_bytes(chunk.data(), to_read));
+            remaining -= to_read;
+        }
+        if(ofile->last_char() != '\n') {
+            ERCV(write_bytes("\n"));
+        }
+        ERCV(write_bytes("endstream\n"));
+    }
+    return write_bytes("endobj\n");
+}
+
+rvoe<NoReturnValue> PdfDocument::write_uncompressed_object(int32_t object_num,
+                                                           const DeflatePDFObject &pobj) {
+    std::string dict =
+        fmt::format("{}  /Length {}\n>>\n", pobj.unclosed_dictionary, pobj.stream.size());
+    if(pobj.stream.empty()) {
+        // write_finished_object would skip the stream keywords and
+        // might pack the object as a plain dictionary.
+        dict += "stream\n\nendstream\n";
+        ERCV(write_object_start(object_num, dict));
+        return write_bytes("endobj\n");
+    }
+    return write_finished_object(object_num, dict, pobj.stream);
+}
+
+rvoe<NoReturnValue> PdfDocument::write_deflate_object(int32_t object_num,
+                                                      const DeflatePDFObject &pobj,
+                                                      const CompressedStream &compressed) {
+    std::string dict = fmt::format("{}  /Filter /FlateDecode\n  /Length {}\n>>\n",
+                                   pobj.unclosed_dictionary,
+                                   compressed.data.size());
+    return write_finished_object(object_num, dict, compressed.data);
 }
 
 rvoe<NoReturnValue> PdfDocument::write_subset_font_data(int32_t object_num,
-                                                        const DelayedSubsetFontData &ssfont) {
-    const auto &font = fonts.at(ssfont.fid.id);
-    ERC(subset_font,
-        font.subsets.generate_subset(
-            font.fontdata.face.get(), font.fontdata.fontdata, ssfont.subset_id));
-
-    ERC(compressed_bytes, flate_compress(subset_font));
-    std::string dictbuf = fmt::format(R"(<<
+                                                        const CompressedStream &font_data,
+                                                        bool is_cff) {
+    std::string dictbuf;
+    if(is_cff) {
+        // Embedded as a whole OpenType file, which has no /Length1.
+        dictbuf = fmt::format(R"(<<
+  /Length {}
+  /Subtype /OpenType
+)",
+                              font_data.data.size());
+    } else {
+        dictbuf = fmt::format(R"(<<
   /Length {}
   /Length1 {}
-  /Filter /FlateDecode
->>
 )",
-                                      compressed_bytes.size(),
-                                      subset_font.size());
-    ERCV(write_finished_object(object_num, dictbuf, compressed_bytes));
+                              font_data.data.size(),
+                              font_data.uncompressed_size);
+    }
+    if(opts.compression.font > 0) {
+        dictbuf += "  /Filter /FlateDecode\n";
+    }
+    dictbuf += ">>\n";
+    ERCV(write_finished_object(object_num, dictbuf, font_data.data));
     return NoReturnValue{};
 }
 
@@ -1033,7 +2139,7 @@ void PdfDocument::write_subset_font_descriptor(int32_t object_num,
   /Descent {}
   /CapHeight {}
   /StemV {}
-  /FontFile2 {} 0 R
+  /{} {} 0 R
 >>
 )",
                               subsetfontname2pdfname(FT_Get_Postscript_Name(face), subset_number),
@@ -1048,6 +2154,7 @@ void PdfDocument::write_subset_font_descriptor(int32_t object_num,
                               0,               // face->descender,
                               face->bbox.yMax, // Copying what Cairo does.
                               80,              // Cairo always sets these to 80.
+                              font.fontdata->font.is_cff() ? "FontFile3" : "FontFile2",
                               font_data_obj);
     write_finished_object(object_num, objbuf, "");
 }
@@ -1055,7 +2162,8 @@ void PdfDocument::write_subset_font_descriptor(int32_t object_num,
 void PdfDocument::write_subset_cmap(int32_t object_num,
                                     const FontThingy &font,
                                     int32_t subset_number) {
-    auto cmap = create_subset_cmap(font.subsets.get_subset(subset_number));
+    auto cmap =
+        create_subset_cmap(font.subsets.get_subset(subset_number), font.subsets.subset_type());
     auto dict = fmt::format(R"(<<
   /Length {}
 >>
@@ -1064,38 +2172,6 @@ void PdfDocument::write_subset_cmap(int32_t object_num,
     write_finished_object(object_num, dict, cmap);
 }
 
-void PdfDocument::pad_subset_until_space(std::vector<TTGlyphs> &subset_glyphs) {
-    const size_t max_count = 100;
-    const uint32_t SPACE = ' ';
-    if(subset_glyphs.size() > SPACE) {
-        return;
-    }
-    bool padding_succeeded = false;
-    for(uint32_t i = 0; i < max_count; ++i) {
-        if(subset_glyphs.size() == SPACE) {
-            padding_succeeded = true;
-            break;
-        }
-        // Yes, this is O(n^2), but n is at most 31.
-        const auto cur_glyph_codepoint = '!' + i;
-        auto glfind = [cur_glyph_codepoint](const TTGlyphs &g) {
-            return std::holds_alternative<RegularGlyph>(g) &&
-                   std::get<RegularGlyph>(g).unicode_codepoint == cur_glyph_codepoint;
-        };
-        if(std::find_if(subset_glyphs.cbegin(), subset_glyphs.cend(), glfind) !=
-           subset_glyphs.cend()) {
-            continue;
-        }
-        subset_glyphs.emplace_back(RegularGlyph{cur_glyph_codepoint});
-    }
-    if(!padding_succeeded) {
-        fprintf(stderr, "Font subset padding failed.\n");
-        std::abort();
-    }
-    subset_glyphs.emplace_back(RegularGlyph{SPACE});
-    assert(subset_glyphs.size() == SPACE + 1);
-}
-
 rvoe<NoReturnValue> PdfDocument::write_subset_font(int32_t object_num,
                                                    const FontThingy &font,
                                                    int32_t subset,
@@ -1127,6 +2203,58 @@ rvoe<NoReturnValue> PdfDocument::write_subset_font(int32_t object_num,
     return NoReturnValue{};
 }
 
+rvoe<NoReturnValue> PdfDocument::write_cid_font(int32_t object_num,
+                                                const FontThingy &font,
+                                                int32_t font_descriptor_obj) {
+    auto face = font.fontdata.face.get();
+    const std::vector<TTGlyphs> &subset_glyphs = font.subsets.get_subset(0);
+    ERC(width_arr, build_subset_width_array(face, subset_glyphs));
+    // The subset font has its glyphs in CID order so no separate mapping is needed.
+    // CFF based fonts are always indexed by CID and do not take a /CIDToGIDMap.
+    const bool is_cff = font.fontdata.fontdata->font.is_cff();
+    auto objbuf = fmt::format(R"(<<
+  /Type /Font
+  /Subtype /{}
+  /BaseFont /{}
+  /CIDSystemInfo <<
+    /Registry (Adobe)
+    /Ordering (Identity)
+    /Supplement 0
+  >>
+  /FontDescriptor {} 0 R
+  /W [ 0 {} ]
+{}>>
+)",
+                              is_cff ? "CIDFontType0" : "CIDFontType2",
+                              subsetfontname2pdfname(FT_Get_Postscript_Name(face), 0),
+                              font_descriptor_obj,
+                              width_arr,
+                              is_cff ? "" : "  /CIDToGIDMap /Identity\n");
+    ERCV(write_finished_object(object_num, objbuf, ""));
+    return NoReturnValue{};
+}
+
+rvoe<NoReturnValue> PdfDocument::write_type0_font(int32_t object_num,
+                                                  const FontThingy &font,
+                                                  int32_t cidfont_obj,
+                                                  int32_t tounicode_obj) {
+    auto face = font.fontdata.face.get();
+    auto objbuf = fmt::format(R"(<<
+  /Type /Font
+  /Subtype /Type0
+  /BaseFont /{}
+  /Encoding /Identity-H
+  /DescendantFonts [ {} 0 R ]
+  /ToUnicode {} 0 R
+>>
+)",
+                              subsetfontname2pdfname(FT_Get_Postscript_Name(face), 0),
+                              cidfont_obj,
+                              tounicode_obj);
+    ERCV(write_finished_object(object_num, objbuf, ""));
+    return NoReturnValue{};
+}
+
 rvoe<NoReturnValue>
 PdfDocument::write_checkbox_widget(int obj_num, const DelayedCheckboxWidgetAnnotation &checkbox) {
     auto loc = form_use.find(checkbox.widget);
@@ -1284,23 +2412,13 @@ rvoe<NoReturnValue> PdfDocument::write_annotation(int obj_num,
 
 rvoe<NoReturnValue> PdfDocument::write_delayed_structure_item(int obj_num,
                                                               const DelayedStructItem &dsi) {
-    std::vector<CapyPDF_StructureItemId> children;
     const auto &si = structure_items.at(dsi.sid.id);
     assert(structure_root_object);
     int32_t parent_object = *structure_root_object;
     if(si.parent) {
         parent_object = structure_items.at(si.parent->id).obj_id;
     }
-
-    // Yes, this is O(n^2). I got lazy.
-    for(int32_t i = 0; i < (int32_t)structure_items.size(); ++i) {
-        if(structure_items[i].parent) {
-            auto current_parent = structure_items.at(structure_items[i].parent->id).obj_id;
-            if(current_parent == si.obj_id) {
-                children.emplace_back(CapyPDF_StructureItemId{i});
-            }
-        }
-    }
+    const auto kids = structure_kids.of(dsi.sid.id);
     std::string dict = fmt::format(R"(<<
   /Type /StructElem
   /S /{}
@@ -1309,10 +2427,18 @@ rvoe<NoReturnValue> PdfDocument::write_delayed_structure_item(int obj_num,
                                    si.stype,
                                    parent_object);
     auto app = std::back_inserter(dict);
-    if(!children.empty()) {
+    if(structure_use.at(dsi.sid.id) >= 0) {
+        fmt::format_to(app, "  /Pg {} 0 R\n", structure_use.at(dsi.sid.id));
+    }
+    if(!kids.empty()) {
         dict += "  /K [\n";
-        for(const auto &c : children) {
-            fmt::format_to(app, "    {} 0 R\n", structure_items.at(c.id).obj_id);
+        for(const auto &k : kids) {
+            const auto &kid = structure_kid_log[k];
+            if(kid.is_marked_content) {
+                fmt::format_to(app, "    {}\n", marked_content[kid.index].mcid);
+            } else {
+                fmt::format_to(app, "    {} 0 R\n", structure_items.at(kid.index).obj_id);
+            }
         }
         dict += "  ]\n";
     }
@@ -1321,41 +2447,46 @@ rvoe<NoReturnValue> PdfDocument::write_delayed_structure_item(int obj_num,
     return NoReturnValue{};
 }
 
+rvoe<NoReturnValue> PdfDocument::write_object_start(int32_t object_number,
+                                                    std::string_view dict_data) {
+    char header[32];
+    auto header_end = fmt::format_to_n(header, sizeof(header), "{} 0 obj\n", object_number);
+    ERCV(write_bytes(header, header_end.size));
+    ERCV(write_bytes(dict_data));
+    if(ofile->last_char() != '\n') {
+        ERCV(write_bytes("\n"));
+    }
+    return NoReturnValue{};
+}
+
 rvoe<NoReturnValue> PdfDocument::write_finished_object(int32_t object_number,
                                                        std::string_view dict_data,
                                                        std::string_view stream_data) {
-    std::string buf;
-    auto appender = std::back_inserter(buf);
-    fmt::format_to(appender, "{} 0 obj\n", object_number);
-    buf += dict_data;
+    if(packing_objects && stream_data.empty()) {
+        return pack_object(object_number, dict_data);
+    }
+    // Written piece by piece so that large streams are not copied.
+    ERCV(write_object_start(object_number, dict_data));
     if(!stream_data.empty()) {
-        if(buf.back() != '\n') {
-            buf += '\n';
+        ERCV(write_bytes("stream\n"));
+        ERCV(write_bytes(stream_data));
+        if(ofile->last_char() != '\n') {
+            ERCV(write_bytes("\n"));
         }
-        buf += "stream\n";
-        buf += stream_data;
-        if(buf.back() != '\n') {
-            buf += '\n';
-        }
-        buf += "endstream\n";
-    }
-    if(buf.back() != '\n') {
-        buf += '\n';
+        ERCV(write_bytes("endstream\n"));
     }
-    buf += "endobj\n";
-    return write_bytes(buf);
+    return write_bytes("endobj\n");
 }
 
 std::optional<CapyPDF_IccColorSpaceId> PdfDocument::find_icc_profile(std::string_view contents) {
-    for(size_t i = 0; i < icc_profiles.size(); ++i) {
-        const auto &stream_obj = document_objects.at(icc_profiles.at(i).stream_num);
-        assert(std::holds_alternative<DeflatePDFObject>(stream_obj));
-        const auto &stream_data = std::get<DeflatePDFObject>(stream_obj);
-        if(stream_data.stream == contents) {
-            return CapyPDF_IccColorSpaceId{(int32_t)i};
-        }
+    ContentHasher hasher;
+    hasher.update(contents);
+    auto it = content_index.find(ContentKey{ContentKind::IccProfile, hasher.digest()});
+    if(it == content_index.end() ||
+       !held_stream_equals(icc_profiles.at(it->second).stream_num, contents)) {
+        return {};
     }
-    return {};
+    return CapyPDF_IccColorSpaceId{it->second};
 }
 
 CapyPDF_IccColorSpaceId PdfDocument::store_icc_profile(std::string_view contents,
@@ -1371,19 +2502,20 @@ CapyPDF_IccColorSpaceId PdfDocument::store_icc_profile(std::string_view contents
   /N {}
 )",
                    num_channels);
-    auto stream_obj_id = add_object(DeflatePDFObject{std::move(buf), std::string{contents}});
+    auto stream_obj_id =
+        add_object(DeflatePDFObject{std::move(buf), std::string{contents}, CAPY_STREAM_OTHER});
     auto obj_id =
         add_object(FullPDFObject{fmt::format("[ /ICCBased {} 0 R ]\n", stream_obj_id), ""});
     icc_profiles.emplace_back(IccInfo{stream_obj_id, obj_id, num_channels});
+    ContentHasher hasher;
+    hasher.update(contents);
+    content_index[ContentKey{ContentKind::IccProfile, hasher.digest()}] =
+        (int32_t)icc_profiles.size() - 1;
     return CapyPDF_IccColorSpaceId{(int32_t)icc_profiles.size() - 1};
 }
 
 rvoe<NoReturnValue> PdfDocument::write_bytes(const char *buf, size_t buf_size) {
-    if(fwrite(buf, 1, buf_size, ofile) != buf_size) {
-        perror(nullptr);
-        RETERR(FileWriteError);
-    }
-    return NoReturnValue{};
+    return ofile->write(std::string_view(buf, buf_size));
 }
 
 rvoe<NoReturnValue> PdfDocument::write_header() {
@@ -1464,19 +2596,87 @@ rvoe<SubsetGlyph> PdfDocument::get_subset_glyph(CapyPDF_FontId fid, uint32_t gly
     return fss;
 }
 
-rvoe<CapyPDF_ImageId> PdfDocument::load_image(const std::filesystem::path &fname) {
-    ERC(image, load_image_file(fname));
-    if(std::holds_alternative<rgb_image>(image)) {
-        return process_rgb_image(std::get<rgb_image>(image));
-    } else if(std::holds_alternative<gray_image>(image)) {
-        return process_gray_image(std::get<gray_image>(image));
-    } else if(std::holds_alternative<mono_image>(image)) {
-        return process_mono_image(std::get<mono_image>(image));
-    } else if(std::holds_alternative<cmyk_image>(image)) {
-        return process_cmyk_image(std::get<cmyk_image>(image));
-    } else {
-        RETERR(UnsupportedFormat);
+rvoe<CapyPDF_ImageId>
+PdfDocument::load_image(const std::filesystem::path &fname,
+                        const std::optional<ImageResolutionLimit> &placement) {
+    if(placement) {
+        for(const auto v : {placement->width_pt, placement->height_pt, placement->max_dpi}) {
+            if(!std::isfinite(v) || v <= 0) {
+                RETERR(InvalidImageLimit);
+            }
+        }
+    }
+    PhaseTimer timer(phase_stats(CAPY_PHASE_IMAGES));
+    ERC(prepared, prepare_image(fname, false, image_size_limit(placement)));
+    return register_image(prepared);
+}
+
+std::optional<ImageSize>
+PdfDocument::image_size_limit(const std::optional<ImageResolutionLimit> &placement) const {
+    std::optional<ImageSize> limit;
+    if(opts.max_image_dimension > 0) {
+        limit = ImageSize{opts.max_image_dimension, opts.max_image_dimension};
+    }
+    if(placement) {
+        // Printing does not benefit from more pixels than the device can show.
+        const auto to_pixels = [&placement](double size_pt) {
+            return (int32_t)std::min(std::ceil(size_pt / 72.0 * placement->max_dpi), 1e9);
+        };
+        const ImageSize placed{to_pixels(placement->width_pt), to_pixels(placement->height_pt)};
+        if(limit) {
+            limit->w = std::min(limit->w, placed.w);
+            limit->h = std::min(limit->h, placed.h);
+        } else {
+            limit = placed;
+        }
+    }
+    return limit;
+}
+
+rvoe<std::vector<CapyPDF_ImageId>>
+PdfDocument::load_images(std::span<const std::filesystem::path> fnames) {
+    std::vector<CapyPDF_ImageId> ids;
+    ids.reserve(fnames.size());
+    const size_t num_threads = std::min(worker_thread_count(), fnames.size());
+    const auto max_size = image_size_limit({});
+    if(num_threads <= 1) {
+        for(const auto &fname : fnames) {
+            ERC(iid, load_image(fname));
+            ids.push_back(iid);
+        }
+        return ids;
+    }
+    PhaseTimer timer(phase_stats(CAPY_PHASE_IMAGES));
+    // Images are decoded and compressed in batches so that only a
+    // few of them need to be held in memory at any one time.
+    const size_t batch_size = 2 * num_threads;
+    for(size_t batch_start = 0; batch_start < fnames.size(); batch_start += batch_size) {
+        const auto batch =
+            fnames.subspan(batch_start, std::min(batch_size, fnames.size() - batch_start));
+        std::vector<rvoe<PreparedImage>> prepared(batch.size());
+        std::atomic<size_t> next_image{0};
+        auto worker = [&]() {
+            for(size_t i = next_image++; i < batch.size(); i = next_image++) {
+                prepared[i] = prepare_image(batch[i], true, max_size);
+            }
+        };
+        std::vector<std::thread> threads;
+        for(size_t i = 0; i < std::min(num_threads, batch.size()); ++i) {
+            threads.emplace_back(worker);
+        }
+        for(auto &t : threads) {
+            t.join();
+        }
+        // Registering in file order keeps the output deterministic.
+        for(auto &p : prepared) {
+            if(!p) {
+                return std::unexpected(p.error());
+            }
+            ERC(iid, register_image(*p));
+            ids.push_back(iid);
+        }
     }
+    return ids;
 }
 
 rvoe<CapyPDF_ImageId> PdfDocument::load_mask_image(const std::filesystem::path &fname) {
@@ -1496,9 +2696,109 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
                                                     std::optional<int32_t> smask_id,
                                                     bool is_mask,
                                                     std::string_view uncompressed_bytes) {
+    ERC(colors, image_color_count(colorspace, is_mask));
+    auto component = make_image_component(
+        w, h, bits_per_component, colorspace, is_mask, colors, std::string(uncompressed_bytes));
+    return add_image_component(component, smask_id);
+}
+
+rvoe<CapyPDF_ImageId> PdfDocument::add_image_component(ImageComponent &component,
+                                                       std::optional<int32_t> smask_id) {
+    assert(component.colorspace);
+    const auto &colorspace = *component.colorspace;
+    ContentHasher hasher;
+    hasher.update_value(component.pixel_hash.h1);
+    hasher.update_value(component.pixel_hash.h2);
+    hasher.update_value(colorspace.index());
+    if(std::holds_alternative<CapyPDF_Colorspace>(colorspace)) {
+        hasher.update_value(std::get<CapyPDF_Colorspace>(colorspace));
+    } else if(std::holds_alternative<int32_t>(colorspace)) {
+        hasher.update_value(std::get<int32_t>(colorspace));
+    }
+    hasher.update_value(smask_id.value_or(-1));
+    const ContentKey key{ContentKind::Image, hasher.digest()};
+    auto existing = content_index.find(key);
+    if(existing != content_index.end()) {
+        // Checked before encoding so that duplicates are not compressed again.
+        auto stored = image_contents.find(existing->second);
+        if(stored != image_contents.end() &&
+           stored_image_matches(stored->second, component, smask_id)) {
+            component.encoded.reset();
+            return CapyPDF_ImageId{existing->second};
+        }
+    }
+    if(!component.encoded) {
+        ERC(encoded, encode_image_component(component));
+        component.encoded = std::move(encoded);
+    }
+    return store_image_object(key, component, smask_id);
+}
+
+rvoe<EncodedImageStream>
+PdfDocument::encode_image_component(const ImageComponent &component) const {
+    const auto level = opts.compression.image;
+    if(level == 0) {
+        return EncodedImageStream{component.pixels, false, {}};
+    }
+    if(opts.png_predictors) {
+        const size_t row_bytes =
+            ((size_t)component.w * component.colors * component.bits_per_component + 7) / 8;
+        const size_t bytes_per_pixel =
+            std::max(1, component.colors * component.bits_per_component / 8);
+        if(row_bytes > 0) {
+            // Predict a band of rows at a time so that a second full size
+            // copy of the image never exists.
+            const size_t band_rows = std::max<size_t>(256 * 1024 / row_bytes, 1);
+            const size_t whole_rows = component.pixels.size() / row_bytes;
+            const auto pixels =
+                std::string_view(component.pixels).substr(0, whole_rows * row_bytes);
+            std::string deflated;
+            ERC(compressor, FlateCompressor::create(level, string_sink(deflated)));
+            std::string_view previous_row;
+            for(size_t offset = 0; offset < pixels.size(); offset += band_rows * row_bytes) {
+                const auto band = pixels.substr(offset, band_rows * row_bytes);
+                ERCV(compressor->append(
+                    png_predict(band, row_bytes, bytes_per_pixel, previous_row)));
+                previous_row = band.substr(band.size() - row_bytes);
+            }
+            ERCV(compressor->finish());
+            return EncodedImageStream{std::move(deflated), true, component.colors};
+        }
+    }
+    ERC(deflated, flate_compress(component.pixels, level));
+    return EncodedImageStream{std::move(deflated), true, {}};
+}
+
+rvoe<int32_t> PdfDocument::image_color_count(const ColorspaceType &colorspace, bool is_mask) const {
+    if(is_mask) {
+        return 1;
+    }
+    if(std::holds_alternative<CapyPDF_Colorspace>(colorspace)) {
+        switch(std::get<CapyPDF_Colorspace>(colorspace)) {
+        case CAPYPDF_CS_DEVICE_RGB:
+            return 3;
+        case CAPYPDF_CS_DEVICE_GRAY:
+            return 1;
+        case CAPYPDF_CS_DEVICE_CMYK:
+            return 4;
+        }
+    } else if(std::holds_alternative<int32_t>(colorspace)) {
+        const auto icc_obj = std::get<int32_t>(colorspace);
+        for(const auto &icc : icc_profiles) {
+            if(icc.object_num == icc_obj) {
+                return icc.num_channels;
+            }
+        }
+    }
+    RETERR(Unreachable);
+}
+
+std::string PdfDocument::image_dictionary(const ImageComponent &component,
+                                          std::optional<int32_t> smask_id) const {
+    assert(component.encoded);
+    const auto &encoded = *component.encoded;
     std::string buf;
     auto app = std::back_inserter(buf);
-    ERC(compressed, flate_compress(uncompressed_bytes));
     fmt::format_to(app,
                    R"(<<
   /Type /XObject
@@ -1507,16 +2807,27 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
   /Height {}
   /BitsPerComponent {}
   /Length {}
-  /Filter /FlateDecode
 )",
-                   w,
-                   h,
-                   bits_per_component,
-                   compressed.size());
+                   component.w,
+                   component.h,
+                   component.bits_per_component,
+                   encoded.size());
+    if(encoded.deflated) {
+        buf += "  /Filter /FlateDecode\n";
+    }
+    if(encoded.predictor_colors) {
+        fmt::format_to(
+            app,
+            "  /DecodeParms << /Predictor 15 /Colors {} /BitsPerComponent {} /Columns {} >>\n",
+            encoded.predictor_colors.value(),
+            component.bits_per_component,
+            component.w);
+    }
     // An image may only have ImageMask or ColorSpace key, not both.
-    if(is_mask) {
+    if(component.is_mask) {
         buf += "  /ImageMask true\n";
     } else {
+        const auto &colorspace = *component.colorspace;
         if(std::holds_alternative<CapyPDF_Colorspace>(colorspace)) {
             const auto &cs = std::get<CapyPDF_Colorspace>(colorspace);
             fmt::format_to(app, "  /ColorSpace {}\n", colorspace_names.at(cs));
@@ -1532,108 +2843,381 @@ rvoe<CapyPDF_ImageId> PdfDocument::add_image_object(int32_t w,
         fmt::format_to(app, "  /SMask {} 0 R\n", smask_id.value());
     }
     buf += ">>\n";
-    auto im_id = add_object(FullPDFObject{std::move(buf), std::move(compressed)});
-    image_info.emplace_back(ImageInfo{{w, h}, im_id});
+    return buf;
+}
+
+rvoe<CapyPDF_ImageId> PdfDocument::store_image_object(const ContentKey &key,
+                                                      ImageComponent &component,
+                                                      std::optional<int32_t> smask_id) {
+    StoredImageContents contents{component.w,
+                                 component.h,
+                                 component.bits_per_component,
+                                 *component.colorspace,
+                                 component.is_mask,
+                                 smask_id,
+                                 component.pixels.empty(),
+                                 {}};
+    auto &encoded = *component.encoded;
+    if(!contents.encoded) {
+        contents.data = std::move(component.pixels);
+    } else if(encoded.file) {
+        contents.file = encoded.file;
+    } else {
+        contents.data = encoded.stream;
+    }
+    auto buf = image_dictionary(component, smask_id);
+    const auto stream_size = encoded.size();
+    int32_t im_id;
+    if(encoded.file) {
+        im_id = add_object(FileStreamPDFObject{
+            std::move(buf), {}, encoded.file->size, {}, std::move(encoded.file)});
+    } else {
+        im_id = add_object(FullPDFObject{std::move(buf), std::move(encoded.stream)});
+    }
+    component.encoded.reset();
+    image_info.emplace_back(ImageInfo{{component.w, component.h}, im_id});
+    content_index[key] = (int32_t)image_info.size() - 1;
+    image_contents.emplace(content_index[key], std::move(contents));
+    if(auto *phase = phase_stats(CAPY_PHASE_IMAGES)) {
+        ++phase->count;
+        phase->bytes += stream_size;
+    }
+    ERCV(flush_object(im_id));
     return CapyPDF_ImageId{(int32_t)image_info.size() - 1};
 }
 
-rvoe<CapyPDF_ImageId> PdfDocument::process_mono_image(const mono_image &image) {
+rvoe<std::optional<ImageComponent>>
+PdfDocument::png_passthrough_component(const std::filesystem::path &fname,
+                                       const std::optional<ImageSize> &max_size) {
+    ERC(png, load_png_passthrough(fname));
+    if(!png) {
+        return std::optional<ImageComponent>{};
+    }
+    if(max_size && (png->w > max_size->w || png->h > max_size->h)) {
+        return std::optional<ImageComponent>{};
+    }
+    CapyPDF_Colorspace cs;
+    if(png->channels == 1) {
+        cs = CAPYPDF_CS_DEVICE_GRAY;
+    } else if(png->channels == 3 && opts.output_colorspace == CAPYPDF_CS_DEVICE_RGB) {
+        cs = CAPYPDF_CS_DEVICE_RGB;
+    } else {
+        return std::optional<ImageComponent>{};
+    }
+    ContentHasher hasher;
+    // Tagged so that the compressed data can never collide with raw pixels.
+    hasher.update("png-idat");
+    hasher.update_value(png->w);
+    hasher.update_value(png->h);
+    hasher.update_value(png->channels);
+    hasher.update(png->idat);
+    // The IDAT stream is already a zlib stream of PNG predicted rows,
+    // which is exactly what FlateDecode with /Predictor 15 expects.
+    return std::optional<ImageComponent>{
+        ImageComponent{hasher.digest(),
+                       png->w,
+                       png->h,
+                       8,
+                       cs,
+                       false,
+                       png->channels,
+                       {},
+                       EncodedImageStream{std::move(png->idat), true, png->channels}}};
+}
+
+rvoe<PreparedImage> PdfDocument::prepare_image(const std::filesystem::path &fname,
+                                               bool encode,
+                                               const std::optional<ImageSize> &max_size) {
+    if(opts.png_predictors && opts.compression.image > 0 && is_png_file(fname)) {
+        ERC(passthrough, png_passthrough_component(fname, max_size));
+        if(passthrough) {
+            return PreparedImage{std::move(*passthrough), {}, {}};
+        }
+    }
+    if(opts.compression.image > 0 && is_tif_file(fname)) {
+        ERC(streamed, prepare_streamed_tif(fname, max_size));
+        if(streamed) {
+            return std::move(*streamed);
+        }
+    }
+    ERC(image, load_image_file(fname));
+    if(max_size) {
+        // Done before color conversion so that it works on fewer pixels.
+        shrink_to_fit(image, max_size->w, max_size->h);
+    }
+    PreparedImage prepared;
+    if(std::holds_alternative<rgb_image>(image)) {
+        ERC(p, prepare_rgb_image(std::get<rgb_image>(image)));
+        prepared = std::move(p);
+    } else if(std::holds_alternative<gray_image>(image)) {
+        prepared = prepare_gray_image(std::get<gray_image>(image));
+    } else if(std::holds_alternative<mono_image>(image)) {
+        prepared = prepare_mono_image(std::get<mono_image>(image));
+    } else if(std::holds_alternative<cmyk_image>(image)) {
+        prepared = prepare_cmyk_image(std::get<cmyk_image>(image));
+    } else {
+        RETERR(UnsupportedFormat);
+    }
+    if(encode) {
+        if(prepared.smask) {
+            ERC(encoded_smask, encode_image_component(*prepared.smask));
+            prepared.smask->encoded = std::move(encoded_smask);
+        }
+        // Images with an ICC profile get their final colorspace later,
+        // but it does not affect the stream contents.
+        ERC(encoded, encode_image_component(prepared.image));
+        prepared.image.encoded = std::move(encoded);
+    }
+    return prepared;
+}
+
+rvoe<std::optional<PreparedImage>>
+PdfDocument::prepare_streamed_tif(const std::filesystem::path &fname,
+                                  const std::optional<ImageSize> &max_size) {
+    // Roughly how many bytes of decoded pixels are held at a time.
+    const size_t band_bytes = 4 * 1024 * 1024;
+    ERC(reader, TiffRowReader::open(fname));
+    const auto w = reader->width();
+    const auto h = reader->height();
+    if(max_size && (w > max_size->w || h > max_size->h)) {
+        // Needs the whole image for downscaling.
+        return std::optional<PreparedImage>{};
+    }
+    PreparedImage prepared;
+    const int32_t bpc = reader->bits_per_component();
+    int32_t colors = reader->channels();
+    std::optional<ColorspaceType> cs;
+    switch(reader->format()) {
+    case TiffPixelFormat::Mono:
+    case TiffPixelFormat::Gray:
+        cs = CAPYPDF_CS_DEVICE_GRAY;
+        break;
+    case TiffPixelFormat::RGB:
+        switch(opts.output_colorspace) {
+        case CAPYPDF_CS_DEVICE_RGB:
+            break;
+        case CAPYPDF_CS_DEVICE_GRAY:
+            colors = 1;
+            break;
+        case CAPYPDF_CS_DEVICE_CMYK:
+            if(cm.get_cmyk().empty()) {
+                RETERR(NoCmykProfile);
+            }
+            colors = 4;
+            break;
+        default:
+            RETERR(Unreachable);
+        }
+        cs = opts.output_colorspace;
+        break;
+    case TiffPixelFormat::CMYK:
+        if(reader->icc()) {
+            // The profile is stored when the image is added to the document.
+            prepared.icc = reader->icc();
+        } else {
+            cs = CAPYPDF_CS_DEVICE_CMYK;
+        }
+        break;
+    }
+    const size_t row_bytes = ((size_t)w * colors * bpc + 7) / 8;
+    const size_t bytes_per_pixel = std::max(1, colors * bpc / 8);
+    const bool predict = opts.png_predictors && row_bytes > 0;
+    const int32_t band_rows =
+        (int32_t)std::clamp<size_t>(band_bytes / std::max<size_t>(reader->row_bytes(), 1), 1, h);
+
+    // Hashed in the same order as make_image_component. Hits are confirmed
+    // against the encoded stream, as the pixels never exist in one piece.
+    ContentHasher hasher;
+    hasher.update_value(w);
+    hasher.update_value(h);
+    hasher.update_value(bpc);
+    hasher.update_value(false);
+    // The compressed stream can be as big as the image, so it is kept on disk
+    // until the object is written.
+    ERC(stream, create_temporary_file());
+    ERC(compressor,
+        FlateCompressor::create(opts.compression.image, temporary_file_sink(stream)));
+    std::string band;
+    std::string previous_row;
+    while(true) {
+        ERC(rows_read, reader->read_rows(band_rows, band));
+        if(rows_read == 0) {
+            break;
+        }
+        if(reader->format() == TiffPixelFormat::RGB) {
+            if(opts.output_colorspace == CAPYPDF_CS_DEVICE_GRAY) {
+                band = cm.rgb_pixels_to_gray(band);
+            } else if(opts.output_colorspace == CAPYPDF_CS_DEVICE_CMYK) {
+                ERC(converted, cm.rgb_pixels_to_cmyk(band));
+                band = std::move(converted);
+            }
+        }
+        hasher.update(band);
+        if(predict) {
+            const auto predicted = png_predict(band, row_bytes, bytes_per_pixel, previous_row);
+            previous_row.assign(band.end() - row_bytes, band.end());
+            ERCV(compressor->append(predicted));
+        } else {
+            ERCV(compressor->append(band));
+        }
+    }
+    ERCV(compressor->finish());
+    ERCV(finish_temporary_file(stream));
+    prepared.image = ImageComponent{
+        hasher.digest(),
+        w,
+        h,
+        bpc,
+        std::move(cs),
+        false,
+        colors,
+        {},
+        EncodedImageStream{{},
+                           true,
+                           predict ? std::optional<int32_t>{colors} : std::nullopt,
+                           std::move(stream)}};
+    return std::optional<PreparedImage>{std::move(prepared)};
+}
+
+rvoe<CapyPDF_ImageId> PdfDocument::register_image(PreparedImage &prepared) {
     std::optional<int32_t> smask_id;
-    if(image.alpha) {
-        ERC(imobj,
-            add_image_object(image.w, image.h, 1, CAPYPDF_CS_DEVICE_GRAY, {}, false, *image.alpha));
-        smask_id = image_info.at(imobj.id).obj;
+    if(prepared.smask) {
+        ERC(smask, add_image_component(*prepared.smask, {}));
+        smask_id = image_info.at(smask.id).obj;
     }
-    return add_image_object(
-        image.w, image.h, 1, CAPYPDF_CS_DEVICE_GRAY, smask_id, false, image.pixels);
+    if(prepared.icc) {
+        const auto icc_id = store_icc_profile(*prepared.icc, prepared.image.colors);
+        prepared.image.colorspace = icc_profiles.at(icc_id.id).object_num;
+    }
+    return add_image_component(prepared.image, smask_id);
 }
 
-rvoe<CapyPDF_ImageId> PdfDocument::process_rgb_image(const rgb_image &image) {
-    std::optional<int32_t> smask_id;
+rvoe<PreparedImage> PdfDocument::prepare_rgb_image(rgb_image &image) {
+    PreparedImage prepared;
     if(image.alpha) {
-        ERC(imobj,
-            add_image_object(image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, {}, false, *image.alpha));
-        smask_id = image_info.at(imobj.id).obj;
+        prepared.smask = make_image_component(
+            image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, false, 1, std::move(*image.alpha));
     }
     switch(opts.output_colorspace) {
     case CAPYPDF_CS_DEVICE_RGB: {
-        return add_image_object(
-            image.w, image.h, 8, CAPYPDF_CS_DEVICE_RGB, smask_id, false, image.pixels);
+        prepared.image = make_image_component(
+            image.w, image.h, 8, CAPYPDF_CS_DEVICE_RGB, false, 3, std::move(image.pixels));
+        break;
     }
     case CAPYPDF_CS_DEVICE_GRAY: {
-        std::string converted_pixels = cm.rgb_pixels_to_gray(image.pixels);
-        return add_image_object(
-            image.w, image.h, 8, CAPYPDF_CS_DEVICE_RGB, smask_id, false, converted_pixels);
+        prepared.image = make_image_component(image.w,
+                                              image.h,
+                                              8,
+                                              CAPYPDF_CS_DEVICE_GRAY,
+                                              false,
+                                              1,
+                                              cm.rgb_pixels_to_gray(image.pixels));
+        break;
     }
     case CAPYPDF_CS_DEVICE_CMYK: {
         if(cm.get_cmyk().empty()) {
             RETERR(NoCmykProfile);
         }
         ERC(converted_pixels, cm.rgb_pixels_to_cmyk(image.pixels));
-        return add_image_object(
-            image.w, image.h, 8, CAPYPDF_CS_DEVICE_CMYK, smask_id, false, converted_pixels);
+        prepared.image = make_image_component(
+            image.w, image.h, 8, CAPYPDF_CS_DEVICE_CMYK, false, 4, std::move(converted_pixels));
+        break;
     }
     default:
         RETERR(Unreachable);
     }
+    return prepared;
 }
 
-rvoe<CapyPDF_ImageId> PdfDocument::process_gray_image(const gray_image &image) {
-    std::optional<int32_t> smask_id;
+PreparedImage PdfDocument::prepare_gray_image(gray_image &image) {
+    PreparedImage prepared;
 
     // Fixme: maybe do color conversion from whatever-gray to a known gray colorspace?
 
     if(image.alpha) {
-        ERC(imgobj,
-            add_image_object(image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, {}, false, *image.alpha));
-        smask_id = image_info.at(imgobj.id).obj;
+        prepared.smask = make_image_component(
+            image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, false, 1, std::move(*image.alpha));
     }
-    return add_image_object(
-        image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, smask_id, false, image.pixels);
+    prepared.image = make_image_component(
+        image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, false, 1, std::move(image.pixels));
+    return prepared;
 }
 
-rvoe<CapyPDF_ImageId> PdfDocument::process_cmyk_image(const cmyk_image &image) {
-    std::optional<int32_t> smask_id;
-    ColorspaceType cs;
+PreparedImage PdfDocument::prepare_mono_image(mono_image &image) {
+    PreparedImage prepared;
+    if(image.alpha) {
+        prepared.smask = make_image_component(
+            image.w, image.h, 1, CAPYPDF_CS_DEVICE_GRAY, false, 1, std::move(*image.alpha));
+    }
+    prepared.image = make_image_component(
+        image.w, image.h, 1, CAPYPDF_CS_DEVICE_GRAY, false, 1, std::move(image.pixels));
+    return prepared;
+}
+
+PreparedImage PdfDocument::prepare_cmyk_image(cmyk_image &image) {
+    PreparedImage prepared;
+    if(image.alpha) {
+        prepared.smask = make_image_component(
+            image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, false, 1, std::move(*image.alpha));
+    }
+    std::optional<ColorspaceType> cs;
     if(image.icc) {
-        auto oldicc = find_icc_profile(*image.icc);
-        if(oldicc) {
-            cs = icc_profiles.at(oldicc->id).object_num;
-        } else {
-            auto icc_obj = store_icc_profile(*image.icc, 4);
-            cs = icc_profiles.at(icc_obj.id).object_num;
-        }
+        // The profile is stored when the image is added to the document.
+        prepared.icc = std::move(image.icc);
     } else {
         cs = CAPYPDF_CS_DEVICE_CMYK;
     }
-    if(image.alpha) {
-        ERC(imobj,
-            add_image_object(image.w, image.h, 8, CAPYPDF_CS_DEVICE_GRAY, {}, false, *image.alpha));
-        smask_id = image_info.at(imobj.id).obj;
-    }
-    return add_image_object(image.w, image.h, 8, cs, smask_id, false, image.pixels);
+    prepared.image =
+        make_image_component(image.w, image.h, 8, cs, false, 4, std::move(image.pixels));
+    return prepared;
 }
 
 rvoe<CapyPDF_ImageId> PdfDocument::embed_jpg(const std::filesystem::path &fname) {
+    PhaseTimer timer(phase_stats(CAPY_PHASE_IMAGES));
     ERC(jpg, load_jpg(fname));
+    ERC(file_hash, hash_file(jpg.path));
+    const ContentKey key{ContentKind::Jpeg, file_hash};
+    auto existing = content_index.find(key);
+    if(existing != content_index.end()) {
+        ERC(same, files_equal(jpeg_files.at(existing->second), jpg.path));
+        if(same) {
+            return CapyPDF_ImageId{existing->second};
+        }
+    }
+    const char *colorspace = jpg.num_components == 1   ? "/DeviceGray"
+                             : jpg.num_components == 3 ? "/DeviceRGB"
+                                                       : "/DeviceCMYK";
     std::string buf;
-    fmt::format_to(std::back_inserter(buf),
+    auto app = std::back_inserter(buf);
+    fmt::format_to(app,
                    R"(<<
   /Type /XObject
   /Subtype /Image
-  /ColorSpace /DeviceRGB
+  /ColorSpace {}
   /Width {}
   /Height {}
   /BitsPerComponent 8
   /Length {}
   /Filter /DCTDecode
->>
 )",
+                   colorspace,
                    jpg.w,
                    jpg.h,
-                   jpg.file_contents.length());
-    auto im_id = add_object(FullPDFObject{std::move(buf), std::move(jpg.file_contents)});
+                   jpg.file_size);
+    if(jpg.inverted_cmyk) {
+        buf += "  /Decode [ 1 0 1 0 1 0 1 0 ]\n";
+    }
+    buf += ">>\n";
+    auto im_id =
+        add_object(FileStreamPDFObject{std::move(buf), jpg.path, jpg.file_size, jpg.mtime});
     image_info.emplace_back(ImageInfo{{jpg.w, jpg.h}, im_id});
+    content_index[key] = (int32_t)image_info.size() - 1;
+    jpeg_files[content_index[key]] = std::move(jpg.path);
+    if(auto *phase = phase_stats(CAPY_PHASE_IMAGES)) {
+        ++phase->count;
+        phase->bytes += jpg.file_size;
+    }
+    ERCV(flush_object(im_id));
     return CapyPDF_ImageId{(int32_t)image_info.size() - 1};
 }
 
@@ -1748,90 +3332,27 @@ ShadingId PdfDocument::add_shading(const ShadingType3 &shade) {
 }
 
 ShadingId PdfDocument::add_shading(const ShadingType4 &shade) {
-    const int shadingtype = 4;
-    std::string serialized = serialize_shade4(shade);
-    std::string buf = fmt::format(
-        R"(<<
-  /ShadingType {}
-  /ColorSpace {}
-  /BitsPerCoordinate 32
-  /BitsPerComponent 16
-  /BitsPerFlag 8
-  /Decode [
-    {} {}
-    {} {}
-    {} {}
-    {} {}
-    {} {}
-  ]
-  /Length {}
->>
-)",
-        shadingtype,
-        colorspace_names.at((int)shade.colorspace),
-        shade.minx,
-        shade.maxx,
-        shade.miny,
-        shade.maxy,
-        0,
-        1,
-        0,
-        1,
-        0,
-        1,
-        serialized.length());
-
-    return ShadingId{add_object(FullPDFObject{std::move(buf), std::move(serialized)})};
+    return ShadingId{add_object(DeflatePDFObject{
+        mesh_shading_dict(4, shade), serialize_shade4(shade), CAPY_STREAM_OTHER})};
 }
 
 ShadingId PdfDocument::add_shading(const ShadingType6 &shade) {
-    const int shadingtype = 6;
-    std::string serialized = serialize_shade6(shade);
-    std::string buf = fmt::format(
-        R"(<<
-  /ShadingType {}
-  /ColorSpace {}
-  /BitsPerCoordinate 32
-  /BitsPerComponent 16
-  /BitsPerFlag 8
-  /Decode [
-    {} {}
-    {} {}
-    {} {}
-    {} {}
-    {} {}
-  ]
-  /Length {}
->>
-)",
-        shadingtype,
-        colorspace_names.at((int)shade.colorspace),
-        shade.minx,
-        shade.maxx,
-        shade.miny,
-        shade.maxy,
-        0,
-        1,
-        0,
-        1,
-        0,
-        1,
-        serialized.length());
-
-    return ShadingId{add_object(FullPDFObject{std::move(buf), std::move(serialized)})};
+    return ShadingId{add_object(DeflatePDFObject{
+        mesh_shading_dict(6, shade), serialize_shade6(shade), CAPY_STREAM_OTHER})};
 }
 
-PatternId PdfDocument::add_pattern(std::string_view pattern_dict, std::string_view commands) {
-    return PatternId{add_object(FullPDFObject{std::string(pattern_dict), std::string(commands)})};
+rvoe<PatternId> PdfDocument::add_pattern(std::string_view pattern_dict,
+                                         std::string_view commands) {
+    const auto pattern_num = add_object(DeflatePDFObject{
+        std::string(pattern_dict), std::string(commands), CAPY_STREAM_PAGE_CONTENT});
+    ERCV(flush_object(pattern_num));
+    return PatternId{pattern_num};
 }
 
 OutlineId PdfDocument::add_outline(std::string_view title_utf8,
                                    PageId dest,
                                    std::optional<OutlineId> parent) {
     const auto cur_id = (int32_t)outlines.items.size();
-    const auto par_id = parent.value_or(OutlineId{-1}).id;
-    outlines.parent[cur_id] = par_id;
-    outlines.children[par_id].push_back(cur_id);
     outlines.items.emplace_back(Outline{std::string{title_utf8}, dest, parent});
     return OutlineId{cur_id};
 }
@@ -1851,22 +3372,38 @@ rvoe<CapyPDF_FormWidgetId> PdfDocument::create_form_checkbox(PdfBox loc,
 
 rvoe<CapyPDF_EmbeddedFileId> PdfDocument::embed_file(const std::filesystem::path &fname) {
     ERC(contents, load_file(fname));
-    std::string dict = fmt::format(R"(<<
-  /Type /EmbeddedFile
-  /Length {}
->>)",
-                                   contents.size());
-    auto fileobj_id = add_object(FullPDFObject{std::move(dict), std::move(contents)});
-    dict = fmt::format(R"(<<
+    const auto filename = fname.filename().string();
+    ContentHasher hasher;
+    // The file name is part of the file specification so it must match too.
+    hasher.update_value(filename.size());
+    hasher.update(filename);
+    hasher.update(contents);
+    const ContentKey key{ContentKind::EmbeddedFile, hasher.digest()};
+    auto filespec_dict = [&filename](int32_t contents_obj) {
+        return fmt::format(R"(<<
   /Type /Filespec
   /F {}
   /EF << /F {} 0 R >>
 >>
 )",
-                       pdfstring_quote(fname.filename().string()),
-                       fileobj_id);
-    auto filespec_id = add_object(FullPDFObject{std::move(dict), ""});
+                           pdfstring_quote(filename),
+                           contents_obj);
+    };
+    auto existing = content_index.find(key);
+    if(existing != content_index.end()) {
+        const auto &stored = embedded_files.at(existing->second);
+        if(held_stream_equals(stored.contents_obj, contents) &&
+           held_object_equals(stored.filespec_obj, filespec_dict(stored.contents_obj), "")) {
+            return CapyPDF_EmbeddedFileId{existing->second};
+        }
+    }
+    auto fileobj_id = add_object(DeflatePDFObject{
+        "<<\n  /Type /EmbeddedFile\n", std::move(contents), CAPY_STREAM_EMBEDDED_FILE});
+    auto filespec_id = add_object(FullPDFObject{filespec_dict(fileobj_id), ""});
     embedded_files.emplace_back(EmbeddedFileObject{filespec_id, fileobj_id});
+    content_index[key] = (int32_t)embedded_files.size() - 1;
+    ERCV(flush_object(fileobj_id));
+    ERCV(flush_object(filespec_id));
     return CapyPDF_EmbeddedFileId{(int32_t)embedded_files.size() - 1};
 }
 
@@ -1892,7 +3429,9 @@ PdfDocument::add_structure_item(std::string_view stype,
     }
     auto stritem_id = (int32_t)structure_items.size();
     auto obj_id = add_object(DelayedStructItem{stritem_id});
+    structure_kid_log.emplace_back(StructureKid{parent, false, stritem_id});
     structure_items.push_back(StructItem{obj_id, std::string(stype), parent});
+    structure_use.push_back(-1);
     return CapyPDF_StructureItemId{(int32_t)structure_items.size() - 1};
 }
 
@@ -1919,52 +3458,97 @@ PdfDocument::add_transparency_group(PdfDrawContext &ctx, const TransparencyGroup
     }
     auto sc_var = ctx.serialize(ex);
     auto &d = std::get<SerializedXObject>(sc_var);
-    auto objid = add_object(FullPDFObject{std::move(d.dict), std::move(d.stream)});
+    auto objid = add_object(
+        DeflatePDFObject{std::move(d.dict), std::move(d.stream), CAPY_STREAM_PAGE_CONTENT});
     transparency_groups.push_back(objid);
+    ERCV(flush_object(objid));
     return CapyPDF_TransparencyGroupId{(int32_t)transparency_groups.size() - 1};
 }
 
 std::optional<double>
 PdfDocument::glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const {
-    FT_Face face = fonts.at(fid.id).fontdata.face.get();
-    FT_Set_Char_Size(face, 0, pointsize * 64, 300, 300);
-    if(FT_Load_Char(face, codepoint, FT_LOAD_NO_HINTING | FT_LOAD_NO_BITMAP) != 0) {
+    if(fid.id < 0 || (size_t)fid.id >= font_objects.size()) {
+        return {};
+    }
+    auto lk = lock_fonts();
+    auto *metrics = font_metrics(fid);
+    if(!metrics) {
+        return {};
+    }
+    const auto adv = metrics->advance(codepoint);
+    if(!adv) {
         return {};
     }
-    const auto font_unit_advance = face->glyph->metrics.horiAdvance;
-    return (font_unit_advance / 64.0) / 300.0 * 72.0;
+    return *adv * pointsize / metrics->units_per_em();
+}
+
+rvoe<double> PdfDocument::text_advances(CapyPDF_FontId fid,
+                                        double pointsize,
+                                        std::span<const uint32_t> codepoints,
+                                        std::span<double> advances) const {
+    CHECK_INDEXNESS_V(fid.id, font_objects);
+    if(!advances.empty() && advances.size() != codepoints.size()) {
+        RETERR(IndexOutOfBounds);
+    }
+    auto lk = lock_fonts();
+    auto *metrics = font_metrics(fid);
+    if(!metrics) {
+        RETERR(BuiltinFontNotSupported);
+    }
+    const double scale = pointsize / metrics->units_per_em();
+    int64_t total = 0;
+    uint32_t previous_codepoint = -1;
+    for(size_t i = 0; i < codepoints.size(); ++i) {
+        const auto codepoint = codepoints[i];
+        const auto adv = metrics->advance(codepoint);
+        if(!adv) {
+            RETERR(FreeTypeError);
+        }
+        int64_t w = *adv;
+        if(previous_codepoint != (uint32_t)-1) {
+            w += metrics->kerning(previous_codepoint, codepoint);
+        }
+        if(!advances.empty()) {
+            advances[i] = w * scale;
+        }
+        total += w;
+        previous_codepoint = codepoint;
+    }
+    return total * scale;
 }
 
-rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem::path &fname) {
-    ERC(fontdata, load_and_parse_truetype_font(fname));
-    TtfFont ttf{std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)>{nullptr, guarded_face_close},
-                std::move(fontdata)};
-    FT_Face face;
-    auto error = FT_New_Face(ft, fname.string().c_str(), 0, &face);
-    if(error) {
-        // By default Freetype is compiled without
-        // error strings. Yay!
-        RETERR(FreeTypeError);
+GlyphMetrics *PdfDocument::font_metrics(CapyPDF_FontId fid) const {
+    const auto font_index = font_objects.at(fid.id).font_index_tmp;
+    if(font_index == size_t(-1)) {
+        return nullptr;
     }
-    ttf.face.reset(face);
+    return &fonts.at(font_index).metrics;
+}
+
+rvoe<CapyPDF_FontId> PdfDocument::load_font(PdfResourceContext &resources,
+                                            const std::filesystem::path &fname) {
+    ERC(fontdata, FontCache::instance().get_font(fname));
+    ERC(face_handle, resources.open_face(fontdata->font.storage));
+    TtfFont ttf{std::move(face_handle), fontdata};
+    FT_Face face = ttf.face.get();
 
     const char *font_format = FT_Get_Font_Format(face);
     if(!font_format) {
         RETERR(UnsupportedFormat);
     }
-    if(strcmp(font_format,
-              "TrueType")) { // != 0 &&
-                             // strcmp(font_format,
-                             // "CFF") != 0) {
+    const bool is_cff = fontdata->font.is_cff();
+    if(strcmp(font_format, is_cff ? "CFF" : "TrueType") != 0) {
         fprintf(stderr,
-                "Only TrueType fonts are supported. %s "
+                "Only TrueType and OpenType CFF fonts are supported. %s "
                 "is a %s font.",
                 fname.string().c_str(),
                 font_format);
         RETERR(UnsupportedFormat);
     }
     FT_Bytes base = nullptr;
-    error = FT_OpenType_Validate(face, FT_VALIDATE_BASE, &base, nullptr, nullptr, nullptr, nullptr);
+    auto error = is_cff ? 1
+                        : FT_OpenType_Validate(
+                              face, FT_VALIDATE_BASE, &base, nullptr, nullptr, nullptr, nullptr);
     if(!error) {
         fprintf(stderr,
                 "Font file %s is an OpenType font. "
@@ -1976,8 +3560,11 @@ rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem
         RETERR(UnsupportedFormat);
     }
     auto font_source_id = fonts.size();
-    ERC(fss, FontSubsetter::construct(fname, face));
-    fonts.emplace_back(FontThingy{std::move(ttf), std::move(fss)});
+    // CFF fonts are embedded as CIDFontType0, which has no simple font variant.
+    const auto subset_type =
+        (opts.cid_fonts || is_cff) ? FontSubsetType::CID : FontSubsetType::Simple;
+    ERC(fss, FontSubsetter::construct(std::move(fontdata), face, subset_type));
+    fonts.emplace_back(FontThingy{std::move(ttf), std::move(fss), GlyphMetrics(face)});
 
     const int32_t subset_num = 0;
     auto subfont_data_obj =
@@ -1986,9 +3573,16 @@ rvoe<CapyPDF_FontId> PdfDocument::load_font(FT_Library ft, const std::filesystem
         CapyPDF_FontId{(int32_t)font_source_id}, subfont_data_obj, subset_num});
     auto subfont_cmap_obj =
         add_object(DelayedSubsetCMap{CapyPDF_FontId{(int32_t)font_source_id}, subset_num});
-    auto subfont_obj = add_object(DelayedSubsetFont{
-        CapyPDF_FontId{(int32_t)font_source_id}, subfont_descriptor_obj, subfont_cmap_obj});
-    (void)subfont_obj;
+    int32_t subfont_obj;
+    if(subset_type == FontSubsetType::CID) {
+        auto cidfont_obj = add_object(
+            DelayedCIDFont{CapyPDF_FontId{(int32_t)font_source_id}, subfont_descriptor_obj});
+        subfont_obj = add_object(DelayedType0Font{
+            CapyPDF_FontId{(int32_t)font_source_id}, cidfont_obj, subfont_cmap_obj});
+    } else {
+        subfont_obj = add_object(DelayedSubsetFont{
+            CapyPDF_FontId{(int32_t)font_source_id}, subfont_descriptor_obj, subfont_cmap_obj});
+    }
     CapyPDF_FontId fid{(int32_t)fonts.size() - 1};
     font_objects.push_back(
         FontInfo{subfont_data_obj, subfont_descriptor_obj, subfont_obj, fonts.size() - 1});
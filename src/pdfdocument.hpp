@@ -16,12 +16,18 @@
 
 #pragma once
 
+#include <array>
 #include <filesystem>
 #include <optional>
 #include <pdfcommon.hpp>
 #include <fontsubsetter.hpp>
 #include <pdfcolorconverter.hpp>
+#include <bufferedwriter.hpp>
+#include <utils.hpp>
 #include <imageops.hpp>
+#include <idset.hpp>
+#include <resourcecontext.hpp>
+#include <glyphmetrics.hpp>
 
 #include <string_view>
 #include <vector>
@@ -30,6 +36,8 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
+#include <span>
+#include <mutex>
 #include <variant>
 
 // To avoid pulling all of LittleCMS in this file.
@@ -37,21 +45,27 @@ typedef void *cmsHPROFILE;
 // Ditto for Freetype
 typedef struct FT_LibraryRec_ *FT_Library;
 typedef struct FT_FaceRec_ *FT_Face;
-typedef int FT_Error;
-
-FT_Error guarded_face_close(FT_Face face);
 
 namespace capypdf {
 
 struct TtfFont {
-    std::unique_ptr<FT_FaceRec_, FT_Error (*)(FT_Face)> face;
-    TrueTypeFontFile fontdata;
+    FaceHandle face;
+    std::shared_ptr<const CachedFontFile> fontdata;
 };
 
 struct PageOffsets {
     int32_t resource_obj_num;
     int32_t commands_obj_num;
     int32_t page_obj_num;
+    // Set when the page tree is created.
+    int32_t parent_obj_num = -1;
+    bool inherits_resources = false;
+};
+
+// The kids of the root /Pages object.
+struct PageTreeRoot {
+    std::vector<int32_t> kids;
+    std::optional<int32_t> resources;
 };
 
 struct ImageSize {
@@ -59,6 +73,13 @@ struct ImageSize {
     int32_t h;
 };
 
+// Limits the resolution of an image that is going to be drawn at the given size.
+struct ImageResolutionLimit {
+    double width_pt;
+    double height_pt;
+    double max_dpi;
+};
+
 struct ImageInfo {
     ImageSize s;
     int32_t obj;
@@ -77,14 +98,38 @@ struct FontInfo {
 
 struct DummyIndexZero {};
 
+// An object that has already been written to the output file
+// in streaming mode. Only its offset is kept for the xref table.
+struct WrittenObject {
+    uint64_t offset;
+};
+
+// Where a dictionary that was packed into an object stream ended up.
+// A stream_obj of zero means that the object was written normally.
+struct PackedObjectLocation {
+    int32_t stream_obj = 0;
+    int32_t index = 0;
+};
+
 struct FullPDFObject {
     std::string dictionary;
     std::string stream;
 };
 
+// A stream whose contents are copied from a file when the object is written.
+struct FileStreamPDFObject {
+    std::string dictionary;
+    std::filesystem::path fname;
+    uint64_t file_size;
+    std::filesystem::file_time_type mtime;
+    // Used instead of fname for streams that were generated into a temporary file.
+    std::optional<TemporaryFile> temporary;
+};
+
 struct DeflatePDFObject {
     std::string unclosed_dictionary;
     std::string stream;
+    CAPYPDF_Stream_Category category;
 };
 
 struct DelayedSubsetFontData {
@@ -109,24 +154,47 @@ struct DelayedSubsetFont {
     int32_t subfont_cmap_obj;
 };
 
+struct DelayedCIDFont {
+    CapyPDF_FontId fid;
+    int32_t subfont_descriptor_obj;
+};
+
+struct DelayedType0Font {
+    CapyPDF_FontId fid;
+    int32_t cidfont_obj;
+    int32_t subfont_cmap_obj;
+};
+
 struct DelayedPages {};
 
+struct CompressedStream {
+    std::string data;
+    size_t uncompressed_size;
+    // Only measured when collecting statistics.
+    double subset_seconds = 0;
+    double compress_seconds = 0;
+};
+
 struct DelayedPage {
     int32_t page_num;
     std::vector<CapyPDF_FormWidgetId> used_form_widgets;
     std::vector<CapyPDF_AnnotationId> used_annotations;
     std::optional<Transition> transition;
     std::optional<int32_t> subnav_root;
+    // Key of the page's marked content in the structure parent tree.
+    std::optional<int32_t> struct_parents;
 };
 
 struct SubsetGlyph {
     FontSubset ss;
-    uint8_t glyph_id;
+    uint32_t glyph_id;
 };
 
 struct FontThingy {
     TtfFont fontdata;
     FontSubsetter subsets;
+    // Filled in by text measurement, which is logically const.
+    mutable GlyphMetrics metrics;
 };
 
 struct ColorProfiles {
@@ -135,6 +203,19 @@ struct ColorProfiles {
     std::filesystem::path cmyk_profile_file;
 };
 
+// Zlib compression level per stream category. Zero means that
+// the stream is written out uncompressed.
+struct CompressionLevels {
+    int32_t page_content = 0;
+    int32_t image = 9;
+    int32_t font = 9;
+    int32_t embedded_file = 0;
+    int32_t other = 9;
+
+    rvoe<int32_t> level(CAPYPDF_Stream_Category category) const;
+    rvoe<NoReturnValue> set_level(CAPYPDF_Stream_Category category, int32_t new_level);
+};
+
 struct IccInfo {
     int32_t stream_num;
     int32_t object_num;
@@ -154,6 +235,58 @@ struct PdfGenerationData {
     ColorProfiles prof;
     std::optional<CAPYPDF_Intent_Subtype> subtype;
     std::string intent_condition_identifier;
+    // Number of threads used to compress streams and generate font
+    // subsets when writing. Zero means one per hardware thread.
+    int32_t num_threads = 1;
+    CompressionLevels compression;
+    // Write pages, images and other self-contained objects to the output
+    // file as soon as they are created rather than keeping them in memory.
+    bool streaming = false;
+    // Number of converted solid colors to remember. Zero disables the cache.
+    int32_t color_cache_size = 0;
+    // Embed TrueType fonts as Identity-H encoded Type0 fonts with a single
+    // subset instead of several simple fonts of at most 255 glyphs each.
+    bool cid_fonts = false;
+    // Apply PNG predictor filters to image data before compressing it. PNG
+    // files that need no conversion are embedded without recompression.
+    bool png_predictors = false;
+    // Larger images are downsampled to fit. Zero means no limit.
+    int32_t max_image_dimension = 0;
+    // Maximum number of decimals written for numbers in content streams.
+    int32_t number_precision = 6;
+    // Leave out the indentation that shows the nesting of content stream operators.
+    bool compact_content = false;
+    // Pack dictionaries into compressed object streams and write the cross
+    // reference table as a stream. Objects already written in streaming mode
+    // are not packed.
+    bool object_streams = false;
+    // Write the catalog, the page tree and everything the first page uses
+    // at the start of the file so it can be shown before the rest has loaded.
+    // Not possible in streaming mode.
+    bool first_page_first = false;
+    // Maximum number of kids in a page tree node. Larger documents get
+    // intermediate /Pages nodes. Zero puts all pages in the root node.
+    int32_t page_tree_fanout = 32;
+    // Measure the time and bytes spent in each phase, see WriteStats.
+    bool collect_stats = false;
+    // Shared with other documents. If set, its color profiles are used instead of prof.
+    std::shared_ptr<PdfResourceContext> resources;
+};
+
+struct PhaseStats {
+    int64_t count = 0;
+    uint64_t bytes = 0;
+    double seconds = 0;
+};
+
+constexpr size_t num_write_phases = CAPY_PHASE_IMAGES + 1;
+
+struct WriteStats {
+    std::array<PhaseStats, num_write_phases> phases;
+    uint64_t compression_in = 0;
+    // Stream data of objects that have not yet been written out.
+    uint64_t held_stream_bytes = 0;
+    uint64_t peak_held_stream_bytes = 0;
 };
 
 struct Outline {
@@ -186,8 +319,20 @@ struct DelayedCheckboxWidgetAnnotation {
 
 struct OutlineData {
     std::vector<Outline> items;
-    std::unordered_map<int32_t, std::vector<int32_t>> children;
-    std::unordered_map<int32_t, int32_t> parent;
+};
+
+// Items grouped by the node they belong to, such as the children of
+// outline or structure tree nodes. Built with a single counting pass.
+struct ChildIndex {
+    // The items of node n are items[start[n], start[n + 1]) in creation order.
+    std::vector<int32_t> start;
+    std::vector<int32_t> items;
+
+    static ChildIndex build(size_t num_nodes, const std::vector<int32_t> &owners);
+
+    std::span<const int32_t> of(size_t node) const {
+        return std::span<const int32_t>(items).subspan(start[node], start[node + 1] - start[node]);
+    }
 };
 
 struct EmbeddedFileObject {
@@ -195,6 +340,26 @@ struct EmbeddedFileObject {
     int32_t contents_obj;
 };
 
+enum class ContentKind : uint8_t {
+    Image,
+    Jpeg,
+    IccProfile,
+    EmbeddedFile,
+    FormXObject,
+    ResourceDict,
+};
+
+struct ContentKey {
+    ContentKind kind;
+    ContentHash hash;
+
+    bool operator==(const ContentKey &o) const = default;
+};
+
+struct ContentKeyHash {
+    size_t operator()(const ContentKey &k) const noexcept { return k.hash.h1 ^ (size_t)k.kind; }
+};
+
 // Other types here.
 
 struct FileAttachmentAnnotation {
@@ -233,6 +398,20 @@ struct DelayedStructItem {
     CapyPDF_StructureItemId sid;
 };
 
+struct MarkedContentRef {
+    int32_t page_num;
+    int32_t mcid;
+    CapyPDF_StructureItemId sid;
+};
+
+// A kid of a structure element, either a structure item or a marked content
+// sequence, logged in the order they are added.
+struct StructureKid {
+    std::optional<CapyPDF_StructureItemId> parent;
+    bool is_marked_content;
+    int32_t index; // Into structure_items or marked_content.
+};
+
 struct StructItem {
     int32_t obj_id;
     std::string stype;
@@ -240,12 +419,16 @@ struct StructItem {
 };
 
 typedef std::variant<DummyIndexZero,
+                     WrittenObject,
                      FullPDFObject,
                      DeflatePDFObject,
+                     FileStreamPDFObject,
                      DelayedSubsetFontData,
                      DelayedSubsetFontDescriptor,
                      DelayedSubsetCMap,
                      DelayedSubsetFont,
+                     DelayedCIDFont,
+                     DelayedType0Font,
                      DelayedPages,
                      DelayedPage,
                      DelayedCheckboxWidgetAnnotation, // FIXME, convert to hold all widgets
@@ -255,6 +438,52 @@ typedef std::variant<DummyIndexZero,
 
 typedef std::variant<CapyPDF_Colorspace, int32_t> ColorspaceType;
 
+struct EncodedImageStream {
+    std::string stream;
+    bool deflated;
+    std::optional<int32_t> predictor_colors;
+    // Large streams go to a temporary file instead, in which case stream is empty.
+    std::optional<TemporaryFile> file;
+
+    uint64_t size() const { return file ? file->size : stream.size(); }
+};
+
+// An image or a soft mask that has been decoded and color converted
+// but not yet added to the document.
+struct ImageComponent {
+    ContentHash pixel_hash;
+    int32_t w;
+    int32_t h;
+    int32_t bits_per_component;
+    // Not set for images whose ICC profile has not yet been stored.
+    std::optional<ColorspaceType> colorspace;
+    bool is_mask;
+    int32_t colors;
+    std::string pixels;
+    std::optional<EncodedImageStream> encoded;
+};
+
+// What an image object was made from. Kept to check deduplication hits,
+// as the object itself may already have been written out.
+struct StoredImageContents {
+    int32_t w;
+    int32_t h;
+    int32_t bits_per_component;
+    ColorspaceType colorspace;
+    bool is_mask;
+    std::optional<int32_t> smask_id;
+    // Images that were never decoded in full keep their encoded stream instead of pixels.
+    bool encoded;
+    std::string data;
+    std::optional<TemporaryFile> file;
+};
+
+struct PreparedImage {
+    ImageComponent image;
+    std::optional<ImageComponent> smask;
+    std::optional<std::string> icc;
+};
+
 class PdfDocument {
 public:
     static rvoe<PdfDocument> construct(const PdfGenerationData &d, PdfColorConverter cm);
@@ -264,19 +493,28 @@ public:
     friend class PdfGen;
     friend class PdfDrawContext;
 
-    rvoe<NoReturnValue> write_to_file(FILE *output_file);
+    rvoe<NoReturnValue> start_streaming(OutputSink sink);
+    // In streaming mode the output goes to the sink given to start_streaming
+    // and the argument is ignored.
+    rvoe<NoReturnValue> write_to_sink(OutputSink sink);
+
+    // Empty unless collect_stats is set.
+    const WriteStats &write_stats() const { return stats; }
+    int32_t num_objects() const { return (int32_t)document_objects.size(); }
 
     // Pages
+    // page_data is only moved from if the page is added.
     rvoe<NoReturnValue> add_page(std::string resource_data,
-                                 std::string page_data,
-                                 const std::unordered_set<CapyPDF_FormWidgetId> &form_widgets,
-                                 const std::unordered_set<CapyPDF_AnnotationId> &annots,
-                                 const std::unordered_set<CapyPDF_StructureItemId> &structs,
+                                 std::string &&page_data,
+                                 const IdSet<CapyPDF_FormWidgetId> &form_widgets,
+                                 const IdSet<CapyPDF_AnnotationId> &annots,
+                                 const IdSet<CapyPDF_StructureItemId> &structs,
+                                 const std::vector<CapyPDF_StructureItemId> &marked_content,
                                  const std::optional<Transition> &transition,
                                  const std::vector<SubPageNavigation> &subnav);
 
     // Form XObjects
-    void add_form_xobject(std::string xobj_data, std::string xobj_stream);
+    rvoe<CapyPDF_FormXObjectId> add_form_xobject(std::string xobj_data, std::string xobj_stream);
 
     // Colors
     SeparationId create_separation(std::string_view name, const DeviceCMYKColor &fallback);
@@ -284,13 +522,22 @@ public:
     rvoe<CapyPDF_IccColorSpaceId> load_icc_file(const std::filesystem::path &fname);
 
     // Fonts
-    rvoe<CapyPDF_FontId> load_font(FT_Library ft, const std::filesystem::path &fname);
+    rvoe<CapyPDF_FontId> load_font(PdfResourceContext &resources,
+                                   const std::filesystem::path &fname);
     rvoe<SubsetGlyph> get_subset_glyph(CapyPDF_FontId fid, uint32_t glyph);
     uint32_t glyph_for_codepoint(FT_Face face, uint32_t ucs4);
+    // Must be held while using font faces or adding glyphs to subsets, as
+    // page draw contexts may do that in several threads at the same time.
+    std::unique_lock<std::mutex> lock_fonts() const {
+        return std::unique_lock<std::mutex>(*font_mutex);
+    }
     CapyPDF_FontId get_builtin_font_id(CapyPDF_Builtin_Fonts font);
 
     // Images
-    rvoe<CapyPDF_ImageId> load_image(const std::filesystem::path &fname);
+    rvoe<CapyPDF_ImageId> load_image(const std::filesystem::path &fname,
+                                     const std::optional<ImageResolutionLimit> &placement = {});
+    // Decodes and compresses the images in parallel. The ids are in the same order as the files.
+    rvoe<std::vector<CapyPDF_ImageId>> load_images(std::span<const std::filesystem::path> fnames);
     rvoe<CapyPDF_ImageId> load_mask_image(const std::filesystem::path &fname);
     rvoe<CapyPDF_ImageId> embed_jpg(const std::filesystem::path &fname);
 
@@ -307,7 +554,7 @@ public:
     ShadingId add_shading(const ShadingType6 &shade);
 
     // Patterns
-    PatternId add_pattern(std::string_view pattern_dict, std::string_view commands);
+    rvoe<PatternId> add_pattern(std::string_view pattern_dict, std::string_view commands);
 
     // Outlines
     OutlineId
@@ -338,14 +585,37 @@ public:
 
     std::optional<double>
     glyph_advance(CapyPDF_FontId fid, double pointsize, uint32_t codepoint) const;
+    // Width of the codepoints drawn one after the other, including kerning. If
+    // advances is not empty, it must be as long as codepoints and gets the
+    // advance of each codepoint plus its kerning against the previous one.
+    rvoe<double> text_advances(CapyPDF_FontId fid,
+                               double pointsize,
+                               std::span<const uint32_t> codepoints,
+                               std::span<double> advances) const;
 
 private:
+    // Null for builtin fonts.
+    GlyphMetrics *font_metrics(CapyPDF_FontId fid) const;
+
     PdfDocument(const PdfGenerationData &d, PdfColorConverter cm);
     rvoe<NoReturnValue> init();
 
-    rvoe<NoReturnValue> write_to_file_impl();
+    rvoe<NoReturnValue> write_to_sink_impl();
 
     int32_t add_object(ObjectType object);
+    rvoe<NoReturnValue> flush_object(int32_t object_num);
+    // Content hashes only find candidates for reuse. This confirms a match
+    // byte by byte. Objects that have already been written are no longer
+    // in memory and never match.
+    bool held_object_equals(int32_t object_num,
+                            std::string_view dictionary,
+                            std::string_view stream) const;
+    bool held_stream_equals(int32_t object_num, std::string_view stream) const;
+    std::vector<int32_t> object_references(int32_t object_num) const;
+    std::vector<int32_t> object_write_order() const;
+
+    std::string take_stream_buffer();
+    void recycle_stream_buffer(std::string &&buf);
 
     int32_t create_subnavigation(const std::vector<SubPageNavigation> &subnav);
 
@@ -366,15 +636,22 @@ private:
     rvoe<int32_t> create_name_dict();
     rvoe<int32_t> create_outlines();
     void create_structure_root_dict();
+    int32_t create_structure_parent_tree();
     std::vector<int32_t> write_pages();
     rvoe<NoReturnValue> write_delayed_page(const DelayedPage &p);
 
+    void create_page_tree();
     rvoe<NoReturnValue> write_pages_root();
     rvoe<NoReturnValue> write_header();
     rvoe<NoReturnValue> generate_info_object();
     rvoe<NoReturnValue> write_cross_reference_table(const std::vector<uint64_t> &object_offsets);
     rvoe<NoReturnValue> write_trailer(int64_t xref_offset);
+    rvoe<NoReturnValue> write_cross_reference_stream(const std::vector<uint64_t> &object_offsets);
+    rvoe<NoReturnValue> pack_object(int32_t object_number, std::string_view dict_data);
+    rvoe<NoReturnValue> flush_object_stream();
 
+    // Writes the object header and dictionary, ending with a newline.
+    rvoe<NoReturnValue> write_object_start(int32_t object_number, std::string_view dict_data);
     rvoe<NoReturnValue> write_finished_object(int32_t object_number,
                                               std::string_view dict_data,
                                               std::string_view stream_data);
@@ -384,8 +661,21 @@ private:
         return write_bytes(view.data(), view.size());
     }
 
+    rvoe<CompressedStream> compress_object(int32_t object_num) const;
+    // Null when not collecting statistics.
+    PhaseStats *phase_stats(CAPYPDF_Write_Phase phase);
+    void record_compression(const CompressedStream &compressed, bool is_font);
+    void record_held_stream(int64_t delta);
+    rvoe<NoReturnValue> write_file_stream_object(int32_t object_num,
+                                                 const FileStreamPDFObject &pobj);
+    rvoe<NoReturnValue> write_uncompressed_object(int32_t object_num,
+                                                  const DeflatePDFObject &pobj);
+    rvoe<NoReturnValue> write_deflate_object(int32_t object_num,
+                                             const DeflatePDFObject &pobj,
+                                             const CompressedStream &compressed);
     rvoe<NoReturnValue> write_subset_font_data(int32_t object_num,
-                                               const DelayedSubsetFontData &ssfont);
+                                               const CompressedStream &font_data,
+                                               bool is_cff);
     void write_subset_font_descriptor(int32_t object_num,
                                       const TtfFont &font,
                                       int32_t font_data_obj,
@@ -396,6 +686,12 @@ private:
                                           int32_t subset,
                                           int32_t font_descriptor_obj,
                                           int32_t tounicode_obj);
+    rvoe<NoReturnValue>
+    write_cid_font(int32_t object_num, const FontThingy &font, int32_t font_descriptor_obj);
+    rvoe<NoReturnValue> write_type0_font(int32_t object_num,
+                                         const FontThingy &font,
+                                         int32_t cidfont_obj,
+                                         int32_t tounicode_obj);
     rvoe<NoReturnValue> write_checkbox_widget(int obj_num,
                                               const DelayedCheckboxWidgetAnnotation &checkbox);
     rvoe<NoReturnValue> write_annotation(int obj_num, const DelayedAnnotation &annotation);
@@ -408,15 +704,37 @@ private:
                                            std::optional<int32_t> smask_id,
                                            bool is_mask,
                                            std::string_view uncompressed_bytes);
-
-    rvoe<CapyPDF_ImageId> process_rgb_image(const rgb_image &image);
-    rvoe<CapyPDF_ImageId> process_gray_image(const gray_image &image);
-    rvoe<CapyPDF_ImageId> process_mono_image(const mono_image &image);
-    rvoe<CapyPDF_ImageId> process_cmyk_image(const cmyk_image &image);
-
+    rvoe<CapyPDF_ImageId> add_image_component(ImageComponent &component,
+                                              std::optional<int32_t> smask_id);
+    rvoe<EncodedImageStream> encode_image_component(const ImageComponent &component) const;
+    std::string image_dictionary(const ImageComponent &component,
+                                 std::optional<int32_t> smask_id) const;
+    rvoe<CapyPDF_ImageId> store_image_object(const ContentKey &key,
+                                             ImageComponent &component,
+                                             std::optional<int32_t> smask_id);
+    rvoe<int32_t> image_color_count(const ColorspaceType &colorspace, bool is_mask) const;
+    rvoe<std::optional<ImageComponent>>
+    png_passthrough_component(const std::filesystem::path &fname,
+                              const std::optional<ImageSize> &max_size);
+
+    // These do not modify the document, so they can be run in several threads at once.
+    rvoe<PreparedImage> prepare_image(const std::filesystem::path &fname,
+                                      bool encode,
+                                      const std::optional<ImageSize> &max_size);
+    rvoe<std::optional<PreparedImage>>
+    prepare_streamed_tif(const std::filesystem::path &fname,
+                         const std::optional<ImageSize> &max_size);
+    rvoe<PreparedImage> prepare_rgb_image(rgb_image &image);
+    PreparedImage prepare_gray_image(gray_image &image);
+    PreparedImage prepare_mono_image(mono_image &image);
+    PreparedImage prepare_cmyk_image(cmyk_image &image);
+    rvoe<CapyPDF_ImageId> register_image(PreparedImage &prepared);
+
+    std::optional<ImageSize>
+    image_size_limit(const std::optional<ImageResolutionLimit> &placement) const;
+    size_t worker_thread_count() const;
     int32_t create_page_group();
     void pad_subset_fonts();
-    void pad_subset_until_space(std::vector<TTGlyphs> &subset_glyphs);
 
     PdfGenerationData opts;
     PdfColorConverter cm;
@@ -432,6 +750,15 @@ private:
     std::vector<FormXObjectInfo> form_xobjects;
     std::vector<int32_t> form_widgets;
     std::vector<EmbeddedFileObject> embedded_files;
+    // Maps the contents of images, ICC profiles and embedded files to their ids.
+    // Hits are checked against the stored bytes before they are reused.
+    std::unordered_map<ContentKey, int32_t, ContentKeyHash> content_index;
+    // Shared page resource dictionaries by object number. Streamed objects
+    // are gone by the time a later page looks them up, so keep a copy.
+    std::unordered_map<int32_t, std::string> resource_dicts;
+    // The same for images by image id, and the files of embedded JPEG images.
+    std::unordered_map<int32_t, StoredImageContents> image_contents;
+    std::unordered_map<int32_t, std::filesystem::path> jpeg_files;
     std::vector<int32_t> annotations;
     std::vector<StructItem> structure_items;
     std::vector<int32_t> ocg_items;
@@ -439,14 +766,41 @@ private:
     // A form widget can be used on one and only one page.
     std::unordered_map<CapyPDF_FormWidgetId, int32_t> form_use;
     std::unordered_map<CapyPDF_AnnotationId, int32_t> annotation_use;
-    std::unordered_map<CapyPDF_StructureItemId, int32_t> structure_use;
+    // The page object of every structure item, -1 if it is not used.
+    std::vector<int32_t> structure_use;
+    // Every marked content sequence of every page, in page and MCID order.
+    std::vector<MarkedContentRef> marked_content;
+    std::vector<StructureKid> structure_kid_log;
+    // Filled in when the structure tree root is created. Node structure_items.size()
+    // is the root. The items index structure_kid_log.
+    ChildIndex structure_kids;
     std::optional<CapyPDF_IccColorSpaceId> output_profile;
     std::optional<int32_t> output_intent_object;
     std::optional<int32_t> structure_root_object;
     int32_t pages_object;
+    PageTreeRoot page_tree_root;
     int32_t page_group_object;
 
-    FILE *ofile = nullptr;
+    std::unique_ptr<BufferedWriter> ofile;
+    bool is_streaming = false;
+    // Page command buffers whose contents have already been written out.
+    // Draw contexts reuse these instead of growing a new buffer for every page.
+    std::vector<std::string> spare_stream_buffers;
+    size_t last_page_stream_size = 0;
+
+    // Object stream state, only used while writing with object_streams enabled.
+    // Object streams are numbered after all document objects.
+    bool packing_objects = false;
+    int32_t first_object_stream_num = 0;
+    std::vector<PackedObjectLocation> packed_objects;
+    std::vector<uint64_t> object_stream_offsets;
+    std::string objstm_index;
+    std::string objstm_body;
+    int32_t objstm_count = 0;
+
+    WriteStats stats;
+    // Behind a pointer to keep the document movable.
+    std::unique_ptr<std::mutex> font_mutex = std::make_unique<std::mutex>();
 };
 
 } // namespace capypdf
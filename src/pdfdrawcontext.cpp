@@ -23,19 +23,36 @@
 #include <utils.hpp>
 #include <lcms2.h>
 #include <fmt/core.h>
+#include <algorithm>
 #include <array>
 #include <cmath>
+#include <limits>
 #include <cassert>
 #include <memory>
 
 namespace capypdf {
 
+namespace {
+
+// Ids, line caps and joins travel in command buffers as doubles. Anything
+// that is not a non-negative integer can not be one of them.
+std::optional<int32_t> buffer_int_operand(double value) {
+    if(!(value >= 0 && value <= std::numeric_limits<int32_t>::max()) ||
+       value != std::trunc(value)) {
+        return {};
+    }
+    return (int32_t)value;
+}
+
+} // namespace
+
 GstatePopper::~GstatePopper() { ctx->cmd_Q(); }
 
 PdfDrawContext::PdfDrawContext(
     PdfDocument *doc, PdfColorConverter *cm, CAPYPDF_Draw_Context_Type dtype, double w, double h)
     : doc(doc), cm(cm), context_type{dtype}, cmd_appender(commands), form_xobj_w{w},
-      form_xobj_h{h} {}
+      form_xobj_h{h}, number_precision{doc->opts.number_precision},
+      indent_content{!doc->opts.compact_content} {}
 
 PdfDrawContext::~PdfDrawContext() {}
 
@@ -58,15 +75,12 @@ DCSerialization PdfDrawContext::serialize(const TransparencyGroupExtra *trinfo)
   /Subtype /Form
   /BBox [ {:f} {:f} {:f} {:f} ]
   /Resources {}
-  /Length {}
->>
 )",
             0.0,
             0.0,
             form_xobj_w,
             form_xobj_h,
-            sc.dict,
-            commands.size());
+            sc.dict);
         return SerializedXObject{std::move(dict), commands};
     } else if(context_type == CAPY_DC_TRANSPARENCY_GROUP) {
         std::string dict = R"(<<
@@ -90,42 +104,70 @@ DCSerialization PdfDrawContext::serialize(const TransparencyGroupExtra *trinfo)
         fmt::format_to(app,
                        R"(  >>
   /Resources {}
-  /Length {}
->>
 )",
-                       sc.dict,
-                       commands.size());
+                       sc.dict);
         return SerializedXObject{std::move(dict), commands};
     } else {
-        sc.commands = fmt::format(
-            R"(<<
-  /Length {}
->>
-stream
-{}
-endstream
-)",
-            commands.size(),
-            commands);
+        // The page is consumed by the document, so hand the buffer over
+        // instead of copying it and continue with a recycled one.
+        sc.commands = std::move(commands);
+        commands = doc->take_stream_buffer();
     }
     return sc;
 }
 
+void PdfDrawContext::restore_commands(std::string &&buf) {
+    doc->recycle_stream_buffer(std::move(commands));
+    commands = std::move(buf);
+}
+
+rvoe<NoReturnValue> PdfDrawContext::resolve_deferred_glyphs() {
+    if(deferred_glyphs.empty()) {
+        return NoReturnValue{};
+    }
+    auto fonts_lock = doc->lock_fonts();
+    std::string resolved = doc->take_stream_buffer();
+    size_t pos = 0;
+    int32_t current_subset = -1;
+    for(auto &d : deferred_glyphs) {
+        resolved.append(commands, pos, d.offset - pos);
+        pos = d.offset;
+        if(d.code_only) {
+            ERCV(append_glyph_code(resolved, d.font, std::get<uint32_t>(d.chars.front())));
+            continue;
+        }
+        if(!d.continues) {
+            current_subset = -1;
+        }
+        ERCV(serialize_charsequence(
+            d.chars, resolved, d.font, current_subset, d.pointsize, d.ind));
+    }
+    resolved.append(commands, pos);
+    doc->recycle_stream_buffer(std::move(commands));
+    commands = std::move(resolved);
+    deferred_glyphs.clear();
+    return NoReturnValue{};
+}
+
 void PdfDrawContext::clear() {
     commands.clear();
     used_images.clear();
     used_subset_fonts.clear();
-    used_fonts.clear();
+    used_builtin_fonts.clear();
     used_colorspaces.clear();
     used_gstates.clear();
     used_shadings.clear();
     used_patterns.clear();
+    used_form_xobjects.clear();
     used_widgets.clear();
     used_annotations.clear();
+    used_structures.clear();
+    marked_content.clear();
     used_ocgs.clear();
     used_trgroups.clear();
     ind.clear();
     sub_navigations.clear();
+    deferred_glyphs.clear();
     transition.reset();
     is_finalized = false;
     uses_all_colorspace = false;
@@ -155,10 +197,14 @@ std::string PdfDrawContext::build_resource_dict() {
         }
         resources += "  >>\n";
     }
-    if(!used_fonts.empty() || !used_subset_fonts.empty()) {
+    if(!used_builtin_fonts.empty() || !used_subset_fonts.empty()) {
         resources += "  /Font <<\n";
-        for(const auto &i : used_fonts) {
-            fmt::format_to(resource_appender, "    /Font{} {} 0 R\n", i, i);
+        // Builtin font objects are created here rather than when drawing,
+        // so contexts filled in other threads do not add document objects.
+        for(const auto &i : used_builtin_fonts) {
+            const auto fid = doc->get_builtin_font_id((CapyPDF_Builtin_Fonts)i);
+            fmt::format_to(
+                resource_appender, "    /BFont{} {} 0 R\n", i, doc->font_object_number(fid));
         }
         for(const auto &i : used_subset_fonts) {
             const auto &bob = doc->font_objects.at(i.fid.id);
@@ -213,19 +259,206 @@ std::string PdfDrawContext::build_resource_dict() {
     return resources;
 }
 
+ErrorCode PdfDrawContext::execute_buffer(std::span<const uint8_t> ops,
+                                         std::span<const double> args) {
+    // Number of operands of each CAPYPDF_Draw_Op.
+    static constexpr uint8_t num_operands[] = {
+        0, // b
+        0, // B
+        0, // bstar
+        0, // Bstar
+        6, // c
+        6, // cm
+        1, // Do
+        0, // EMC
+        0, // f
+        0, // fstar
+        1, // G
+        1, // g
+        0, // h
+        1, // i
+        1, // j
+        1, // J
+        4, // K
+        4, // k
+        2, // l
+        2, // m
+        1, // M
+        0, // n
+        0, // q
+        0, // Q
+        4, // re
+        3, // RG
+        3, // rg
+        0, // s
+        0, // S
+        4, // v
+        1, // w
+        0, // W
+        0, // Wstar
+        4, // y
+        1, // draw_image
+    };
+    // Check the shape of the whole buffer first so that a malformed one
+    // does not leave partial output behind.
+    size_t total_operands = 0;
+    for(const auto op : ops) {
+        if(op >= std::size(num_operands)) {
+            return ErrorCode::BadCommandBuffer;
+        }
+        total_operands += num_operands[op];
+    }
+    if(total_operands != args.size()) {
+        return ErrorCode::BadCommandBuffer;
+    }
+    size_t arg_offset = 0;
+    for(const auto op : ops) {
+        const double *a = args.data() + arg_offset;
+        arg_offset += num_operands[op];
+        ErrorCode rc;
+        switch((CAPYPDF_Draw_Op)op) {
+        case CAPY_OP_b:
+            rc = cmd_b();
+            break;
+        case CAPY_OP_B:
+            rc = cmd_B();
+            break;
+        case CAPY_OP_bstar:
+            rc = cmd_bstar();
+            break;
+        case CAPY_OP_Bstar:
+            rc = cmd_Bstar();
+            break;
+        case CAPY_OP_c:
+            rc = cmd_c(a[0], a[1], a[2], a[3], a[4], a[5]);
+            break;
+        case CAPY_OP_cm:
+            rc = cmd_cm(a[0], a[1], a[2], a[3], a[4], a[5]);
+            break;
+        case CAPY_OP_Do:
+            if(const auto i = buffer_int_operand(a[0])) {
+                rc = cmd_Do(CapyPDF_FormXObjectId{*i});
+            } else {
+                return ErrorCode::BadCommandBuffer;
+            }
+            break;
+        case CAPY_OP_EMC:
+            rc = cmd_EMC();
+            break;
+        case CAPY_OP_f:
+            rc = cmd_f();
+            break;
+        case CAPY_OP_fstar:
+            rc = cmd_fstar();
+            break;
+        case CAPY_OP_G:
+            rc = cmd_G(a[0]);
+            break;
+        case CAPY_OP_g:
+            rc = cmd_g(a[0]);
+            break;
+        case CAPY_OP_h:
+            rc = cmd_h();
+            break;
+        case CAPY_OP_i:
+            rc = cmd_i(a[0]);
+            break;
+        case CAPY_OP_j:
+            if(const auto i = buffer_int_operand(a[0])) {
+                rc = cmd_j((CAPYPDF_Line_Join)*i);
+            } else {
+                return ErrorCode::BadCommandBuffer;
+            }
+            break;
+        case CAPY_OP_J:
+            if(const auto i = buffer_int_operand(a[0])) {
+                rc = cmd_J((CAPYPDF_Line_Cap)*i);
+            } else {
+                return ErrorCode::BadCommandBuffer;
+            }
+            break;
+        case CAPY_OP_K:
+            rc = cmd_K(a[0], a[1], a[2], a[3]);
+            break;
+        case CAPY_OP_k:
+            rc = cmd_k(a[0], a[1], a[2], a[3]);
+            break;
+        case CAPY_OP_l:
+            rc = cmd_l(a[0], a[1]);
+            break;
+        case CAPY_OP_m:
+            rc = cmd_m(a[0], a[1]);
+            break;
+        case CAPY_OP_M:
+            rc = cmd_M(a[0]);
+            break;
+        case CAPY_OP_n:
+            rc = cmd_n();
+            break;
+        case CAPY_OP_q:
+            rc = cmd_q();
+            break;
+        case CAPY_OP_Q:
+            rc = cmd_Q();
+            break;
+        case CAPY_OP_re:
+            rc = cmd_re(a[0], a[1], a[2], a[3]);
+            break;
+        case CAPY_OP_RG:
+            rc = cmd_RG(a[0], a[1], a[2]);
+            break;
+        case CAPY_OP_rg:
+            rc = cmd_rg(a[0], a[1], a[2]);
+            break;
+        case CAPY_OP_s:
+            rc = cmd_s();
+            break;
+        case CAPY_OP_S:
+            rc = cmd_S();
+            break;
+        case CAPY_OP_v:
+            rc = cmd_v(a[0], a[1], a[2], a[3]);
+            break;
+        case CAPY_OP_w:
+            rc = cmd_w(a[0]);
+            break;
+        case CAPY_OP_W:
+            rc = cmd_W();
+            break;
+        case CAPY_OP_Wstar:
+            rc = cmd_Wstar();
+            break;
+        case CAPY_OP_y:
+            rc = cmd_y(a[0], a[1], a[2], a[3]);
+            break;
+        case CAPY_OP_draw_image:
+            if(const auto i = buffer_int_operand(a[0])) {
+                rc = draw_image(CapyPDF_ImageId{*i});
+            } else {
+                return ErrorCode::BadCommandBuffer;
+            }
+            break;
+        default:
+            return ErrorCode::BadCommandBuffer;
+        }
+        if(rc != ErrorCode::NoError) {
+            return rc;
+        }
+    }
+    return ErrorCode::NoError;
+}
+
 ErrorCode PdfDrawContext::add_form_widget(CapyPDF_FormWidgetId widget) {
-    if(used_widgets.find(widget) != used_widgets.end()) {
+    if(!used_widgets.insert(widget)) {
         return ErrorCode::AnnotationReuse;
     }
-    used_widgets.insert(widget);
     return ErrorCode::NoError;
 }
 
 ErrorCode PdfDrawContext::annotate(CapyPDF_AnnotationId annotation) {
-    if(used_annotations.find(annotation) != used_annotations.end()) {
+    if(!used_annotations.insert(annotation)) {
         return ErrorCode::AnnotationReuse;
     }
-    used_annotations.insert(annotation);
     return ErrorCode::NoError;
 }
 
@@ -259,6 +492,11 @@ ErrorCode PdfDrawContext::cmd_Bstar() {
 }
 
 ErrorCode PdfDrawContext::cmd_BDC(CapyPDF_StructureItemId sid) {
+    // The parent tree only maps page MCIDs, form XObjects would need
+    // their own /StructParents entries.
+    if(context_type != CAPY_DC_PAGE) {
+        return ErrorCode::StructureOutsidePage;
+    }
     ++marked_depth;
     used_structures.insert(sid);
     fmt::format_to(cmd_appender,
@@ -266,8 +504,9 @@ ErrorCode PdfDrawContext::cmd_BDC(CapyPDF_StructureItemId sid) {
 {}BDC
 )",
                    ind,
-                   sid.id,
+                   marked_content.size(),
                    ind);
+    marked_content.push_back(sid);
     indent(DrawStateType::MarkedContent);
     return ErrorCode::NoError;
 }
@@ -291,14 +530,16 @@ ErrorCode PdfDrawContext::cmd_BMC(std::string_view tag) {
 }
 
 ErrorCode PdfDrawContext::cmd_c(double x1, double y1, double x2, double y2, double x3, double y3) {
-    fmt::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {:f} {:f} {:f} c\n", ind, x1, y1, x2, y2, x3, y3);
+    append_operator(commands, "c", x1, y1, x2, y2, x3, y3);
     return ErrorCode::NoError;
 }
 
+ErrorCode PdfDrawContext::cmd_c_array(std::span<const double> coords) {
+    return append_operator_array("c", coords, 6);
+}
+
 ErrorCode PdfDrawContext::cmd_cm(double m1, double m2, double m3, double m4, double m5, double m6) {
-    fmt::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {:f} {:f} {:f} cm\n", ind, m1, m2, m3, m4, m5, m6);
+    append_operator(commands, "cm", m1, m2, m3, m4, m5, m6);
     return ErrorCode::NoError;
 }
 
@@ -323,10 +564,9 @@ ErrorCode PdfDrawContext::cmd_d(double *dash_array, size_t dash_array_length, do
     }
     commands += ind;
     commands += "[ ";
-    for(size_t i = 0; i < dash_array_length; ++i) {
-        fmt::format_to(cmd_appender, "{:f} ", dash_array[i]);
-    }
-    fmt::format_to(cmd_appender, " ] {} d\n", phase);
+    append_operands(commands, std::span<const double>(dash_array, dash_array_length));
+    commands += "] ";
+    finish_operator(commands, "d", phase);
     return ErrorCode::NoError;
 }
 
@@ -378,13 +618,13 @@ ErrorCode PdfDrawContext::cmd_fstar() {
 
 ErrorCode PdfDrawContext::cmd_G(double gray) {
     CHECK_COLORCOMPONENT(gray);
-    fmt::format_to(cmd_appender, "{}{:f} G\n", ind, gray);
+    append_operator(commands, "G", gray);
     return ErrorCode::NoError;
 }
 
 ErrorCode PdfDrawContext::cmd_g(double gray) {
     CHECK_COLORCOMPONENT(gray);
-    fmt::format_to(cmd_appender, "{}{:f} g\n", ind, gray);
+    append_operator(commands, "g", gray);
     return ErrorCode::NoError;
 }
 
@@ -405,7 +645,7 @@ ErrorCode PdfDrawContext::cmd_i(double flatness) {
     if(flatness < 0 || flatness > 100) {
         return ErrorCode::InvalidFlatness;
     }
-    fmt::format_to(cmd_appender, "{}{:f} i\n", ind, flatness);
+    append_operator(commands, "i", flatness);
     return ErrorCode::NoError;
 }
 
@@ -426,7 +666,7 @@ ErrorCode PdfDrawContext::cmd_K(double c, double m, double y, double k) {
     CHECK_COLORCOMPONENT(m);
     CHECK_COLORCOMPONENT(y);
     CHECK_COLORCOMPONENT(k);
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} K\n", ind, c, m, y, k);
+    append_operator(commands, "K", c, m, y, k);
     return ErrorCode::NoError;
 }
 ErrorCode PdfDrawContext::cmd_k(double c, double m, double y, double k) {
@@ -434,22 +674,26 @@ ErrorCode PdfDrawContext::cmd_k(double c, double m, double y, double k) {
     CHECK_COLORCOMPONENT(m);
     CHECK_COLORCOMPONENT(y);
     CHECK_COLORCOMPONENT(k);
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} k\n", ind, c, m, y, k);
+    append_operator(commands, "k", c, m, y, k);
     return ErrorCode::NoError;
 }
 
 ErrorCode PdfDrawContext::cmd_l(double x, double y) {
-    fmt::format_to(cmd_appender, "{}{:f} {:f} l\n", ind, x, y);
+    append_operator(commands, "l", x, y);
     return ErrorCode::NoError;
 }
 
+ErrorCode PdfDrawContext::cmd_l_array(std::span<const double> xy) {
+    return append_operator_array("l", xy, 2);
+}
+
 ErrorCode PdfDrawContext::cmd_m(double x, double y) {
-    fmt::format_to(cmd_appender, "{}{:f} {:f} m\n", ind, x, y);
+    append_operator(commands, "m", x, y);
     return ErrorCode::NoError;
 }
 
 ErrorCode PdfDrawContext::cmd_M(double miterlimit) {
-    fmt::format_to(cmd_appender, "{}{:f} M\n", ind, miterlimit);
+    append_operator(commands, "M", miterlimit);
     return ErrorCode::NoError;
 }
 
@@ -477,15 +721,19 @@ ErrorCode PdfDrawContext::cmd_Q() {
 }
 
 ErrorCode PdfDrawContext::cmd_re(double x, double y, double w, double h) {
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} re\n", ind, x, y, w, h);
+    append_operator(commands, "re", x, y, w, h);
     return ErrorCode::NoError;
 }
 
+ErrorCode PdfDrawContext::cmd_re_array(std::span<const double> rects) {
+    return append_operator_array("re", rects, 4);
+}
+
 ErrorCode PdfDrawContext::cmd_RG(double r, double g, double b) {
     CHECK_COLORCOMPONENT(r);
     CHECK_COLORCOMPONENT(g);
     CHECK_COLORCOMPONENT(b);
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} RG\n", ind, r, g, b);
+    append_operator(commands, "RG", r, g, b);
     return ErrorCode::NoError;
 }
 
@@ -493,7 +741,7 @@ ErrorCode PdfDrawContext::cmd_rg(double r, double g, double b) {
     CHECK_COLORCOMPONENT(r);
     CHECK_COLORCOMPONENT(g);
     CHECK_COLORCOMPONENT(b);
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} rg\n", ind, r, g, b);
+    append_operator(commands, "rg", r, g, b);
     return ErrorCode::NoError;
 }
 
@@ -516,12 +764,12 @@ ErrorCode PdfDrawContext::cmd_S() {
 }
 
 ErrorCode PdfDrawContext::cmd_SCN(double value) {
-    fmt::format_to(cmd_appender, "{}{:f} SCN\n", ind, value);
+    append_operator(commands, "SCN", value);
     return ErrorCode::NoError;
 }
 
 ErrorCode PdfDrawContext::cmd_scn(double value) {
-    fmt::format_to(cmd_appender, "{}{:f} scn\n", ind, value);
+    append_operator(commands, "scn", value);
     return ErrorCode::NoError;
 }
 
@@ -539,7 +787,7 @@ ErrorCode PdfDrawContext::cmd_Tr(CapyPDF_Text_Mode mode) {
 }
 
 ErrorCode PdfDrawContext::cmd_v(double x2, double y2, double x3, double y3) {
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} v\n", ind, x2, y2, x3, y3);
+    append_operator(commands, "v", x2, y2, x3, y3);
     return ErrorCode::NoError;
 }
 
@@ -547,7 +795,7 @@ ErrorCode PdfDrawContext::cmd_w(double w) {
     if(w < 0) {
         return ErrorCode::NegativeLineWidth;
     }
-    fmt::format_to(cmd_appender, "{}{:f} w\n", ind, w);
+    append_operator(commands, "w", w);
     return ErrorCode::NoError;
 }
 
@@ -564,7 +812,7 @@ ErrorCode PdfDrawContext::cmd_Wstar() {
 }
 
 ErrorCode PdfDrawContext::cmd_y(double x1, double y1, double x3, double y3) {
-    fmt::format_to(cmd_appender, "{}{:f} {:f} {:f} {:f} y\n", ind, x1, y1, x3, y3);
+    append_operator(commands, "y", x1, y1, x3, y3);
     return ErrorCode::NoError;
 }
 
@@ -660,10 +908,9 @@ ErrorCode PdfDrawContext::set_color(const ICCColor &icc, bool stroke) {
     used_colorspaces.insert(icc_info.object_num);
     fmt::format_to(
         cmd_appender, "{}/CSpace{} {}\n", ind, icc_info.object_num, stroke ? "CS" : "cs");
-    for(const auto &i : icc.values) {
-        fmt::format_to(cmd_appender, "{:f} ", i);
-    }
-    fmt::format_to(cmd_appender, "{}\n", stroke ? "SCN" : "scn");
+    commands += ind;
+    append_operands(commands, icc.values);
+    commands += stroke ? "SCN\n" : "scn\n";
     return ErrorCode::NoError;
 }
 
@@ -710,8 +957,24 @@ ErrorCode PdfDrawContext::set_color(const LabColor &c, bool stroke) {
     used_colorspaces.insert(c.id.id);
     std::string csname = fmt::format("/CSpace{}", c.id.id);
     cmd_CS(csname);
-    fmt::format_to(
-        cmd_appender, "{}{:f} {:f} {:f} {}\n", ind, c.l, c.a, c.b, stroke ? "SCN" : "scn");
+    append_operator(commands, stroke ? "SCN" : "scn", c.l, c.a, c.b);
+    return ErrorCode::NoError;
+}
+
+ErrorCode PdfDrawContext::append_operator_array(std::string_view op,
+                                                std::span<const double> values,
+                                                size_t arity) {
+    if(values.size() % arity != 0) {
+        return ErrorCode::BadCoordinateCount;
+    }
+    // Typical coordinates take less than ten characters.
+    commands.reserve(commands.size() + values.size() * 10);
+    for(size_t i = 0; i < values.size(); i += arity) {
+        commands += ind;
+        append_operands(commands, values.subspan(i, arity));
+        commands += op;
+        commands += '\n';
+    }
     return ErrorCode::NoError;
 }
 
@@ -750,41 +1013,47 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_charsequence(const std::vector<Cha
                                                            std::string &serialisation,
                                                            CapyPDF_FontId &current_font,
                                                            int32_t &current_subset,
-                                                           double &current_pointsize) {
+                                                           double &current_pointsize,
+                                                           const std::string &indent) {
     std::back_insert_iterator<std::string> app = std::back_inserter(serialisation);
     bool is_first = true;
     for(const auto &e : charseq) {
         if(std::holds_alternative<double>(e)) {
             if(is_first) {
-                serialisation += ind;
+                serialisation += indent;
                 serialisation += "[ ";
             }
-            fmt::format_to(app, "{:f} ", std::get<double>(e));
+            append_pdf_number(serialisation, std::get<double>(e), number_precision);
+            serialisation += ' ';
         } else {
             assert(std::holds_alternative<uint32_t>(e));
             const auto codepoint = std::get<uint32_t>(e);
             ERC(current_subset_glyph, doc->get_subset_glyph(current_font, codepoint));
-            used_subset_fonts.insert(current_subset_glyph.ss);
+            use_subset_font(current_subset_glyph.ss);
             if(current_subset_glyph.ss.subset_id != current_subset) {
                 if(!is_first) {
                     serialisation += "] TJ\n";
                 }
                 fmt::format_to(app,
                                "{}/SFont{}-{} {} Tf\n{}[ ",
-                               ind,
+                               indent,
                                doc->font_objects.at(current_subset_glyph.ss.fid.id).font_obj,
                                current_subset_glyph.ss.subset_id,
                                current_pointsize,
-                               ind);
+                               indent);
             } else {
                 if(is_first) {
-                    serialisation += ind;
+                    serialisation += indent;
                     serialisation += "[ ";
                 }
             }
             current_font = current_subset_glyph.ss.fid;
             current_subset = current_subset_glyph.ss.subset_id;
-            fmt::format_to(app, "<{:02x}> ", current_subset_glyph.glyph_id);
+            if(is_cid_font(current_font)) {
+                fmt::format_to(app, "<{:04x}> ", current_subset_glyph.glyph_id);
+            } else {
+                fmt::format_to(app, "<{:02x}> ", current_subset_glyph.glyph_id);
+            }
         }
         is_first = false;
     }
@@ -792,6 +1061,34 @@ rvoe<NoReturnValue> PdfDrawContext::serialize_charsequence(const std::vector<Cha
     return NoReturnValue{};
 }
 
+rvoe<NoReturnValue>
+PdfDrawContext::append_glyph_code(std::string &out, CapyPDF_FontId fid, uint32_t codepoint) {
+    ERC(current_subset_glyph, doc->get_subset_glyph(fid, codepoint));
+    use_subset_font(current_subset_glyph.ss);
+    if(is_cid_font(fid)) {
+        fmt::format_to(std::back_inserter(out), "<{:04x}>", current_subset_glyph.glyph_id);
+    } else {
+        fmt::format_to(
+            std::back_inserter(out), "<{:02x}>", (unsigned char)current_subset_glyph.glyph_id);
+    }
+    return NoReturnValue{};
+}
+
+void PdfDrawContext::use_subset_font(const FontSubset &fss) {
+    auto it = std::lower_bound(
+        used_subset_fonts.begin(), used_subset_fonts.end(), fss, [](const auto &a, const auto &b) {
+            return a.fid.id < b.fid.id || (a.fid.id == b.fid.id && a.subset_id < b.subset_id);
+        });
+    if(it == used_subset_fonts.end() || *it != fss) {
+        used_subset_fonts.insert(it, fss);
+    }
+}
+
+bool PdfDrawContext::is_cid_font(CapyPDF_FontId fid) const {
+    const auto &font = doc->fonts.at(doc->font_objects.at(fid.id).font_index_tmp);
+    return font.subsets.subset_type() == FontSubsetType::CID;
+}
+
 ErrorCode PdfDrawContext::utf8_to_kerned_chars(const u8string &text,
                                                std::vector<CharItem> &charseq,
                                                CapyPDF_FontId fid) {
@@ -803,14 +1100,17 @@ ErrorCode PdfDrawContext::utf8_to_kerned_chars(const u8string &text,
     if(!face) {
         return ErrorCode::BuiltinFontNotSupported;
     }
-    ERC_CONV(glyphs, utf8_to_glyphs(text));
+    auto rc = utf8_to_glyphs(text.sv(), codepoint_buffer);
+    if(!rc) {
+        return rc.error();
+    }
 
     uint32_t previous_codepoint = -1;
     // Freetype does not support GPOS kerning because it is context-sensitive.
     // So this method might produce incorrect kerning. Users that need precision
     // need to use the glyph based rendering method.
     const bool has_kerning = FT_HAS_KERNING(face);
-    for(const auto codepoint : glyphs) {
+    for(const auto codepoint : codepoint_buffer) {
         if(has_kerning && previous_codepoint != (uint32_t)-1) {
             FT_Vector kerning;
             const auto index_left = FT_Get_Char_Index(face, previous_codepoint);
@@ -836,12 +1136,33 @@ ErrorCode PdfDrawContext::render_text(const PdfText &textobj) {
     if(textobj.creator() != this) {
         return ErrorCode::WrongDrawContext;
     }
+    auto fonts_lock = doc->lock_fonts();
+    const bool defer_glyphs = context_type == CAPY_DC_PAGE;
+    std::vector<DeferredGlyphs> deferred;
+    bool continues = false;
     std::string serialisation{ind + "BT\n"};
     indent(DrawStateType::Text);
     std::back_insert_iterator<std::string> app = std::back_inserter(serialisation);
     int32_t current_subset{-1};
     CapyPDF_FontId current_font{-1};
     double current_pointsize{-1};
+    auto add_charsequence = [&](const std::vector<CharItem> &charseq) -> rvoe<NoReturnValue> {
+        if(!defer_glyphs) {
+            return serialize_charsequence(
+                charseq, serialisation, current_font, current_subset, current_pointsize, ind);
+        }
+        // Catch what get_subset_glyph would while the caller can still tell where it went wrong.
+        CHECK_INDEXNESS_V(current_font.id, doc->font_objects);
+        deferred.push_back(DeferredGlyphs{serialisation.size(),
+                                          charseq,
+                                          current_font,
+                                          current_pointsize,
+                                          ind,
+                                          continues,
+                                          false});
+        continues = true;
+        return NoReturnValue{};
+    };
     for(const auto &e : textobj.get_events()) {
         if(std::holds_alternative<TStar_arg>(e)) {
             serialisation += ind;
@@ -851,63 +1172,59 @@ ErrorCode PdfDrawContext::render_text(const PdfText &textobj) {
             fmt::format_to(app, "{}{} Tc\n", ind, tc.val);
         } else if(std::holds_alternative<Td_arg>(e)) {
             const auto &td = std::get<Td_arg>(e);
-            fmt::format_to(app, "{}{:f} {:f} Td\n", ind, td.tx, td.ty);
+            append_operator(serialisation, "Td", td.tx, td.ty);
         } else if(std::holds_alternative<TD_arg>(e)) {
             const auto &tD = std::get<TD_arg>(e);
-            fmt::format_to(app, "{}{:f} {:f} TD\n", ind, tD.tx, tD.ty);
+            append_operator(serialisation, "TD", tD.tx, tD.ty);
         } else if(std::holds_alternative<Tf_arg>(e)) {
             current_font = std::get<Tf_arg>(e).font;
             current_subset = -1;
             current_pointsize = std::get<Tf_arg>(e).pointsize;
+            continues = false;
         } else if(std::holds_alternative<Text_arg>(e)) {
             const auto &tj = std::get<Text_arg>(e);
-            std::vector<CharItem> charseq;
-            auto ec = utf8_to_kerned_chars(tj.text, charseq, current_font);
+            charseq_buffer.clear();
+            auto ec = utf8_to_kerned_chars(tj.text, charseq_buffer, current_font);
             if(ec != ErrorCode::NoError) {
                 return ec;
             }
-            auto rv = serialize_charsequence(
-                charseq, serialisation, current_font, current_subset, current_pointsize);
+            auto rv = add_charsequence(charseq_buffer);
             if(!rv) {
                 return rv.error();
             }
         } else if(std::holds_alternative<TJ_arg>(e)) {
             const auto &tJ = std::get<TJ_arg>(e);
-            auto rc = serialize_charsequence(
-                tJ.elements, serialisation, current_font, current_subset, current_pointsize);
+            auto rc = add_charsequence(tJ.elements);
             if(!rc) {
                 return rc.error();
             }
         } else if(std::holds_alternative<TL_arg>(e)) {
             const auto &tL = std::get<TL_arg>(e);
-            fmt::format_to(app, "{}{:f} TL\n", ind, tL.leading);
+            append_operator(serialisation, "TL", tL.leading);
         } else if(std::holds_alternative<Tr_arg>(e)) {
             const auto &tr = std::get<Tr_arg>(e);
             fmt::format_to(app, "{}{} Tr\n", ind, (int)tr.rmode);
         } else if(std::holds_alternative<Tm_arg>(e)) {
             const auto &tm = std::get<Tm_arg>(e);
-            fmt::format_to(app,
-                           "{}{:f} {:f} {:f} {:f} {:f} {:f} Tm\n",
-                           ind,
-                           tm.a,
-                           tm.b,
-                           tm.c,
-                           tm.d,
-                           tm.e,
-                           tm.f);
+            append_operator(serialisation, "Tm", tm.a, tm.b, tm.c, tm.d, tm.e, tm.f);
         } else if(std::holds_alternative<Ts_arg>(e)) {
             const auto &ts = std::get<Ts_arg>(e);
-            fmt::format_to(app, "{}{:f} Ts\n", ind, ts.rise);
+            append_operator(serialisation, "Ts", ts.rise);
         } else if(std::holds_alternative<Tw_arg>(e)) {
             const auto &tw = std::get<Tw_arg>(e);
-            fmt::format_to(app, "{}{:f} Tw\n", ind, tw.width);
+            append_operator(serialisation, "Tw", tw.width);
         } else if(std::holds_alternative<Tz_arg>(e)) {
             const auto &tz = std::get<Tz_arg>(e);
-            fmt::format_to(app, "{}{:f} Tz\n", ind, tz.scaling);
+            append_operator(serialisation, "Tz", tz.scaling);
         } else if(std::holds_alternative<CapyPDF_StructureItemId>(e)) {
             const auto &sid = std::get<CapyPDF_StructureItemId>(e);
+            if(context_type != CAPY_DC_PAGE) {
+                return ErrorCode::StructureOutsidePage;
+            }
             used_structures.insert(sid);
-            fmt::format_to(app, "{}/P << /MCID {} >>\n{}BDC\n", ind, sid.id, ind);
+            fmt::format_to(
+                app, "{}/P << /MCID {} >>\n{}BDC\n", ind, marked_content.size(), ind);
+            marked_content.push_back(sid);
             indent(DrawStateType::MarkedContent);
         } else if(std::holds_alternative<Emc_arg>(e)) {
             auto rc = dedent(DrawStateType::MarkedContent);
@@ -925,16 +1242,10 @@ ErrorCode PdfDrawContext::render_text(const PdfText &textobj) {
             const auto &nsarg = std::get<Nonstroke_arg>(e);
             if(std::holds_alternative<DeviceRGBColor>(nsarg.c)) {
                 auto &rgb = std::get<DeviceRGBColor>(nsarg.c);
-                fmt::format_to(app, "{}{:f} {:f} {:f} rg\n", ind, rgb.r.v(), rgb.g.v(), rgb.b.v());
+                append_operator(serialisation, "rg", rgb.r.v(), rgb.g.v(), rgb.b.v());
             } else if(std::holds_alternative<DeviceCMYKColor>(nsarg.c)) {
                 auto &cmyk = std::get<DeviceCMYKColor>(nsarg.c);
-                fmt::format_to(app,
-                               "{}{:f} {:f} {:f} {:f} k\n",
-                               ind,
-                               cmyk.c.v(),
-                               cmyk.m.v(),
-                               cmyk.y.v(),
-                               cmyk.k.v());
+                append_operator(serialisation, "k", cmyk.c.v(), cmyk.m.v(), cmyk.y.v(), cmyk.k.v());
             } else {
                 printf("Text nonstroke colorspace not supported yet.\n");
                 std::abort();
@@ -950,6 +1261,10 @@ ErrorCode PdfDrawContext::render_text(const PdfText &textobj) {
     }
     serialisation += ind;
     serialisation += "ET\n";
+    for(auto &d : deferred) {
+        d.offset += commands.size();
+        deferred_glyphs.push_back(std::move(d));
+    }
     commands += serialisation;
     return ErrorCode::NoError;
 }
@@ -958,6 +1273,7 @@ void PdfDrawContext::render_raw_glyph(
     uint32_t glyph, CapyPDF_FontId fid, double pointsize, double x, double y) {
     auto &font_data = doc->font_objects.at(fid.id);
     // used_fonts.insert(font_data.font_obj);
+    auto fonts_lock = doc->lock_fonts();
 
     const auto font_glyph_id = doc->glyph_for_codepoint(
         doc->fonts.at(font_data.font_index_tmp).fontdata.face.get(), glyph);
@@ -990,6 +1306,7 @@ ErrorCode PdfDrawContext::render_glyphs(const std::vector<PdfGlyph> &glyphs,
         return ErrorCode::NoError;
     }
     auto &font_data = doc->font_objects.at(fid.id);
+    auto fonts_lock = doc->lock_fonts();
     // FIXME, do per character.
     // const auto &bob =
     //    doc->font_objects.at(doc->get_subset_glyph(fid, glyphs.front().codepoint).ss.fid.id);
@@ -1003,23 +1320,58 @@ ErrorCode PdfDrawContext::render_glyphs(const std::vector<PdfGlyph> &glyphs,
                    0,
                    pointsize);
     for(const auto &g : glyphs) {
-        auto rv = doc->get_subset_glyph(fid, g.codepoint);
-        if(!rv) {
-            return rv.error();
+        commands += ind;
+        if(indent_content) {
+            commands += "  ";
         }
-        auto &current_subset_glyph = rv.value();
-        // const auto &bob = doc->font_objects.at(current_subset_glyph.ss.fid.id);
-        used_subset_fonts.insert(current_subset_glyph.ss);
-        fmt::format_to(cmd_appender, "  {:f} {:f} Td\n", g.x - prev_x, g.y - prev_y);
+        finish_operator(commands, "Td", g.x - prev_x, g.y - prev_y);
         prev_x = g.x;
         prev_y = g.y;
-        fmt::format_to(
-            cmd_appender, "  <{:02x}> Tj\n", (unsigned char)current_subset_glyph.glyph_id);
+        commands += "  ";
+        if(context_type == CAPY_DC_PAGE) {
+            deferred_glyphs.push_back(
+                DeferredGlyphs{commands.size(), {g.codepoint}, fid, pointsize, {}, false, true});
+        } else {
+            auto rv = append_glyph_code(commands, fid, g.codepoint);
+            if(!rv) {
+                return rv.error();
+            }
+        }
+        commands += " Tj\n";
     }
     fmt::format_to(cmd_appender, "{}ET\n", ind);
     return ErrorCode::NoError;
 }
 
+ErrorCode PdfDrawContext::render_glyph_run(const PdfGlyphRun &run, double x, double y) {
+    if(run.doc != doc) {
+        return ErrorCode::WrongDrawContext;
+    }
+    for(const auto &ss : run.subsets) {
+        use_subset_font(ss);
+    }
+    commands += ind;
+    commands += "BT\n";
+    commands += ind;
+    // The run's operators are indented by one level within the text object.
+    commands += "  ";
+    finish_operator(commands, "Td", x, y);
+    if(ind.empty()) {
+        commands += run.operators;
+    } else {
+        std::string_view ops{run.operators};
+        while(!ops.empty()) {
+            const auto line_end = ops.find('\n') + 1;
+            commands += ind;
+            commands += ops.substr(0, line_end);
+            ops.remove_prefix(line_end);
+        }
+    }
+    commands += ind;
+    commands += "ET\n";
+    return ErrorCode::NoError;
+}
+
 ErrorCode PdfDrawContext::render_pdfdoc_text_builtin(const char *pdfdoc_encoded_text,
                                                      CapyPDF_Builtin_Fonts font_id,
                                                      double pointsize,
@@ -1028,18 +1380,17 @@ ErrorCode PdfDrawContext::render_pdfdoc_text_builtin(const char *pdfdoc_encoded_
     if(doc->opts.subtype) {
         return ErrorCode::BadOperationForIntent;
     }
-    auto font_object = doc->font_object_number(doc->get_builtin_font_id(font_id));
-    used_fonts.insert(font_object);
+    used_builtin_fonts.insert((int32_t)font_id);
     fmt::format_to(cmd_appender,
                    R"({}BT
-{}  /Font{} {} Tf
+{}  /BFont{} {} Tf
 {}  {:f} {:f} Td
 {}  {} Tj
 {}ET
 )",
                    ind,
                    ind,
-                   font_object,
+                   (int32_t)font_id,
                    pointsize,
                    ind,
                    x,
@@ -1079,7 +1430,7 @@ PdfDrawContext::add_simple_navigation(std::span<const CapyPDF_OptionalContentGro
         std::abort();
     }
     for(const auto &sn : navs) {
-        if(used_ocgs.find(sn) == used_ocgs.end()) {
+        if(!used_ocgs.contains(sn)) {
             RETERR(UnusedOcg);
         }
     }
@@ -23,20 +23,11 @@
 #include <pdfdocument.hpp>
 #include <string>
 #include <string_view>
-#include <unordered_set>
 #include <vector>
 #include <optional>
 #include <span>
 #include <stack>
 
-template<> struct std::hash<capypdf::FontSubset> {
-    size_t operator()(capypdf::FontSubset const &s) const noexcept {
-        const size_t x = (size_t)s.fid.id;
-        const size_t y = s.subset_id;
-        return (x << 32) + y;
-    }
-};
-
 namespace capypdf {
 
 class PdfDrawContext;
@@ -69,6 +60,17 @@ struct PdfGlyph {
     double x, y;
 };
 
+// Glyphs whose subsets have been resolved and whose text operators have
+// been serialized once. A run can be drawn any number of times on any
+// page of the document that created it without going through the font
+// subsetter again, so drawing it does not need the font lock.
+struct PdfGlyphRun {
+    const PdfDocument *doc = nullptr;
+    std::vector<FontSubset> subsets;
+    // Operators for the inside of a text object, relative to where the run starts.
+    std::string operators;
+};
+
 enum class DrawStateType {
     MarkedContent,
     SaveState,
@@ -85,6 +87,12 @@ public:
                    double h = -1);
     ~PdfDrawContext();
     DCSerialization serialize(const TransparencyGroupExtra *trinfo = nullptr);
+    // Takes back the commands of a serialized page that the document did not accept.
+    void restore_commands(std::string &&buf);
+    // Text drawn into page contexts gets its subset glyphs only when the page is
+    // added, in page order, so the numbering does not depend on which of the
+    // contexts filled in parallel reached the font lock first.
+    rvoe<NoReturnValue> resolve_deferred_glyphs();
 
     PdfDrawContext() = delete;
     PdfDrawContext(const PdfDrawContext &) = delete;
@@ -102,6 +110,7 @@ public:
     ErrorCode cmd_BDC(CapyPDF_OptionalContentGroupId id);
     ErrorCode cmd_BMC(std::string_view tag);
     ErrorCode cmd_c(double x1, double y1, double x2, double y2, double x3, double y3);
+    ErrorCode cmd_c_array(std::span<const double> coords);
     ErrorCode cmd_cm(double m1, double m2, double m3, double m4, double m5, double m6);
     ErrorCode cmd_CS(std::string_view cspace_name);
     ErrorCode cmd_cs(std::string_view cspace_name);
@@ -122,12 +131,15 @@ public:
     ErrorCode cmd_K(double c, double m, double y, double k);
     ErrorCode cmd_k(double c, double m, double y, double k);
     ErrorCode cmd_l(double x, double y);
+    // Bulk versions take flat coordinate arrays. Each element writes one operator.
+    ErrorCode cmd_l_array(std::span<const double> xy);
     ErrorCode cmd_m(double x, double y);
     ErrorCode cmd_M(double miterlimit);
     ErrorCode cmd_n();
     ErrorCode cmd_q(); // Save
     ErrorCode cmd_Q(); // Restore
     ErrorCode cmd_re(double x, double y, double w, double h);
+    ErrorCode cmd_re_array(std::span<const double> rects);
     ErrorCode cmd_RG(double r, double g, double b);
     ErrorCode cmd_rg(double r, double g, double b);
     ErrorCode cmd_ri(CapyPDF_Rendering_Intent ri);
@@ -143,6 +155,9 @@ public:
     ErrorCode cmd_Wstar();
     ErrorCode cmd_y(double x1, double y1, double x3, double y3);
 
+    // Runs a batch of CAPYPDF_Draw_Op operations with their operands packed in args.
+    ErrorCode execute_buffer(std::span<const uint8_t> ops, std::span<const double> args);
+
     ErrorCode set_stroke_color(const Color &c) { return set_color(c, true); }
     ErrorCode set_nonstroke_color(const Color &c) { return set_color(c, false); }
 
@@ -166,6 +181,7 @@ public:
     void render_raw_glyph(uint32_t glyph, CapyPDF_FontId fid, double pointsize, double x, double y);
     ErrorCode
     render_glyphs(const std::vector<PdfGlyph> &glyphs, CapyPDF_FontId fid, double pointsize);
+    ErrorCode render_glyph_run(const PdfGlyphRun &run, double x, double y);
     ErrorCode render_pdfdoc_text_builtin(const char *pdfdoc_encoded_text,
                                          CapyPDF_Builtin_Fonts font_id,
                                          double pointsize,
@@ -184,6 +200,7 @@ public:
     PdfDocument &get_doc() { return *doc; }
 
     std::string build_resource_dict();
+    // For page contexts this does not contain text until the page has been added.
     std::string_view get_command_stream() { return commands; }
 
     rvoe<NoReturnValue> set_form_xobject_size(double w, double h);
@@ -192,12 +209,12 @@ public:
 
     int32_t marked_content_depth() const { return marked_depth; }
 
-    const std::unordered_set<CapyPDF_FormWidgetId> &get_form_usage() const { return used_widgets; }
-    const std::unordered_set<CapyPDF_AnnotationId> &get_annotation_usage() const {
-        return used_annotations;
-    }
-    const std::unordered_set<CapyPDF_StructureItemId> &get_structure_usage() const {
-        return used_structures;
+    const IdSet<CapyPDF_FormWidgetId> &get_form_usage() const { return used_widgets; }
+    const IdSet<CapyPDF_AnnotationId> &get_annotation_usage() const { return used_annotations; }
+    const IdSet<CapyPDF_StructureItemId> &get_structure_usage() const { return used_structures; }
+    // The structure item of every marked content sequence, indexed by MCID.
+    const std::vector<CapyPDF_StructureItemId> &get_marked_content() const {
+        return marked_content;
     }
 
     const std::optional<Transition> &get_transition() const { return transition; }
@@ -212,18 +229,38 @@ public:
                                               const std::optional<Transition> &tr);
 
 private:
+    struct DeferredGlyphs {
+        // Where the glyphs go in the command stream.
+        size_t offset;
+        std::vector<CharItem> chars;
+        CapyPDF_FontId font;
+        double pointsize;
+        std::string ind;
+        // The previous entry is in the same text object with no font change in between.
+        bool continues;
+        // A single glyph code for Tj instead of a TJ array.
+        bool code_only;
+    };
+
     rvoe<NoReturnValue> serialize_charsequence(const std::vector<CharItem> &charseq,
                                                std::string &serialisation,
                                                CapyPDF_FontId &current_font,
                                                int32_t &current_subset,
-                                               double &current_pointsize);
+                                               double &current_pointsize,
+                                               const std::string &indent);
+    rvoe<NoReturnValue>
+    append_glyph_code(std::string &out, CapyPDF_FontId fid, uint32_t codepoint);
+    bool is_cid_font(CapyPDF_FontId fid) const;
+    void use_subset_font(const FontSubset &fss);
     ErrorCode utf8_to_kerned_chars(const u8string &text,
                                    std::vector<CharItem> &charseq,
                                    CapyPDF_FontId fid);
 
     void indent(DrawStateType dtype) {
         dstates.push(dtype);
-        ind += "  ";
+        if(indent_content) {
+            ind += "  ";
+        }
     }
 
     rvoe<NoReturnValue> dedent(DrawStateType dtype) {
@@ -233,34 +270,67 @@ private:
         if(dstates.top() != dtype) {
             RETERR(DrawStateEndMismatch);
         }
-        if(ind.size() < 2) {
-            std::abort();
-        }
         dstates.pop();
-        ind.pop_back();
-        ind.pop_back();
+        if(indent_content) {
+            if(ind.size() < 2) {
+                std::abort();
+            }
+            ind.pop_back();
+            ind.pop_back();
+        }
         return NoReturnValue{};
     }
 
+    // Writes an operator and its numeric operands on one line.
+    template<typename... Operands>
+    void append_operator(std::string &out, std::string_view op, Operands... operands) {
+        out += ind;
+        finish_operator(out, op, operands...);
+    }
+
+    // Ditto, but continues a line whose indentation has already been written.
+    template<typename... Operands>
+    void finish_operator(std::string &out, std::string_view op, Operands... operands) {
+        ((append_pdf_number(out, operands, number_precision), out += ' '), ...);
+        out += op;
+        out += '\n';
+    }
+
+    ErrorCode
+    append_operator_array(std::string_view op, std::span<const double> values, size_t arity);
+
+    void append_operands(std::string &out, std::span<const double> operands) {
+        for(const auto v : operands) {
+            append_pdf_number(out, v, number_precision);
+            out += ' ';
+        }
+    }
+
     PdfDocument *doc;
     PdfColorConverter *cm;
     CAPYPDF_Draw_Context_Type context_type;
     std::string commands;
     std::back_insert_iterator<std::string> cmd_appender;
-    std::unordered_set<int32_t> used_images;
-    std::unordered_set<FontSubset> used_subset_fonts;
-    std::unordered_set<int32_t> used_fonts;
-    std::unordered_set<int32_t> used_colorspaces;
-    std::unordered_set<int32_t> used_gstates;
-    std::unordered_set<int32_t> used_shadings;
-    std::unordered_set<int32_t> used_patterns;
-    std::unordered_set<int32_t> used_form_xobjects;
-    std::unordered_set<CapyPDF_FormWidgetId> used_widgets;
-    std::unordered_set<CapyPDF_AnnotationId> used_annotations;
-    std::unordered_set<CapyPDF_StructureItemId> used_structures;
-    std::unordered_set<CapyPDF_OptionalContentGroupId> used_ocgs;
-    std::unordered_set<CapyPDF_TransparencyGroupId> used_trgroups;
+    IdSet<int32_t> used_images;
+    // A page uses only a handful of subsets, kept sorted by font and subset.
+    std::vector<FontSubset> used_subset_fonts;
+    IdSet<int32_t> used_builtin_fonts;
+    IdSet<int32_t> used_colorspaces;
+    IdSet<int32_t> used_gstates;
+    IdSet<int32_t> used_shadings;
+    IdSet<int32_t> used_patterns;
+    IdSet<int32_t> used_form_xobjects;
+    IdSet<CapyPDF_FormWidgetId> used_widgets;
+    IdSet<CapyPDF_AnnotationId> used_annotations;
+    IdSet<CapyPDF_StructureItemId> used_structures;
+    std::vector<CapyPDF_StructureItemId> marked_content;
+    IdSet<CapyPDF_OptionalContentGroupId> used_ocgs;
+    IdSet<CapyPDF_TransparencyGroupId> used_trgroups;
     std::vector<SubPageNavigation> sub_navigations;
+    std::vector<DeferredGlyphs> deferred_glyphs;
+    // Scratch space for text serialization. It holds no state, so .clear() leaves it alone.
+    std::vector<uint32_t> codepoint_buffer;
+    std::vector<CharItem> charseq_buffer;
 
     std::stack<DrawStateType> dstates;
     std::optional<Transition> transition;
@@ -270,6 +340,8 @@ private:
     double form_xobj_w = -1;
     double form_xobj_h = -1;
     int32_t marked_depth = 0;
+    int32_t number_precision;
+    bool indent_content;
     std::string ind;
 };
 
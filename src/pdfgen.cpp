@@ -22,6 +22,8 @@
 #include <lcms2.h>
 #include <stdexcept>
 #include <array>
+#include <algorithm>
+#include <cmath>
 #include <fmt/core.h>
 #include <ft2build.h>
 #include FT_FREETYPE_H
@@ -57,55 +59,128 @@ DrawContextPopper::~DrawContextPopper() {
     }
 }
 
+rvoe<std::unique_ptr<PdfGen>> PdfGen::create(const PdfGenerationData &d) {
+    auto resources = d.resources;
+    if(!resources) {
+        ERC(private_resources,
+            PdfResourceContext::construct(
+                d.prof.rgb_profile_file, d.prof.gray_profile_file, d.prof.cmyk_profile_file));
+        resources = std::move(private_resources);
+    }
+    PdfColorConverter cm(resources->color_profiles());
+    cm.set_color_cache_size(d.color_cache_size);
+    ERC(pdoc, PdfDocument::construct(d, std::move(cm)));
+    return std::unique_ptr<PdfGen>(new PdfGen("", std::move(resources), std::move(pdoc)));
+}
+
 rvoe<std::unique_ptr<PdfGen>> PdfGen::construct(const std::filesystem::path &ofname,
                                                 const PdfGenerationData &d) {
-    FT_Library ft_;
-    auto error = FT_Init_FreeType(&ft_);
-    if(error) {
-        RETERR(FreeTypeError);
+    ERC(gen, create(d));
+    gen->ofilename = ofname;
+    if(d.streaming) {
+        FILE *ofile = fopen(gen->temp_file_name().string().c_str(), "wb");
+        if(!ofile) {
+            perror(nullptr);
+            RETERR(CouldNotOpenFile);
+        }
+        gen->stream_file = ofile;
+        ERCV(gen->pdoc.start_streaming(file_sink(ofile)));
     }
-    std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft(ft_, FT_Done_FreeType);
-    ERC(cm,
-        PdfColorConverter::construct(
-            d.prof.rgb_profile_file, d.prof.gray_profile_file, d.prof.cmyk_profile_file));
-    ERC(pdoc, PdfDocument::construct(d, std::move(cm)));
-    return std::unique_ptr<PdfGen>(new PdfGen(ofname, std::move(ft), std::move(pdoc)));
+    return std::move(gen);
+}
+
+rvoe<std::unique_ptr<PdfGen>> PdfGen::construct(OutputSink sink, const PdfGenerationData &d) {
+    ERC(gen, create(d));
+    gen->output_sink = std::move(sink);
+    if(d.streaming) {
+        ERCV(gen->pdoc.start_streaming(gen->output_sink));
+    }
+    return std::move(gen);
+}
+
+rvoe<std::unique_ptr<PdfGen>> PdfGen::construct_in_memory(const PdfGenerationData &d) {
+    ERC(gen, create(d));
+    // The generator is always heap allocated so the buffer does not move.
+    gen->output_sink = string_sink(gen->memory_buffer);
+    if(d.streaming) {
+        ERCV(gen->pdoc.start_streaming(gen->output_sink));
+    }
+    return std::move(gen);
 }
 
 PdfGen::~PdfGen() {
+    if(stream_file) {
+        // The document was never finished so the partial output is useless.
+        fclose(stream_file);
+        std::error_code ec;
+        std::filesystem::remove(temp_file_name(), ec);
+    }
     pdoc.font_objects.clear();
     pdoc.fonts.clear();
 }
 
+std::filesystem::path PdfGen::temp_file_name() const {
+    auto tempfname = ofilename;
+    tempfname.replace_extension(".pdf~");
+    return tempfname;
+}
+
+rvoe<NoReturnValue> PdfGen::write_to_output_sink() {
+    try {
+        return pdoc.write_to_sink(output_sink);
+    } catch(const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        RETERR(DynamicError);
+    } catch(...) {
+        fprintf(stderr, "Unexpected error.\n");
+        RETERR(DynamicError);
+    }
+}
+
 rvoe<NoReturnValue> PdfGen::write() {
     if(pdoc.pages.size() == 0) {
         RETERR(NoPages);
     }
+    if(output_sink) {
+        return write_to_output_sink();
+    }
 
-    auto tempfname = ofilename;
-    tempfname.replace_extension(".pdf~");
-    FILE *ofile = fopen(tempfname.string().c_str(), "wb");
+    auto tempfname = temp_file_name();
+    FILE *ofile = stream_file;
+    stream_file = nullptr;
+    if(!ofile) {
+        ofile = fopen(tempfname.string().c_str(), "wb");
+    }
     if(!ofile) {
         perror(nullptr);
         RETERR(CouldNotOpenFile);
     }
 
+    // A partial file is useless, so remove it on every error.
+    auto discard = [&](ErrorCode code) -> rvoe<NoReturnValue> {
+        if(ofile) {
+            fclose(ofile);
+        }
+        std::error_code ec;
+        std::filesystem::remove(tempfname, ec);
+        return std::unexpected(code);
+    };
     try {
-        ERCV(pdoc.write_to_file(ofile));
+        auto rc = pdoc.write_to_sink(file_sink(ofile));
+        if(!rc) {
+            return discard(rc.error());
+        }
     } catch(const std::exception &e) {
         fprintf(stderr, "%s\n", e.what());
-        fclose(ofile);
-        RETERR(DynamicError);
+        return discard(ErrorCode::DynamicError);
     } catch(...) {
         fprintf(stderr, "Unexpected error.\n");
-        fclose(ofile);
-        RETERR(DynamicError);
+        return discard(ErrorCode::DynamicError);
     }
 
     if(fflush(ofile) != 0) {
         perror(nullptr);
-        fclose(ofile);
-        RETERR(DynamicError);
+        return discard(ErrorCode::DynamicError);
     }
     if(
 #ifdef _WIN32
@@ -116,12 +191,13 @@ rvoe<NoReturnValue> PdfGen::write() {
         != 0) {
 
         perror(nullptr);
-        fclose(ofile);
-        RETERR(FileWriteError);
+        return discard(ErrorCode::FileWriteError);
     }
-    if(fclose(ofile) != 0) {
+    const auto close_rc = fclose(ofile);
+    ofile = nullptr;
+    if(close_rc != 0) {
         perror(nullptr);
-        RETERR(FileWriteError);
+        return discard(ErrorCode::FileWriteError);
     }
 
     // If we made it here, the file has been fully written and fsynd'd to disk. Now replace.
@@ -129,7 +205,7 @@ rvoe<NoReturnValue> PdfGen::write() {
     std::filesystem::rename(tempfname, ofilename, ec);
     if(ec) {
         fprintf(stderr, "%s\n", ec.category().message(ec.value()).c_str());
-        RETERR(FileWriteError);
+        return discard(ErrorCode::FileWriteError);
     }
     return NoReturnValue{};
 }
@@ -144,16 +220,23 @@ rvoe<PageId> PdfGen::add_page(PdfDrawContext &ctx) {
     if(ctx.has_unclosed_state()) {
         RETERR(DrawStateEndMismatch);
     }
+    ERCV(ctx.resolve_deferred_glyphs());
     auto sc_var = ctx.serialize();
     assert(std::holds_alternative<SerializedBasicContext>(sc_var));
     auto &sc = std::get<SerializedBasicContext>(sc_var);
-    ERCV(pdoc.add_page(std::move(sc.dict),
-                       std::move(sc.commands),
-                       ctx.get_form_usage(),
-                       ctx.get_annotation_usage(),
-                       ctx.get_structure_usage(),
-                       ctx.get_transition(),
-                       ctx.get_subpage_navigation()));
+    auto rc = pdoc.add_page(std::move(sc.dict),
+                            std::move(sc.commands),
+                            ctx.get_form_usage(),
+                            ctx.get_annotation_usage(),
+                            ctx.get_structure_usage(),
+                            ctx.get_marked_content(),
+                            ctx.get_transition(),
+                            ctx.get_subpage_navigation());
+    if(!rc) {
+        // The document did not take the commands, so the context keeps its contents.
+        ctx.restore_commands(std::move(sc.commands));
+        return std::unexpected(rc.error());
+    }
     ctx.clear();
     return PageId{(int32_t)pdoc.pages.size() - 1};
 }
@@ -168,11 +251,9 @@ rvoe<CapyPDF_FormXObjectId> PdfGen::add_form_xobject(PdfDrawContext &ctx) {
     auto sc_var = ctx.serialize();
     assert(std::holds_alternative<SerializedXObject>(sc_var));
     auto &sc = std::get<SerializedXObject>(sc_var);
-    pdoc.add_form_xobject(std::move(sc.dict), std::move(sc.stream));
+    ERC(fxoid, pdoc.add_form_xobject(std::move(sc.dict), std::move(sc.stream)));
     ctx.clear();
-    CapyPDF_FormXObjectId fxoid;
-    fxoid.id = (int32_t)pdoc.form_xobjects.size() - 1;
-    return rvoe<CapyPDF_FormXObjectId>{fxoid};
+    return fxoid;
 }
 
 rvoe<PatternId> PdfGen::add_pattern(ColorPatternBuilder &cp) {
@@ -193,8 +274,6 @@ rvoe<PatternId> PdfGen::add_pattern(ColorPatternBuilder &cp) {
   /XStep {:f}
   /YStep {:f}
   /Resources {}
-  /Length {}
->>
 )",
                            0.0,
                            0.0,
@@ -202,8 +281,7 @@ rvoe<PatternId> PdfGen::add_pattern(ColorPatternBuilder &cp) {
                            cp.h,
                            cp.w,
                            cp.h,
-                           resources,
-                           commands.length());
+                           resources);
 
     return pdoc.add_pattern(buf, commands);
 }
@@ -216,6 +294,10 @@ PdfDrawContext *PdfGen::new_page_draw_context() {
     return new PdfDrawContext{&pdoc, &pdoc.cm, CAPY_DC_PAGE};
 }
 
+PdfDrawContext *PdfGen::new_form_xobject_draw_context(double w, double h) {
+    return new PdfDrawContext{&pdoc, &pdoc.cm, CAPY_DC_FORM_XOBJECT, w, h};
+}
+
 ColorPatternBuilder PdfGen::new_color_pattern_builder(double w, double h) {
     return ColorPatternBuilder{PdfDrawContext{&pdoc, &pdoc.cm, CAPY_DC_COLOR_TILING}, w, h};
 }
@@ -225,36 +307,118 @@ PdfGen::utf8_text_width(const u8string &txt, CapyPDF_FontId fid, double pointsiz
     if(txt.empty()) {
         return 0;
     }
-    double w = 0;
-    FT_Face face = pdoc.fonts.at(pdoc.font_objects.at(fid.id).font_index_tmp).fontdata.face.get();
-    if(!face) {
+    ERC(glyphs, utf8_to_glyphs(txt));
+    return pdoc.text_advances(fid, pointsize, glyphs, {});
+}
+
+rvoe<PdfGlyphRun>
+PdfGen::create_glyph_run(CapyPDF_FontId fid, double pointsize, std::span<const PdfGlyph> glyphs) {
+    CHECK_INDEXNESS_V(fid.id, pdoc.font_objects);
+    auto lk = pdoc.lock_fonts();
+    auto *metrics = pdoc.font_metrics(fid);
+    if(!metrics) {
         RETERR(BuiltinFontNotSupported);
     }
-    ERC(glyphs, utf8_to_glyphs(txt));
+    const bool two_byte_codes =
+        pdoc.fonts.at(pdoc.font_objects.at(fid.id).font_index_tmp).subsets.subset_type() ==
+        FontSubsetType::CID;
+    const double scale = pointsize / metrics->units_per_em();
+    const auto precision = pdoc.opts.number_precision;
+    PdfGlyphRun run;
+    run.doc = &pdoc;
+    auto &ops = run.operators;
+    auto app = std::back_inserter(ops);
+    int32_t current_subset = -1;
+    bool in_array = false;
+    // Start of the current text line and the point where the previous
+    // glyph left the text position, both relative to the start of the run.
+    double line_x = 0;
+    double line_y = 0;
+    double pen_x = 0;
+    auto close_array = [&] {
+        if(in_array) {
+            ops += "] TJ\n";
+            in_array = false;
+        }
+    };
+    for(const auto &g : glyphs) {
+        ERC(sg, pdoc.get_subset_glyph(fid, g.codepoint));
+        const auto adv = metrics->advance(g.codepoint);
+        if(!adv) {
+            RETERR(FreeTypeError);
+        }
+        if(sg.ss.subset_id != current_subset) {
+            close_array();
+            fmt::format_to(app,
+                           "  /SFont{}-{} {} Tf\n",
+                           pdoc.font_objects.at(sg.ss.fid.id).font_obj,
+                           sg.ss.subset_id,
+                           pointsize);
+            current_subset = sg.ss.subset_id;
+            if(std::find(run.subsets.begin(), run.subsets.end(), sg.ss) == run.subsets.end()) {
+                run.subsets.push_back(sg.ss);
+            }
+        }
+        if(g.y != line_y) {
+            close_array();
+            ops += "  ";
+            append_pdf_number(ops, g.x - line_x, precision);
+            ops += ' ';
+            append_pdf_number(ops, g.y - line_y, precision);
+            ops += " Td\n";
+            line_x = pen_x = g.x;
+            line_y = g.y;
+        }
+        if(!in_array) {
+            ops += "  [";
+            in_array = true;
+        }
+        // Positive TJ adjustments move the next glyph left, in thousandths of text space.
+        const double adjustment = (pen_x - g.x) * 1000 / pointsize;
+        if(std::abs(adjustment) > 1e-6) {
+            append_pdf_number(ops, adjustment, precision);
+            ops += ' ';
+        }
+        if(two_byte_codes) {
+            fmt::format_to(app, "<{:04x}> ", sg.glyph_id);
+        } else {
+            fmt::format_to(app, "<{:02x}> ", (unsigned char)sg.glyph_id);
+        }
+        pen_x = g.x + *adv * scale;
+    }
+    close_array();
+    return run;
+}
 
-    uint32_t previous_codepoint = -1;
-    const bool has_kerning = FT_HAS_KERNING(face);
-    for(const auto codepoint : glyphs) {
-        if(has_kerning && previous_codepoint != (uint32_t)-1) {
-            FT_Vector kerning;
-            const auto index_left = FT_Get_Char_Index(face, previous_codepoint);
-            const auto index_right = FT_Get_Char_Index(face, codepoint);
-            auto ec = FT_Get_Kerning(face, index_left, index_right, FT_KERNING_DEFAULT, &kerning);
-            if(ec != 0) {
+rvoe<PdfGlyphRun>
+PdfGen::create_text_run(const u8string &txt, CapyPDF_FontId fid, double pointsize) {
+    CHECK_INDEXNESS_V(fid.id, pdoc.font_objects);
+    ERC(codepoints, utf8_to_glyphs(txt));
+    std::vector<PdfGlyph> glyphs;
+    glyphs.reserve(codepoints.size());
+    {
+        auto lk = pdoc.lock_fonts();
+        auto *metrics = pdoc.font_metrics(fid);
+        if(!metrics) {
+            RETERR(BuiltinFontNotSupported);
+        }
+        const double scale = pointsize / metrics->units_per_em();
+        int64_t x = 0;
+        uint32_t previous_codepoint = -1;
+        for(const auto codepoint : codepoints) {
+            const auto adv = metrics->advance(codepoint);
+            if(!adv) {
                 RETERR(FreeTypeError);
             }
-            if(kerning.x != 0) {
-                // None of the fonts I tested had kerning that Freetype recognized,
-                // so don't know if this actually works.
-                w += int(kerning.x) / face->units_per_EM;
+            if(previous_codepoint != (uint32_t)-1) {
+                x += metrics->kerning(previous_codepoint, codepoint);
             }
+            glyphs.push_back(PdfGlyph{codepoint, x * scale, 0});
+            x += *adv;
+            previous_codepoint = codepoint;
         }
-        auto bob = glyph_advance(fid, pointsize, codepoint);
-        assert(bob);
-        w += *bob;
-        previous_codepoint = codepoint;
     }
-    return w;
+    return create_glyph_run(fid, pointsize, glyphs);
 }
 
 } // namespace capypdf
@@ -25,6 +25,7 @@
 #include <string_view>
 #include <optional>
 #include <filesystem>
+#include <span>
 
 namespace capypdf {
 
@@ -50,13 +51,24 @@ class PdfGen {
 public:
     static rvoe<std::unique_ptr<PdfGen>> construct(const std::filesystem::path &ofname,
                                                    const PdfGenerationData &d);
-    PdfGen(PdfGen &&o) = default;
+    // The output is passed to the sink instead of being written to a file.
+    static rvoe<std::unique_ptr<PdfGen>> construct(OutputSink sink, const PdfGenerationData &d);
+    // The output is collected in memory and can be read with memory_output() after writing.
+    static rvoe<std::unique_ptr<PdfGen>> construct_in_memory(const PdfGenerationData &d);
+    // The memory sink refers to memory_buffer and the stream file is closed on
+    // destruction, so a generator can not be moved.
+    PdfGen(PdfGen &&o) = delete;
+    PdfGen &operator=(PdfGen &&o) = delete;
     ~PdfGen();
 
     rvoe<NoReturnValue> write();
 
-    rvoe<CapyPDF_ImageId> load_image(const std::filesystem::path &fname) {
-        return pdoc.load_image(fname);
+    rvoe<CapyPDF_ImageId> load_image(const std::filesystem::path &fname,
+                                     const std::optional<ImageResolutionLimit> &placement = {}) {
+        return pdoc.load_image(fname, placement);
+    }
+    rvoe<std::vector<CapyPDF_ImageId>> load_images(std::span<const std::filesystem::path> fnames) {
+        return pdoc.load_images(fnames);
     }
     rvoe<CapyPDF_ImageId> load_mask_image(const std::filesystem::path &fname) {
         return pdoc.load_mask_image(fname);
@@ -68,7 +80,7 @@ public:
         return pdoc.embed_file(fname);
     }
     rvoe<CapyPDF_FontId> load_font(const std::filesystem::path &fname) {
-        return pdoc.load_font(ft.get(), fname);
+        return pdoc.load_font(*resources, fname);
     };
 
     ImageSize get_image_info(CapyPDF_ImageId img_id) { return pdoc.image_info.at(img_id.id).s; }
@@ -104,8 +116,13 @@ public:
     }
 
     DrawContextPopper guarded_page_context();
+    // Page contexts can be filled in different threads at the same time, as
+    // long as the fonts, images and other resources they use have been created
+    // beforehand and the generator is not otherwise used meanwhile. Once they
+    // are done, pass them to add_page in page order from a single thread.
     PdfDrawContext *new_page_draw_context();
 
+    PdfDrawContext *new_form_xobject_draw_context(double w, double h);
     PdfDrawContext new_form_xobject(double w, double h) {
         return PdfDrawContext(&this->pdoc, &pdoc.cm, CAPY_DC_FORM_XOBJECT, w, h);
     }
@@ -117,6 +134,7 @@ public:
     ColorPatternBuilder new_color_pattern_builder(double w, double h);
 
     rvoe<PageId> add_page(PdfDrawContext &ctx);
+    // Adding a form XObject that is identical to an earlier one returns the earlier id.
     rvoe<CapyPDF_FormXObjectId> add_form_xobject(PdfDrawContext &ctx);
     rvoe<PatternId> add_pattern(ColorPatternBuilder &cp);
     rvoe<CapyPDF_TransparencyGroupId> add_transparency_group(PdfDrawContext &ctx,
@@ -146,16 +164,43 @@ public:
     }
 
     rvoe<double> utf8_text_width(const u8string &txt, CapyPDF_FontId fid, double pointsize) const;
+    rvoe<double> text_advances(CapyPDF_FontId fid,
+                               double pointsize,
+                               std::span<const uint32_t> codepoints,
+                               std::span<double> advances) const {
+        return pdoc.text_advances(fid, pointsize, codepoints, advances);
+    }
+
+    rvoe<PdfGlyphRun>
+    create_glyph_run(CapyPDF_FontId fid, double pointsize, std::span<const PdfGlyph> glyphs);
+    // Glyphs placed at their advance widths with kerning applied, like render_text.
+    rvoe<PdfGlyphRun>
+    create_text_run(const u8string &txt, CapyPDF_FontId fid, double pointsize);
+
+    ColorCacheStats color_cache_stats() const { return pdoc.cm.color_cache_stats(); }
+    const WriteStats &write_stats() const { return pdoc.write_stats(); }
+    int32_t num_objects() const { return pdoc.num_objects(); }
+
+    const std::string &memory_output() const { return memory_buffer; }
 
 private:
     PdfGen(std::filesystem::path ofilename,
-           std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft,
+           std::shared_ptr<PdfResourceContext> resources,
            PdfDocument pdoc)
-        : ofilename(std::move(ofilename)), ft(std::move(ft)), pdoc(std::move(pdoc)) {}
+        : ofilename(std::move(ofilename)), resources(std::move(resources)),
+          pdoc(std::move(pdoc)) {}
+
+    static rvoe<std::unique_ptr<PdfGen>> create(const PdfGenerationData &d);
+
+    std::filesystem::path temp_file_name() const;
+    rvoe<NoReturnValue> write_to_output_sink();
 
     std::filesystem::path ofilename;
-    std::unique_ptr<FT_LibraryRec_, FT_Error (*)(FT_LibraryRec_ *)> ft;
+    OutputSink output_sink; // If set, used instead of ofilename.
+    std::string memory_buffer;
+    std::shared_ptr<PdfResourceContext> resources;
     PdfDocument pdoc;
+    FILE *stream_file = nullptr; // Only used in streaming mode.
 };
 
 struct GenPopper {
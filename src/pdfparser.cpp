@@ -16,12 +16,14 @@
 
 #include <pdfparser.hpp>
 #include <strings.h>
-#include <regex>
+#include <charconv>
+#include <cstring>
 #include <string_view>
 #include <vector>
 #include <string>
 #include <unordered_map>
 #include <map>
+#include <memory>
 #include <cstdint>
 #include <cstdlib>
 #include <optional>
@@ -29,22 +31,50 @@
 #include <algorithm>
 
 #include <fmt/core.h>
+#include <zlib.h>
 
 namespace {
 
-const std::regex whitespace{R"(^\s)"};
-const std::regex dictstart{R"(^<<)"};
-const std::regex dictend{R"(^>>)"};
-const std::regex arraystart{R"(^\[)"};
-const std::regex arrayend{R"(^\])"};
-const std::regex objname{R"(^(\d+)\s+(\d+)\s+obj)"};
-const std::regex objref{R"((^\d+)\s+(\d+)\s+R)"};
-const std::regex stringlit{R"(^/([a-zA-Z][-a-zA-Z0-9+]+))"};
-const std::regex stringobj{R"(^\()"};
-const std::regex endobj{R"(^endobj)"};
-const std::regex number{R"(^-?\d+)"};
-const std::regex real{R"(^(-?\d+\.\d+))"};
-const std::regex hexstr{R"(^<([0-9a-fA-F]+)>)"};
+const int xref_entry_size = 20;
+
+bool is_whitespace(char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\0';
+}
+
+bool is_delimiter(char c) {
+    switch(c) {
+    case '(':
+    case ')':
+    case '<':
+    case '>':
+    case '[':
+    case ']':
+    case '{':
+    case '}':
+    case '/':
+    case '%':
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool is_regular(char c) { return !is_whitespace(c) && !is_delimiter(c); }
+
+bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+bool is_hex_or_space(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || is_whitespace(c);
+}
+
+std::optional<uint64_t> parse_uint(std::string_view text) {
+    uint64_t value;
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if(ec != std::errc{} || ptr == text.data()) {
+        return {};
+    }
+    return value;
+}
 
 } // namespace
 
@@ -64,113 +94,187 @@ const char *text2 = R"(9 0 obj
 endobj
 )";
 
-int PdfLexer::lex_string(const char *t) {
+std::optional<size_t> PdfLexer::lex_string(std::string_view t) const {
     bool prev_was_backslash = false;
     int num_parens = 1;
-    size_t myoff = 0;
-    while(t[myoff] != '\0') {
+    for(size_t myoff = 0; myoff < t.size(); ++myoff) {
         switch(t[myoff]) {
 
         case '\\':
-            prev_was_backslash = true;
+            prev_was_backslash = !prev_was_backslash;
             break;
 
         case '(':
-            if(prev_was_backslash) {
-
-            } else {
+            if(!prev_was_backslash) {
                 ++num_parens;
             }
             prev_was_backslash = false;
             break;
 
         case ')':
-            if(prev_was_backslash) {
-
-            } else {
+            if(!prev_was_backslash) {
                 if(--num_parens == 0) {
-                    return (int64_t)myoff + 1;
+                    return myoff;
                 }
             }
             prev_was_backslash = false;
             break;
 
-        case '\0':
-            return -1;
-
         default:
             prev_was_backslash = false;
             break;
         }
-        ++myoff;
     }
-    return -1;
+    return {};
 }
 
-PdfToken PdfLexer::next() {
-    std::cmatch m;
+void PdfLexer::skip_whitespace() {
     while(offset < text.size()) {
-        if(std::regex_search(text.c_str() + offset, m, whitespace)) {
-            offset += m.length();
-            continue;
+        if(is_whitespace(text[offset])) {
+            ++offset;
+        } else if(text[offset] == '%') {
+            while(offset < text.size() && text[offset] != '\n' && text[offset] != '\r') {
+                ++offset;
+            }
+        } else {
+            break;
         }
+    }
+}
 
-        if(std::regex_search(text.c_str() + offset, m, objname)) {
-            int64_t number = atoll(text.c_str() + offset + m.position(1));
-            int64_t version = atoll(text.c_str() + offset + m.position(2));
-            offset += m.length();
-            return PdfTokenObjName(number, version);
-        } else if(std::regex_search(text.c_str() + offset, m, dictstart)) {
-            offset += m.length();
+std::optional<PdfToken> PdfLexer::lex_number() {
+    const auto start = offset;
+    auto end = start;
+    while(end < text.size() && is_regular(text[end])) {
+        ++end;
+    }
+    const auto word = text.substr(start, end - start);
+    if(word.find('.') != std::string_view::npos) {
+        double value;
+        const char *first = word.data() + (word.front() == '+' ? 1 : 0);
+        auto [ptr, ec] = std::from_chars(first, word.data() + word.size(), value);
+        if(ec != std::errc{} || ptr != word.data() + word.size()) {
+            return {};
+        }
+        offset = end;
+        return PdfTokenReal{value};
+    }
+    int64_t value;
+    const char *first = word.data() + (word.front() == '+' ? 1 : 0);
+    auto [ptr, ec] = std::from_chars(first, word.data() + word.size(), value);
+    if(ec != std::errc{} || ptr != word.data() + word.size()) {
+        return {};
+    }
+    offset = end;
+    if(!is_digit(word.front())) {
+        return PdfTokenInteger{value};
+    }
+    // "N G obj" and "N G R" are lexed as single tokens.
+    const auto integer_end = offset;
+    skip_whitespace();
+    auto second_end = offset;
+    while(second_end < text.size() && is_digit(text[second_end])) {
+        ++second_end;
+    }
+    if(second_end != offset && second_end < text.size() && is_whitespace(text[second_end])) {
+        const auto version = parse_uint(text.substr(offset, second_end - offset));
+        offset = second_end;
+        skip_whitespace();
+        auto keyword_end = offset;
+        while(keyword_end < text.size() && is_regular(text[keyword_end])) {
+            ++keyword_end;
+        }
+        const auto keyword = text.substr(offset, keyword_end - offset);
+        if(version && keyword == "obj") {
+            offset = keyword_end;
+            return PdfTokenObjName((int)value, (int)*version);
+        }
+        if(version && keyword == "R") {
+            offset = keyword_end;
+            return PdfTokenObjRef((int)value, (int)*version);
+        }
+    }
+    offset = integer_end;
+    return PdfTokenInteger{value};
+}
+
+PdfToken PdfLexer::next() {
+    skip_whitespace();
+    if(offset >= text.size()) {
+        return PdfTokenFinished{};
+    }
+    const char c = text[offset];
+    switch(c) {
+    case '<':
+        if(offset + 1 < text.size() && text[offset + 1] == '<') {
+            offset += 2;
             return PdfTokenDictStart();
-        } else if(std::regex_search(text.c_str() + offset, m, dictend)) {
-            offset += m.length();
-            return PdfTokenDictEnd();
-        } else if(std::regex_search(text.c_str() + offset, m, arraystart)) {
-            offset += m.length();
-            return PdfTokenArrayStart{};
-        } else if(std::regex_search(text.c_str() + offset, m, arrayend)) {
-            offset += m.length();
-            return PdfTokenArrayEnd{};
-        } else if(std::regex_search(text.c_str() + offset, m, stringlit)) {
-            std::string name(text.c_str() + offset + 1, m.length(1));
-            offset += m.length();
-            return PdfTokenStringLiteral{std::move(name)};
-        } else if(std::regex_search(text.c_str() + offset, m, objref)) {
-            int64_t onum = atoll(text.c_str() + offset);
-            int64_t version = atoll(text.c_str() + offset + m.position(2));
-            offset += m.length();
-            return PdfTokenObjRef(onum, version);
-        } else if(std::regex_search(text.c_str() + offset, m, stringobj)) {
-            ++offset;
-            auto advance = lex_string(text.c_str() + offset);
-            if(advance < 0) {
-                // std::cout << "\nParent string parsing failed.\n";
+        } else {
+            const auto end = text.find('>', offset);
+            if(end == std::string_view::npos) {
                 return PdfTokenError{};
             }
-            std::string temptext(text.c_str() + offset, advance);
-            offset += advance;
-            return PdfTokenString(std::move(temptext));
-        } else if(std::regex_search(text.c_str() + offset, m, real)) {
-            double value = strtod(text.c_str() + offset, nullptr);
-            offset += m.length();
-            return PdfTokenReal{value};
-        } else if(std::regex_search(text.c_str() + offset, m, number)) {
-            int64_t value = atoll(text.c_str() + offset);
-            offset += m.length();
-            return PdfTokenInteger{value};
-        } else if(std::regex_search(text.c_str() + offset, m, endobj)) {
-            offset += m.length();
-            return PdfTokenEndObj{};
-        } else if(std::regex_search(text.c_str() + offset, m, hexstr)) {
-            std::string hexs(text.c_str() + offset + m.position(1), m.length(1));
-            offset += m.length();
-            return PdfTokenHexString{std::move(hexs)};
-        } else {
+            const auto hexs = text.substr(offset + 1, end - offset - 1);
+            if(!std::all_of(hexs.begin(), hexs.end(), is_hex_or_space)) {
+                return PdfTokenError{};
+            }
+            offset = end + 1;
+            return PdfTokenHexString{hexs};
+        }
+    case '>':
+        if(offset + 1 < text.size() && text[offset + 1] == '>') {
+            offset += 2;
+            return PdfTokenDictEnd();
+        }
+        return PdfTokenError{};
+    case '[':
+        ++offset;
+        return PdfTokenArrayStart{};
+    case ']':
+        ++offset;
+        return PdfTokenArrayEnd{};
+    case '(': {
+        ++offset;
+        auto length = lex_string(text.substr(offset));
+        if(!length) {
             return PdfTokenError{};
         }
+        const auto str = text.substr(offset, *length);
+        offset += *length + 1;
+        return PdfTokenString(str);
     }
-    return PdfTokenFinished{};
+    case '/': {
+        auto end = offset + 1;
+        while(end < text.size() && is_regular(text[end])) {
+            ++end;
+        }
+        const auto name = text.substr(offset + 1, end - offset - 1);
+        offset = end;
+        return PdfTokenStringLiteral{name};
+    }
+    default:
+        break;
+    }
+    if(is_digit(c) || c == '-' || c == '+' || c == '.') {
+        auto number = lex_number();
+        if(!number) {
+            return PdfTokenError{};
+        }
+        return std::move(*number);
+    }
+    if(!is_regular(c)) {
+        return PdfTokenError{};
+    }
+    auto end = offset;
+    while(end < text.size() && is_regular(text[end])) {
+        ++end;
+    }
+    const auto word = text.substr(offset, end - offset);
+    offset = end;
+    if(word == "endobj") {
+        return PdfTokenEndObj{};
+    }
+    return PdfTokenKeyword{word};
 }
 
 std::optional<PdfObjectDefinition> PdfParser::parse() {
@@ -204,13 +308,25 @@ std::optional<PdfValueElement> PdfParser::parse_value() {
         return PdfNodeObjRef{refval->objnum, refval->version};
     }
     if(auto strval = accept<PdfTokenString>(); strval) {
-        return PdfNodeString{strval->text};
+        return PdfNodeString{std::string{strval->text}};
     }
     if(auto strval = accept<PdfTokenStringLiteral>(); strval) {
-        return PdfNodeStringLiteral{strval->text};
+        return PdfNodeStringLiteral{std::string{strval->text}};
     }
     if(auto strval = accept<PdfTokenHexString>(); strval) {
-        return PdfNodeHexString{strval->text};
+        return PdfNodeHexString{std::string{strval->text}};
+    }
+    if(auto keyword = accept<PdfTokenKeyword>(); keyword) {
+        if(keyword->text == "true") {
+            return true;
+        }
+        if(keyword->text == "false") {
+            return false;
+        }
+        if(keyword->text == "null") {
+            return PdfNodeNull{};
+        }
+        return {};
     }
     if(auto dictval = accept<PdfTokenDictStart>(); dictval) {
         auto dict_id = parse_dict();
@@ -247,7 +363,7 @@ std::optional<size_t> PdfParser::parse_dict() {
         if(!v) {
             return {};
         }
-        dict[k->text] = std::move(*v);
+        dict[std::string{k->text}] = std::move(*v);
     }
 }
 
@@ -266,6 +382,489 @@ std::optional<size_t> PdfParser::parse_array() {
     }
 }
 
+namespace {
+
+// Finds the object at the given offset. A negative object number accepts any.
+std::optional<PdfObjectData>
+object_at(std::string_view data, uint64_t offset, int64_t object_num) {
+    if(offset >= data.size()) {
+        return {};
+    }
+    const auto objdata = data.substr(offset);
+    PdfLexer lex(objdata);
+    auto header = lex.next();
+    if(!std::holds_alternative<PdfTokenObjName>(header) ||
+       (object_num >= 0 && std::get<PdfTokenObjName>(header).number != object_num)) {
+        return {};
+    }
+    // Walk over the object's value to find where it ends, picking up
+    // a direct /Length on the way.
+    int depth = 0;
+    bool length_key = false;
+    std::optional<uint64_t> length;
+    do {
+        auto t = lex.next();
+        if(std::holds_alternative<PdfTokenDictStart>(t) ||
+           std::holds_alternative<PdfTokenArrayStart>(t)) {
+            ++depth;
+        } else if(std::holds_alternative<PdfTokenDictEnd>(t) ||
+                  std::holds_alternative<PdfTokenArrayEnd>(t)) {
+            --depth;
+        } else if(std::holds_alternative<PdfTokenStringLiteral>(t)) {
+            length_key = depth == 1 && std::get<PdfTokenStringLiteral>(t).text == "Length";
+            continue;
+        } else if(std::holds_alternative<PdfTokenInteger>(t)) {
+            if(length_key && std::get<PdfTokenInteger>(t).value >= 0) {
+                length = std::get<PdfTokenInteger>(t).value;
+            }
+        } else if(std::holds_alternative<PdfTokenError>(t) ||
+                  std::holds_alternative<PdfTokenFinished>(t) ||
+                  std::holds_alternative<PdfTokenEndObj>(t)) {
+            return {};
+        }
+        length_key = false;
+    } while(depth > 0);
+    PdfObjectData od;
+    const auto value_end = lex.position();
+    auto t = lex.next();
+    if(std::holds_alternative<PdfTokenKeyword>(t) &&
+       std::get<PdfTokenKeyword>(t).text == "stream") {
+        od.dict = objdata.substr(0, value_end);
+        auto stream_start = lex.position();
+        if(stream_start < objdata.size() && objdata[stream_start] == '\r') {
+            ++stream_start;
+        }
+        if(stream_start < objdata.size() && objdata[stream_start] == '\n') {
+            ++stream_start;
+        }
+        if(length && stream_start + *length <= objdata.size() &&
+           objdata.substr(stream_start + *length).find("endstream") < 3) {
+            od.stream = objdata.substr(stream_start, *length);
+        } else {
+            // The length is indirect or wrong, so look for the end marker.
+            auto endstream = objdata.find("endstream", stream_start);
+            if(endstream == std::string_view::npos) {
+                return {};
+            }
+            while(endstream > stream_start &&
+                  (objdata[endstream - 1] == '\n' || objdata[endstream - 1] == '\r')) {
+                --endstream;
+            }
+            od.stream = objdata.substr(stream_start, endstream - stream_start);
+        }
+    } else {
+        const auto endobj = objdata.find("endobj");
+        if(endobj == std::string_view::npos) {
+            return {};
+        }
+        od.dict = objdata.substr(0, endobj);
+    }
+    return od;
+}
+
+const PdfDict *dict_of(const PdfObjectDefinition &def) {
+    if(!std::holds_alternative<PdfNodeDict>(def.root)) {
+        return nullptr;
+    }
+    return &def.dicts.at(std::get<PdfNodeDict>(def.root).i);
+}
+
+std::optional<int64_t> dict_int(const PdfDict &dict, const char *key) {
+    auto it = dict.find(key);
+    if(it == dict.end() || !std::holds_alternative<int64_t>(it->second)) {
+        return {};
+    }
+    return std::get<int64_t>(it->second);
+}
+
+bool has_name(const PdfDict &dict, const char *key, const char *value) {
+    auto it = dict.find(key);
+    return it != dict.end() && std::holds_alternative<PdfNodeStringLiteral>(it->second) &&
+           std::get<PdfNodeStringLiteral>(it->second).value == value;
+}
+
+uint64_t read_field(std::string_view bytes) {
+    uint64_t value = 0;
+    for(const auto c : bytes) {
+        value = (value << 8) | (uint8_t)c;
+    }
+    return value;
+}
+
+} // namespace
+
+std::optional<PdfObjectIndex> PdfObjectIndex::create(std::string_view file_data) {
+    if(file_data.find("%PDF-") != 0) {
+        return {};
+    }
+    const auto xrefloc = file_data.rfind("startxref");
+    if(xrefloc == std::string_view::npos) {
+        return {};
+    }
+    PdfLexer lex(file_data.substr(xrefloc + strlen("startxref")));
+    auto xref_start = lex.next();
+    if(!std::holds_alternative<PdfTokenInteger>(xref_start)) {
+        return {};
+    }
+    PdfObjectIndex index(file_data);
+    std::optional<uint64_t> section = std::get<PdfTokenInteger>(xref_start).value;
+    // Newer revisions are read first, so entries that are already set win.
+    std::vector<bool> seen;
+    // Guards against /Prev loops in broken files.
+    std::vector<uint64_t> visited;
+    while(section) {
+        if(std::find(visited.begin(), visited.end(), *section) != visited.end()) {
+            return {};
+        }
+        visited.push_back(*section);
+        std::optional<uint64_t> prev;
+        if(!index.read_xref_section(*section, seen, prev)) {
+            return {};
+        }
+        section = prev;
+    }
+    index.located.resize(index.entries.size());
+    return index;
+}
+
+bool PdfObjectIndex::read_xref_section(uint64_t xref_offset,
+                                       std::vector<bool> &seen,
+                                       std::optional<uint64_t> &prev) {
+    if(xref_offset >= data.size()) {
+        return false;
+    }
+    auto xref = data.substr(xref_offset);
+    if(xref.find("xref") != 0) {
+        return read_xref_stream(xref_offset, seen, prev);
+    }
+    size_t pos = 4;
+    while(true) {
+        pos = xref.find_first_not_of(" \t\r\n", pos);
+        if(pos == std::string_view::npos) {
+            return false;
+        }
+        if(xref.substr(pos).starts_with("trailer")) {
+            pos += strlen("trailer");
+            break;
+        }
+        PdfLexer header(xref.substr(pos));
+        auto first = header.next();
+        auto count = header.next();
+        if(!std::holds_alternative<PdfTokenInteger>(first) ||
+           !std::holds_alternative<PdfTokenInteger>(count)) {
+            return false;
+        }
+        const auto first_obj = std::get<PdfTokenInteger>(first).value;
+        const auto num_objects = std::get<PdfTokenInteger>(count).value;
+        // Every object needs at least one byte in the file and every entry takes
+        // xref_entry_size bytes, so this bounds the table by the file size.
+        if(first_obj < 0 || num_objects < 0 || first_obj > (int64_t)data.size() ||
+           num_objects > (int64_t)(xref.size() / xref_entry_size)) {
+            return false;
+        }
+        const auto entry_start = xref.find_first_not_of(" \r\n", pos + header.position());
+        if(entry_start == std::string_view::npos ||
+           entry_start + num_objects * xref_entry_size > xref.size()) {
+            return false;
+        }
+        const auto needed = size_t(first_obj + num_objects);
+        if(entries.size() < needed) {
+            entries.resize(needed);
+            seen.resize(needed, false);
+        }
+        for(int64_t i = 0; i < num_objects; ++i) {
+            const auto line = xref.substr(entry_start + i * xref_entry_size, xref_entry_size);
+            const auto offset = parse_uint(line.substr(0, 10));
+            const auto generation = parse_uint(line.substr(11, 5));
+            if(!offset || !generation || (line[17] != 'n' && line[17] != 'f')) {
+                return false;
+            }
+            const auto object_num = size_t(first_obj + i);
+            if(seen[object_num]) {
+                continue;
+            }
+            seen[object_num] = true;
+            entries[object_num] = PdfXrefEntry{line[17] == 'n', (int32_t)*generation, *offset};
+        }
+        pos = entry_start + num_objects * xref_entry_size;
+    }
+    PdfLexer lex(xref.substr(pos));
+    // Only /Prev is needed from the trailer.
+    int depth = 0;
+    bool prev_key = false;
+    do {
+        auto t = lex.next();
+        if(std::holds_alternative<PdfTokenDictStart>(t)) {
+            ++depth;
+        } else if(std::holds_alternative<PdfTokenDictEnd>(t)) {
+            --depth;
+        } else if(std::holds_alternative<PdfTokenStringLiteral>(t)) {
+            prev_key = depth == 1 && std::get<PdfTokenStringLiteral>(t).text == "Prev";
+            continue;
+        } else if(std::holds_alternative<PdfTokenInteger>(t)) {
+            if(prev_key) {
+                prev = std::get<PdfTokenInteger>(t).value;
+            }
+        } else if(std::holds_alternative<PdfTokenError>(t) ||
+                  std::holds_alternative<PdfTokenFinished>(t)) {
+            return false;
+        }
+        prev_key = false;
+    } while(depth > 0);
+    return true;
+}
+
+bool PdfObjectIndex::read_xref_stream(uint64_t xref_offset,
+                                      std::vector<bool> &seen,
+                                      std::optional<uint64_t> &prev) {
+    auto od = object_at(data, xref_offset, -1);
+    if(!od) {
+        return false;
+    }
+    PdfParser parser(od->dict);
+    auto def = parser.parse();
+    const auto *dict = def ? dict_of(*def) : nullptr;
+    // Predictors would need PNG row filtering, which is not implemented.
+    if(!dict || !has_name(*dict, "Type", "XRef") || dict->contains("DecodeParms")) {
+        return false;
+    }
+    std::string decoded;
+    if(has_name(*dict, "Filter", "FlateDecode")) {
+        auto inflated = inflate_stream(od->stream);
+        if(!inflated) {
+            return false;
+        }
+        decoded = std::move(*inflated);
+    } else if(!dict->contains("Filter")) {
+        decoded = od->stream;
+    } else {
+        return false;
+    }
+    const auto size = dict_int(*dict, "Size");
+    const auto w_it = dict->find("W");
+    if(!size || *size < 0 || w_it == dict->end() ||
+       !std::holds_alternative<PdfNodeArray>(w_it->second)) {
+        return false;
+    }
+    const auto &w_arr = def->arrays.at(std::get<PdfNodeArray>(w_it->second).i);
+    if(w_arr.size() != 3) {
+        return false;
+    }
+    int64_t widths[3];
+    for(int i = 0; i < 3; ++i) {
+        if(!std::holds_alternative<int64_t>(w_arr[i])) {
+            return false;
+        }
+        widths[i] = std::get<int64_t>(w_arr[i]);
+        if(widths[i] < 0 || widths[i] > 8) {
+            return false;
+        }
+    }
+    const size_t entry_size = widths[0] + widths[1] + widths[2];
+    if(entry_size == 0) {
+        return false;
+    }
+    std::vector<int64_t> subsections;
+    if(auto index_it = dict->find("Index"); index_it != dict->end()) {
+        if(!std::holds_alternative<PdfNodeArray>(index_it->second)) {
+            return false;
+        }
+        for(const auto &v : def->arrays.at(std::get<PdfNodeArray>(index_it->second).i)) {
+            if(!std::holds_alternative<int64_t>(v)) {
+                return false;
+            }
+            subsections.push_back(std::get<int64_t>(v));
+        }
+        if(subsections.size() % 2 != 0) {
+            return false;
+        }
+    } else {
+        subsections = {0, *size};
+    }
+    if(auto prev_offset = dict_int(*dict, "Prev"); prev_offset) {
+        prev = *prev_offset;
+    }
+    size_t pos = 0;
+    for(size_t s = 0; s < subsections.size(); s += 2) {
+        const auto first_obj = subsections[s];
+        const auto num_objects = subsections[s + 1];
+        // As with xref tables, every entry must be present in the stream data.
+        if(first_obj < 0 || num_objects < 0 || first_obj > (int64_t)data.size() ||
+           num_objects > (int64_t)((decoded.size() - pos) / entry_size)) {
+            return false;
+        }
+        const auto needed = size_t(first_obj + num_objects);
+        if(entries.size() < needed) {
+            entries.resize(needed);
+            seen.resize(needed, false);
+        }
+        for(int64_t i = 0; i < num_objects; ++i) {
+            const auto line = std::string_view{decoded}.substr(pos, entry_size);
+            pos += entry_size;
+            // A missing type field means that the object is in use.
+            const auto type = widths[0] == 0 ? 1 : read_field(line.substr(0, widths[0]));
+            const auto field2 = read_field(line.substr(widths[0], widths[1]));
+            const auto field3 = read_field(line.substr(widths[0] + widths[1], widths[2]));
+            const auto object_num = size_t(first_obj + i);
+            if(seen[object_num]) {
+                continue;
+            }
+            seen[object_num] = true;
+            if(type == 1) {
+                entries[object_num] = PdfXrefEntry{true, (int32_t)field3, field2};
+            } else if(type == 2) {
+                if(field2 == 0 || field2 == object_num) {
+                    return false;
+                }
+                entries[object_num] = PdfXrefEntry{true, 0, 0, field2, (uint32_t)field3};
+            } else {
+                // Free entries and unknown types both read as the null object.
+                entries[object_num] = PdfXrefEntry{false, (int32_t)field3, 0};
+            }
+        }
+    }
+    return true;
+}
+
+std::optional<PdfObjectData> PdfObjectIndex::object(size_t object_num) {
+    if(object_num >= entries.size() || !entries[object_num].in_use) {
+        return {};
+    }
+    if(!located[object_num]) {
+        located[object_num] = locate_object(object_num);
+    }
+    return located[object_num];
+}
+
+std::optional<PdfObjectData> PdfObjectIndex::locate_object(size_t object_num) {
+    const auto &e = entries[object_num];
+    if(e.stream_obj != 0) {
+        return unpack_object(object_num);
+    }
+    return object_at(data, e.offset, object_num);
+}
+
+std::optional<PdfObjectData> PdfObjectIndex::unpack_object(size_t object_num) {
+    const auto container = entries[object_num].stream_obj;
+    const auto index = entries[object_num].index;
+    // Object streams can not be inside other object streams.
+    if(container >= entries.size() || entries[container].stream_obj != 0) {
+        return {};
+    }
+    auto def = parse_object(container);
+    const auto *dict = def ? dict_of(*def) : nullptr;
+    if(!dict || !has_name(*dict, "Type", "ObjStm")) {
+        return {};
+    }
+    const auto num_objects = dict_int(*dict, "N");
+    const auto first = dict_int(*dict, "First");
+    if(!num_objects || !first || *first < 0 || index >= *num_objects) {
+        return {};
+    }
+    auto it = object_streams.find(container);
+    if(it == object_streams.end()) {
+        auto decoded = decoded_stream(container);
+        if(!decoded) {
+            return {};
+        }
+        it = object_streams.emplace(container, std::move(*decoded)).first;
+    }
+    const std::string_view contents = it->second;
+    if((size_t)*first > contents.size()) {
+        return {};
+    }
+    // The header has a pair of object number and offset for every object.
+    PdfLexer header(contents.substr(0, *first));
+    std::optional<uint64_t> start;
+    uint64_t end = contents.size() - *first;
+    for(uint32_t i = 0; i <= index + 1 && i < *num_objects; ++i) {
+        auto number = header.next();
+        auto offset = header.next();
+        if(!std::holds_alternative<PdfTokenInteger>(number) ||
+           !std::holds_alternative<PdfTokenInteger>(offset) ||
+           std::get<PdfTokenInteger>(offset).value < 0) {
+            return {};
+        }
+        if(i == index) {
+            if(std::get<PdfTokenInteger>(number).value != (int64_t)object_num) {
+                return {};
+            }
+            start = std::get<PdfTokenInteger>(offset).value;
+        } else if(i == index + 1) {
+            end = std::get<PdfTokenInteger>(offset).value;
+        }
+    }
+    if(!start || *start > end || end > contents.size() - *first) {
+        return {};
+    }
+    const auto value = contents.substr(*first + *start, end - *start);
+    unpacked.emplace_back(
+        std::make_unique<std::string>(fmt::format("{} 0 obj\n{}\n", object_num, value)));
+    return PdfObjectData{*unpacked.back(), {}};
+}
+
+std::optional<PdfObjectDefinition> PdfObjectIndex::parse_object(size_t object_num) {
+    auto od = object(object_num);
+    if(!od) {
+        return {};
+    }
+    PdfParser parser(od->dict);
+    return parser.parse();
+}
+
+std::optional<std::string> PdfObjectIndex::decoded_stream(size_t object_num) {
+    auto od = object(object_num);
+    if(!od) {
+        return {};
+    }
+    bool is_flate = false;
+    if(auto def = parse_object(object_num); def) {
+        const auto *dict = dict_of(*def);
+        is_flate = dict && has_name(*dict, "Filter", "FlateDecode");
+    } else {
+        // Fall back to text matching for dictionaries the parser can not read.
+        is_flate = od->dict.find("/FlateDecode") != std::string_view::npos;
+    }
+    if(!is_flate) {
+        return std::string{od->stream};
+    }
+    return inflate_stream(od->stream);
+}
+
+std::optional<std::string> inflate_stream(std::string_view compressed) {
+    std::string inflated;
+    const int CHUNK = 1024 * 1024;
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = 0;
+    strm.next_in = Z_NULL;
+    if(inflateInit(&strm) != Z_OK) {
+        return {};
+    }
+    std::unique_ptr<z_stream, int (*)(z_stream *)> zcloser(&strm, inflateEnd);
+    strm.avail_in = compressed.size();
+    strm.next_in = (Bytef *)compressed.data(); // zlib header is const-broken
+    int ret;
+    do {
+        const auto old_size = inflated.size();
+        inflated.resize(old_size + CHUNK);
+        strm.avail_out = CHUNK;
+        strm.next_out = (Bytef *)inflated.data() + old_size;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        inflated.resize(old_size + CHUNK - strm.avail_out);
+        if(ret != Z_OK && ret != Z_STREAM_END) {
+            return {};
+        }
+        if(ret == Z_OK && strm.avail_in == 0 && strm.avail_out != 0) {
+            // Truncated input.
+            return {};
+        }
+    } while(ret != Z_STREAM_END);
+    return inflated;
+}
+
 std::string PrettyPrinter::prettyprint() {
     fmt::format_to(app, "{}obj {} {}\n", indent, def.number, def.version);
     print_value(def.root);
@@ -301,6 +900,10 @@ void PrettyPrinter::print_value(const PdfValueElement &e, bool with_indent) {
     } else if(std::holds_alternative<double>(e)) {
         const auto &v = std::get<double>(e);
         fmt::format_to(app, "{}{}\n", ind, v);
+    } else if(std::holds_alternative<bool>(e)) {
+        fmt::format_to(app, "{}{}\n", ind, std::get<bool>(e) ? "true" : "false");
+    } else if(std::holds_alternative<PdfNodeNull>(e)) {
+        fmt::format_to(app, "{}null\n", ind);
     } else if(std::holds_alternative<PdfNodeArray>(e)) {
         const auto &v = std::get<PdfNodeArray>(e);
         fmt::format_to(app, "{}[\n", ind);
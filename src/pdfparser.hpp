@@ -16,7 +16,10 @@
 
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <optional>
 #include <vector>
@@ -31,13 +34,13 @@ struct PdfTokenDictStart {};
 struct PdfTokenDictEnd {};
 
 struct PdfTokenString {
-    explicit PdfTokenString(std::string s) : text(std::move(s)) {}
-    std::string text;
+    explicit PdfTokenString(std::string_view s) : text(s) {}
+    std::string_view text;
 };
 
 struct PdfTokenStringLiteral {
-    explicit PdfTokenStringLiteral(std::string s) : text(std::move(s)) {}
-    std::string text;
+    explicit PdfTokenStringLiteral(std::string_view s) : text(s) {}
+    std::string_view text;
 };
 
 struct PdfTokenObjName {
@@ -47,8 +50,8 @@ struct PdfTokenObjName {
 };
 
 struct PdfTokenHexString {
-    explicit PdfTokenHexString(std::string s) : text(std::move(s)) {}
-    std::string text;
+    explicit PdfTokenHexString(std::string_view s) : text(s) {}
+    std::string_view text;
 };
 
 struct PdfTokenObjRef {
@@ -69,6 +72,12 @@ struct PdfTokenReal {
 
 struct PdfTokenEndObj {};
 
+// Any other bare word, such as true, null or stream.
+struct PdfTokenKeyword {
+    explicit PdfTokenKeyword(std::string_view s) : text(s) {}
+    std::string_view text;
+};
+
 struct PdfTokenFinished {};
 
 struct PdfTokenError {};
@@ -82,6 +91,7 @@ typedef std::variant<PdfTokenDictStart,
                      PdfTokenObjName,
                      PdfTokenObjRef,
                      PdfTokenEndObj,
+                     PdfTokenKeyword,
                      PdfTokenHexString,
                      PdfTokenInteger,
                      PdfTokenReal,
@@ -89,16 +99,21 @@ typedef std::variant<PdfTokenDictStart,
                      PdfTokenFinished>
     PdfToken;
 
+// Tokens refer to the lexed text, which must outlive them.
 class PdfLexer {
 public:
     explicit PdfLexer(const char *t) : text(t), offset(0) {}
     explicit PdfLexer(std::string_view t) : text(t), offset(0) {}
 
-    int lex_string(const char *t);
     PdfToken next();
+    size_t position() const { return offset; }
 
 private:
-    std::string text;
+    std::optional<size_t> lex_string(std::string_view t) const;
+    std::optional<PdfToken> lex_number();
+    void skip_whitespace();
+
+    std::string_view text;
     size_t offset;
 };
 
@@ -121,9 +136,12 @@ struct PdfNodeStringLiteral {
 struct PdfNodeHexString {
     std::string value;
 };
+struct PdfNodeNull {};
 
 typedef std::variant<int64_t,
                      double,
+                     bool,
+                     PdfNodeNull,
                      PdfNodeArray,
                      PdfNodeDict,
                      PdfNodeObjRef,
@@ -179,6 +197,66 @@ private:
     PdfObjectDefinition objdef;
 };
 
+struct PdfXrefEntry {
+    bool in_use = false;
+    int32_t generation = 0;
+    uint64_t offset = 0;
+    // For objects stored in an object stream, the stream's object number and
+    // the position of the object in it.
+    uint64_t stream_obj = 0;
+    uint32_t index = 0;
+};
+
+// Views into the file data. The dictionary part starts with the "N G obj" header.
+// For objects taken out of an object stream the header is added when unpacking.
+struct PdfObjectData {
+    std::string_view dict;
+    std::string_view stream;
+};
+
+// Random access to the objects of a file through its cross reference
+// tables, following /Prev to older revisions. Objects are located the
+// first time they are asked for and streams are only decompressed on
+// request, so opening a file only reads the trailer and the xref.
+// Both xref tables and xref streams are read, as are objects in object
+// streams. The /XRefStm entry of hybrid files and xref streams with
+// predictors are not supported.
+class PdfObjectIndex {
+public:
+    static std::optional<PdfObjectIndex> create(std::string_view file_data);
+
+    size_t size() const { return entries.size(); }
+    const PdfXrefEntry &entry(size_t object_num) const { return entries.at(object_num); }
+
+    std::optional<PdfObjectData> object(size_t object_num);
+    std::optional<PdfObjectDefinition> parse_object(size_t object_num);
+    // Undoes /FlateDecode. Streams with other filters are returned as is.
+    std::optional<std::string> decoded_stream(size_t object_num);
+
+private:
+    explicit PdfObjectIndex(std::string_view file_data) : data(file_data) {}
+
+    bool read_xref_section(uint64_t xref_offset,
+                           std::vector<bool> &seen,
+                           std::optional<uint64_t> &prev);
+    bool read_xref_stream(uint64_t xref_offset,
+                          std::vector<bool> &seen,
+                          std::optional<uint64_t> &prev);
+    std::optional<PdfObjectData> locate_object(size_t object_num);
+    std::optional<PdfObjectData> unpack_object(size_t object_num);
+
+    std::string_view data;
+    std::vector<PdfXrefEntry> entries;
+    std::vector<std::optional<PdfObjectData>> located;
+    // Decoded object streams and the objects unpacked from them. Located
+    // entries point into these.
+    std::unordered_map<size_t, std::string> object_streams;
+    std::vector<std::unique_ptr<std::string>> unpacked;
+};
+
+// Inflates a complete zlib stream.
+std::optional<std::string> inflate_stream(std::string_view compressed);
+
 class PrettyPrinter {
 public:
     explicit PrettyPrinter(PdfObjectDefinition p) : def{p}, app{std::back_inserter(output)} {}
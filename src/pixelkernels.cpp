@@ -0,0 +1,421 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pixelkernels.hpp>
+#include <atomic>
+#include <cassert>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CAPYPDF_X86_KERNELS
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define CAPYPDF_NEON_KERNELS
+#include <arm_neon.h>
+#endif
+
+namespace capypdf {
+
+namespace {
+
+std::atomic<KernelLevel> max_kernel_level{KernelLevel::NEON};
+
+bool level_allowed(KernelLevel level) { return level <= max_kernel_level.load(); }
+
+// The scalar versions start from the given index so that they can finish
+// whatever tail the vector versions leave over.
+
+void split_alpha_scalar(const uint8_t *src,
+                        size_t start,
+                        size_t num_pixels,
+                        size_t color_channels,
+                        uint8_t *color,
+                        uint8_t *alpha) {
+    const size_t stride = color_channels + 1;
+    for(size_t i = start; i < num_pixels; ++i) {
+        for(size_t c = 0; c < color_channels; ++c) {
+            color[i * color_channels + c] = src[i * stride + c];
+        }
+        alpha[i] = src[i * stride + color_channels];
+    }
+}
+
+void narrow_scalar(const uint16_t *src, size_t start, size_t num_samples, uint8_t *dst) {
+    for(size_t i = start; i < num_samples; ++i) {
+        dst[i] = uint8_t(src[i] >> 8);
+    }
+}
+
+void invert_scalar(uint8_t *data, size_t start, size_t num_bytes) {
+    for(size_t i = start; i < num_bytes; ++i) {
+        data[i] = ~data[i];
+    }
+}
+
+// The vector versions only write whole bytes, so start is a multiple of 8.
+void pack_bits_scalar(
+    const uint8_t *src, size_t start, size_t num_pixels, uint8_t on_value, uint8_t *dst) {
+    assert(start % 8 == 0);
+    for(size_t i = start; i < num_pixels; i += 8) {
+        uint8_t byte = 0;
+        for(size_t bit = 0; bit < 8; ++bit) {
+            byte <<= 1;
+            if(i + bit < num_pixels && src[i + bit] == on_value) {
+                byte |= 1;
+            }
+        }
+        dst[i / 8] = byte;
+    }
+}
+
+void interleave_scalar(const uint8_t *const *planes,
+                       size_t num_planes,
+                       size_t start,
+                       size_t num_pixels,
+                       uint8_t *dst) {
+    for(size_t i = start; i < num_pixels; ++i) {
+        for(size_t p = 0; p < num_planes; ++p) {
+            dst[i * num_planes + p] = planes[p][i];
+        }
+    }
+}
+
+#if defined(CAPYPDF_X86_KERNELS)
+
+__attribute__((target("sse2"))) size_t
+split_gray_alpha_sse2(const uint8_t *src, size_t num_pixels, uint8_t *color, uint8_t *alpha) {
+    const __m128i low_mask = _mm_set1_epi16(0xff);
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        const __m128i g = _mm_packus_epi16(_mm_and_si128(a, low_mask), _mm_and_si128(b, low_mask));
+        const __m128i al = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(color + i), g);
+        _mm_storeu_si128((__m128i *)(alpha + i), al);
+    }
+    return i;
+}
+
+__attribute__((target("ssse3"))) size_t
+split_rgb_alpha_ssse3(const uint8_t *src, size_t num_pixels, uint8_t *color, uint8_t *alpha) {
+    // Pack the RGB bytes of four pixels to the low 12 bytes.
+    const __m128i rgb_shuffle =
+        _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    // Move the four alpha bytes to position 4*k for the k'th input vector.
+    const __m128i alpha_shuffle[4] = {
+        _mm_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1),
+        _mm_setr_epi8(-1, -1, -1, -1, 3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1),
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 3, 7, 11, 15, -1, -1, -1, -1),
+        _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 3, 7, 11, 15)};
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const uint8_t *in = src + 4 * i;
+        __m128i v[4];
+        __m128i c[4];
+        __m128i al = _mm_setzero_si128();
+        for(int k = 0; k < 4; ++k) {
+            v[k] = _mm_loadu_si128((const __m128i *)(in + 16 * k));
+            c[k] = _mm_shuffle_epi8(v[k], rgb_shuffle);
+            al = _mm_or_si128(al, _mm_shuffle_epi8(v[k], alpha_shuffle[k]));
+        }
+        uint8_t *out = color + 3 * i;
+        _mm_storeu_si128((__m128i *)out, _mm_or_si128(c[0], _mm_slli_si128(c[1], 12)));
+        _mm_storeu_si128((__m128i *)(out + 16),
+                         _mm_or_si128(_mm_srli_si128(c[1], 4), _mm_slli_si128(c[2], 8)));
+        _mm_storeu_si128((__m128i *)(out + 32),
+                         _mm_or_si128(_mm_srli_si128(c[2], 8), _mm_slli_si128(c[3], 4)));
+        _mm_storeu_si128((__m128i *)(alpha + i), al);
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) size_t
+narrow_sse2(const uint16_t *src, size_t num_samples, uint8_t *dst) {
+    size_t i = 0;
+    for(; i + 16 <= num_samples; i += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t
+narrow_avx2(const uint16_t *src, size_t num_samples, uint8_t *dst) {
+    size_t i = 0;
+    for(; i + 32 <= num_samples; i += 32) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+        // The pack works within 128 bit lanes, so put the quadwords back in order.
+        const __m256i packed =
+            _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) size_t invert_sse2(uint8_t *data, size_t num_bytes) {
+    const __m128i ones = _mm_set1_epi8(-1);
+    size_t i = 0;
+    for(; i + 16 <= num_bytes; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, ones));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t invert_avx2(uint8_t *data, size_t num_bytes) {
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for(; i + 32 <= num_bytes; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, ones));
+    }
+    return i;
+}
+
+// Movemask puts the first pixel in the lowest bit, so reverse each group of
+// eight bytes before taking the mask.
+__attribute__((target("ssse3"))) size_t
+pack_bits_ssse3(const uint8_t *src, size_t num_pixels, uint8_t on_value, uint8_t *dst) {
+    const __m128i reverse = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m128i on = _mm_set1_epi8((char)on_value);
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        const int mask = _mm_movemask_epi8(_mm_shuffle_epi8(_mm_cmpeq_epi8(v, on), reverse));
+        dst[i / 8] = uint8_t(mask);
+        dst[i / 8 + 1] = uint8_t(mask >> 8);
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) size_t
+pack_bits_avx2(const uint8_t *src, size_t num_pixels, uint8_t on_value, uint8_t *dst) {
+    // The shuffle works within 128 bit lanes, which is all the reversal needs.
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i on = _mm256_set1_epi8((char)on_value);
+    size_t i = 0;
+    for(; i + 32 <= num_pixels; i += 32) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        const uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+            _mm256_shuffle_epi8(_mm256_cmpeq_epi8(v, on), reverse));
+        for(size_t k = 0; k < 4; ++k) {
+            dst[i / 8 + k] = uint8_t(mask >> (8 * k));
+        }
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) size_t
+interleave4_sse2(const uint8_t *const *planes, size_t num_pixels, uint8_t *dst) {
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const __m128i p0 = _mm_loadu_si128((const __m128i *)(planes[0] + i));
+        const __m128i p1 = _mm_loadu_si128((const __m128i *)(planes[1] + i));
+        const __m128i p2 = _mm_loadu_si128((const __m128i *)(planes[2] + i));
+        const __m128i p3 = _mm_loadu_si128((const __m128i *)(planes[3] + i));
+        const __m128i lo01 = _mm_unpacklo_epi8(p0, p1);
+        const __m128i hi01 = _mm_unpackhi_epi8(p0, p1);
+        const __m128i lo23 = _mm_unpacklo_epi8(p2, p3);
+        const __m128i hi23 = _mm_unpackhi_epi8(p2, p3);
+        uint8_t *out = dst + 4 * i;
+        _mm_storeu_si128((__m128i *)out, _mm_unpacklo_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i *)(out + 16), _mm_unpackhi_epi16(lo01, lo23));
+        _mm_storeu_si128((__m128i *)(out + 32), _mm_unpacklo_epi16(hi01, hi23));
+        _mm_storeu_si128((__m128i *)(out + 48), _mm_unpackhi_epi16(hi01, hi23));
+    }
+    return i;
+}
+
+#elif defined(CAPYPDF_NEON_KERNELS)
+
+size_t
+split_gray_alpha_neon(const uint8_t *src, size_t num_pixels, uint8_t *color, uint8_t *alpha) {
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const uint8x16x2_t v = vld2q_u8(src + 2 * i);
+        vst1q_u8(color + i, v.val[0]);
+        vst1q_u8(alpha + i, v.val[1]);
+    }
+    return i;
+}
+
+size_t
+split_rgb_alpha_neon(const uint8_t *src, size_t num_pixels, uint8_t *color, uint8_t *alpha) {
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const uint8x16x4_t v = vld4q_u8(src + 4 * i);
+        const uint8x16x3_t rgb = {{v.val[0], v.val[1], v.val[2]}};
+        vst3q_u8(color + 3 * i, rgb);
+        vst1q_u8(alpha + i, v.val[3]);
+    }
+    return i;
+}
+
+size_t narrow_neon(const uint16_t *src, size_t num_samples, uint8_t *dst) {
+    size_t i = 0;
+    for(; i + 16 <= num_samples; i += 16) {
+        const uint8x8_t lo = vshrn_n_u16(vld1q_u16(src + i), 8);
+        const uint8x8_t hi = vshrn_n_u16(vld1q_u16(src + i + 8), 8);
+        vst1q_u8(dst + i, vcombine_u8(lo, hi));
+    }
+    return i;
+}
+
+size_t invert_neon(uint8_t *data, size_t num_bytes) {
+    size_t i = 0;
+    for(; i + 16 <= num_bytes; i += 16) {
+        vst1q_u8(data + i, vmvnq_u8(vld1q_u8(data + i)));
+    }
+    return i;
+}
+
+size_t pack_bits_neon(const uint8_t *src, size_t num_pixels, uint8_t on_value, uint8_t *dst) {
+    const uint8_t weights[16] = {128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1};
+    const uint8x16_t w = vld1q_u8(weights);
+    const uint8x16_t on = vdupq_n_u8(on_value);
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        const uint8x16_t bits = vandq_u8(vceqq_u8(vld1q_u8(src + i), on), w);
+        // Adding up each group of eight weights gives one packed byte.
+        const uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(bits)));
+        dst[i / 8] = uint8_t(vgetq_lane_u64(sums, 0));
+        dst[i / 8 + 1] = uint8_t(vgetq_lane_u64(sums, 1));
+    }
+    return i;
+}
+
+size_t interleave_neon(const uint8_t *const *planes,
+                       size_t num_planes,
+                       size_t num_pixels,
+                       uint8_t *dst) {
+    size_t i = 0;
+    for(; i + 16 <= num_pixels; i += 16) {
+        if(num_planes == 3) {
+            const uint8x16x3_t v = {
+                {vld1q_u8(planes[0] + i), vld1q_u8(planes[1] + i), vld1q_u8(planes[2] + i)}};
+            vst3q_u8(dst + 3 * i, v);
+        } else {
+            const uint8x16x4_t v = {{vld1q_u8(planes[0] + i),
+                                     vld1q_u8(planes[1] + i),
+                                     vld1q_u8(planes[2] + i),
+                                     vld1q_u8(planes[3] + i)}};
+            vst4q_u8(dst + 4 * i, v);
+        }
+    }
+    return i;
+}
+
+#endif
+
+} // namespace
+
+void set_max_kernel_level(KernelLevel level) { max_kernel_level = level; }
+
+void split_alpha(const uint8_t *src,
+                 size_t num_pixels,
+                 size_t color_channels,
+                 uint8_t *color,
+                 uint8_t *alpha) {
+    assert(color_channels == 1 || color_channels == 3);
+    size_t done = 0;
+#if defined(CAPYPDF_X86_KERNELS)
+    if(color_channels == 1 && level_allowed(KernelLevel::SSE2) &&
+       __builtin_cpu_supports("sse2")) {
+        done = split_gray_alpha_sse2(src, num_pixels, color, alpha);
+    } else if(color_channels == 3 && level_allowed(KernelLevel::SSSE3) &&
+              __builtin_cpu_supports("ssse3")) {
+        done = split_rgb_alpha_ssse3(src, num_pixels, color, alpha);
+    }
+#elif defined(CAPYPDF_NEON_KERNELS)
+    if(level_allowed(KernelLevel::NEON)) {
+        done = color_channels == 1 ? split_gray_alpha_neon(src, num_pixels, color, alpha)
+                                   : split_rgb_alpha_neon(src, num_pixels, color, alpha);
+    }
+#endif
+    split_alpha_scalar(src, done, num_pixels, color_channels, color, alpha);
+}
+
+void narrow_16_to_8(const uint16_t *src, size_t num_samples, uint8_t *dst) {
+    size_t done = 0;
+#if defined(CAPYPDF_X86_KERNELS)
+    if(level_allowed(KernelLevel::AVX2) && __builtin_cpu_supports("avx2")) {
+        done = narrow_avx2(src, num_samples, dst);
+    } else if(level_allowed(KernelLevel::SSE2) && __builtin_cpu_supports("sse2")) {
+        done = narrow_sse2(src, num_samples, dst);
+    }
+#elif defined(CAPYPDF_NEON_KERNELS)
+    if(level_allowed(KernelLevel::NEON)) {
+        done = narrow_neon(src, num_samples, dst);
+    }
+#endif
+    narrow_scalar(src, done, num_samples, dst);
+}
+
+void invert_bytes(uint8_t *data, size_t num_bytes) {
+    size_t done = 0;
+#if defined(CAPYPDF_X86_KERNELS)
+    if(level_allowed(KernelLevel::AVX2) && __builtin_cpu_supports("avx2")) {
+        done = invert_avx2(data, num_bytes);
+    } else if(level_allowed(KernelLevel::SSE2) && __builtin_cpu_supports("sse2")) {
+        done = invert_sse2(data, num_bytes);
+    }
+#elif defined(CAPYPDF_NEON_KERNELS)
+    if(level_allowed(KernelLevel::NEON)) {
+        done = invert_neon(data, num_bytes);
+    }
+#endif
+    invert_scalar(data, done, num_bytes);
+}
+
+void pack_bits(const uint8_t *src, size_t num_pixels, uint8_t on_value, uint8_t *dst) {
+    size_t done = 0;
+#if defined(CAPYPDF_X86_KERNELS)
+    if(level_allowed(KernelLevel::AVX2) && __builtin_cpu_supports("avx2")) {
+        done = pack_bits_avx2(src, num_pixels, on_value, dst);
+    } else if(level_allowed(KernelLevel::SSSE3) && __builtin_cpu_supports("ssse3")) {
+        done = pack_bits_ssse3(src, num_pixels, on_value, dst);
+    }
+#elif defined(CAPYPDF_NEON_KERNELS)
+    if(level_allowed(KernelLevel::NEON)) {
+        done = pack_bits_neon(src, num_pixels, on_value, dst);
+    }
+#endif
+    pack_bits_scalar(src, done, num_pixels, on_value, dst);
+}
+
+void interleave_planes(const uint8_t *const *planes,
+                       size_t num_planes,
+                       size_t num_pixels,
+                       uint8_t *dst) {
+    assert(num_planes == 3 || num_planes == 4);
+    size_t done = 0;
+#if defined(CAPYPDF_X86_KERNELS)
+    if(num_planes == 4 && level_allowed(KernelLevel::SSE2) && __builtin_cpu_supports("sse2")) {
+        done = interleave4_sse2(planes, num_pixels, dst);
+    }
+#elif defined(CAPYPDF_NEON_KERNELS)
+    if(level_allowed(KernelLevel::NEON)) {
+        done = interleave_neon(planes, num_planes, num_pixels, dst);
+    }
+#endif
+    interleave_scalar(planes, num_planes, done, num_pixels, dst);
+}
+
+} // namespace capypdf
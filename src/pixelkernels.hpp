@@ -0,0 +1,62 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace capypdf {
+
+// Bulk pixel conversions used by the image loaders. The implementation
+// picks an SSE2, SSSE3, AVX2 or NEON version at runtime where one exists
+// and falls back to plain loops otherwise. Results are identical on all paths.
+
+// The instruction sets in increasing order of preference.
+enum class KernelLevel : int { Scalar, SSE2, SSSE3, AVX2, NEON };
+
+// Limits the kernels to the given level and below. Meant for tests that
+// compare the vector versions with the plain loops.
+void set_max_kernel_level(KernelLevel level);
+
+// Splits interleaved pixels with a trailing alpha channel into separate color
+// and alpha planes. Only one (gray+alpha) and three (RGB+alpha) color channels
+// are supported.
+void split_alpha(const uint8_t *src,
+                 size_t num_pixels,
+                 size_t color_channels,
+                 uint8_t *color,
+                 uint8_t *alpha);
+
+// Reduces 16 bit samples to 8 bits by keeping the high byte.
+void narrow_16_to_8(const uint16_t *src, size_t num_samples, uint8_t *dst);
+
+void invert_bytes(uint8_t *data, size_t num_bytes);
+
+// Packs one byte per pixel into one bit per pixel, most significant bit
+// first. A bit is set when its byte equals on_value. Writes
+// (num_pixels + 7) / 8 bytes and leaves the unused low bits of the last one
+// as zero.
+void pack_bits(const uint8_t *src, size_t num_pixels, uint8_t on_value, uint8_t *dst);
+
+// Interleaves separate color planes into pixels, e.g. the C, M, Y and K
+// planes of a planar TIFF. Only three and four planes are supported.
+void interleave_planes(const uint8_t *const *planes,
+                       size_t num_planes,
+                       size_t num_pixels,
+                       uint8_t *dst);
+
+} // namespace capypdf
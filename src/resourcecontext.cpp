@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <resourcecontext.hpp>
+#include <utils.hpp>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+namespace capypdf {
+
+void FaceCloser::operator()(FT_Face face) const {
+    std::lock_guard<std::mutex> lk(owner->ft_mutex);
+    FT_Done_Face(face);
+}
+
+rvoe<std::shared_ptr<PdfResourceContext>>
+PdfResourceContext::construct(const std::filesystem::path &rgb_profile_fname,
+                              const std::filesystem::path &gray_profile_fname,
+                              const std::filesystem::path &cmyk_profile_fname) {
+    ERC(profiles,
+        ColorProfileSet::construct(rgb_profile_fname, gray_profile_fname, cmyk_profile_fname));
+    FT_Library ft;
+    auto error = FT_Init_FreeType(&ft);
+    if(error) {
+        RETERR(FreeTypeError);
+    }
+    return std::shared_ptr<PdfResourceContext>(new PdfResourceContext(ft, std::move(profiles)));
+}
+
+PdfResourceContext::PdfResourceContext(FT_Library ft, std::shared_ptr<ColorProfileSet> profiles)
+    : ft{ft}, profiles{std::move(profiles)} {}
+
+PdfResourceContext::~PdfResourceContext() { FT_Done_FreeType(ft); }
+
+rvoe<FaceHandle> PdfResourceContext::open_face(std::shared_ptr<const MappedFile> file) {
+    FT_Face face;
+    {
+        std::lock_guard<std::mutex> lk(ft_mutex);
+        const auto data = file->data();
+        auto error =
+            FT_New_Memory_Face(ft, (const FT_Byte *)data.data(), (FT_Long)data.size(), 0, &face);
+        if(error) {
+            // By default Freetype is compiled without
+            // error strings. Yay!
+            RETERR(FreeTypeError);
+        }
+    }
+    return FaceHandle{face, FaceCloser{shared_from_this(), std::move(file)}};
+}
+
+} // namespace capypdf
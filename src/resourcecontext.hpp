@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errorhandling.hpp>
+#include <pdfcolorconverter.hpp>
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+
+typedef struct FT_LibraryRec_ *FT_Library;
+typedef struct FT_FaceRec_ *FT_Face;
+
+namespace capypdf {
+
+class PdfResourceContext;
+
+class MappedFile;
+
+// Faces are closed under the lock of the library that opened them.
+struct FaceCloser {
+    std::shared_ptr<PdfResourceContext> owner;
+    // The memory FreeType reads the face from. Released after the face is closed.
+    std::shared_ptr<const MappedFile> file;
+    void operator()(FT_Face face) const;
+};
+
+typedef std::unique_ptr<FT_FaceRec_, FaceCloser> FaceHandle;
+
+// Resources that do not change once loaded, so that documents generated
+// at the same time in different threads can share them: the FreeType
+// library, the color profiles and the transforms between them. Parsed
+// font files are shared through FontCache.
+class PdfResourceContext : public std::enable_shared_from_this<PdfResourceContext> {
+public:
+    static rvoe<std::shared_ptr<PdfResourceContext>>
+    construct(const std::filesystem::path &rgb_profile_fname,
+              const std::filesystem::path &gray_profile_fname,
+              const std::filesystem::path &cmyk_profile_fname);
+
+    PdfResourceContext(const PdfResourceContext &) = delete;
+    ~PdfResourceContext();
+
+    // A face may only be used by one thread at a time, so every document
+    // opens its own. The faces read the shared file contents and do not
+    // copy them.
+    rvoe<FaceHandle> open_face(std::shared_ptr<const MappedFile> file);
+
+    const std::shared_ptr<ColorProfileSet> &color_profiles() const { return profiles; }
+
+private:
+    friend struct FaceCloser;
+    PdfResourceContext(FT_Library ft, std::shared_ptr<ColorProfileSet> profiles);
+
+    // FreeType requires creating and destroying faces of one library to be serialized.
+    std::mutex ft_mutex;
+    FT_Library ft;
+    std::shared_ptr<ColorProfileSet> profiles;
+};
+
+} // namespace capypdf
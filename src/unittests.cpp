@@ -0,0 +1,678 @@
+/*
+ * Copyright 2023 Jussi Pakkanen
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Tests for internal code that is not reachable through the C API.
+//
+// Usage: unittests [test names]
+
+#include <imageops.hpp>
+#include <pdfgen.hpp>
+#include <pdfparser.hpp>
+#include <pixelkernels.hpp>
+#include <fmt/core.h>
+#include <zlib.h>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace capypdf;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if(!(cond)) {                                                                              \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);               \
+            ++failures;                                                                            \
+        }                                                                                          \
+    } while(false)
+
+std::vector<uint8_t> random_bytes(size_t size) {
+    std::mt19937 gen(size);
+    std::uniform_int_distribution<int> dist(0, 255);
+    std::vector<uint8_t> bytes(size);
+    for(auto &b : bytes) {
+        b = uint8_t(dist(gen));
+    }
+    return bytes;
+}
+
+// Sizes around the vector widths so that every tail length is covered.
+std::vector<size_t> kernel_sizes() {
+    std::vector<size_t> sizes;
+    for(size_t i = 0; i < 70; ++i) {
+        sizes.push_back(i);
+    }
+    sizes.push_back(1000);
+    sizes.push_back(4099);
+    return sizes;
+}
+
+const KernelLevel vector_levels[] = {
+    KernelLevel::SSE2, KernelLevel::SSSE3, KernelLevel::AVX2, KernelLevel::NEON};
+
+// Runs the given kernel with only the plain loops and at every vector level
+// and checks that the outputs match. Levels the CPU lacks fall back to a
+// lower one, which is still a valid comparison.
+void compare_with_scalar(const std::function<std::vector<uint8_t>(size_t)> &kernel) {
+    for(const auto size : kernel_sizes()) {
+        set_max_kernel_level(KernelLevel::Scalar);
+        const auto expected = kernel(size);
+        for(const auto level : vector_levels) {
+            set_max_kernel_level(level);
+            if(kernel(size) != expected) {
+                fprintf(stderr, "Mismatch at level %d for size %zu.\n", (int)level, size);
+                ++failures;
+            }
+        }
+    }
+    set_max_kernel_level(KernelLevel::NEON);
+}
+
+void test_split_alpha() {
+    for(const size_t channels : {1, 3}) {
+        compare_with_scalar([channels](size_t num_pixels) {
+            const auto src = random_bytes(num_pixels * (channels + 1));
+            std::vector<uint8_t> out(num_pixels * (channels + 1));
+            uint8_t *alpha = out.data() + num_pixels * channels;
+            split_alpha(src.data(), num_pixels, channels, out.data(), alpha);
+            return out;
+        });
+    }
+    const uint8_t rgba[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t color[6];
+    uint8_t alpha[2];
+    split_alpha(rgba, 2, 3, color, alpha);
+    const uint8_t expected_color[] = {1, 2, 3, 5, 6, 7};
+    CHECK(memcmp(color, expected_color, sizeof(color)) == 0);
+    CHECK(alpha[0] == 4 && alpha[1] == 8);
+}
+
+void test_narrow() {
+    compare_with_scalar([](size_t num_samples) {
+        const auto bytes = random_bytes(num_samples * 2);
+        std::vector<uint16_t> src(num_samples);
+        memcpy(src.data(), bytes.data(), bytes.size());
+        std::vector<uint8_t> out(num_samples);
+        narrow_16_to_8(src.data(), num_samples, out.data());
+        return out;
+    });
+    const uint16_t samples[] = {0x0000, 0x00ff, 0x1234, 0xff00, 0xffff};
+    uint8_t out[5];
+    narrow_16_to_8(samples, 5, out);
+    const uint8_t expected[] = {0x00, 0x00, 0x12, 0xff, 0xff};
+    CHECK(memcmp(out, expected, sizeof(out)) == 0);
+}
+
+void test_invert() {
+    compare_with_scalar([](size_t num_bytes) {
+        auto data = random_bytes(num_bytes);
+        invert_bytes(data.data(), num_bytes);
+        return data;
+    });
+    uint8_t data[] = {0x00, 0x0f, 0xff};
+    invert_bytes(data, 3);
+    CHECK(data[0] == 0xff && data[1] == 0xf0 && data[2] == 0x00);
+}
+
+void test_pack_bits() {
+    compare_with_scalar([](size_t num_pixels) {
+        auto src = random_bytes(num_pixels);
+        for(auto &b : src) {
+            b &= 1;
+        }
+        std::vector<uint8_t> out((num_pixels + 7) / 8);
+        pack_bits(src.data(), num_pixels, 1, out.data());
+        return out;
+    });
+    // The first pixel goes to the high bit and padding stays zero.
+    const uint8_t pixels[] = {1, 0, 0, 0, 0, 0, 0, 1, 0, 1, 1};
+    uint8_t out[2];
+    pack_bits(pixels, 11, 1, out);
+    CHECK(out[0] == 0x81 && out[1] == 0x60);
+    pack_bits(pixels, 11, 0, out);
+    CHECK(out[0] == 0x7e && out[1] == 0x80);
+}
+
+void test_interleave_planes() {
+    for(const size_t num_planes : {3, 4}) {
+        compare_with_scalar([num_planes](size_t num_pixels) {
+            const auto src = random_bytes(num_pixels * num_planes);
+            const uint8_t *planes[4];
+            for(size_t p = 0; p < num_planes; ++p) {
+                planes[p] = src.data() + p * num_pixels;
+            }
+            std::vector<uint8_t> out(num_pixels * num_planes);
+            interleave_planes(planes, num_planes, num_pixels, out.data());
+            return out;
+        });
+    }
+    const uint8_t c[] = {1, 5}, m[] = {2, 6}, y[] = {3, 7}, k[] = {4, 8};
+    const uint8_t *cmyk[] = {c, m, y, k};
+    uint8_t out[8];
+    interleave_planes(cmyk, 4, 2, out);
+    const uint8_t expected[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    CHECK(memcmp(out, expected, sizeof(out)) == 0);
+}
+
+std::string inflate(const std::string &compressed, size_t size) {
+    std::string result(size, '\0');
+    uLongf result_size = size;
+    if(uncompress((Bytef *)result.data(),
+                  &result_size,
+                  (const Bytef *)compressed.data(),
+                  compressed.size()) != Z_OK) {
+        return "";
+    }
+    result.resize(result_size);
+    return result;
+}
+
+void test_flate_compressor() {
+    // Half noise and half runs so that both stored and compressed blocks show up.
+    const auto noise = random_bytes(150000);
+    std::string data((const char *)noise.data(), noise.size());
+    data += std::string(150000, 'x');
+    // Level -1 is zlib's default, which libdeflate does not know.
+    for(const int level : {-1, 0, 6, 9}) {
+        std::string streamed;
+        auto compressor = FlateCompressor::create(level, string_sink(streamed));
+        CHECK(compressor);
+        if(!compressor) {
+            continue;
+        }
+        for(size_t offset = 0; offset < data.size(); offset += 70000) {
+            CHECK((*compressor)->append(std::string_view(data).substr(offset, 70000)));
+        }
+        CHECK((*compressor)->finish());
+        CHECK(!(*compressor)->append("x"));
+        CHECK(inflate(streamed, data.size()) == data);
+        const auto oneshot = flate_compress(data, level);
+        CHECK(oneshot && inflate(*oneshot, data.size()) == data);
+    }
+}
+
+std::string generate_test_pdf(bool object_streams = false) {
+    PdfGenerationData opts;
+    opts.compression.page_content = 6;
+    opts.object_streams = object_streams;
+    auto gen = std::move(PdfGen::construct_in_memory(opts).value());
+    std::unique_ptr<PdfDrawContext> ctx{gen->new_page_draw_context()};
+    ctx->cmd_rg(0.2, 0.4, 0.8);
+    for(int i = 0; i < 100; ++i) {
+        ctx->cmd_re(10, 20 + i, 30, 40);
+    }
+    ctx->cmd_f();
+    CHECK(gen->add_page(*ctx));
+    CHECK(gen->write());
+    return gen->memory_output();
+}
+
+const PdfDict *root_dict(const PdfObjectDefinition &def) {
+    if(!std::holds_alternative<PdfNodeDict>(def.root)) {
+        return nullptr;
+    }
+    return &def.dicts.at(std::get<PdfNodeDict>(def.root).i);
+}
+
+bool has_name(const PdfDict &dict, const std::string &key, const std::string &value) {
+    auto it = dict.find(key);
+    return it != dict.end() && std::holds_alternative<PdfNodeStringLiteral>(it->second) &&
+           std::get<PdfNodeStringLiteral>(it->second).value == value;
+}
+
+void check_parsed_test_pdf(const std::string &pdf, bool object_streams) {
+    auto index = PdfObjectIndex::create(pdf);
+    CHECK(index);
+    if(!index) {
+        return;
+    }
+    CHECK(index->size() > 1);
+    CHECK(!index->entry(0).in_use);
+    int catalogs = 0;
+    int pages = 0;
+    int packed = 0;
+    bool found_content = false;
+    for(size_t i = 1; i < index->size(); ++i) {
+        CHECK(index->entry(i).in_use);
+        packed += index->entry(i).stream_obj != 0;
+        auto def = index->parse_object(i);
+        CHECK(def && def->number == (int64_t)i);
+        const auto *dict = def ? root_dict(*def) : nullptr;
+        if(!dict) {
+            continue;
+        }
+        catalogs += has_name(*dict, "Type", "Catalog");
+        pages += has_name(*dict, "Type", "Page");
+        if(dict->contains("Filter")) {
+            auto decoded = index->decoded_stream(i);
+            CHECK(decoded);
+            if(decoded && decoded->find("10 119 30 40 re") != std::string::npos) {
+                found_content = true;
+            }
+        }
+    }
+    CHECK(catalogs == 1);
+    CHECK(pages == 1);
+    CHECK(found_content);
+    CHECK((packed > 0) == object_streams);
+}
+
+void test_parser() {
+    const auto pdf = generate_test_pdf();
+    check_parsed_test_pdf(pdf, false);
+    // Uses an xref stream and puts the dictionaries in object streams.
+    check_parsed_test_pdf(generate_test_pdf(true), true);
+
+    PdfParser keywords("3 0 obj\n<< /A true /B false /C null /D [ true 1 ] >>\nendobj\n");
+    auto def = keywords.parse();
+    CHECK(def && root_dict(*def));
+    if(def && root_dict(*def)) {
+        const auto &dict = *root_dict(*def);
+        CHECK(dict.size() == 4);
+        if(dict.size() == 4) {
+            CHECK(std::holds_alternative<bool>(dict.at("A")) && std::get<bool>(dict.at("A")));
+            CHECK(std::holds_alternative<bool>(dict.at("B")) && !std::get<bool>(dict.at("B")));
+            CHECK(std::holds_alternative<PdfNodeNull>(dict.at("C")));
+            CHECK(std::holds_alternative<PdfNodeArray>(dict.at("D")));
+        }
+    }
+    CHECK(!PdfParser("3 0 obj\n<< /A maybe >>\nendobj\n").parse());
+
+    // An xref section that claims object numbers far beyond the file size.
+    auto broken = pdf;
+    const auto xref = broken.rfind("xref\n0 ");
+    CHECK(xref != std::string::npos);
+    broken.replace(xref, 7, "xref\n2000000000 ");
+    CHECK(!PdfObjectIndex::create(broken));
+    CHECK(!PdfObjectIndex::create(pdf.substr(0, pdf.size() / 2)));
+}
+
+const PdfValueElement *dict_value(const PdfDict &dict, const std::string &key) {
+    auto it = dict.find(key);
+    return it == dict.end() ? nullptr : &it->second;
+}
+
+int64_t ref_target(const PdfValueElement *value) {
+    if(!value || !std::holds_alternative<PdfNodeObjRef>(*value)) {
+        return -1;
+    }
+    return std::get<PdfNodeObjRef>(*value).obj;
+}
+
+void test_structure() {
+    PdfGenerationData opts;
+    auto gen = std::move(PdfGen::construct_in_memory(opts).value());
+    const auto doc_item = gen->add_structure_item("Document", {}).value();
+    const auto para1 = gen->add_structure_item("P", doc_item).value();
+    std::unique_ptr<PdfDrawContext> ctx{gen->new_page_draw_context()};
+    ctx->cmd_BDC(doc_item);
+    ctx->cmd_re(10, 10, 20, 20);
+    ctx->cmd_f();
+    ctx->cmd_EMC();
+    ctx->cmd_BDC(para1);
+    ctx->cmd_re(40, 10, 20, 20);
+    ctx->cmd_f();
+    ctx->cmd_EMC();
+    CHECK(gen->add_page(*ctx));
+    // Added after the page, so it must come after the MCID in the kids.
+    const auto para2 = gen->add_structure_item("P", doc_item).value();
+    (void)para2;
+    CHECK(gen->write());
+    auto index = PdfObjectIndex::create(gen->memory_output());
+    CHECK(index);
+    if(!index) {
+        return;
+    }
+    std::vector<PdfObjectDefinition> objects(index->size());
+    int64_t catalog = -1;
+    int64_t tree_root = -1;
+    std::vector<int64_t> elements;
+    for(size_t i = 1; i < index->size(); ++i) {
+        auto def = index->parse_object(i);
+        CHECK(def);
+        if(!def || !root_dict(*def)) {
+            continue;
+        }
+        objects[i] = std::move(*def);
+        const auto &dict = *root_dict(objects[i]);
+        if(has_name(dict, "Type", "Catalog")) {
+            catalog = i;
+        } else if(has_name(dict, "Type", "StructTreeRoot")) {
+            tree_root = i;
+        } else if(has_name(dict, "Type", "StructElem")) {
+            elements.push_back(i);
+        }
+    }
+    CHECK(catalog > 0 && tree_root > 0 && elements.size() == 3);
+    if(catalog < 0 || tree_root < 0 || elements.size() != 3) {
+        return;
+    }
+    const auto &catalog_def = objects[catalog];
+    const auto &catalog_dict = *root_dict(catalog_def);
+    CHECK(ref_target(dict_value(catalog_dict, "StructTreeRoot")) == tree_root);
+    const auto *mark_info = dict_value(catalog_dict, "MarkInfo");
+    CHECK(mark_info && std::holds_alternative<PdfNodeDict>(*mark_info));
+    if(mark_info && std::holds_alternative<PdfNodeDict>(*mark_info)) {
+        const auto &mark_dict = catalog_def.dicts.at(std::get<PdfNodeDict>(*mark_info).i);
+        const auto *marked = dict_value(mark_dict, "Marked");
+        CHECK(marked && std::holds_alternative<bool>(*marked) && std::get<bool>(*marked));
+    }
+
+    // Structure items are created in order, so elements are Document, P, P.
+    const auto &root = *root_dict(objects[tree_root]);
+    const auto *root_kids = dict_value(root, "K");
+    CHECK(root_kids && std::holds_alternative<PdfNodeArray>(*root_kids));
+    if(root_kids && std::holds_alternative<PdfNodeArray>(*root_kids)) {
+        const auto &kids = objects[tree_root].arrays.at(std::get<PdfNodeArray>(*root_kids).i);
+        CHECK(kids.size() == 1 && ref_target(&kids[0]) == elements[0]);
+    }
+    const auto parent_tree = ref_target(dict_value(root, "ParentTree"));
+    CHECK(parent_tree > 0 && (size_t)parent_tree < objects.size());
+    if(parent_tree > 0 && (size_t)parent_tree < objects.size() && root_dict(objects[parent_tree])) {
+        const auto &pt = objects[parent_tree];
+        const auto *nums = dict_value(*root_dict(pt), "Nums");
+        CHECK(nums && std::holds_alternative<PdfNodeArray>(*nums));
+        if(nums && std::holds_alternative<PdfNodeArray>(*nums)) {
+            const auto &entries = pt.arrays.at(std::get<PdfNodeArray>(*nums).i);
+            CHECK(entries.size() == 2 && std::holds_alternative<int64_t>(entries[0]) &&
+                  std::get<int64_t>(entries[0]) == 0);
+            if(entries.size() == 2 && std::holds_alternative<PdfNodeArray>(entries[1])) {
+                const auto &mcids = pt.arrays.at(std::get<PdfNodeArray>(entries[1]).i);
+                CHECK(mcids.size() == 2 && ref_target(&mcids[0]) == elements[0] &&
+                      ref_target(&mcids[1]) == elements[1]);
+            } else {
+                CHECK(false);
+            }
+        }
+    }
+
+    const auto &doc_def = objects[elements[0]];
+    const auto *doc_kids = dict_value(*root_dict(doc_def), "K");
+    CHECK(doc_kids && std::holds_alternative<PdfNodeArray>(*doc_kids));
+    if(doc_kids && std::holds_alternative<PdfNodeArray>(*doc_kids)) {
+        const auto &kids = doc_def.arrays.at(std::get<PdfNodeArray>(*doc_kids).i);
+        CHECK(kids.size() == 3);
+        if(kids.size() == 3) {
+            CHECK(ref_target(&kids[0]) == elements[1]);
+            CHECK(std::holds_alternative<int64_t>(kids[1]) && std::get<int64_t>(kids[1]) == 0);
+            CHECK(ref_target(&kids[2]) == elements[2]);
+        }
+    }
+    CHECK(!dict_value(*root_dict(objects[elements[2]]), "Pg"));
+}
+
+void test_structure_parent_tree() {
+    // More pages than fit in one number tree node to get a two level tree.
+    const int64_t num_pages = 70;
+    PdfGenerationData opts;
+    opts.object_streams = true;
+    auto gen = std::move(PdfGen::construct_in_memory(opts).value());
+    const auto doc_item = gen->add_structure_item("Document", {}).value();
+    std::unique_ptr<PdfDrawContext> ctx{gen->new_page_draw_context()};
+    for(int64_t i = 0; i < num_pages; ++i) {
+        const auto para = gen->add_structure_item("P", doc_item).value();
+        CHECK(ctx->cmd_BDC(para) == ErrorCode::NoError);
+        ctx->cmd_re(10, 10, 20, 20);
+        ctx->cmd_f();
+        ctx->cmd_EMC();
+        CHECK(gen->add_page(*ctx));
+    }
+    std::unique_ptr<PdfDrawContext> form{gen->new_form_xobject_draw_context(10, 10)};
+    CHECK(form->cmd_BDC(doc_item) == ErrorCode::StructureOutsidePage);
+    CHECK(form->marked_content_depth() == 0);
+    CHECK(gen->write());
+    auto index = PdfObjectIndex::create(gen->memory_output());
+    CHECK(index);
+    if(!index) {
+        return;
+    }
+    std::vector<PdfObjectDefinition> objects(index->size());
+    int64_t tree_root = -1;
+    for(size_t i = 1; i < index->size(); ++i) {
+        auto def = index->parse_object(i);
+        CHECK(def);
+        if(!def || !root_dict(*def)) {
+            continue;
+        }
+        objects[i] = std::move(*def);
+        if(has_name(*root_dict(objects[i]), "Type", "StructTreeRoot")) {
+            tree_root = i;
+        }
+    }
+    CHECK(tree_root > 0);
+    if(tree_root < 0) {
+        return;
+    }
+    auto array_of = [&](int64_t obj,
+                        const std::string &key) -> const std::vector<PdfValueElement> * {
+        if(obj <= 0 || (size_t)obj >= objects.size() || !root_dict(objects[obj])) {
+            return nullptr;
+        }
+        const auto *value = dict_value(*root_dict(objects[obj]), key);
+        if(!value || !std::holds_alternative<PdfNodeArray>(*value)) {
+            return nullptr;
+        }
+        return &objects[obj].arrays.at(std::get<PdfNodeArray>(*value).i);
+    };
+    const auto parent_tree = ref_target(dict_value(*root_dict(objects[tree_root]), "ParentTree"));
+    const auto *root_kids = array_of(parent_tree, "Kids");
+    CHECK(root_kids && root_kids->size() == 2);
+    CHECK(!array_of(parent_tree, "Nums") && !array_of(parent_tree, "Limits"));
+    if(!root_kids) {
+        return;
+    }
+    int64_t next_key = 0;
+    for(const auto &kid : *root_kids) {
+        const auto leaf = ref_target(&kid);
+        const auto *limits = array_of(leaf, "Limits");
+        const auto *nums = array_of(leaf, "Nums");
+        CHECK(limits && limits->size() == 2 && nums && nums->size() % 2 == 0);
+        if(!limits || limits->size() != 2 || !nums) {
+            return;
+        }
+        const int64_t first_key = next_key;
+        for(size_t i = 0; i + 1 < nums->size(); i += 2) {
+            CHECK(std::holds_alternative<int64_t>((*nums)[i]) &&
+                  std::get<int64_t>((*nums)[i]) == next_key);
+            CHECK(std::holds_alternative<PdfNodeArray>((*nums)[i + 1]));
+            if(std::holds_alternative<PdfNodeArray>((*nums)[i + 1])) {
+                const auto &mcids =
+                    objects[leaf].arrays.at(std::get<PdfNodeArray>((*nums)[i + 1]).i);
+                CHECK(mcids.size() == 1);
+                const auto element = ref_target(mcids.empty() ? nullptr : &mcids[0]);
+                CHECK(element > 0 && (size_t)element < objects.size() &&
+                      root_dict(objects[element]) &&
+                      has_name(*root_dict(objects[element]), "Type", "StructElem"));
+            }
+            ++next_key;
+        }
+        CHECK(std::holds_alternative<int64_t>((*limits)[0]) &&
+              std::get<int64_t>((*limits)[0]) == first_key);
+        CHECK(std::holds_alternative<int64_t>((*limits)[1]) &&
+              std::get<int64_t>((*limits)[1]) == next_key - 1);
+    }
+    CHECK(next_key == num_pages);
+}
+
+void test_failed_page() {
+    PdfGenerationData opts;
+    auto gen = std::move(PdfGen::construct_in_memory(opts).value());
+    const auto item = gen->add_structure_item("P", {}).value();
+    std::unique_ptr<PdfDrawContext> ctx{gen->new_page_draw_context()};
+    ctx->cmd_BDC(item);
+    ctx->cmd_EMC();
+    CHECK(gen->add_page(*ctx));
+    // A structure item can only be used on one page.
+    ctx->cmd_BDC(item);
+    ctx->cmd_re(10, 20, 30, 40);
+    ctx->cmd_f();
+    ctx->cmd_EMC();
+    const std::string before{ctx->get_command_stream()};
+    CHECK(!gen->add_page(*ctx));
+    CHECK(ctx->get_command_stream() == before);
+    CHECK(before.find("10 20 30 40 re") != std::string::npos);
+}
+
+void test_dash_indent() {
+    PdfGenerationData opts;
+    auto gen = std::move(PdfGen::construct_in_memory(opts).value());
+    std::unique_ptr<PdfDrawContext> ctx{gen->new_page_draw_context()};
+    double dashes[] = {1, 2.5};
+    ctx->cmd_q();
+    CHECK(ctx->cmd_d(dashes, 2, 0.5) == ErrorCode::NoError);
+    ctx->cmd_Q();
+    CHECK(ctx->get_command_stream() == "q\n  [ 1 2.5 ] 0.5 d\nQ\n");
+}
+
+// Returns the decoded data stream of the only mesh shading in a document that draws it.
+template<typename T> std::string mesh_stream(const T &shade) {
+    PdfGenerationData opts;
+    auto gen = std::move(PdfGen::construct_in_memory(opts).value());
+    const auto shid = gen->add_shading(shade);
+    std::unique_ptr<PdfDrawContext> ctx{gen->new_page_draw_context()};
+    CHECK(ctx->cmd_sh(shid) == ErrorCode::NoError);
+    CHECK(gen->add_page(*ctx));
+    CHECK(gen->write());
+    auto index = PdfObjectIndex::create(gen->memory_output());
+    CHECK(index);
+    std::string stream;
+    for(size_t i = 1; index && i < index->size(); ++i) {
+        auto def = index->parse_object(i);
+        const auto *dict = def ? root_dict(*def) : nullptr;
+        if(dict && dict->contains("ShadingType")) {
+            auto decoded = index->decoded_stream(i);
+            CHECK(decoded && stream.empty());
+            stream = decoded.value_or("");
+        }
+    }
+    return stream;
+}
+
+uint32_t read32(const std::string &s, size_t offset) {
+    return uint32_t((uint8_t)s[offset]) << 24 | uint32_t((uint8_t)s[offset + 1]) << 16 |
+           uint32_t((uint8_t)s[offset + 2]) << 8 | uint32_t((uint8_t)s[offset + 3]);
+}
+
+void test_mesh_shadings() {
+    // Both bounds are the default 0 to 200, so 100 is half of the coordinate range.
+    const DeviceRGBColor red{1.0, 0.0, 0.0};
+    const DeviceRGBColor green{0.0, 1.0, 0.0};
+    const DeviceRGBColor blue{0.0, 0.0, 1.0};
+    ShadingType4 gouraud;
+    gouraud.start_strip(ShadingPoint{{100, 10}, red},
+                        ShadingPoint{{-30, 190}, green},
+                        ShadingPoint{{250, 100}, blue});
+    const auto stream4 = mesh_stream(gouraud);
+    CHECK(stream4.size() == 3 * 15);
+    if(stream4.size() == 3 * 15) {
+        CHECK(stream4[0] == 0);
+        CHECK(read32(stream4, 1) == 0x7fffffff);
+        CHECK(stream4.substr(9, 6) == std::string("\xff\xff\0\0\0\0", 6));
+        // Points outside of the bounds are clamped to them.
+        CHECK(read32(stream4, 15 + 1) == 0);
+        CHECK(read32(stream4, 30 + 1) == 0xffffffff);
+        CHECK(read32(stream4, 30 + 5) == 0x7fffffff);
+    }
+    ShadingType4 clamped_gouraud;
+    clamped_gouraud.start_strip(ShadingPoint{{100, 10}, red},
+                                ShadingPoint{{0, 190}, green},
+                                ShadingPoint{{200, 100}, blue});
+    CHECK(mesh_stream(clamped_gouraud) == stream4);
+
+    FullCoonsPatch fp;
+    fp.p = {Point{50, 50},
+            Point{-20, 80},
+            Point{70, 140},
+            Point{50, 150},
+            Point{70, 170},
+            Point{140, 145},
+            Point{150, 150},
+            Point{110, 130},
+            Point{170, 70},
+            Point{150, 50},
+            Point{135, 235},
+            Point{70, 70}};
+    fp.c = {red, green, blue, DeviceRGBColor{1.0, 0.0, 1.0}};
+    ShadingType6 coons;
+    coons.elements.emplace_back(fp);
+    const auto stream6 = mesh_stream(coons);
+    CHECK(stream6.size() == 1 + 12 * 8 + 4 * 6);
+    fp.p[1].x = 0;
+    fp.p[10].y = 200;
+    ShadingType6 clamped_coons;
+    clamped_coons.elements.emplace_back(fp);
+    CHECK(mesh_stream(clamped_coons) == stream6);
+}
+
+void test_box_downsample() {
+    const int32_t w = 8000;
+    const int32_t h = 6000;
+    const std::string gray((size_t)w * h, char(200));
+    CHECK(box_downsample(gray, w, h, 1, 1, 1) == std::string(1, char(200)));
+    const char pixels[] = {0, 10, 20, 30, 40, 50, 60, 70};
+    // Two by two boxes of single channel pixels in a 4x2 image.
+    CHECK(box_downsample(std::string_view(pixels, 8), 4, 2, 1, 2, 1) ==
+          std::string({char(25), char(45)}));
+}
+
+struct UnitTest {
+    const char *name;
+    void (*func)();
+};
+
+const UnitTest tests[] = {
+    {"split_alpha", test_split_alpha},
+    {"narrow", test_narrow},
+    {"invert", test_invert},
+    {"pack_bits", test_pack_bits},
+    {"interleave_planes", test_interleave_planes},
+    {"flate_compressor", test_flate_compressor},
+    {"parser", test_parser},
+    {"structure", test_structure},
+    {"structure_parent_tree", test_structure_parent_tree},
+    {"failed_page", test_failed_page},
+    {"dash_indent", test_dash_indent},
+    {"mesh_shadings", test_mesh_shadings},
+    {"box_downsample", test_box_downsample},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+    for(const auto &t : tests) {
+        bool selected = argc < 2;
+        for(int i = 1; i < argc; ++i) {
+            if(strcmp(argv[i], t.name) == 0) {
+                selected = true;
+            }
+        }
+        if(!selected) {
+            continue;
+        }
+        const int before = failures;
+        t.func();
+        printf("%s: %s\n", t.name, failures == before ? "ok" : "FAILED");
+    }
+    return failures == 0 ? 0 : 1;
+}
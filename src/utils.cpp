@@ -16,18 +16,29 @@
 
 #include <utils.hpp>
 #include <zlib.h>
+#ifdef CAPYPDF_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 #include <cassert>
 #include <cstring>
+#include <algorithm>
 #ifdef _WIN32
 #include <time.h>
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #endif
 
 #include <fmt/core.h>
 #include <memory>
 #include <random>
+#include <bit>
+#include <charconv>
+#include <cmath>
 
 namespace capypdf {
 
@@ -62,6 +73,17 @@ rvoe<uint32_t> unpack_one(std::string_view input, size_t cur, const UtfDecodeSte
     return unpacked;
 }
 
+// Checked as two 64 bit words. Compilers turn the check and the widening
+// loop that follows it into vector instructions where available.
+constexpr size_t ascii_block_size = 16;
+
+bool is_ascii_block(const unsigned char *block) {
+    uint64_t w1, w2;
+    memcpy(&w1, block, sizeof(w1));
+    memcpy(&w2, block + sizeof(w1), sizeof(w2));
+    return ((w1 | w2) & 0x8080808080808080ULL) == 0;
+}
+
 std::vector<uint16_t> glyphs_to_utf16be(const std::vector<uint32_t> &glyphs) {
     std::vector<uint16_t> u16buf;
     u16buf.reserve(glyphs.size());
@@ -81,45 +103,140 @@ std::vector<uint16_t> glyphs_to_utf16be(const std::vector<uint32_t> &glyphs) {
 
 } // namespace
 
-rvoe<std::string> flate_compress(std::string_view data) {
-    std::string compressed;
-    const int CHUNK = 1024 * 1024;
-    std::string buf;
+#ifdef CAPYPDF_USE_LIBDEFLATE
+
+rvoe<std::string> flate_compress(std::string_view data, int level) {
+    // Allocating a compressor is expensive, so every thread keeps the last one it used.
+    struct CompressorCache {
+        libdeflate_compressor *compressor = nullptr;
+        int level = -1;
+        ~CompressorCache() { libdeflate_free_compressor(compressor); }
+    };
+    thread_local CompressorCache cache;
+    if(level == Z_DEFAULT_COMPRESSION) {
+        // What zlib uses, libdeflate only accepts explicit levels.
+        level = 6;
+    }
+    if(!cache.compressor || cache.level != level) {
+        libdeflate_free_compressor(cache.compressor);
+        cache.compressor = libdeflate_alloc_compressor(level);
+        cache.level = cache.compressor ? level : -1;
+        if(!cache.compressor) {
+            RETERR(CompressionFailure);
+        }
+    }
+    std::string compressed(libdeflate_zlib_compress_bound(cache.compressor, data.size()), '\0');
+    const auto compressed_size = libdeflate_zlib_compress(
+        cache.compressor, data.data(), data.size(), compressed.data(), compressed.size());
+    if(compressed_size == 0) {
+        RETERR(CompressionFailure);
+    }
+    compressed.resize(compressed_size);
+    // Callers keep the result, so do not hold on to the whole bound.
+    compressed.shrink_to_fit();
+    return std::move(compressed);
+}
+
+#else
+
+rvoe<std::string> flate_compress(std::string_view data, int level) {
     z_stream strm;
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
 
-    auto ret = deflateInit(&strm, Z_BEST_COMPRESSION);
+    auto ret = deflateInit(&strm, level);
     if(ret != Z_OK) {
         RETERR(CompressionFailure);
     }
     std::unique_ptr<z_stream, int (*)(z_stream *)> zcloser(&strm, deflateEnd);
+    // The bound is exact enough that the whole output is produced with a
+    // single call and no intermediate buffers.
+    std::string compressed(deflateBound(&strm, data.size()), '\0');
     strm.avail_in = data.size();
     strm.next_in = (Bytef *)(data.data()); // Very unsafe.
-
-    do {
-        buf.resize(CHUNK);
-        strm.avail_out = CHUNK;
-        strm.next_out = (Bytef *)buf.data();
-        ret = deflate(&strm, Z_FINISH); /* no bad return value */
-        assert(ret != Z_STREAM_ERROR);  /* state not clobbered */
-        int write_size = CHUNK - strm.avail_out;
-        assert(write_size <= (int)buf.size());
-        buf.resize(write_size);
-        compressed += buf;
-    } while(strm.avail_out == 0);
-    if(strm.avail_in != 0) { /* all input will be used */
+    strm.avail_out = compressed.size();
+    strm.next_out = (Bytef *)compressed.data();
+    ret = deflate(&strm, Z_FINISH);
+    assert(ret != Z_STREAM_ERROR);
+    if(strm.avail_in != 0 || ret != Z_STREAM_END) {
         RETERR(CompressionFailure);
     }
-    /* done when last data in file processed */
-    if(ret != Z_STREAM_END) {
+    compressed.resize(compressed.size() - strm.avail_out);
+    // Callers keep the result, so do not hold on to the whole bound.
+    compressed.shrink_to_fit();
+    return std::move(compressed);
+}
+
+#endif
+
+rvoe<std::unique_ptr<FlateCompressor>> FlateCompressor::create(int level, OutputSink sink) {
+    std::unique_ptr<FlateCompressor> c(new FlateCompressor());
+    c->sink = std::move(sink);
+    c->level = level;
+#ifndef CAPYPDF_USE_LIBDEFLATE
+    c->strm = std::make_unique<z_stream>();
+    c->strm->zalloc = Z_NULL;
+    c->strm->zfree = Z_NULL;
+    c->strm->opaque = Z_NULL;
+    if(deflateInit(c->strm.get(), level) != Z_OK) {
+        c->strm.reset();
         RETERR(CompressionFailure);
     }
+#endif
+    return c;
+}
 
-    return std::move(compressed);
+FlateCompressor::~FlateCompressor() {
+    if(strm) {
+        deflateEnd(strm.get());
+    }
 }
 
+rvoe<NoReturnValue> FlateCompressor::run(std::string_view data, bool last) {
+    if(finished) {
+        RETERR(CompressionFailure);
+    }
+#ifdef CAPYPDF_USE_LIBDEFLATE
+    pending += data;
+    if(last) {
+        ERC(compressed, flate_compress(pending, level));
+        pending = std::string{};
+        finished = true;
+        ERCV(sink(compressed));
+    }
+    return NoReturnValue{};
+#else
+    strm->avail_in = data.size();
+    strm->next_in = (Bytef *)(data.data());
+    int ret;
+    do {
+        strm->avail_out = out_buf.size();
+        strm->next_out = (Bytef *)out_buf.data();
+        ret = deflate(strm.get(), last ? Z_FINISH : Z_NO_FLUSH);
+        assert(ret != Z_STREAM_ERROR);
+        const size_t produced = out_buf.size() - strm->avail_out;
+        if(produced > 0) {
+            ERCV(sink(std::string_view(out_buf.data(), produced)));
+        }
+    } while(strm->avail_out == 0);
+    if(strm->avail_in != 0) {
+        RETERR(CompressionFailure);
+    }
+    if(last) {
+        if(ret != Z_STREAM_END) {
+            RETERR(CompressionFailure);
+        }
+        finished = true;
+    }
+    return NoReturnValue{};
+#endif
+}
+
+rvoe<NoReturnValue> FlateCompressor::append(std::string_view data) { return run(data, false); }
+
+rvoe<NoReturnValue> FlateCompressor::finish() { return run({}, true); }
+
 rvoe<std::string> load_file(const char *fname) {
     FILE *f = fopen(fname, "rb");
     if(!f) {
@@ -130,6 +247,45 @@ rvoe<std::string> load_file(const char *fname) {
     return load_file(f);
 }
 
+rvoe<std::shared_ptr<const MappedFile>> MappedFile::open(const std::filesystem::path &fname) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+    ERC(contents, load_file(fname));
+    file->fallback = std::move(contents);
+    file->contents = file->fallback;
+#else
+    const int fd = ::open(fname.c_str(), O_RDONLY);
+    if(fd < 0) {
+        RETERR(CouldNotOpenFile);
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0) {
+        close(fd);
+        RETERR(FileReadError);
+    }
+    if(st.st_size > 0) {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(addr == MAP_FAILED) {
+            close(fd);
+            RETERR(FileReadError);
+        }
+        file->mapping = addr;
+        file->contents = std::string_view((const char *)addr, (size_t)st.st_size);
+    }
+    // The mapping stays valid after the descriptor is closed.
+    close(fd);
+#endif
+    return std::shared_ptr<const MappedFile>(std::move(file));
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if(mapping) {
+        munmap(mapping, contents.size());
+    }
+#endif
+}
+
 rvoe<std::string> load_file(const std::filesystem::path &fname) {
     return load_file(fname.string().c_str());
 }
@@ -166,8 +322,7 @@ rvoe<std::string> utf8_to_pdfmetastr(const u8string &input) {
     return utf8_to_pdfmetastr(input.sv());
 }
 
-rvoe<std::vector<uint32_t>> utf8_to_glyphs(std::string_view input) {
-    std::vector<uint32_t> glyphs;
+rvoe<NoReturnValue> utf8_to_glyphs(std::string_view input, std::vector<uint32_t> &glyphs) {
     UtfDecodeStep par;
     // clang-format off
     const uint32_t twobyte_header_mask    = 0b11100000;
@@ -177,27 +332,58 @@ rvoe<std::vector<uint32_t>> utf8_to_glyphs(std::string_view input) {
     const uint32_t fourbyte_header_mask   = 0b11111000;
     const uint32_t fourbyte_header_value  = 0b11110000;
     // clang-format on
-    for(size_t i = 0; i < input.size(); ++i) {
-        const uint32_t code = uint32_t((unsigned char)input[i]);
-        if(code < 0x80) {
-            glyphs.push_back(code);
-            continue;
-        } else if((code & twobyte_header_mask) == twobyte_header_value) {
-            par.byte1_data_mask = 0b11111;
-            par.num_subsequent_bytes = 1;
-        } else if((code & threebyte_header_mask) == threebyte_header_value) {
-            par.byte1_data_mask = 0b1111;
-            par.num_subsequent_bytes = 2;
-        } else if((code & fourbyte_header_mask) == fourbyte_header_value) {
-            par.byte1_data_mask = 0b111;
-            par.num_subsequent_bytes = 3;
-        } else {
-            RETERR(BadUtf8);
+    // There is never more than one code point per input byte, so the output
+    // can be written through a pointer and trimmed at the end.
+    glyphs.resize(input.size());
+    uint32_t *out = glyphs.data();
+    size_t i = 0;
+    while(i < input.size()) {
+        // Most text is ASCII. Check and widen it a block at a time and only
+        // go through the full decoder for the blocks that contain other bytes.
+        while(i + ascii_block_size <= input.size() &&
+              is_ascii_block((const unsigned char *)input.data() + i)) {
+            for(size_t j = 0; j < ascii_block_size; ++j) {
+                out[j] = (unsigned char)input[i + j];
+            }
+            out += ascii_block_size;
+            i += ascii_block_size;
+        }
+        const size_t block_end = std::min(i + ascii_block_size, input.size());
+        while(i < block_end) {
+            const uint32_t code = uint32_t((unsigned char)input[i]);
+            if(code < 0x80) {
+                *out++ = code;
+                ++i;
+                continue;
+            } else if((code & twobyte_header_mask) == twobyte_header_value) {
+                par.byte1_data_mask = 0b11111;
+                par.num_subsequent_bytes = 1;
+            } else if((code & threebyte_header_mask) == threebyte_header_value) {
+                par.byte1_data_mask = 0b1111;
+                par.num_subsequent_bytes = 2;
+            } else if((code & fourbyte_header_mask) == fourbyte_header_value) {
+                par.byte1_data_mask = 0b111;
+                par.num_subsequent_bytes = 3;
+            } else {
+                glyphs.clear();
+                RETERR(BadUtf8);
+            }
+            auto unpacked = unpack_one(input, i, par);
+            if(!unpacked) {
+                glyphs.clear();
+                return std::unexpected(unpacked.error());
+            }
+            *out++ = unpacked.value();
+            i += par.num_subsequent_bytes + 1;
         }
-        ERC(unpacked, unpack_one(input, i, par));
-        glyphs.push_back(unpacked);
-        i += par.num_subsequent_bytes;
     }
+    glyphs.resize(out - glyphs.data());
+    return NoReturnValue{};
+}
+
+rvoe<std::vector<uint32_t>> utf8_to_glyphs(std::string_view input) {
+    std::vector<uint32_t> glyphs;
+    ERCV(utf8_to_glyphs(input, glyphs));
     return glyphs;
 }
 
@@ -248,7 +434,13 @@ std::string pdfstring_quote(std::string_view raw_string) {
 }
 
 bool is_ascii(std::string_view text) {
-    for(const auto c : text) {
+    size_t i = 0;
+    for(; i + ascii_block_size <= text.size(); i += ascii_block_size) {
+        if(!is_ascii_block((const unsigned char *)text.data() + i)) {
+            return false;
+        }
+    }
+    for(const auto c : text.substr(i)) {
         auto ci = int32_t((unsigned char)c);
         if(ci > 127) {
             return false;
@@ -257,6 +449,37 @@ bool is_ascii(std::string_view text) {
     return true;
 }
 
+void append_pdf_number(std::string &out, double value, int32_t precision) {
+    char buf[64];
+    if(std::abs(value) < 1e15 && value == std::trunc(value)) {
+        const auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), (int64_t)value);
+        assert(ec == std::errc{});
+        out.append(buf, end);
+        return;
+    }
+    std::string huge;
+    std::string_view number;
+    const auto [end, ec] =
+        std::to_chars(buf, buf + sizeof(buf), value, std::chars_format::fixed, precision);
+    if(ec == std::errc{}) {
+        number = std::string_view(buf, end);
+    } else {
+        // Very large values do not fit in the buffer.
+        huge = fmt::format("{:.{}f}", value, precision);
+        number = huge;
+    }
+    if(number.find('.') != std::string_view::npos) {
+        number = number.substr(0, number.find_last_not_of('0') + 1);
+        if(number.back() == '.') {
+            number.remove_suffix(1);
+        }
+    }
+    if(number == "-0") {
+        number = "0";
+    }
+    out += number;
+}
+
 std::string create_trailer_id() {
     int num_bytes = 16;
     std::string msg;
@@ -273,4 +496,139 @@ std::string create_trailer_id() {
     return msg;
 }
 
+void ContentHasher::mix(uint64_t word) {
+    a = std::rotl((a ^ word) * 0x9E3779B97F4A7C15, 31);
+    b = std::rotl((b ^ std::rotl(word, 32)) * 0xC2B2AE3D27D4EB4F, 29) + a;
+}
+
+void ContentHasher::update(std::string_view data) {
+    total_bytes += data.size();
+    size_t i = 0;
+    if(tail_size > 0) {
+        while(tail_size < sizeof(tail) && i < data.size()) {
+            tail[tail_size++] = data[i++];
+        }
+        if(tail_size < sizeof(tail)) {
+            return;
+        }
+        uint64_t word;
+        memcpy(&word, tail, sizeof(word));
+        mix(word);
+        tail_size = 0;
+    }
+    for(; i + sizeof(uint64_t) <= data.size(); i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data.data() + i, sizeof(word));
+        mix(word);
+    }
+    while(i < data.size()) {
+        tail[tail_size++] = data[i++];
+    }
+}
+
+ContentHash ContentHasher::digest() const {
+    ContentHasher final_state{*this};
+    uint64_t word = 0;
+    memcpy(&word, tail, tail_size);
+    final_state.mix(word);
+    final_state.mix(total_bytes);
+    // Murmur3 finalizer so that every input bit affects every output bit.
+    auto fmix = [](uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xFF51AFD7ED558CCD;
+        k ^= k >> 33;
+        k *= 0xC4CEB9FE1A85EC53;
+        k ^= k >> 33;
+        return k;
+    };
+    return ContentHash{fmix(final_state.a), fmix(final_state.b ^ final_state.a)};
+}
+
+rvoe<ContentHash> hash_file(const std::filesystem::path &fname) {
+    FILE *f = fopen(fname.string().c_str(), "rb");
+    if(!f) {
+        RETERR(CouldNotOpenFile);
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> fcloser(f, fclose);
+    ContentHasher hasher;
+    std::string buf(1024 * 1024, '\0');
+    size_t num_read;
+    while((num_read = fread(buf.data(), 1, buf.size(), f)) > 0) {
+        hasher.update(std::string_view(buf.data(), num_read));
+    }
+    if(ferror(f)) {
+        RETERR(FileReadError);
+    }
+    return hasher.digest();
+}
+
+namespace {
+
+rvoe<bool> streams_equal(FILE *f1, FILE *f2) {
+    std::string buf1(1024 * 1024, '\0');
+    std::string buf2(buf1.size(), '\0');
+    while(true) {
+        const auto num_read1 = fread(buf1.data(), 1, buf1.size(), f1);
+        const auto num_read2 = fread(buf2.data(), 1, buf2.size(), f2);
+        if(ferror(f1) || ferror(f2)) {
+            RETERR(FileReadError);
+        }
+        if(num_read1 != num_read2 || memcmp(buf1.data(), buf2.data(), num_read1) != 0) {
+            return false;
+        }
+        if(num_read1 < buf1.size()) {
+            return true;
+        }
+    }
+}
+
+} // namespace
+
+rvoe<bool> files_equal(const std::filesystem::path &fname1, const std::filesystem::path &fname2) {
+    FILE *f1 = fopen(fname1.string().c_str(), "rb");
+    if(!f1) {
+        RETERR(CouldNotOpenFile);
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> fcloser1(f1, fclose);
+    FILE *f2 = fopen(fname2.string().c_str(), "rb");
+    if(!f2) {
+        RETERR(CouldNotOpenFile);
+    }
+    std::unique_ptr<FILE, int (*)(FILE *)> fcloser2(f2, fclose);
+    return streams_equal(f1, f2);
+}
+
+rvoe<TemporaryFile> create_temporary_file() {
+    FILE *f = tmpfile();
+    if(!f) {
+        RETERR(CouldNotOpenFile);
+    }
+    return TemporaryFile{std::shared_ptr<FILE>(f, fclose), 0};
+}
+
+OutputSink temporary_file_sink(TemporaryFile &tf) {
+    auto sink = file_sink(tf.f.get());
+    return [&tf, sink](std::string_view data) -> rvoe<NoReturnValue> {
+        ERCV(sink(data));
+        tf.size += data.size();
+        return NoReturnValue{};
+    };
+}
+
+rvoe<NoReturnValue> finish_temporary_file(TemporaryFile &tf) {
+    if(fflush(tf.f.get()) != 0) {
+        RETERR(FileWriteError);
+    }
+    return NoReturnValue{};
+}
+
+rvoe<bool> files_equal(const TemporaryFile &tf1, const TemporaryFile &tf2) {
+    if(tf1.size != tf2.size) {
+        return false;
+    }
+    rewind(tf1.f.get());
+    rewind(tf2.f.get());
+    return streams_equal(tf1.f.get(), tf2.f.get());
+}
+
 } // namespace capypdf
@@ -17,6 +17,7 @@
 #pragma once
 
 #include <errorhandling.hpp>
+#include <bufferedwriter.hpp>
 #include <pdfcommon.hpp>
 #include <string>
 #include <expected>
@@ -24,10 +25,112 @@
 #include <string_view>
 #include <filesystem>
 #include <vector>
+#include <cstdint>
+#include <memory>
+#include <array>
+
+struct z_stream_s;
 
 namespace capypdf {
 
-rvoe<std::string> flate_compress(std::string_view data);
+struct ContentHash {
+    uint64_t h1;
+    uint64_t h2;
+
+    bool operator==(const ContentHash &o) const = default;
+};
+
+// Fast non-cryptographic 128 bit hash for detecting duplicate data.
+// The result does not depend on how the data is split between update calls.
+class ContentHasher {
+public:
+    void update(std::string_view data);
+    template<typename T> void update_value(const T &value) {
+        update(std::string_view((const char *)&value, sizeof(value)));
+    }
+    ContentHash digest() const;
+
+private:
+    void mix(uint64_t word);
+
+    uint64_t a = 0x243F6A8885A308D3;
+    uint64_t b = 0x13198A2E03707344;
+    uint64_t total_bytes = 0;
+    char tail[8];
+    size_t tail_size = 0;
+};
+
+rvoe<ContentHash> hash_file(const std::filesystem::path &fname);
+// Compares the contents of two files.
+rvoe<bool> files_equal(const std::filesystem::path &fname1, const std::filesystem::path &fname2);
+
+// An anonymous file for data that would take too much memory to hold. The
+// system deletes it when the last copy of the handle goes away.
+struct TemporaryFile {
+    std::shared_ptr<FILE> f;
+    uint64_t size = 0;
+};
+
+rvoe<TemporaryFile> create_temporary_file();
+// Appends to the file and keeps its size up to date. The file must
+// outlive the sink.
+OutputSink temporary_file_sink(TemporaryFile &tf);
+// Flushes the data so that it can be read back.
+rvoe<NoReturnValue> finish_temporary_file(TemporaryFile &tf);
+rvoe<bool> files_equal(const TemporaryFile &tf1, const TemporaryFile &tf2);
+
+// Uses libdeflate instead of zlib if the deflate_backend build option selects it.
+// Both produce zlib streams, but not byte identical ones.
+rvoe<std::string> flate_compress(std::string_view data, int level);
+
+// Deflates data that arrives in pieces and hands the compressed bytes to
+// a sink as they are produced. Uses the same backend as flate_compress.
+// Libdeflate can only compress whole buffers, so with it the input is
+// collected and compressed in finish().
+class FlateCompressor {
+public:
+    static rvoe<std::unique_ptr<FlateCompressor>> create(int level, OutputSink sink);
+    ~FlateCompressor();
+
+    FlateCompressor(const FlateCompressor &) = delete;
+    FlateCompressor &operator=(const FlateCompressor &) = delete;
+
+    rvoe<NoReturnValue> append(std::string_view data);
+    // Flushes the end of the stream to the sink. No data can be added after this.
+    rvoe<NoReturnValue> finish();
+
+private:
+    FlateCompressor() = default;
+    rvoe<NoReturnValue> run(std::string_view data, bool last);
+
+    std::unique_ptr<z_stream_s> strm;
+    // Only used by the libdeflate backend.
+    std::string pending;
+    int level = 0;
+    OutputSink sink;
+    std::array<char, 64 * 1024> out_buf;
+    bool finished = false;
+};
+
+// Read only view of a whole file, memory mapped where the platform allows it.
+// The file must not be truncated while it is open.
+class MappedFile {
+public:
+    static rvoe<std::shared_ptr<const MappedFile>> open(const std::filesystem::path &fname);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    std::string_view data() const { return contents; }
+
+private:
+    MappedFile() = default;
+
+    std::string_view contents;
+    void *mapping = nullptr;
+    std::string fallback;
+};
 
 rvoe<std::string> load_file(const char *fname);
 
@@ -40,6 +143,8 @@ rvoe<std::string> utf8_to_pdfmetastr(std::string_view input);
 rvoe<std::string> utf8_to_pdfmetastr(const u8string &input);
 
 rvoe<std::vector<uint32_t>> utf8_to_glyphs(std::string_view input);
+// Replaces the contents of glyphs, so a buffer can be reused without reallocating.
+rvoe<NoReturnValue> utf8_to_glyphs(std::string_view input, std::vector<uint32_t> &glyphs);
 rvoe<std::vector<uint32_t>> utf8_to_glyphs(const u8string &input);
 
 std::string current_date_string();
@@ -48,6 +153,10 @@ std::string pdfstring_quote(std::string_view raw_string);
 
 bool is_ascii(std::string_view text);
 
+// Appends a number in fixed point notation with at most `precision` decimals
+// and without trailing zeros. Integral values are written without a decimal point.
+void append_pdf_number(std::string &out, double value, int32_t precision);
+
 std::string create_trailer_id();
 
 } // namespace capypdf
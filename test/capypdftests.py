@@ -15,8 +15,8 @@
 # limitations under the License.
 
 
-import unittest
-import os, sys, pathlib, shutil, subprocess
+import unittest, contextlib
+import os, sys, pathlib, shutil, subprocess, array, re, threading, struct, zlib, random
 import PIL.Image, PIL.ImageChops
 
 if shutil.which('gs') is None:
@@ -42,6 +42,357 @@ def draw_intersect_shape(ctx):
     ctx.cmd_l(20, 10)
     ctx.cmd_h()
 
+def draw_test_path(ctx, use_arrays=False):
+    with ctx.push_gstate():
+        ctx.cmd_w(5)
+        ctx.cmd_J(capypdf.LineCapStyle.Round)
+        ctx.cmd_m(10, 10)
+        if use_arrays:
+            ctx.cmd_c_array(array.array('d', [80, 10, 20, 90, 90, 90]))
+        else:
+            ctx.cmd_c(80, 10, 20, 90, 90, 90)
+        ctx.cmd_S()
+    with ctx.push_gstate():
+        ctx.cmd_w(10)
+        ctx.translate(100, 0)
+        ctx.cmd_RG(1.0, 0.0, 0.0)
+        ctx.cmd_rg(0.9, 0.9, 0.0)
+        ctx.cmd_j(capypdf.LineJoinStyle.Bevel)
+        ctx.cmd_m(50, 90)
+        if use_arrays:
+            ctx.cmd_l_array([10, 10, 90, 10])
+        else:
+            ctx.cmd_l(10, 10)
+            ctx.cmd_l(90, 10)
+        ctx.cmd_h()
+        ctx.cmd_B()
+    with ctx.push_gstate():
+        ctx.translate(0, 100)
+        draw_intersect_shape(ctx)
+        ctx.cmd_w(3)
+        ctx.cmd_rg(0, 1, 0)
+        ctx.cmd_RG(0.5, 0.1, 0.5)
+        ctx.cmd_j(capypdf.LineJoinStyle.Round)
+        ctx.cmd_B()
+    with ctx.push_gstate():
+        ctx.translate(100, 100)
+        ctx.cmd_w(2)
+        ctx.cmd_rg(0, 1, 0)
+        ctx.cmd_RG(0.5, 0.1, 0.5)
+        draw_intersect_shape(ctx)
+        ctx.cmd_Bstar()
+
+test_image_files = ['1bit_noalpha.png', 'gray_alpha.png', 'rgb_tiff.tif']
+
+def load_test_images(g):
+    return [g.embed_jpg(image_dir / 'simple.jpg')] + \
+        [g.load_image(image_dir / f) for f in test_image_files]
+
+def draw_test_images(ctx, bg_img, mono_img, gray_img, rgb_tif_img):
+    for img, x, y in ((bg_img, 10, 10),
+                      (mono_img, 10, 110),
+                      (gray_img, 110, 110),
+                      (rgb_tif_img, 110, 10)):
+        with ctx.push_gstate():
+            ctx.translate(x, y)
+            ctx.scale(80, 80)
+            ctx.draw_image(img)
+
+def draw_sample_text(ctx, fid):
+    ctx.render_text('Av, Tv, kerning yo.', fid, 12, 50, 150)
+
+def add_sample_text_page(g):
+    '''Adds the page shown in python_text.png.'''
+    fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+    with g.page_draw_context() as ctx:
+        draw_sample_text(ctx, fid)
+
+def sample_text_options(w, h):
+    opts = capypdf.Options()
+    opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+    return opts
+
+@contextlib.contextmanager
+def fixed_source_date():
+    old_epoch = os.environ.get('SOURCE_DATE_EPOCH')
+    os.environ['SOURCE_DATE_EPOCH'] = '1700000000'
+    try:
+        yield
+    finally:
+        if old_epoch is None:
+            del os.environ['SOURCE_DATE_EPOCH']
+        else:
+            os.environ['SOURCE_DATE_EPOCH'] = old_epoch
+
+def without_document_id(data):
+    '''The document id is random, everything else is reproducible.'''
+    return re.sub(rb'/ID \[<[0-9A-F]+><[0-9A-F]+>\]', b'', data)
+
+def image_dictionaries(pdfname):
+    '''Returns the dictionaries of all image XObjects that are not JPEG files.'''
+    dicts = re.findall(rb'\d+ 0 obj\n(<<(?:(?!endobj).)*?)\nstream\n', pdfname.read_bytes(),
+                       re.DOTALL)
+    return [d for d in dicts if b'/Subtype /Image' in d and b'/DCTDecode' not in d]
+
+def write_tiff(fname, w, h, samples, photometric, strips):
+    '''Writes an uncompressed 8 bit TIFF. A single strip holds interleaved
+    samples while several strips are the separate planes of a planar image.'''
+    planar = len(strips) > 1
+    tags = [(256, 4, [w]),
+            (257, 4, [h]),
+            (258, 3, [8] * samples),
+            (259, 3, [1]),
+            (262, 3, [photometric]),
+            (273, 4, [0] * len(strips)),
+            (277, 3, [samples]),
+            (278, 4, [max(h, 1)]),
+            (279, 4, [len(s) for s in strips]),
+            (284, 3, [2 if planar else 1])]
+    ifd_size = 2 + 12 * len(tags) + 4
+    # Values that do not fit in a tag go after the directory, then the strips.
+    arrays = [(tag, typ, values) for tag, typ, values in tags
+              if len(values) * (2 if typ == 3 else 4) > 4]
+    array_offsets = {}
+    offset = 8 + ifd_size
+    for tag, typ, values in arrays:
+        array_offsets[tag] = offset
+        offset += len(values) * (2 if typ == 3 else 4)
+    strip_offsets = []
+    for strip in strips:
+        strip_offsets.append(offset)
+        offset += len(strip)
+    tags[5] = (273, 4, strip_offsets)
+    ifd = struct.pack('<H', len(tags))
+    extra = b''
+    for tag, typ, values in tags:
+        fmt = '<' + ('H' if typ == 3 else 'I') * len(values)
+        if tag in array_offsets:
+            ifd += struct.pack('<HHII', tag, typ, len(values), array_offsets[tag])
+            extra += struct.pack(fmt, *values)
+        else:
+            ifd += struct.pack('<HHI', tag, typ, len(values)) + \
+                struct.pack(fmt, *values).ljust(4, b'\0')
+    ifd += struct.pack('<I', 0)
+    fname.write_bytes(b'II*\0' + struct.pack('<I', 8) + ifd + extra + b''.join(strips))
+
+def simple_glyph_chars(fontfile):
+    '''Returns the BMP characters of a TrueType font whose glyphs have
+    outlines and are not composites.'''
+    data = fontfile.read_bytes()
+    num_tables = struct.unpack_from('>H', data, 4)[0]
+    tables = {}
+    for i in range(num_tables):
+        tag, _, offset, _ = struct.unpack_from('>4sIII', data, 12 + 16 * i)
+        tables[tag] = offset
+    long_loca = struct.unpack_from('>h', data, tables[b'head'] + 50)[0] == 1
+    def glyph_range(gid):
+        if long_loca:
+            return struct.unpack_from('>II', data, tables[b'loca'] + 4 * gid)
+        start, end = struct.unpack_from('>HH', data, tables[b'loca'] + 2 * gid)
+        return 2 * start, 2 * end
+    cmap = tables[b'cmap']
+    num_subtables = struct.unpack_from('>H', data, cmap + 2)[0]
+    for i in range(num_subtables):
+        platform, encoding, offset = struct.unpack_from('>HHI', data, cmap + 4 + 8 * i)
+        if (platform, encoding) == (3, 1):
+            sub = cmap + offset
+    segments = struct.unpack_from('>H', data, sub + 6)[0] // 2
+    ends = struct.unpack_from('>%dH' % segments, data, sub + 14)
+    starts = struct.unpack_from('>%dH' % segments, data, sub + 16 + 2 * segments)
+    deltas = struct.unpack_from('>%dh' % segments, data, sub + 16 + 4 * segments)
+    range_offsets_pos = sub + 16 + 6 * segments
+    chars = []
+    for seg in range(segments):
+        range_offset = struct.unpack_from('>H', data, range_offsets_pos + 2 * seg)[0]
+        for c in range(starts[seg], min(ends[seg], 0xfffe) + 1):
+            if range_offset == 0:
+                gid = (c + deltas[seg]) % 65536
+            else:
+                pos = range_offsets_pos + 2 * seg + range_offset + 2 * (c - starts[seg])
+                gid = struct.unpack_from('>H', data, pos)[0]
+                gid = (gid + deltas[seg]) % 65536 if gid else 0
+            start, end = glyph_range(gid)
+            if gid and end > start and \
+                    struct.unpack_from('>h', data, tables[b'glyf'] + start)[0] >= 0:
+                chars.append(chr(c))
+    return chars
+
+def write_rgb_tiff(fname, w, h, pixels):
+    '''Writes an uncompressed 8 bit RGB TIFF with a single strip.'''
+    write_tiff(fname, w, h, 3, 2, [pixels])
+
+def write_png(fname, w, h, bit_depth, color_type, rows, palette=None):
+    '''Writes a PNG with no ancillary chunks. Rows are packed samples
+    without the filter type byte.'''
+    def chunk(kind, data):
+        return struct.pack('>I', len(data)) + kind + data + \
+            struct.pack('>I', zlib.crc32(kind + data))
+    png = b'\x89PNG\r\n\x1a\n'
+    png += chunk(b'IHDR', struct.pack('>IIBBBBB', w, h, bit_depth, color_type, 0, 0, 0))
+    if palette is not None:
+        png += chunk(b'PLTE', b''.join(bytes(rgb) for rgb in palette))
+    idat = zlib.compress(b''.join(b'\0' + row for row in rows))
+    png += chunk(b'IDAT', idat) + chunk(b'IEND', b'')
+    fname.write_bytes(png)
+    return idat
+
+def find_cmyk_profile():
+    '''Ghostscript, which renders the test images, ships a CMYK profile.'''
+    gsdir = pathlib.Path('/usr/share/ghostscript')
+    for candidate in sorted(gsdir.glob('*/iccprofiles/default_cmyk.icc')):
+        return candidate
+    return None
+
+def render_pdf(utobj, pdfname, pngname, w, h):
+    utobj.assertEqual(subprocess.run(['gs',
+                                      '-q',
+                                      '-dNOPAUSE',
+                                      '-dBATCH',
+                                      '-sDEVICE=png16m',
+                                      f'-g{w}x{h}',
+                                      #'-dPDFFitPage',
+                                      f'-sOutputFile={pngname}',
+                                      str(pdfname)]).returncode, 0)
+
+def assert_same_rendering(utobj, pdf1, pdf2, w, h):
+    png1 = pdf1.with_suffix('.png')
+    png2 = pdf2.with_suffix('.png')
+    render_pdf(utobj, pdf1, png1, w, h)
+    render_pdf(utobj, pdf2, png2, w, h)
+    diff = PIL.ImageChops.difference(PIL.Image.open(png1), PIL.Image.open(png2))
+    utobj.assertFalse(diff.getbbox(), 'Rendered images are different.')
+    for f in (pdf1, pdf2, png1, png2):
+        f.unlink()
+
+def cff_number(value):
+    if -107 <= value <= 107:
+        return bytes([value + 139])
+    return b'\x1c' + struct.pack('>h', value)
+
+def cff_offset(value):
+    # Five byte integers keep the Top DICT size independent of the offsets.
+    return b'\x1d' + struct.pack('>i', value)
+
+def cff_charstring(*items):
+    return b''.join(cff_number(i) if isinstance(i, int) else i for i in items)
+
+def cff_index(entries):
+    if not entries:
+        return b'\0\0'
+    offsets = [1]
+    for e in entries:
+        offsets.append(offsets[-1] + len(e))
+    return struct.pack('>HB', len(entries), 4) + \
+        b''.join(struct.pack('>I', o) for o in offsets) + b''.join(entries)
+
+def generate_cff_font(fname, cid_keyed):
+    '''Write an OpenType font with CFF outlines for space, A, B and C.
+
+    The glyphs are plain rectangles. B uses a local and C a global subroutine.'''
+    hlineto = b'\x06'
+    callsubr = b'\x0a'
+    subr_return = b'\x0b'
+    endchar = b'\x0e'
+    rmoveto = b'\x15'
+    callgsubr = b'\x1d'
+    subrs = [cff_charstring(400, 300, -400, hlineto, subr_return)]
+    gsubrs = [cff_charstring(200, 700, -200, hlineto, subr_return)]
+    charstrings = [endchar,
+                   endchar,
+                   cff_charstring(100, 0, rmoveto, 400, 700, -400, hlineto, endchar),
+                   cff_charstring(100, 0, rmoveto, -107, callsubr,
+                                  0, 100, rmoveto, -107, callsubr, endchar),
+                   cff_charstring(100, 0, rmoveto, -107, callgsubr, endchar)]
+    num_glyphs = len(charstrings)
+    if cid_keyed:
+        strings = [b'Adobe', b'Identity']
+        # CIDs that differ from glyph ids, which the subset must renumber.
+        charset = b'\0' + b''.join(struct.pack('>H', 10 * i) for i in range(1, num_glyphs))
+        # Two Font DICTs so that the subset has to remap FDSelect.
+        fd_select = b'\0' + bytes([0, 0, 0, 1, 1])
+    else:
+        strings = []
+        # Standard strings for space, A, B and C.
+        charset = b'\0' + b''.join(struct.pack('>H', i) for i in (1, 34, 35, 36))
+        fd_select = b''
+    num_privates = 2 if cid_keyed else 1
+    private_dict = cff_offset(6) + b'\x13'
+    private_data = private_dict + cff_index(subrs)
+
+    def top_dict(charset_off, charstrings_off, fd_array_off, fd_select_off, private_off):
+        d = b''
+        if cid_keyed:
+            d += cff_offset(391) + cff_offset(392) + cff_number(0) + b'\x0c\x1e'
+        d += cff_offset(charset_off) + b'\x0f' + cff_offset(charstrings_off) + b'\x11'
+        if cid_keyed:
+            d += cff_offset(fd_array_off) + b'\x0c\x24' + cff_offset(fd_select_off) + b'\x0c\x25'
+        else:
+            d += cff_offset(len(private_dict)) + cff_offset(private_off) + b'\x12'
+        return d
+
+    def fd_array(private_offs):
+        return cff_index([cff_offset(len(private_dict)) + cff_offset(o) + b'\x12'
+                          for o in private_offs])
+
+    header = b'\x01\x00\x04\x04'
+    pos = len(header) + len(cff_index([b'CapyTest'])) + \
+        len(cff_index([top_dict(0, 0, 0, 0, 0)])) + \
+        len(cff_index(strings)) + len(cff_index(gsubrs))
+    charset_off = pos
+    pos += len(charset)
+    fd_select_off = pos
+    pos += len(fd_select)
+    charstrings_off = pos
+    pos += len(cff_index(charstrings))
+    fd_array_off = pos
+    if cid_keyed:
+        pos += len(fd_array([0, 0]))
+    private_offs = [pos + i * len(private_data) for i in range(num_privates)]
+    cff = header + cff_index([b'CapyTest']) + \
+        cff_index([top_dict(charset_off, charstrings_off, fd_array_off, fd_select_off,
+                            private_offs[0])]) + \
+        cff_index(strings) + cff_index(gsubrs) + charset + fd_select + \
+        cff_index(charstrings)
+    if cid_keyed:
+        cff += fd_array(private_offs)
+    cff += private_data * num_privates
+
+    head = struct.pack('>IIIIHHqqhhhhHHhhh',
+                       0x10000, 0x10000, 0, 0x5F0F3CF5, 0, 1000, 0, 0,
+                       0, 0, 500, 700, 0, 8, 2, 0, 0)
+    hhea = struct.pack('>IhhhHhhhhhhhhhhhH',
+                       0x10000, 800, -200, 0, 600, 0, 0, 500, 1, 0, 0, 0, 0, 0, 0, 0,
+                       num_glyphs)
+    maxp = struct.pack('>IH', 0x5000, num_glyphs)
+    hmtx = struct.pack('>HhHhHhHhHh', 600, 0, 600, 0, 600, 100, 600, 100, 600, 100)
+    # Format 4 subtable mapping space to glyph 1 and A to C to glyphs 2 to 4.
+    starts = [0x20, 0x41, 0xffff]
+    ends = [0x20, 0x43, 0xffff]
+    deltas = [1 - 0x20, 2 - 0x41, 1]
+    seg_count = len(starts)
+    cmap4 = struct.pack('>HHHHHHH', 4, 16 + 8 * seg_count, 0, 2 * seg_count, 4, 1, 2) + \
+        struct.pack(f'>{seg_count}H', *ends) + b'\0\0' + \
+        struct.pack(f'>{seg_count}H', *starts) + \
+        struct.pack(f'>{seg_count}h', *deltas) + b'\0\0' * seg_count
+    cmap = struct.pack('>HHHHI', 0, 1, 3, 1, 12) + cmap4
+    ps_name = 'CapyTest'.encode('utf-16-be')
+    name = struct.pack('>HHHHHHHHH', 0, 1, 18, 3, 1, 0x409, 6, len(ps_name), 0) + ps_name
+    post = struct.pack('>IIhhIIIII', 0x30000, 0, -100, 50, 0, 0, 0, 0, 0)
+    tables = sorted([(b'CFF ', cff), (b'cmap', cmap), (b'head', head), (b'hhea', hhea),
+                     (b'hmtx', hmtx), (b'maxp', maxp), (b'name', name), (b'post', post)])
+    entry_selector = len(tables).bit_length() - 1
+    search_range = 16 << entry_selector
+    out = struct.pack('>4sHHHH', b'OTTO', len(tables), search_range, entry_selector,
+                      len(tables) * 16 - search_range)
+    offset = len(out) + 16 * len(tables)
+    body = b''
+    for tag, data in tables:
+        padded = data + b'\0' * (-len(data) % 4)
+        checksum = sum(struct.unpack(f'>{len(padded) // 4}I', padded)) & 0xffffffff
+        out += struct.pack('>4sIII', tag, checksum, offset + len(body), len(data))
+        body += padded
+    fname.write_bytes(out + body)
+
 def validate_image(basename, w, h):
     import functools
     def decorator_validate(func):
@@ -60,15 +411,7 @@ def validate_image(basename, w, h):
             value = func(*args, **kwargs)
             the_truth = testdata_dir / pngname
             utobj.assertTrue(os.path.exists(pdfname), 'Test did not generate a PDF file.')
-            utobj.assertEqual(subprocess.run(['gs',
-                                              '-q',
-                                              '-dNOPAUSE',
-                                              '-dBATCH',
-                                              '-sDEVICE=png16m',
-                                              f'-g{w}x{h}',
-                                              #'-dPDFFitPage',
-                                              f'-sOutputFile={pngname}',
-                                              str(pdfname)]).returncode, 0)
+            render_pdf(utobj, pdfname, pngname, w, h)
             oracle_image = PIL.Image.open(the_truth)
             gen_image = PIL.Image.open(pngname)
             diff = PIL.ImageChops.difference(oracle_image, gen_image)
@@ -105,12 +448,653 @@ class TestPDFCreation(unittest.TestCase):
 
     @validate_image('python_text', 400, 400)
     def test_text(self, ofilename, w, h):
+        with capypdf.Generator(ofilename, sample_text_options(w, h)) as g:
+            add_sample_text_page(g)
+
+    @validate_image('python_simple', 480, 640)
+    def test_streaming(self, ofilename, w, h):
         opts = capypdf.Options()
-        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        opts.set_streaming(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_rg(1.0, 0.0, 0.0)
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+
+    @validate_image('python_text', 400, 400)
+    def test_first_page_first(self, ofilename, w, h):
+        opts = sample_text_options(w, h)
+        opts.set_first_page_first(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            add_sample_text_page(g)
+        data = ofilename.read_bytes()
+        # The document info dictionary is object 1 but it is not needed for the first page.
+        self.assertLess(data.find(b'/Type /Catalog'), data.find(b'/Producer'))
+        # Streamed objects can not be reordered.
+        opts.set_streaming(True)
+        with self.assertRaises(capypdf.CapyPDFException):
+            capypdf.Generator.to_memory(opts)
+
+    def test_page_tree(self):
+        opts = capypdf.Options()
+        opts.set_page_tree_fanout(4)
+        with capypdf.Generator.to_memory(opts) as g:
+            for i in range(20):
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_re(10, 10, 10 + i, 10)
+                    ctx.cmd_f()
+        data = g.memory_output()
+        self.assertEqual(data.count(b'/Type /Page\n'), 20)
+        # 5 nodes of 4 pages, 2 nodes above them and the root.
+        self.assertEqual(data.count(b'/Type /Pages\n'), 8)
+        self.assertIn(b'/Count 20\n', data)
+        # All pages have the same resources, which are inherited from the root.
+        self.assertEqual(data.count(b'/Resources '), 1)
+        with self.assertRaises(capypdf.CapyPDFException):
+            opts.set_page_tree_fanout(1)
+
+    @validate_image('python_simple', 480, 640)
+    def test_command_buffer(self, ofilename, w, h):
+        buf = capypdf.CommandBuffer()
+        buf.cmd_rg(1.0, 0.0, 0.0)
+        buf.cmd_re(10, 10, 100, 100)
+        buf.cmd_f()
+        with capypdf.Generator(ofilename) as g:
+            with g.page_draw_context() as ctx:
+                ctx.execute_buffer(buf)
+                bad = capypdf.CommandBuffer()
+                bad.add(capypdf.DrawOp.re, 1, 2, 3)
+                with self.assertRaises(capypdf.CapyPDFException):
+                    ctx.execute_buffer(bad)
+                for bad_id in (float('nan'), 1e20, -1, 0.5):
+                    bad.clear()
+                    bad.add(capypdf.DrawOp.draw_image, bad_id)
+                    with self.assertRaises(capypdf.CapyPDFException):
+                        ctx.execute_buffer(bad)
+
+    def test_command_buffer_validation(self):
+        opts = capypdf.Options()
+        opts.set_compression(capypdf.StreamCategory.PageContent, 0)
+        with capypdf.Generator.to_memory(opts) as g:
+            with g.page_draw_context() as ctx:
+                bad = capypdf.CommandBuffer()
+                # One operand too many.
+                bad.cmd_re(1, 2, 3, 4)
+                bad.add(capypdf.DrawOp.f, 5.0)
+                with self.assertRaises(capypdf.CapyPDFException):
+                    ctx.execute_buffer(bad)
+                # An unknown operation after valid ones.
+                bad.clear()
+                bad.cmd_re(1, 2, 3, 4)
+                bad.cmd_f()
+                bad.ops.append(255)
+                with self.assertRaises(capypdf.CapyPDFException):
+                    ctx.execute_buffer(bad)
+                ctx.cmd_re(6, 7, 8, 9)
+        # Neither malformed buffer drew anything.
+        data = g.memory_output()
+        self.assertNotIn(b'1 2 3 4 re', data)
+        self.assertIn(b'6 7 8 9 re', data)
+
+    @validate_image('python_simple', 480, 640)
+    def test_incremental_update(self, ofilename, w, h):
+        with capypdf.Generator(ofilename) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_rg(0.0, 0.0, 1.0)
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+        original_size = ofilename.stat().st_size
+        u = capypdf.IncrementalUpdate(ofilename)
+        def ref(dictionary, key):
+            return int(re.search(key + r'\s+(\d+) 0 R', dictionary).group(1))
+        pages = ref(u.object_dictionary(u.root_object()), '/Pages')
+        page = int(re.search(r'/Kids\s*\[\s*(\d+) 0 R', u.object_dictionary(pages)).group(1))
+        contents = ref(u.object_dictionary(page), '/Contents')
+        stream = b'1 0 0 rg\n10 10 100 100 re\nf\n'
+        u.replace_object(contents, '<<\n  /Length {}\n>>\n'.format(len(stream)), stream)
+        u.write()
+        data = ofilename.read_bytes()
+        self.assertGreater(len(data), original_size)
+        self.assertIn(b'/Prev ', data[original_size:])
+
+    @validate_image('python_simple', 480, 640)
+    def test_memory_output(self, ofilename, w, h):
+        with capypdf.Generator.to_memory() as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_rg(1.0, 0.0, 0.0)
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+        data = g.memory_output()
+        self.assertTrue(data.startswith(b'%PDF-'))
+        chunks = []
+        with capypdf.Generator.to_callback(chunks.append) as g:
+            with g.page_draw_context() as ctx:
+                ctx.cmd_rg(1.0, 0.0, 0.0)
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+        ofilename.write_bytes(b''.join(chunks))
+
+    @cleanup('buffered.pdf')
+    def test_buffered_output(self, ofilename):
+        opts = capypdf.Options()
+        opts.set_compression(capypdf.StreamCategory.PageContent, 0)
+        def generate(g):
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                # A content stream several times larger than the write buffer.
+                for i in range(20000):
+                    ctx.cmd_re(i % 400, i % 300, 10, 10)
+                ctx.cmd_f()
+                draw_sample_text(ctx, fid)
+        with fixed_source_date():
+            with capypdf.Generator(ofilename, opts) as g:
+                generate(g)
+            with capypdf.Generator.to_memory(opts) as g:
+                generate(g)
+        data = pathlib.Path(ofilename).read_bytes()
+        self.assertGreater(len(data), 4 * 64 * 1024)
+        self.assertEqual(without_document_id(data), without_document_id(g.memory_output()))
+        # The writer counts the bytes it has written, so every offset must be exact.
+        xref_offset = int(re.search(rb'startxref\n(\d+)\n%%EOF\n$', data).group(1))
+        self.assertTrue(data[xref_offset:].startswith(b'xref\n0 '))
+        num_objects = int(data[xref_offset:].split(b'\n')[1].split(b' ')[1])
+        entries = re.findall(rb'(\d{10}) \d{5} ([nf])', data[xref_offset:])[:num_objects]
+        self.assertEqual(len(entries), num_objects)
+        for objnum, (offset, kind) in enumerate(entries):
+            if kind == b'n':
+                self.assertTrue(data[int(offset):].startswith(f'{objnum} 0 obj'.encode()))
+
+    @validate_image('python_text', 400, 400)
+    def test_threaded_write(self, ofilename, w, h):
+        outputs = []
+        with fixed_source_date():
+            for num_threads in (1, 4):
+                opts = sample_text_options(w, h)
+                opts.set_num_threads(num_threads)
+                with capypdf.Generator.to_memory(opts) as g:
+                    add_sample_text_page(g)
+                outputs.append(g.memory_output())
+        # Streams are compressed and subsets generated in worker threads,
+        # which must not change a single byte of the output.
+        self.assertEqual(without_document_id(outputs[1]), without_document_id(outputs[0]))
+        self.assertIn(b'/FontFile2', outputs[1])
+        ofilename.write_bytes(outputs[1])
+
+    def test_threaded_subsets_identical(self):
+        # Enough glyphs for several 255 glyph subsets. Composite glyphs can not
+        # yet be split over subsets, so they are left out.
+        chars = simple_glyph_chars(noto_fontdir / 'NotoSans-Regular.ttf')[:1200]
+        def generate(num_threads):
+            opts = capypdf.Options()
+            opts.set_num_threads(num_threads)
+            with capypdf.Generator.to_memory(opts) as g:
+                fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+                for start in range(0, len(chars), 200):
+                    with g.page_draw_context() as ctx:
+                        for i in range(start, min(start + 200, len(chars)), 20):
+                            ctx.render_text(''.join(chars[i:i + 20]), fid, 12, 50, 800 - 2 * i)
+            return without_document_id(g.memory_output())
+        with fixed_source_date():
+            single = generate(1)
+            self.assertGreaterEqual(len(set(re.findall(rb'/SFont\d+-\d+ ', single))), 4)
+            for _ in range(3):
+                self.assertEqual(generate(8), single)
+
+    @validate_image('python_text', 400, 400)
+    def test_cid_fonts(self, ofilename, w, h):
+        opts = sample_text_options(w, h)
+        opts.set_cid_fonts(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            add_sample_text_page(g)
+        data = ofilename.read_bytes()
+        self.assertIn(b'/Subtype /Type0', data)
+        self.assertIn(b'/Encoding /Identity-H', data)
+        self.assertIn(b'/Subtype /CIDFontType2', data)
+        self.assertIn(b'/CIDToGIDMap /Identity', data)
+        self.assertNotIn(b'/Subtype /TrueType', data)
+
+    def test_cid_many_glyphs(self):
+        # More distinct glyphs than fit in one simple font subset.
+        text = ''.join(chr(c) for c in range(0x21, 0x7f)) + \
+            ''.join(chr(c) for c in range(0xa1, 0x180))
+        lines = [text[i:i + 40] for i in range(0, len(text), 40)]
+        w = 400
+        h = 400
+        def generate(ofilename, cid_fonts):
+            opts = capypdf.Options()
+            opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+            opts.set_cid_fonts(cid_fonts)
+            with capypdf.Generator(ofilename, opts) as g:
+                fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+                with g.page_draw_context() as ctx:
+                    for i, line in enumerate(lines):
+                        if not cid_fonts:
+                            # A separate font per line keeps every subset small.
+                            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+                        ctx.render_text(line, fid, 10, 10, 380 - 15 * i)
+        cid_pdf = pathlib.Path('python_cid_many.pdf')
+        simple_pdf = pathlib.Path('python_simple_many.pdf')
+        generate(cid_pdf, True)
+        generate(simple_pdf, False)
+        self.assertEqual(cid_pdf.read_bytes().count(b'/Subtype /Type0'), 1)
+        assert_same_rendering(self, cid_pdf, simple_pdf, w, h)
+
+    def test_cff_fonts(self):
+        w = 200
+        h = 100
+        def generate(ofilename, fontfile):
+            opts = capypdf.Options()
+            opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+            with capypdf.Generator(ofilename, opts) as g:
+                fid = g.load_font(fontfile)
+                with g.page_draw_context() as ctx:
+                    ctx.render_text('CAB BA', fid, 50, 10, 30)
+        def embedded_font(pdfname):
+            pdf = pdfname.read_bytes()
+            self.assertEqual(pdf.count(b'/Subtype /CIDFontType0'), 1)
+            m = re.search(rb'/Subtype /OpenType\n(.*?)>>\nstream\n', pdf, re.DOTALL)
+            self.assertIsNotNone(m)
+            start = m.end()
+            data = pdf[start:pdf.index(b'\nendstream', start)]
+            if b'/FlateDecode' in m.group(1):
+                data = zlib.decompress(data)
+            return data
+        fonts = []
+        pdfs = []
+        for cid_keyed in (False, True):
+            fontfile = pathlib.Path('cid_keyed.otf' if cid_keyed else 'name_keyed.otf')
+            pdfname = fontfile.with_suffix('.pdf')
+            generate_cff_font(fontfile, cid_keyed)
+            generate(pdfname, fontfile)
+            font = embedded_font(pdfname)
+            self.assertEqual(font[0:4], b'OTTO')
+            self.assertIn(b'CFF ', font[12:12 + 16 * struct.unpack('>H', font[4:6])[0]])
+            fontfile.unlink()
+            pdfs.append(pdfname)
+        assert_same_rendering(self, pdfs[0], pdfs[1], w, h)
+
+    @validate_image('python_text', 400, 400)
+    def test_object_streams(self, ofilename, w, h):
+        opts = sample_text_options(w, h)
+        with capypdf.Generator.to_memory(opts) as g:
+            add_sample_text_page(g)
+        plain = g.memory_output()
+        opts.set_object_streams(True)
         with capypdf.Generator(ofilename, opts) as g:
+            add_sample_text_page(g)
+        data = ofilename.read_bytes()
+        self.assertIn(b'/Type /ObjStm', data)
+        self.assertIn(b'/Type /XRef', data)
+        self.assertNotIn(b'\ntrailer\n', data)
+        # Only streams are left as top level objects.
+        self.assertGreaterEqual(data.count(b'\nendstream\n'), 4)
+        self.assertEqual(len(re.findall(rb'\n\d+ 0 obj\n', data)), data.count(b'\nendstream\n'))
+        self.assertLess(len(data), len(plain))
+
+    def test_text_advances(self):
+        with capypdf.Generator.to_memory() as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            text = 'AVAVA Ωμέγα'
+            advances = g.text_advances(text, fid, 12)
+            self.assertEqual(len(advances), len(text))
+            self.assertAlmostEqual(sum(advances), g.text_width(text, fid, 12))
+            self.assertAlmostEqual(advances[0], advances[2])
+            self.assertAlmostEqual(g.text_width('A', fid, 24), 2 * g.text_width('A', fid, 12))
+            with g.page_draw_context() as ctx:
+                ctx.render_text(text, fid, 12, 10, 10)
+
+    def test_glyph_runs(self):
+        with capypdf.Generator.to_memory() as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            text_run = g.text_run('Av, Tv, kerning yo.', fid, 12)
+            glyph_run = g.glyph_run(fid, 12, [('A', 0, 0), ('Ω', 10, 0), ('b', 0, -14)])
+            for i in range(3):
+                with g.page_draw_context() as ctx:
+                    ctx.render_glyph_run(text_run, 50, 150)
+                    ctx.render_glyph_run(glyph_run, 50, 100)
+            with capypdf.Generator.to_memory() as g2:
+                with g2.page_draw_context() as ctx:
+                    with self.assertRaises(capypdf.CapyPDFException):
+                        ctx.render_glyph_run(text_run, 0, 0)
+
+    def test_glyph_run_indent(self):
+        opts = capypdf.Options()
+        opts.set_compression(capypdf.StreamCategory.PageContent, 0)
+        with capypdf.Generator.to_memory(opts) as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            run = g.glyph_run(fid, 12, [('A', 0, 0)])
+            with g.page_draw_context() as ctx:
+                ctx.cmd_q()
+                ctx.render_glyph_run(run, 50, 100)
+                ctx.cmd_Q()
+        # Every line within the text object is one level deeper than BT.
+        self.assertRegex(g.memory_output(),
+                         rb'\nq\n  BT\n    50 100 Td\n    /SFont[0-9]+-0 12 Tf\n'
+                         rb'(    .*\n)*  ET\nQ\n')
+
+    def test_form_xobject_dedup(self):
+        with capypdf.Generator.to_memory() as g:
+            stamps = []
+            for text_x in (0, 0, 5):
+                sctx = g.form_xobject_draw_context(100, 20)
+                sctx.cmd_re(text_x, 0, 50, 20)
+                sctx.cmd_f()
+                stamps.append(g.add_form_xobject(sctx))
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_Do(stamps[-1])
+            self.assertEqual(stamps[0].id, stamps[1].id)
+            self.assertNotEqual(stamps[0].id, stamps[2].id)
+
+    def test_form_xobject_context(self):
+        with capypdf.Generator.to_memory() as g:
+            with g.form_xobject_draw_context(100, 20) as sctx:
+                sctx.cmd_re(0, 0, 50, 20)
+                sctx.cmd_f()
+            self.assertIsNotNone(sctx.xobject_id)
+            with g.page_draw_context() as ctx:
+                ctx.cmd_Do(sctx.xobject_id)
+        data = g.memory_output()
+        self.assertIn(b'/Subtype /Form', data)
+        self.assertIn(b'/Count 1', data)
+
+    def test_write_stats(self):
+        opts = capypdf.Options()
+        opts.set_collect_stats(True)
+        with capypdf.Generator.to_memory(opts) as g:
             fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
             with g.page_draw_context() as ctx:
                 ctx.render_text('Av, Tv, kerning yo.', fid, 12, 50, 150)
+        num_objects, compression_in, peak_stream_bytes = g.write_stats()
+        self.assertGreater(num_objects, 0)
+        self.assertGreater(compression_in, 0)
+        self.assertGreater(peak_stream_bytes, 0)
+        pages = g.phase_stats(capypdf.WritePhase.Pages)
+        self.assertEqual(pages[0], 2)
+        self.assertGreater(pages[1], 0)
+        subsetting = g.phase_stats(capypdf.WritePhase.FontSubsetting)
+        self.assertEqual(subsetting[0], 1)
+        xref_bytes = g.phase_stats(capypdf.WritePhase.Xref)[1]
+        total = sum(g.phase_stats(p)[1] for p in (capypdf.WritePhase.Objects,
+                                                   capypdf.WritePhase.Streams,
+                                                   capypdf.WritePhase.Fonts,
+                                                   capypdf.WritePhase.Pages,
+                                                   capypdf.WritePhase.Xref))
+        self.assertLess(total, len(g.memory_output()))
+        self.assertGreater(xref_bytes, 0)
+
+    @validate_image('python_text', 400, 400)
+    def test_shared_resources(self, ofilename, w, h):
+        opts = capypdf.Options()
+        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        opts.set_resource_context(capypdf.ResourceContext(opts))
+        outputs = [None] * 4
+        def generate(i):
+            g = capypdf.Generator.to_memory(opts)
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            with g.page_draw_context() as ctx:
+                ctx.render_text('Av, Tv, kerning yo.', fid, 12, 50, 150)
+            g.write()
+            outputs[i] = g.memory_output()
+        threads = [threading.Thread(target=generate, args=(i,)) for i in range(len(outputs))]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        for data in outputs:
+            self.assertTrue(data.startswith(b'%PDF-'))
+        ofilename.write_bytes(outputs[0])
+
+    @validate_image('python_text', 400, 400)
+    def test_parallel_pages(self, ofilename, w, h):
+        opts = sample_text_options(w, h)
+        opts.set_compression(capypdf.StreamCategory.PageContent, 0)
+        with capypdf.Generator(ofilename, opts) as g:
+            fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+            contexts = [g.page_draw_context() for _ in range(4)]
+            threads = [threading.Thread(target=draw_sample_text, args=(ctx, fid)) for ctx in contexts]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            for ctx in contexts:
+                g.add_page(ctx)
+        data = ofilename.read_bytes()
+        self.assertIn(b'/Count 4', data)
+        # All pages share one subset and have the same content.
+        self.assertEqual(len(set(re.findall(rb'/SFont\d+-\d+ ', data))), 1)
+        streams = re.findall(rb'\nstream\n(.*?)\nendstream\n', data, re.DOTALL)
+        contents = [s for s in streams if s.isascii() and b'BT\n' in s]
+        self.assertEqual(len(contents), 4)
+        self.assertEqual(len(set(contents)), 1)
+
+    def test_parallel_pages_deterministic(self):
+        # Enough different glyphs on every page to need several subsets.
+        chars = simple_glyph_chars(noto_fontdir / 'NotoSans-Regular.ttf')[:600]
+        def generate(drawing_order, threaded=False):
+            with capypdf.Generator.to_memory() as g:
+                fid = g.load_font(noto_fontdir / 'NotoSans-Regular.ttf')
+                contexts = [g.page_draw_context() for _ in range(6)]
+                def draw(i):
+                    for j in range(i * 100, (i + 1) * 100, 20):
+                        contexts[i].render_text(''.join(chars[j:j + 20]), fid, 12, 50, 800 - 2 * j)
+                if threaded:
+                    threads = [threading.Thread(target=draw, args=(i,)) for i in drawing_order]
+                    for t in threads:
+                        t.start()
+                    for t in threads:
+                        t.join()
+                else:
+                    for i in drawing_order:
+                        draw(i)
+                for ctx in contexts:
+                    g.add_page(ctx)
+            return without_document_id(g.memory_output())
+        with fixed_source_date():
+            in_order = generate(range(6))
+            self.assertGreaterEqual(len(set(re.findall(rb'/SFont\d+-\d+ ', in_order))), 3)
+            # Glyphs get their subset slots when pages are added, not when they are drawn.
+            self.assertEqual(generate(reversed(range(6))), in_order)
+            for _ in range(3):
+                self.assertEqual(generate(range(6), True), in_order)
+
+    @validate_image('python_text', 400, 400)
+    def test_font_cache(self, ofilename, w, h):
+        capypdf.set_font_subset_cache_capacity(4)
+        try:
+            stats = []
+            for _ in range(2):
+                with capypdf.Generator(ofilename, sample_text_options(w, h)) as g:
+                    add_sample_text_page(g)
+                stats.append(capypdf.font_cache_stats())
+            # The second document neither parses the file nor subsets it again.
+            self.assertEqual([b - a for a, b in zip(*stats)], [1, 0, 1, 0])
+        finally:
+            capypdf.set_font_subset_cache_capacity(0)
+
+    def test_font_cache_capacity(self):
+        fonts = [noto_fontdir / 'NotoSans-Regular.ttf', noto_fontdir / 'NotoSerif-Regular.ttf']
+        capypdf.set_font_cache_capacity(1)
+        try:
+            def load(fontfile):
+                with capypdf.Generator.to_memory() as g:
+                    g.load_font(fontfile)
+                    with g.page_draw_context() as ctx:
+                        pass
+            load(fonts[0])
+            misses = capypdf.font_cache_stats()[1]
+            load(fonts[0])
+            self.assertEqual(capypdf.font_cache_stats()[1], misses)
+            # Only one file fits, so the first one has to be parsed again.
+            load(fonts[1])
+            load(fonts[0])
+            self.assertEqual(capypdf.font_cache_stats()[1], misses + 2)
+        finally:
+            capypdf.set_font_cache_capacity(64)
+
+    def test_image_dedup(self):
+        ofile = pathlib.Path('dedup.pdf')
+        with capypdf.Generator(ofile) as g:
+            first = g.load_image(image_dir / 'gray_alpha.png')
+            second = g.load_image(image_dir / 'gray_alpha.png')
+            other = g.load_image(image_dir / '1bit_noalpha.png')
+            self.assertEqual(first.id, second.id)
+            self.assertNotEqual(first.id, other.id)
+            jpg1 = g.embed_jpg(image_dir / 'simple.jpg')
+            jpg2 = g.embed_jpg(image_dir / 'simple.jpg')
+            self.assertEqual(jpg1.id, jpg2.id)
+            with g.page_draw_context() as ctx:
+                ctx.cmd_re(10, 10, 100, 100)
+                ctx.cmd_f()
+        ofile.unlink()
+
+    def test_image_dedup_streaming(self):
+        jpgcopy = pathlib.Path('dedup_copy.jpg')
+        shutil.copyfile(image_dir / 'simple.jpg', jpgcopy)
+        opts = capypdf.Options()
+        opts.set_streaming(True)
+        opts.set_collect_stats(True)
+        try:
+            with capypdf.Generator.to_memory(opts) as g:
+                # The first copies have been written out by the time the second ones are added.
+                first = g.load_image(image_dir / 'gray_alpha.png')
+                jpg1 = g.embed_jpg(image_dir / 'simple.jpg')
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_re(10, 10, 100, 100)
+                    ctx.cmd_f()
+                images = g.phase_stats(capypdf.WritePhase.Images)
+                second = g.load_image(image_dir / 'gray_alpha.png')
+                jpg2 = g.embed_jpg(jpgcopy)
+                # Duplicates are found before they are compressed or stored.
+                self.assertEqual(g.phase_stats(capypdf.WritePhase.Images)[:2], images[:2])
+                self.assertEqual(first.id, second.id)
+                self.assertEqual(jpg1.id, jpg2.id)
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_re(10, 10, 100, 100)
+                    ctx.cmd_f()
+            self.assertEqual(g.memory_output().count(b'/Subtype /Image'), 3)
+        finally:
+            jpgcopy.unlink()
+
+    def image_stream(self, data, w):
+        m = re.search(rb'/Width %d\n(?:(?!endobj).)*?/Length (\d+)\n'
+                      rb'(?:(?!endobj).)*?stream\n' % w, data, re.DOTALL)
+        self.assertIsNotNone(m)
+        return data[m.end():m.end() + int(m.group(1))]
+
+    def test_mono_png_packing(self):
+        pngfile = pathlib.Path('mono_packing.png')
+        # Palette index 1 is white. The padding of the last byte is set in the
+        # file and must not show up in the output.
+        rows = [bytes([0b10000001, 0b01111111]), bytes([0b01111110, 0b10011111])]
+        write_png(pngfile, 11, 2, 1, 3, rows, [(0, 0, 0), (255, 255, 255)])
+        try:
+            with capypdf.Generator.to_memory() as g:
+                img = g.load_image(pngfile)
+                with g.page_draw_context() as ctx:
+                    ctx.draw_image(img)
+            self.assertEqual(zlib.decompress(self.image_stream(g.memory_output(), 11)),
+                             bytes([0b10000001, 0b01100000, 0b01111110, 0b10000000]))
+        finally:
+            pngfile.unlink()
+
+    def test_png_passthrough(self):
+        # An upper case extension, like load_image accepts.
+        pngfile = pathlib.Path('passthrough.PNG')
+        w, h = 23, 7
+        rows = [bytes((3 * x + y) % 256 for x in range(3 * w)) for y in range(h)]
+        idat = write_png(pngfile, w, h, 8, 2, rows)
+        try:
+            opts = capypdf.Options()
+            opts.set_png_predictors(True)
+            with capypdf.Generator.to_memory(opts) as g:
+                img = g.load_image(pngfile)
+                with g.page_draw_context() as ctx:
+                    ctx.draw_image(img)
+            data = g.memory_output()
+            # The IDAT bytes are copied as they are.
+            self.assertEqual(self.image_stream(data, w), idat)
+            self.assertIn(b'/Predictor 15 /Colors 3 /BitsPerComponent 8 /Columns 23', data)
+            with capypdf.Generator.to_memory() as g:
+                img = g.load_image(pngfile)
+                with g.page_draw_context() as ctx:
+                    ctx.draw_image(img)
+            self.assertEqual(zlib.decompress(self.image_stream(g.memory_output(), w)),
+                             b''.join(rows))
+        finally:
+            pngfile.unlink()
+
+    def test_planar_cmyk_tiff(self):
+        tiffile = pathlib.Path('planar.tif')
+        w, h = 37, 5
+        planes = [bytes((17 * p + i) % 256 for i in range(w * h)) for p in range(4)]
+        write_tiff(tiffile, w, h, 4, 5, planes)
+        try:
+            with capypdf.Generator.to_memory() as g:
+                img = g.load_image(tiffile)
+                with g.page_draw_context() as ctx:
+                    ctx.draw_image(img)
+            interleaved = bytes(planes[i % 4][i // 4] for i in range(4 * w * h))
+            self.assertEqual(zlib.decompress(self.image_stream(g.memory_output(), w)),
+                             interleaved)
+        finally:
+            tiffile.unlink()
+
+    def test_streamed_tiff(self):
+        # An upper case extension, like load_image accepts.
+        tiffile = pathlib.Path('streamed.TIF')
+        # 9 MiB of pixels, read in three bands.
+        w, h = 1024, 3072
+        # Random so that the compressed stream is as big as the pixels.
+        pixels = random.Random(3).randbytes(3 * w * h)
+        write_rgb_tiff(tiffile, w, h, pixels)
+        try:
+            for streaming in (False, True):
+                opts = capypdf.Options()
+                opts.set_streaming(streaming)
+                opts.set_collect_stats(True)
+                with capypdf.Generator.to_memory(opts) as g:
+                    img = g.load_image(tiffile)
+                    # Found as a duplicate by comparing the compressed streams.
+                    self.assertEqual(g.load_image(tiffile).id, img.id)
+                    with g.page_draw_context() as ctx:
+                        with ctx.push_gstate():
+                            ctx.scale(100, 300)
+                            ctx.draw_image(img)
+                # The compressed stream is kept in a temporary file and not in memory.
+                self.assertLess(g.write_stats()[2], 100000)
+                data = g.memory_output()
+                self.assertEqual(data.count(b'/Subtype /Image'), 1)
+                self.assertEqual(zlib.decompress(self.image_stream(data, w)), pixels)
+            write_rgb_tiff(tiffile, w, 0, b'')
+            with capypdf.Generator.to_memory() as g:
+                with self.assertRaises(capypdf.CapyPDFException):
+                    g.load_image(tiffile)
+                with g.page_draw_context() as ctx:
+                    pass
+        finally:
+            tiffile.unlink()
+
+    def test_jpg_changed(self):
+        ofile = pathlib.Path('jpg_changed.pdf')
+        jpgfile = pathlib.Path('jpg_changed.jpg')
+        shutil.copyfile(image_dir / 'simple.jpg', jpgfile)
+        try:
+            with self.assertRaises(capypdf.CapyPDFException):
+                with capypdf.Generator(ofile) as g:
+                    jpg = g.embed_jpg(jpgfile)
+                    with g.page_draw_context() as ctx:
+                        ctx.cmd_q()
+                        ctx.cmd_cm(100, 0, 0, 100, 10, 10)
+                        ctx.draw_image(jpg)
+                        ctx.cmd_Q()
+                    # Same size, but rewritten after it was embedded.
+                    st = jpgfile.stat()
+                    os.utime(jpgfile, ns=(st.st_atime_ns, st.st_mtime_ns + 10**9))
+            # Neither the output nor the partially written temporary file is left behind.
+            self.assertFalse(ofile.exists())
+            self.assertFalse(ofile.with_suffix('.pdf~').exists())
+        finally:
+            jpgfile.unlink()
 
     def test_error(self):
         ofile = pathlib.Path('delme.pdf')
@@ -138,29 +1122,113 @@ class TestPDFCreation(unittest.TestCase):
     def test_images(self, ofilename, w, h):
         opts = capypdf.Options()
         opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        with capypdf.Generator(ofilename, opts) as g:
+            bg_img, mono_img, gray_img, rgb_tif_img = load_test_images(g)
+            with g.page_draw_context() as ctx:
+                draw_test_images(ctx, bg_img, mono_img, gray_img, rgb_tif_img)
+
+    @validate_image('python_image', 200, 200)
+    def test_compression_levels(self, ofilename, w, h):
+        opts = capypdf.Options()
+        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        opts.set_compression(capypdf.StreamCategory.PageContent, 6)
+        opts.set_compression(capypdf.StreamCategory.Image, 0)
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_compression(capypdf.StreamCategory.Font, 10)
+        self.assertEqual(str(cm.exception), 'Compression level must be between 0 and 9.')
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_compression(capypdf.StreamCategory.Font, -1)
+        self.assertEqual(str(cm.exception), 'Compression level must be between 0 and 9.')
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_compression(capypdf.StreamCategory.Font, 4.5)
+        self.assertEqual(str(cm.exception), 'Compression level must be an integer.')
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_compression(2, 6)
+        self.assertEqual(str(cm.exception), 'Argument must be a stream category.')
+        with capypdf.Generator(ofilename, opts) as g:
+            bg_img, mono_img, gray_img, rgb_tif_img = load_test_images(g)
+            with g.page_draw_context() as ctx:
+                draw_test_images(ctx, bg_img, mono_img, gray_img, rgb_tif_img)
+        colors = {b'/DeviceGray': 1, b'/DeviceRGB': 3, b'/ImageMask true': 1}
+        images = image_dictionaries(ofilename)
+        self.assertGreaterEqual(len(images), 3)
+        for d in images:
+            # Uncompressed images hold exactly their raw pixel data.
+            self.assertNotIn(b'/Filter', d)
+            width, height, bpc, length = [int(re.search(rb'/' + key + rb' (\d+)', d).group(1))
+                                          for key in (b'Width', b'Height', b'BitsPerComponent',
+                                                      b'Length')]
+            num_colors = [v for k, v in colors.items() if k in d]
+            self.assertEqual(len(num_colors), 1)
+            self.assertEqual(length, (width * num_colors[0] * bpc + 7) // 8 * height)
+
+    def test_image_downsampling(self):
+        full_file = pathlib.Path('fullres.pdf')
+        small_file = pathlib.Path('downsampled.pdf')
+        opts = capypdf.Options()
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_image_max_dimension(-1)
+        self.assertEqual(str(cm.exception), 'Image size limits must be positive.')
+        with capypdf.Generator(full_file, opts) as g:
+            img = g.load_image(image_dir / 'flame_gradient.png')
+            with g.page_draw_context() as ctx:
+                ctx.scale(100, 100)
+                ctx.draw_image(img)
+        opts.set_image_max_dimension(300)
+        with capypdf.Generator(small_file, opts) as g:
+            # A one inch square at 72 DPI needs 72x72 pixels.
+            img = g.load_image_for_placement(image_dir / 'flame_gradient.png', 72, 72, 72)
+            with g.page_draw_context() as ctx:
+                ctx.scale(100, 100)
+                ctx.draw_image(img)
+        self.assertLess(small_file.stat().st_size, full_file.stat().st_size)
+        self.assertRegex(image_dictionaries(full_file)[0], rb'/Width 512\n  /Height 512\n')
+        self.assertRegex(image_dictionaries(small_file)[0], rb'/Width 72\n  /Height 72\n')
+        full_file.unlink()
+        small_file.unlink()
+        with capypdf.Generator.to_memory() as g:
+            for bad in ((0, 72, 72), (72, -1, 72), (72, 72, float('nan')), (float('inf'), 72, 72)):
+                with self.assertRaises(capypdf.CapyPDFException) as cm:
+                    g.load_image_for_placement(image_dir / 'flame_gradient.png', *bad)
+                self.assertEqual(str(cm.exception), 'Image size limits must be positive.')
+            with g.page_draw_context() as ctx:
+                pass
+
+    @validate_image('python_image', 200, 200)
+    def test_load_images(self, ofilename, w, h):
+        opts = capypdf.Options()
+        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        opts.set_num_threads(3)
         with capypdf.Generator(ofilename, opts) as g:
             bg_img = g.embed_jpg(image_dir / 'simple.jpg')
-            mono_img = g.load_image(image_dir / '1bit_noalpha.png')
-            gray_img = g.load_image(image_dir / 'gray_alpha.png')
-            rgb_tif_img = g.load_image(image_dir / 'rgb_tiff.tif')
-            with g.page_draw_context() as ctx:
-                with ctx.push_gstate():
-                    ctx.translate(10, 10)
-                    ctx.scale(80, 80)
-                    ctx.draw_image(bg_img)
-                with ctx.push_gstate():
-                    ctx.translate(0, 100)
-                    ctx.translate(10, 10)
-                    ctx.scale(80, 80)
-                    ctx.draw_image(mono_img)
-                with ctx.push_gstate():
-                    ctx.translate(110, 110)
-                    ctx.scale(80, 80)
-                    ctx.draw_image(gray_img)
-                with ctx.push_gstate():
-                    ctx.translate(110, 10)
-                    ctx.scale(80, 80)
-                    ctx.draw_image(rgb_tif_img)
+            images = g.load_images([image_dir / f for f in test_image_files])
+            # Ids come back in file order, so loading the files one by one
+            # finds the same images.
+            self.assertEqual([i.id for i in images],
+                             [g.load_image(image_dir / f).id for f in test_image_files])
+            with self.assertRaises(capypdf.CapyPDFException):
+                g.load_images([image_dir / 'gray_alpha.png', image_dir / 'nonexistent.png'])
+            mono_img, gray_img, rgb_tif_img = images
+            with g.page_draw_context() as ctx:
+                draw_test_images(ctx, bg_img, mono_img, gray_img, rgb_tif_img)
+
+    @validate_image('python_image', 200, 200)
+    def test_png_predictors(self, ofilename, w, h):
+        opts = capypdf.Options()
+        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        opts.set_png_predictors(True)
+        with capypdf.Generator(ofilename, opts) as g:
+            bg_img, mono_img, gray_img, rgb_tif_img = load_test_images(g)
+            with g.page_draw_context() as ctx:
+                draw_test_images(ctx, bg_img, mono_img, gray_img, rgb_tif_img)
+        images = image_dictionaries(ofilename)
+        self.assertGreaterEqual(len(images), 3)
+        for d in images:
+            self.assertIn(b'/Filter /FlateDecode', d)
+            width = re.search(rb'/Width (\d+)', d).group(1)
+            bpc = re.search(rb'/BitsPerComponent (\d+)', d).group(1)
+            self.assertRegex(d, rb'/DecodeParms << /Predictor 15 /Colors \d /BitsPerComponent ' +
+                             bpc + rb' /Columns ' + width + rb' >>')
 
     @validate_image('python_path', 200, 200)
     def test_path(self, ofilename, w, h):
@@ -168,38 +1236,64 @@ class TestPDFCreation(unittest.TestCase):
         opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
         with capypdf.Generator(ofilename, opts) as g:
             with g.page_draw_context() as ctx:
-                with ctx.push_gstate():
-                    ctx.cmd_w(5)
-                    ctx.cmd_J(capypdf.LineCapStyle.Round)
-                    ctx.cmd_m(10, 10);
-                    ctx.cmd_c(80, 10, 20, 90, 90, 90);
-                    ctx.cmd_S();
-                with ctx.push_gstate():
-                    ctx.cmd_w(10)
-                    ctx.translate(100, 0)
-                    ctx.cmd_RG(1.0, 0.0, 0.0)
-                    ctx.cmd_rg(0.9, 0.9, 0.0)
-                    ctx.cmd_j(capypdf.LineJoinStyle.Bevel)
-                    ctx.cmd_m(50, 90)
-                    ctx.cmd_l(10, 10)
-                    ctx.cmd_l(90, 10)
-                    ctx.cmd_h()
-                    ctx.cmd_B()
-                with ctx.push_gstate():
-                    ctx.translate(0, 100)
-                    draw_intersect_shape(ctx)
-                    ctx.cmd_w(3)
-                    ctx.cmd_rg(0, 1, 0)
-                    ctx.cmd_RG(0.5, 0.1, 0.5)
-                    ctx.cmd_j(capypdf.LineJoinStyle.Round)
-                    ctx.cmd_B()
-                with ctx.push_gstate():
-                    ctx.translate(100, 100)
-                    ctx.cmd_w(2)
-                    ctx.cmd_rg(0, 1, 0);
-                    ctx.cmd_RG(0.5, 0.1, 0.5)
-                    draw_intersect_shape(ctx)
-                    ctx.cmd_Bstar()
+                draw_test_path(ctx)
+
+    @validate_image('python_path', 200, 200)
+    def test_path_arrays(self, ofilename, w, h):
+        opts = capypdf.Options()
+        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                for cmd in (ctx.cmd_l_array, ctx.cmd_c_array, ctx.cmd_re_array):
+                    with self.assertRaises(capypdf.CapyPDFException) as cm:
+                        cmd([1, 2, 3])
+                    self.assertEqual(str(cm.exception),
+                                     'Coordinate array does not consist of whole path elements.')
+                draw_test_path(ctx, use_arrays=True)
+
+    def test_rect_arrays(self):
+        w = 200
+        h = 200
+        rects = [10, 10, 50, 30, 100, 20, 20, 80, 60, 120, 100, 50]
+        array_pdf = pathlib.Path('python_re_array.pdf')
+        single_pdf = pathlib.Path('python_re_single.pdf')
+        for ofilename in (array_pdf, single_pdf):
+            opts = capypdf.Options()
+            opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+            with capypdf.Generator(ofilename, opts) as g:
+                with g.page_draw_context() as ctx:
+                    ctx.cmd_rg(0.2, 0.4, 0.8)
+                    if ofilename == array_pdf:
+                        # Every other value of a strided view, which is not contiguous.
+                        padded = array.array('d', [v for r in rects for v in (r, -1)])
+                        ctx.cmd_re_array(memoryview(padded)[::2])
+                    else:
+                        for i in range(0, len(rects), 4):
+                            ctx.cmd_re(*rects[i:i + 4])
+                    ctx.cmd_f()
+        assert_same_rendering(self, array_pdf, single_pdf, w, h)
+
+    @validate_image('python_path', 200, 200)
+    def test_compact_content(self, ofilename, w, h):
+        opts = capypdf.Options()
+        opts.set_pagebox(capypdf.PageBox.Media, 0, 0, w, h)
+        with self.assertRaises(capypdf.CapyPDFException) as cm:
+            opts.set_number_precision(10)
+        self.assertEqual(str(cm.exception), 'Number precision must be between 0 and 9.')
+        opts.set_number_precision(3)
+        opts.set_compact_content(True)
+        opts.set_compression(capypdf.StreamCategory.PageContent, 0)
+        with capypdf.Generator(ofilename, opts) as g:
+            with g.page_draw_context() as ctx:
+                draw_test_path(ctx)
+        streams = re.findall(rb'stream\n(.*?)\nendstream', ofilename.read_bytes(), re.DOTALL)
+        content = [c for c in streams if c.endswith(b'B*\nQ')]
+        self.assertEqual(len(content), 1)
+        numbers = re.findall(rb'-?[0-9.]+', content[0])
+        self.assertIn(b'0.9', numbers)
+        for n in numbers:
+            # No trailing zeros after the decimal point and no bare point.
+            self.assertNotRegex(n, rb'\.(\d*0)?$')
 
     @validate_image('python_textobj', 200, 200)
     def test_text(self, ofilename, w, h):
@@ -231,6 +1325,40 @@ class TestPDFCreation(unittest.TestCase):
                 ctx.cmd_re(10, 10, 80, 80)
                 ctx.cmd_B()
 
+    def test_color_cache(self):
+        profile = find_cmyk_profile()
+        if profile is None:
+            self.skipTest('No CMYK profile found.')
+        opts = capypdf.Options()
+        opts.set_colorspace(capypdf.Colorspace.DeviceCMYK)
+        opts.set_device_profile(capypdf.Colorspace.DeviceCMYK, profile)
+        opts.set_color_cache_size(16)
+        red = capypdf.Color()
+        red.set_rgb(0.9, 0.1, 0.1)
+        blue = capypdf.Color()
+        blue.set_rgb(0.1, 0.1, 0.9)
+        with capypdf.Generator.to_memory(opts) as g:
+            self.assertEqual(g.color_cache_stats(), (0, 0))
+            with g.page_draw_context() as ctx:
+                for i in range(10):
+                    ctx.set_nonstroke(red if i % 2 == 0 else blue)
+                    ctx.cmd_re(10 * i, 10, 5, 5)
+                    ctx.cmd_f()
+            # Only the first use of each color is converted.
+            self.assertEqual(g.color_cache_stats(), (8, 2))
+            with g.page_draw_context() as ctx:
+                ctx.set_stroke(red)
+                ctx.set_nonstroke(blue)
+                ctx.cmd_re(10, 10, 50, 50)
+                ctx.cmd_B()
+            self.assertEqual(g.color_cache_stats(), (10, 2))
+        with capypdf.Generator.to_memory(opts) as g:
+            with g.page_draw_context() as ctx:
+                ctx.set_nonstroke(red)
+                ctx.set_nonstroke(red)
+            # Every generator has a cache of its own.
+            self.assertEqual(g.color_cache_stats(), (1, 1))
+
     @cleanup('transitions.pdf')
     def test_transitions(self, ofilename):
         opts = capypdf.Options()